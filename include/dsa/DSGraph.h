@@ -16,13 +16,16 @@
 #define LLVM_ANALYSIS_DSGRAPH_H
 
 #include "dsa/DSNode.h"
+#include "dsa/DSNodeArena.h"
 #include "dsa/DSCallGraph.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/EquivalenceClasses.h"
 #include "llvm/IR/Function.h"
 
 #include <list>
 #include <map>
 #include <set>
+#include <unordered_map>
 
 namespace llvm {
 
@@ -40,8 +43,12 @@ class GlobalValue;
 /// of DSA.  In all of these cases, the DSA phase is really trying to identify
 /// globals or unique node handles active in the function.
 ///
+/// The value map is hashed, since it is probed for every value DSA looks at.
+/// It is node based rather than a DenseMap because clients hold references
+/// to its handles across insertions.  Iteration order is unspecified.
+///
 class DSScalarMap {
-  typedef std::map<const Value*, DSNodeHandle> ValueMapTy;
+  typedef std::unordered_map<const Value*, DSNodeHandle> ValueMapTy;
   ValueMapTy ValueMap;
 
   typedef std::set<const GlobalValue*> GlobalSetTy;
@@ -201,8 +208,8 @@ public:
 
   /// NodeMapTy - This data type is used when cloning one graph into another to
   /// keep track of the correspondence between the nodes in the old and new
-  /// graphs.
-  typedef std::map<const DSNode*, DSNodeHandle> NodeMapTy;
+  /// graphs.  References into it are not stable across insertion.
+  typedef DenseMap<const DSNode*, DSNodeHandle> NodeMapTy;
 
   // InvNodeMapTy - This data type is used to represent the inverse of a node
   // map.
@@ -220,6 +227,10 @@ private:
 
   bool UseAuxCalls;      // Should this pass use the Aux calls vector?
 
+  /// NodeArena - The memory the nodes created in this graph come from.  Nodes
+  /// spliced in from another graph stay in the arena they came from.
+  DSNodeArena *NodeArena;
+
   NodeListTy Nodes;
   ScalarMapTy ScalarMap;
 
@@ -260,7 +271,7 @@ public:
   DSGraph(EquivalenceClasses<const GlobalValue*> &ECs, const DataLayout &td,
           SuperSet<Type*>& tss,
           DSGraph *GG = 0) 
-    :GlobalsGraph(GG), UseAuxCalls(false), 
+    :GlobalsGraph(GG), UseAuxCalls(false), NodeArena(new DSNodeArena()),
      ScalarMap(ECs), TD(td), TypeSS(tss)
   { }
 
@@ -290,6 +301,10 @@ public:
     return TypeSS;
   }
 
+  /// getNodeArena - Return the arena that nodes created in this graph are
+  /// allocated from.
+  DSNodeArena &getNodeArena() const { return *NodeArena; }
+
   /// getDataLayout - Return the DataLayout object for the current target.
   ///
   const DataLayout &getDataLayout() const { return TD; }
@@ -650,8 +665,8 @@ class ReachabilityCloner {
   // NodeMap - A mapping from nodes in the source graph to the nodes that
   // represent them in the destination graph.
   // We cannot use a densemap here as references into it are not stable across
-  // insertion
-  typedef std::map<const DSNode*, DSNodeHandle> RCNodeMap;
+  // insertion, but a node based hash map keeps them stable.
+  typedef std::unordered_map<const DSNode*, DSNodeHandle> RCNodeMap;
   RCNodeMap NodeMap;
 
 public:
@@ -20,6 +20,7 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "dsa/svset.h"
+#include "dsa/svmap.h"
 #include "dsa/super_set.h"
 #include "dsa/keyiterator.h"
 #include "dsa/DSGraph.h"
@@ -42,13 +43,16 @@ class DSNodeIterator;          // Data structure graph traversal iterator
 ///
 class DSNode : public ilist_node<DSNode> {
 public:
-  typedef std::map<unsigned, SuperSet<Type*>::setPtr> TyMapTy;
-  typedef std::map<unsigned, DSNodeHandle> LinkMapTy;
+  typedef svmap<unsigned, SuperSet<Type*>::setPtr> TyMapTy;
+  typedef svmap<unsigned, DSNodeHandle> LinkMapTy;
 
 private:
   friend struct ilist_sentinel_traits<DSNode>;
   //Sentinel
   DSNode() : NumReferrers(0), Size(0), NodeType(0) {}
+
+  /// operator new - Only the sentinel is allocated without a graph.
+  void *operator new(size_t Size);
   
   /// NumReferrers - The number of DSNodeHandles pointing to this node... if
   /// this is a forwarding node, then this is the number of node handles which
@@ -73,11 +77,13 @@ private:
   DSGraph *ParentGraph;
 
   /// TyMap - Keep track of the loadable types and offsets those types are seen
-  // at.
+  /// at.  Sorted by offset.
   TyMapTy TyMap;
 
-  /// Links - Contains one entry for every byte in this memory
-  /// object.  
+  /// Links - Contains one entry for every offset in this memory object that
+  /// holds a pointer, sorted by offset.  References into Links are invalidated
+  /// when a link is added, so hold on to a copy of a link across anything
+  /// that can merge nodes.
   ///
   LinkMapTy Links;
 
@@ -139,6 +145,13 @@ public:
   DSNode(const DSNode &, DSGraph *G, bool NullLinks = false);
   ~DSNode();
 
+  /// operator new - Nodes are allocated from the node arena of the graph they
+  /// are created in, so create them with "new (G) DSNode(G)".
+  ///
+  void *operator new(size_t Size, DSGraph *G);
+  void operator delete(void *Ptr, DSGraph *G);
+  void operator delete(void *Ptr);
+
   // Iterator for graph interface... Defined in DSGraphTraits.h
   typedef DSNodeIterator<DSNode> iterator;
   typedef DSNodeIterator<const DSNode> const_iterator;
@@ -434,7 +447,7 @@ public:
   /// remapLinks - Change all of the Links in the current node according to the
   /// specified mapping.
   ///
-  void remapLinks(std::map<const DSNode*, DSNodeHandle> &OldNodeMap);
+  void remapLinks(DenseMap<const DSNode*, DSNodeHandle> &OldNodeMap);
 
   /// markReachableNodes - This method recursively traverses the specified
   /// DSNodes, marking any nodes which are reachable.  All reachable nodes it
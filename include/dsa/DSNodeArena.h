@@ -0,0 +1,85 @@
+//===- DSNodeArena.h - Slab allocator for DSNodes ---------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// DSNodeArena hands out the memory for the DSNodes of one DSGraph.  Nodes are
+// carved out of large slabs, nodes deleted by removeDeadNodes and friends are
+// put on a free list for reuse, and the slabs are released all at once.
+//
+// Nodes can outlive their graph: spliceFrom moves nodes into another graph,
+// and a forwarding node lives until its last referrer lets go of it.  The
+// arena is therefore reference counted, with one reference held by the graph
+// that created it and one by every live node carved out of it.
+//
+// An arena is not thread safe.  The nodes of a graph must only be created and
+// deleted by one thread at a time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_ANALYSIS_DSNODEARENA_H
+#define LLVM_ANALYSIS_DSNODEARENA_H
+
+#include "llvm/Support/Allocator.h"
+
+#include <cassert>
+#include <cstddef>
+
+namespace llvm {
+
+class DSNodeArena {
+  /// Slabs - The memory every node of this arena is carved out of.
+  BumpPtrAllocator Slabs;
+
+  /// FreeList - Nodes that have been deleted, linked through their first word.
+  void *FreeList;
+
+  /// ChunkSize - The size of every chunk handed out, fixed by the first one.
+  size_t ChunkSize;
+
+  /// NumRefs - One for the owning graph plus one for every live chunk.
+  unsigned NumRefs;
+
+  DSNodeArena(const DSNodeArena &);   // DO NOT IMPLEMENT
+  void operator=(const DSNodeArena &); // DO NOT IMPLEMENT
+  ~DSNodeArena() {}
+public:
+  DSNodeArena() : FreeList(0), ChunkSize(0), NumRefs(1) {}
+
+  /// Allocate - Return a chunk of Size bytes aligned to Align.  Every call on
+  /// an arena must ask for the same size.
+  void *Allocate(size_t Size, size_t Align) {
+    assert((ChunkSize == 0 || ChunkSize == Size) && "Mixed chunk sizes!");
+    ChunkSize = Size;
+    ++NumRefs;
+    if (void *Chunk = FreeList) {
+      FreeList = *static_cast<void**>(Chunk);
+      return Chunk;
+    }
+    return Slabs.Allocate(Size, Align);
+  }
+
+  /// Deallocate - Put a chunk back on the free list.  This drops the chunk's
+  /// reference to the arena, which may free the arena.
+  void Deallocate(void *Chunk) {
+    *static_cast<void**>(Chunk) = FreeList;
+    FreeList = Chunk;
+    release();
+  }
+
+  /// release - Drop a reference.  The owning graph calls this when it is
+  /// destroyed; the slabs go away once no node in them is left alive.
+  void release() {
+    assert(NumRefs && "Arena released too many times!");
+    if (--NumRefs == 0)
+      delete this;
+  }
+};
+
+} // End llvm namespace
+
+#endif
@@ -0,0 +1,141 @@
+//===- DSParallel.h - Running DSA passes on several threads -----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The pieces a DSA pass needs to work on several graphs at once: a lock that
+// is only taken when there is one, a lock for each graph, and a queue that
+// hands out numbered pieces of work to threads once the work they depend on is
+// done.
+//
+// Before any threads start, the pass must also call
+// DataStructures::computeStructLayouts and make its type SuperSet thread safe.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_ANALYSIS_DSPARALLEL_H
+#define LLVM_ANALYSIS_DSPARALLEL_H
+
+#include "llvm/ADT/DenseMap.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace llvm {
+
+class DSGraph;
+
+/// OptionalLock - Hold the specified lock, if there is one, while in scope.
+/// Passing null lets the sequential traversal share code with the parallel
+/// one without locking.
+class OptionalLock {
+  std::mutex *M;
+public:
+  explicit OptionalLock(std::mutex *m) : M(m) { if (M) M->lock(); }
+  ~OptionalLock() { if (M) M->unlock(); }
+};
+
+/// DSGraphLocks - A lock for each graph.  Copying a handle to a node updates
+/// the node's referrer count, so a graph that is only read from, such as a
+/// graph being inlined into another one, still has to be locked.
+class DSGraphLocks {
+  std::mutex Lock;
+  std::deque<std::mutex> Pool;
+  DenseMap<const DSGraph*, std::mutex*> Locks;
+public:
+  std::mutex *get(const DSGraph *G) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    std::mutex *&L = Locks[G];
+    if (!L) {
+      Pool.emplace_back();
+      L = &Pool.back();
+    }
+    return L;
+  }
+};
+
+/// DSWorkQueue - Pieces of work numbered from 0, each of which may have to
+/// wait for others to finish.  run() gives each piece to a thread once every
+/// piece it waits for is done.  Ready pieces are kept on a stack: the pieces
+/// that are ready from the start are handed out lowest number first, and a
+/// piece that becomes ready goes ahead of them.
+class DSWorkQueue {
+  /// Successors - The pieces that wait for each piece.
+  std::vector<std::vector<unsigned> > Successors;
+
+  /// NumPending - The number of pieces each piece still waits for.
+  std::vector<unsigned> NumPending;
+
+  /// Ready - Pieces that wait for nothing, waiting for a thread.
+  std::vector<unsigned> Ready;
+
+  /// NumRunning - The number of pieces being worked on right now.
+  unsigned NumRunning;
+
+  /// Lock - Protects all of the above.
+  std::mutex Lock;
+  std::condition_variable Wake;
+
+  /// runWorker - The body of each thread: do ready pieces until none are
+  /// left.
+  template<typename WorkFn>
+  void runWorker(WorkFn &Work) {
+    std::unique_lock<std::mutex> Guard(Lock);
+    while (true) {
+      while (Ready.empty() && NumRunning)
+        Wake.wait(Guard);
+      if (Ready.empty())
+        break;
+
+      unsigned Next = Ready.back();
+      Ready.pop_back();
+      ++NumRunning;
+      Guard.unlock();
+      Work(Next);
+      Guard.lock();
+      --NumRunning;
+
+      for (unsigned i = 0, e = Successors[Next].size(); i != e; ++i)
+        if (--NumPending[Successors[Next][i]] == 0)
+          Ready.push_back(Successors[Next][i]);
+      Wake.notify_all();
+    }
+  }
+
+public:
+  explicit DSWorkQueue(unsigned NumPieces)
+    : Successors(NumPieces), NumPending(NumPieces), NumRunning(0) {}
+
+  /// addEdge - Piece After may not start until piece Before is done.
+  void addEdge(unsigned Before, unsigned After) {
+    Successors[Before].push_back(After);
+    ++NumPending[After];
+  }
+
+  /// run - Call Work with the number of every piece on NumThreads threads, and
+  /// return once all pieces are done.  Work must be safe to call from several
+  /// threads at once.
+  template<typename WorkFn>
+  void run(unsigned NumThreads, WorkFn Work) {
+    for (unsigned i = NumPending.size(); i != 0; --i)
+      if (NumPending[i - 1] == 0)
+        Ready.push_back(i - 1);
+
+    std::vector<std::thread> Workers;
+    for (unsigned i = 0; i != NumThreads; ++i)
+      Workers.push_back(std::thread([this, &Work] { runWorker(Work); }));
+    for (unsigned i = 0; i != NumThreads; ++i)
+      Workers[i].join();
+  }
+};
+
+} // End llvm namespace
+
+#endif
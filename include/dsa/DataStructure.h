@@ -37,6 +37,7 @@ class DSGraph;
 class DSCallSite;
 class DSNode;
 class DSNodeHandle;
+struct TDParallelState;
 
 FunctionPass *createDataStructureStatsPass();
 FunctionPass *createDataStructureGraphCheckerPass();
@@ -98,6 +99,10 @@ protected:
   
   void formGlobalFunctionList();
 
+  /// computeStructLayouts - Compute the layout of every struct type in M
+  /// before graphs are built on several threads.
+  void computeStructLayouts(Module &M) const;
+
   DataStructures(char & id, const char* name) 
     : ModulePass(id), TD(0), GraphSource(0), printname(name), GlobalsGraph(0) {  
     // For now, the graphs are owned by this pass
@@ -356,10 +361,14 @@ class TDDataStructures : public DataStructures {
 
   bool useEQBU;
 
+  // Parallel - The state of the parallel top-down traversal while one is
+  // running (see -dsa-td-threads), null otherwise.
+  TDParallelState *Parallel;
+
 public:
   static char ID;
   TDDataStructures(char & CID = ID, const char* printname = "td.", bool useEQ = false)
-    : DataStructures(CID, printname), useEQBU(useEQ) {}
+    : DataStructures(CID, printname), useEQBU(useEQ), Parallel(0) {}
   ~TDDataStructures();
 
   virtual bool runOnModule(Module &M);
@@ -381,6 +390,7 @@ private:
                                                   DenseSet<DSNode*> &Visited);
 
   void InlineCallersIntoGraph(DSGraph* G);
+  void parallelInlineCallers(Module &M, std::vector<DSGraph*> &PostOrder);
   void ComputePostOrder(const Function &F, DenseSet<DSGraph*> &Visited,
                         std::vector<DSGraph*> &PostOrder);
 };
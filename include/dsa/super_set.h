@@ -1,4 +1,4 @@
-/* 
+/*
  * File:   super_set.h
  * Author: andrew
  *
@@ -9,34 +9,134 @@
 #define	_SUPER_SET_H
 
 #include "dsa/svset.h"
-#include <set>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 // Contains stable references to a set
 // The sets can be grown.
+//
+// Every distinct set is stored once (hash-consed), so two sets are equal
+// exactly when their setPtrs are.  Sets are found through an open addressing
+// table that keeps each set's hash next to it, and the results of adding a
+// member to a set and of joining two sets are memoized, so merging type
+// information is normally a single table lookup.
+//
+// While a parallel analysis is running, setThreadSafe(true) makes the
+// members below safe to call from several threads.  The sets themselves never
+// change once created, so reading through a setPtr needs no lock.
 
 template<typename Ty>
 class SuperSet {
-  //std::set provides stable iterators, and that matters a lot
   typedef svset<Ty> InnerSetTy;
-  typedef std::set<InnerSetTy> OuterSetTy;
-  OuterSetTy container;
 public:
-  typedef const typename OuterSetTy::value_type* setPtr;
+  typedef const InnerSetTy* setPtr;
 
-  setPtr getOrCreate(svset<Ty>& S) {
+private:
+  //std::deque provides stable references, and that matters a lot
+  std::deque<InnerSetTy> container;
+
+  // The interning table.  Empty buckets have a null set.
+  struct Bucket {
+    size_t Hash;
+    setPtr Set;
+  };
+  std::vector<Bucket> table;
+
+  // Memoized results of getOrCreate(setPtr, Ty) and getUnion.
+  llvm::DenseMap<std::pair<setPtr, Ty>, setPtr> insertCache;
+  llvm::DenseMap<std::pair<setPtr, setPtr>, setPtr> unionCache;
+
+  bool threadSafe;
+  std::mutex lock;
+
+  static size_t hashSet(const InnerSetTy& S) {
+    return llvm::hash_combine_range(S.begin(), S.end());
+  }
+
+  void growTable() {
+    std::vector<Bucket> old;
+    old.swap(table);
+    table.resize(old.empty() ? 64 : old.size() * 2);
+    for (unsigned i = 0, e = old.size(); i != e; ++i)
+      if (old[i].Set)
+        table[findBucket(old[i].Hash, *old[i].Set)] = old[i];
+  }
+
+  // Return the bucket holding S, or the empty bucket where it belongs.
+  unsigned findBucket(size_t Hash, const InnerSetTy& S) const {
+    unsigned Mask = table.size() - 1;
+    for (unsigned i = Hash & Mask; ; i = (i + 1) & Mask) {
+      const Bucket& B = table[i];
+      if (!B.Set || (B.Hash == Hash && *B.Set == S))
+        return i;
+    }
+  }
+
+  setPtr intern(svset<Ty>& S) {
     if (S.empty()) return 0;
-    return &(*container.insert(S).first);
+    size_t Hash = hashSet(S);
+    unsigned i = findBucket(Hash, S);
+    if (table[i].Set)
+      return table[i].Set;
+
+    container.push_back(InnerSetTy());
+    container.back().swap(S);
+    table[i].Hash = Hash;
+    table[i].Set = &container.back();
+    setPtr Result = table[i].Set;
+    // Keep the table at most three quarters full.
+    if (container.size() * 4 > table.size() * 3)
+      growTable();
+    return Result;
+  }
+
+public:
+  SuperSet() : threadSafe(false) { growTable(); }
+
+  void setThreadSafe(bool Enable) { threadSafe = Enable; }
+
+  setPtr getOrCreate(svset<Ty>& S) {
+    std::unique_lock<std::mutex> Guard(lock, std::defer_lock);
+    if (threadSafe) Guard.lock();
+    return intern(S);
   }
 
   setPtr getOrCreate(setPtr P, Ty t) {
-    svset<Ty> s;
-    if (P)
-      s.insert(P->begin(), P->end());
-    s.insert(t);
-    return getOrCreate(s);
+    if (P && P->count(t))
+      return P;
+    std::unique_lock<std::mutex> Guard(lock, std::defer_lock);
+    if (threadSafe) Guard.lock();
+    setPtr& Cached = insertCache[std::make_pair(P, t)];
+    if (!Cached) {
+      svset<Ty> s;
+      if (P)
+        s.insert(P->begin(), P->end());
+      s.insert(t);
+      Cached = intern(s);
+    }
+    return Cached;
   }
-};
 
+  /// getUnion - Return the set holding the members of both P and Q.
+  setPtr getUnion(setPtr P, setPtr Q) {
+    if (!P || P == Q) return Q;
+    if (!Q) return P;
+    if (Q < P) std::swap(P, Q);
+    std::unique_lock<std::mutex> Guard(lock, std::defer_lock);
+    if (threadSafe) Guard.lock();
+    setPtr& Cached = unionCache[std::make_pair(P, Q)];
+    if (!Cached) {
+      svset<Ty> s(*P);
+      s.insert(Q->begin(), Q->end());
+      Cached = intern(s);
+    }
+    return Cached;
+  }
+};
 
 
 #endif	/* _SUPER_SET_H */
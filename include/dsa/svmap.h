@@ -0,0 +1,117 @@
+//===- svmap.h - A map implemented atop a sorted small vector ---*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// svmap is a map from small keys to values, kept as a sorted vector of pairs
+// with room for N of them inline.  DSNode uses it for its links and types,
+// which usually have only a handful of entries, so lookups stay in one cache
+// line and most nodes need no heap allocation for them at all.
+//
+// It supports the subset of the std::map interface that DSA uses.  Unlike
+// std::map, iterators and references into an svmap are not stable across
+// insert or erase.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _SV_ORDERED_MAP_HH_
+#define _SV_ORDERED_MAP_HH_ 1
+
+#include "llvm/ADT/SmallVector.h"
+
+#include <algorithm>
+#include <utility>
+
+template<typename Key, typename T, unsigned N = 2>
+class svmap {
+public:
+  typedef Key key_type;
+  typedef T mapped_type;
+  typedef std::pair<Key, T> value_type;
+
+private:
+  typedef llvm::SmallVector<value_type, N> internal_type;
+
+  internal_type container_;
+
+  struct key_less {
+    bool operator()(const value_type &LHS, const key_type &RHS) const {
+      return LHS.first < RHS;
+    }
+  };
+
+public:
+  typedef typename internal_type::iterator iterator;
+  typedef typename internal_type::const_iterator const_iterator;
+  typedef typename internal_type::size_type size_type;
+
+  svmap() { }
+
+  iterator begin() { return container_.begin(); }
+  iterator end() { return container_.end(); }
+  const_iterator begin() const { return container_.begin(); }
+  const_iterator end() const { return container_.end(); }
+
+  bool empty() const { return container_.empty(); }
+  size_type size() const { return container_.size(); }
+  void clear() { container_.clear(); }
+  void swap(svmap &RHS) { container_.swap(RHS.container_); }
+
+  iterator lower_bound(const key_type &K) {
+    return std::lower_bound(container_.begin(), container_.end(), K,
+                            key_less());
+  }
+  const_iterator lower_bound(const key_type &K) const {
+    return std::lower_bound(container_.begin(), container_.end(), K,
+                            key_less());
+  }
+
+  iterator find(const key_type &K) {
+    iterator I = lower_bound(K);
+    if (I != end() && I->first == K) return I;
+    return end();
+  }
+  const_iterator find(const key_type &K) const {
+    const_iterator I = lower_bound(K);
+    if (I != end() && I->first == K) return I;
+    return end();
+  }
+
+  size_type count(const key_type &K) const {
+    return find(K) != end();
+  }
+
+  /// Insert a value, unless its key is already present.
+  std::pair<iterator, bool> insert(const value_type &V) {
+    iterator I = lower_bound(V.first);
+    if (I != end() && I->first == V.first)
+      return std::make_pair(I, false);
+    return std::make_pair(container_.insert(I, V), true);
+  }
+
+  /// Return the value for K, inserting a default constructed one if K is not
+  /// present.
+  mapped_type &operator[](const key_type &K) {
+    iterator I = lower_bound(K);
+    if (I == end() || I->first != K)
+      I = container_.insert(I, value_type(K, mapped_type()));
+    return I->second;
+  }
+
+  iterator erase(iterator I) {
+    return container_.erase(I);
+  }
+
+  size_type erase(const key_type &K) {
+    iterator I = find(K);
+    if (I == end()) return 0;
+    erase(I);
+    return 1;
+  }
+};
+
+#endif // _SV_ORDERED_MAP_HH_
@@ -23,9 +23,11 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <string>
 
 namespace llvm {
   class Value;
+  class Constant;
   class Function;
   class Module;
   class DSGraph;
@@ -412,6 +414,81 @@ namespace PA {
       virtual void HackFunctionBody(Function &F, std::map<const DSNode*, Value*> &PDs);
   };
 
+  //===-- AllocProfile Heuristic ------------------------------------------===//
+  //
+  // This heuristic lays out pools according to the pool statistics of a
+  // profiling run: allocation and free counts and allocated bytes per node.
+  // It has no measure of access locality.  Without a profile, it gives every
+  // node a pool of its own and names each pool for the runtime, so that
+  // running the program with POOLALLOC_STATS set writes the profile.  With
+  // one, nodes that were rarely allocated stay on malloc, nodes whose objects
+  // were never freed before pooldestroy and hot nodes get pools of their own,
+  // and the rest share pools with nodes of the same size.
+  //
+  class AllocProfileHeuristic : public Heuristic, public ModulePass {
+    public:
+      // NodeProfile - What the profiling run measured for one node.
+      struct NodeProfile {
+        unsigned long long Pools, Allocs, Frees, AllocBytes;
+        NodeProfile() : Pools(0), Allocs(0), Frees(0), AllocBytes(0) {}
+      };
+
+    private:
+      // Profile - The profile, indexed by pool name.  Empty when
+      // instrumenting.
+      std::map<std::string, NodeProfile> Profile;
+      bool Instrument;
+
+      // PoolNames - The name strings of the local pools to name once their
+      // poolinit calls exist.
+      std::map<const DSNode*, Constant*> PoolNames;
+
+      // BumpNodes - Local nodes the profiling run never freed.  They get pools
+      // of their own, which PoolOptimize can turn into bump-pointer pools once
+      // their frees are gone.
+      DSNodeSet_t BumpNodes;
+
+      // NodeNames - The pool name of every node, computed before pool
+      // allocation changes the program.
+      std::map<const DSNode*, std::string> NodeNames;
+
+      Constant *PoolProfileName;
+
+      bool readProfile(StringRef Filename);
+      void nameGraphNodes(DSGraph *G);
+      std::string getPoolName(const DSNode *N);
+      Constant *getNameString(const std::string &Name);
+      void nameAfterPoolInits(Value *PD, Constant *Name, Function *F);
+
+    public:
+      static char ID;
+      virtual void *getAdjustedAnalysisPointer(AnalysisID ID) {
+        if (ID == &Heuristic::ID)
+          return (Heuristic*)this;
+        return this;
+      }
+
+      AllocProfileHeuristic(char & IDp = ID) :
+        ModulePass (IDp), Instrument(false), PoolProfileName(0) {}
+
+      virtual bool runOnModule (Module & M);
+      virtual void releaseMemory ();
+      virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+        // We require DSA while this pass is still responding to queries
+        AU.addRequiredTransitive<EQTDDataStructures>();
+
+        // This pass does not modify anything when it runs
+        AU.setPreservesAll();
+      }
+
+      virtual void AssignToPools(const DSNodeList_t &NodesToPA,
+                                 Function *F, DSGraph* G,
+                                 std::vector<OnePool> &ResultPools);
+
+      virtual void HackFunctionBody(Function &F,
+                                    std::map<const DSNode*, Value*> &PDs);
+  };
+
   //===-- NoNodes Heuristic -----------------------------------------------===//
   //
   // This dummy heuristic chooses to not pool allocate anything.
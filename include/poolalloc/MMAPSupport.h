@@ -55,3 +55,50 @@ AllocateSpaceWithMMAP(size_t Size, bool UseNoReserve = false) {
   assert(Mem != MAP_FAILED && "couldn't get space!");
   return Mem;
 }
+
+/// AllocateAlignedSpaceWithMMAP - Like AllocateSpaceWithMMAP, but the memory
+/// returned is aligned to Align, which must be a power of two multiple of the
+/// page size.
+static inline void *
+AllocateAlignedSpaceWithMMAP(size_t Size, size_t Align,
+                             bool UseNoReserve = false) {
+  char *Mem = (char*)AllocateSpaceWithMMAP(Size+Align, UseNoReserve);
+  char *Aligned = (char*)(((size_t)Mem + Align-1) & ~(Align-1));
+
+  // Give back the unaligned head and the unused tail of the mapping.
+  if (Aligned != Mem)
+    ::munmap(Mem, Aligned-Mem);
+  if (Aligned != Mem+Align)
+    ::munmap(Aligned+Size, Mem+Align-Aligned);
+  return Aligned;
+}
+
+/// ReserveSpaceWithMMAP - Reserve Size bytes of address space, aligned to
+/// Align, without making any of it accessible.  Use CommitSpaceWithMMAP to
+/// make parts of it usable.
+static inline void *
+ReserveSpaceWithMMAP(size_t Size, size_t Align) {
+  char *Mem = (char*)AllocateAlignedSpaceWithMMAP(Size, Align, true);
+  ::mprotect(Mem, Size, PROT_NONE);
+  return Mem;
+}
+
+/// CommitSpaceWithMMAP - Make the reserved pages in [Mem, Mem+Size) readable
+/// and writable.  Mem and Size must be multiples of the page size.
+static inline void
+CommitSpaceWithMMAP(void *Mem, size_t Size) {
+  int Err = ::mprotect(Mem, Size, PROT_READ|PROT_WRITE);
+  assert(Err == 0 && "couldn't commit space!");
+  (void)Err;
+}
+
+/// DecommitSpaceWithMMAP - Give the pages in [Mem, Mem+Size) back to the
+/// system, and make them inaccessible again.  The address space stays
+/// reserved.
+static inline void
+DecommitSpaceWithMMAP(void *Mem, size_t Size) {
+#ifdef MADV_DONTNEED
+  ::madvise(Mem, Size, MADV_DONTNEED);
+#endif
+  ::mprotect(Mem, Size, PROT_NONE);
+}
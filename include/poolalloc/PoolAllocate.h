@@ -45,6 +45,7 @@ class AllocaInst;
 namespace PA {
 
   extern cl::opt<bool>  PA_SAFECODE;
+  extern cl::opt<bool>  BatchLoopAllocs;
 
   /// FuncInfo - Represent the pool allocation information for one function in
   /// the program.  Note that many functions must actually be cloned in order
@@ -215,6 +216,19 @@ public:
   Constant *PoolFree;
   Constant *PoolCalloc;
   Constant *PoolStrdup;
+  Constant *PoolAllocN;
+
+  // The inline fast paths for poolalloc and poolfree, or null if they are not
+  // in use (see -poolalloc-inline-fast-path).
+  Constant *PoolAllocInline, *PoolFreeInline;
+
+  // The entry points for pools that only one thread uses, or null if they are
+  // not in use (see -poolalloc-thread-private-pools).
+  Constant *PoolInitST, *PoolAllocST, *PoolFreeST;
+
+  // The inline fast paths for such pools, which call poolalloc_st and
+  // poolfree_st on the slow path, or null if they are not in use.
+  Constant *PoolAllocInlineST, *PoolFreeInlineST;
 
   // Function which will initialize global pools
   Function * GlobalPoolCtor;
@@ -331,7 +345,7 @@ protected:
     if (SAFECodeEnabled)
       return ArrayType::get(VoidPtrType, 92);
     else
-      return ArrayType::get(VoidPtrType, 16);
+      return ArrayType::get(VoidPtrType, 32);
   }
 
   virtual DSGraph* getDSGraph (const Function & F) const {
@@ -504,7 +518,29 @@ protected:
                             std::multimap<AllocaInst*, Instruction*> &PoolUses,
                             std::multimap<AllocaInst*, CallInst*> &PoolFrees);
 
-  void CalculateLivePoolFreeBlocks(std::set<BasicBlock*> &LiveBlocks,Value *PD);
+  void CalculateLivePoolFreeBlocks(std::set<BasicBlock*> &LiveBlocks,Value *PD,
+                              const std::set<Argument*> *MayAllocArgs = 0);
+
+  bool isPoolAllocatingUse(User *U, Value *PD,
+                           const std::set<Argument*> *MayAllocArgs);
+  bool isPoolAllocatedAfter(Instruction *I, Value *PD,
+                            const std::set<BasicBlock*> &LiveBlocks,
+                            const std::set<Argument*> &MayAllocArgs);
+
+  /// EliminateDeadPoolFrees - Delete the poolfree calls in the whole program
+  /// that cannot be followed by an allocation from the same pool.
+  void EliminateDeadPoolFrees(Module &M);
+
+  /// ThreadPrivateNodes - The nodes whose pools are created with poolinit_st.
+  DenseSet<const DSNode*> ThreadPrivateNodes;
+
+  /// FindThreadPrivateNodes - Add the nodes of G that no other thread can
+  /// reach to ThreadPrivateNodes.
+  void FindThreadPrivateNodes(DSGraph *G);
+
+  /// UseThreadPrivateEntryPoints - Make the allocations and frees made
+  /// directly on poolinit_st pools call poolalloc_st and poolfree_st.
+  void UseThreadPrivateEntryPoints();
 };
 
 
@@ -1,8 +1,31 @@
+//===- PoolAllocator.h - Policy based pool allocator ------------*- C++ -*-===//
+// 
+//                         Automatic Pool Allocation
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+// 
+//===----------------------------------------------------------------------===//
+//
+// This file defines PoolAllocator, a pool whose allocation strategy is chosen
+// by a SlabManager policy class, and the slab managers that go with it.  The
+// runtime/SlabManager library exports these pools through the same C entry
+// points as the FL2 runtime.
+//
+// A SlabManager provides slab_alloc, slab_free, slab_valid, slab_managed and
+// slab_getbounds, and is constructed from an object size and alignment.  The
+// fixed size manager of a CompoundSlabManager also provides slab_fits.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef POOLALLOC_RUNTIME_POOLALLOCATOR_H
+#define POOLALLOC_RUNTIME_POOLALLOCATOR_H
+
 #include "poolalloc_runtime/Support/SplayTree.h"
-#include "llvm/ADT/hash_map.h"
 #include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <stdint.h>
 #include <sys/mman.h>
 
 template<class SlabManager >
@@ -19,7 +42,7 @@ class PoolAllocator : SlabManager {
     {}
     
   // In-place new operator
-  static void* operator new( std::size_t s, void* p ) throw() {
+  static void* operator new( std::size_t, void* p ) throw() {
     return p;
   }
     
@@ -69,7 +92,7 @@ class MallocSlabManager {
   };
 
   public:
-  MallocSlabManager(unsigned Osize, unsigned Alignment) : objsize(Osize) {}
+  MallocSlabManager(unsigned Osize, unsigned) : objsize(Osize) {}
   ~MallocSlabManager() {
     dealloc_actor act(this);
     objs.clear(act);
@@ -98,128 +121,284 @@ class MallocSlabManager {
   }
 };
 
+// SlabMap - An open addressed hash table from slab base addresses to slab
+// metadata.  Keys are never null, so a null key marks an empty bucket.
+template<class Value, class SafeAllocator>
+class SlabMap {
+  struct entry {
+    void* key;
+    Value* value;
+  };
+  typedef typename SafeAllocator::template rebind<entry>::other EAlloc;
+
+  EAlloc alloc;
+  entry* table;
+  unsigned capacity;
+  unsigned count;
+
+  unsigned bucketFor(void* key) const {
+    uintptr_t k = (uintptr_t)key;
+    k ^= k >> 17;
+    k *= 0x9E3779B1U;
+    return (unsigned)(k ^ (k >> 15)) & (capacity - 1);
+  }
+
+  void grow() {
+    entry* old = table;
+    unsigned oldcap = capacity;
+    capacity = capacity ? capacity * 2 : 64;
+    table = alloc.allocate(capacity);
+    std::fill(table, table + capacity, entry());
+    count = 0;
+    for (unsigned i = 0; i < oldcap; ++i)
+      if (old[i].key)
+        insert(old[i].key, old[i].value);
+    if (old)
+      alloc.deallocate(old, oldcap);
+  }
+
+ public:
+  SlabMap() : table(0), capacity(0), count(0) {}
+  ~SlabMap() {
+    if (table)
+      alloc.deallocate(table, capacity);
+  }
+
+  Value* find(void* key) const {
+    if (!capacity) return 0;
+    for (unsigned i = bucketFor(key); table[i].key; i = (i + 1) & (capacity - 1))
+      if (table[i].key == key)
+        return table[i].value;
+    return 0;
+  }
+
+  void insert(void* key, Value* value) {
+    if ((count + 1) * 4 > capacity * 3)
+      grow();
+    unsigned i = bucketFor(key);
+    while (table[i].key)
+      i = (i + 1) & (capacity - 1);
+    table[i].key = key;
+    table[i].value = value;
+    ++count;
+  }
+
+  // erase - Remove key, shifting later entries of its probe sequence back so
+  // that no tombstones are needed.
+  void erase(void* key) {
+    unsigned i = bucketFor(key);
+    while (table[i].key != key) {
+      if (!table[i].key) return;
+      i = (i + 1) & (capacity - 1);
+    }
+    unsigned hole = i;
+    for (unsigned j = (i + 1) & (capacity - 1); table[j].key;
+         j = (j + 1) & (capacity - 1)) {
+      unsigned home = bucketFor(table[j].key);
+      if (((j - home) & (capacity - 1)) >= ((j - hole) & (capacity - 1))) {
+        table[hole] = table[j];
+        hole = j;
+      }
+    }
+    table[hole] = entry();
+    --count;
+  }
+
+  template<class O>
+  void for_each(O& act) {
+    for (unsigned i = 0; i < capacity; ++i)
+      if (table[i].key)
+        act(table[i].value);
+  }
+};
+
+// BitMaskSlabManager - Carve slabs of 2^PageShiftAmount pages into fixed size
+// objects, and track which are in use with a bitmask kept outside the slab.
+// Slabs are aligned to their size, so the slab of an object is found by
+// masking its address.  Slabs with free space are kept on a list, and a slab
+// that becomes empty is given back to the PageManager unless that would push
+// the occupancy of the remaining slabs above load percent.
 template<class PageManager, unsigned PageShiftAmount = 6, unsigned load = 80,
   class SafeAllocator = std::allocator<void> >
 class BitMaskSlabManager {
   struct slab_metadata {
     void* data;
     unsigned* free_bitmask;
+    // Bit y of full_summary is set when word y of free_bitmask is all ones,
+    // so findFree skips full words 32 at a time.
+    unsigned* full_summary;
+    // No word of free_bitmask below firstOpenWord has a free slot.
+    unsigned firstOpenWord;
+    unsigned numUsed;
+    // Links in the list of slabs with free space.
+    slab_metadata* prev;
+    slab_metadata* next;
   };
 
-  typedef typename SafeAllocator::template rebind<std::pair<void*, slab_metadata> >::other SAlloc;
-  typedef typename SafeAllocator::template rebind<unsigned>::other SBMAlloc;
-  typedef hash_map<void*, slab_metadata , hash<void*>, std::equal_to<void*>, SAlloc> MapTy;
+  enum { BitsPerInt = sizeof(unsigned) * 8 };
+  enum { SlabBytes = PageManager::pageSize << PageShiftAmount };
 
-  MapTy slabmetadata;
-  hash_map<void*, void*, hash<void*>, std::equal_to<void*>, SAlloc> mappedPages;
+  typedef typename SafeAllocator::template rebind<slab_metadata>::other SAlloc;
+  typedef typename SafeAllocator::template rebind<unsigned>::other SBMAlloc;
 
+  SlabMap<slab_metadata, SafeAllocator> slabmetadata;
+  SAlloc SlabAlloc;
   SBMAlloc BMAlloc;
 
   unsigned objsize;
+  unsigned numObjs;
+  // The first slab with free space; allocation always comes from here.
   slab_metadata* CurAllocSlab;
   unsigned totalslots;
   unsigned totalallocs;
 
   unsigned numObjsPerSlab() const {
-    return (PageManager::pageSize << PageShiftAmount) / objsize;
+    return numObjs;
   }
 
   unsigned numIntsPerSlabMeta() const {
-    return (numObjsPerSlab() + (sizeof(unsigned) * 8 - 1)) / (sizeof(unsigned) * 8);
+    return (numObjsPerSlab() + (BitsPerInt - 1)) / BitsPerInt;
   }
 
-  slab_metadata* getSlabForObj(void* obj) {
-    intptr_t ptr = (intptr_t)obj;
-    ptr &= ~(PageManager::pageSize - 1);
-    void* page = (void*)ptr;
-    page = mappedPages[page];
-    typename MapTy::iterator ii = slabmetadata.find(page);
-    if (ii == slabmetadata.end()) return 0;
-    return &ii->second;
+  unsigned numIntsPerSlabSummary() const {
+    return (numIntsPerSlabMeta() + (BitsPerInt - 1)) / BitsPerInt;
   }
 
-  unsigned getObjLoc(slab_metadata* slab, void* obj) {
+  slab_metadata* getSlabForObj(void* obj) const {
+    return slabmetadata.find((void*)((uintptr_t)obj & ~(uintptr_t)(SlabBytes - 1)));
+  }
+
+  unsigned getObjLoc(slab_metadata* slab, void* obj) const {
     return ((char*)obj - (char*)(slab->data)) / objsize;
   }
 
-  unsigned findFree(slab_metadata* slab) const {
-    // FIXME: free_bitmask is treated as a linear array.  A bit-tree representation would be faster
-    
-    for (unsigned y = 0; y < numIntsPerSlabMeta(); ++y) {
-      unsigned zone = slab->free_bitmask[y];
-      if (zone != ~0)
-        for (unsigned x = 0; x < sizeof(unsigned); ++x)
-          if ((zone >> (x * 8) & 0x00FF) != 0x00FF)
-            for (int z = 0; z < 8; ++z)
-              if (!(zone & 1 << (x * 8 + z)))
-                return y * sizeof(unsigned) + x * 8 + z;
-    }
-    return ~0;
+  unsigned findFree(slab_metadata* slab) {
+    unsigned y = slab->firstOpenWord / BitsPerInt;
+    unsigned open = ~slab->full_summary[y] & (~0U << (slab->firstOpenWord % BitsPerInt));
+    for (unsigned e = numIntsPerSlabSummary(); !open; open = ~slab->full_summary[y])
+      if (++y == e)
+        return ~0;
+    unsigned word = y * BitsPerInt + __builtin_ctz(open);
+    slab->firstOpenWord = word;
+    return word * BitsPerInt + __builtin_ctz(~slab->free_bitmask[word]);
   }
 
   bool isFree(slab_metadata* slab, unsigned loc) const {
-    return !(slab->free_bitmask[loc / sizeof(unsigned)] & ( 1 << (loc % sizeof(unsigned))));
+    return !(slab->free_bitmask[loc / BitsPerInt] & (1U << (loc % BitsPerInt)));
   }
 
   void setFree(slab_metadata* slab, unsigned loc) {
-    slab->free_bitmask[loc / sizeof(unsigned)] &= ~( 1 << (loc % sizeof(unsigned)));
+    unsigned word = loc / BitsPerInt;
+    slab->free_bitmask[word] &= ~(1U << (loc % BitsPerInt));
+    slab->full_summary[word / BitsPerInt] &= ~(1U << (word % BitsPerInt));
+    if (word < slab->firstOpenWord)
+      slab->firstOpenWord = word;
+    --slab->numUsed;
     --totalallocs;
   }
 
   void setUsed(slab_metadata* slab, unsigned loc) {
-    slab->free_bitmask[loc / sizeof(unsigned)] |= ( 1 << (loc % sizeof(unsigned)));
+    unsigned word = loc / BitsPerInt;
+    slab->free_bitmask[word] |= (1U << (loc % BitsPerInt));
+    if (slab->free_bitmask[word] == ~0U)
+      slab->full_summary[word / BitsPerInt] |= (1U << (word % BitsPerInt));
+    ++slab->numUsed;
     ++totalallocs;
   }
 
-  void createOrSetNewSlab() {
-    if (!totalslots || ((totalallocs * 100) / totalslots > load)) {
-      // Create new slab
-      void* mem = PageManager::getPages(1 << PageShiftAmount);
-      slab_metadata& slab = slabmetadata[mem];
-      slab.data = mem;
-      slab.free_bitmask = BMAlloc.allocate(numIntsPerSlabMeta());
-      std::fill(slab.free_bitmask, slab.free_bitmask + numIntsPerSlabMeta(), 0);
-      CurAllocSlab = &slab;
-      totalslots += numObjsPerSlab();
-      for (unsigned x = 0; x < (1 << PageShiftAmount); ++x)
-        mappedPages[(void*) &(((char*)mem)[x * PageManager::pageSize])] = mem;
-    } else {
-      // Find a slab with some free space
-      for (typename MapTy::iterator ii = slabmetadata.begin(),
-             ee = slabmetadata.end(); ii != ee; ++ii)
-        if (findFree(&ii->second)) {
-          CurAllocSlab = &ii->second;
-          break;
-        }
-    }
+  void addToFreeList(slab_metadata* slab) {
+    slab->prev = 0;
+    slab->next = CurAllocSlab;
+    if (CurAllocSlab)
+      CurAllocSlab->prev = slab;
+    CurAllocSlab = slab;
   }
 
+  void removeFromFreeList(slab_metadata* slab) {
+    if (slab->prev)
+      slab->prev->next = slab->next;
+    else
+      CurAllocSlab = slab->next;
+    if (slab->next)
+      slab->next->prev = slab->prev;
+  }
+
+  void createNewSlab() {
+    void* mem = PageManager::getAlignedPages(1 << PageShiftAmount);
+    if (!mem) return;
+    slab_metadata* slab = SlabAlloc.allocate(1);
+    slab->data = mem;
+    slab->firstOpenWord = 0;
+    slab->numUsed = 0;
+    slab->free_bitmask = BMAlloc.allocate(numIntsPerSlabMeta());
+    slab->full_summary = BMAlloc.allocate(numIntsPerSlabSummary());
+    std::fill(slab->free_bitmask, slab->free_bitmask + numIntsPerSlabMeta(), 0);
+    std::fill(slab->full_summary, slab->full_summary + numIntsPerSlabSummary(), 0);
+
+    // Slots past the end of the slab, and summary bits past the end of the
+    // bitmask, look used so that findFree never returns them.
+    if (numObjs % BitsPerInt)
+      slab->free_bitmask[numObjs / BitsPerInt] = ~0U << (numObjs % BitsPerInt);
+    unsigned numInts = numIntsPerSlabMeta();
+    if (numInts % BitsPerInt)
+      slab->full_summary[numInts / BitsPerInt] = ~0U << (numInts % BitsPerInt);
+
+    totalslots += numObjs;
+    slabmetadata.insert(mem, slab);
+    addToFreeList(slab);
+  }
+
+  void destroySlab(slab_metadata* slab) {
+    PageManager::freePages(slab->data, 1 << PageShiftAmount);
+    BMAlloc.deallocate(slab->free_bitmask, numIntsPerSlabMeta());
+    BMAlloc.deallocate(slab->full_summary, numIntsPerSlabSummary());
+    SlabAlloc.deallocate(slab, 1);
+  }
+
+  struct destroy_actor {
+    BitMaskSlabManager* m;
+    void operator()(slab_metadata* slab) { m->destroySlab(slab); }
+    destroy_actor(BitMaskSlabManager* _m) : m(_m) {}
+  };
+
   public:
   BitMaskSlabManager(unsigned Osize, unsigned Alignment) 
-  :objsize(Osize), CurAllocSlab(0), totalslots(0), totalallocs(0)
-  {}
+  :CurAllocSlab(0), totalslots(0), totalallocs(0)
+  {
+    if (Alignment < 1) Alignment = 1;
+    if (Osize < 1) Osize = 1;
+    objsize = (Osize + Alignment - 1) / Alignment * Alignment;
+    numObjs = SlabBytes / objsize;
+  }
   ~BitMaskSlabManager() {
-    for (typename MapTy::const_iterator ii = slabmetadata.begin(),
-           ee = slabmetadata.end(); ii != ee; ++ii) {
-      PageManager::freePages(ii->second.data, 1 << PageShiftAmount);
-      BMAlloc.deallocate(ii->second.free_bitmask, numIntsPerSlabMeta());
-    }
+    destroy_actor act(this);
+    slabmetadata.for_each(act);
   }
     
+  // slab_fits - Return true if an object fits in a slab.  Larger objects
+  // have to come from somewhere else.
+  bool slab_fits() const {
+    return numObjs != 0;
+  }
   void* slab_alloc(unsigned num) {
     if (num > 1) {
       assert(0 && "Only size 1 allowed");
       abort();
     }
-    if (!CurAllocSlab)
-      createOrSetNewSlab();
-    unsigned loc = findFree(CurAllocSlab);
-    if (loc == ~0) {
-      CurAllocSlab = 0;
-      return slab_alloc(num);
+    if (!slab_fits()) {
+      assert(0 && "Object larger than a slab");
+      abort();
+    }
+    if (!CurAllocSlab) {
+      createNewSlab();
+      if (!CurAllocSlab) return 0;
     }
-    setUsed(CurAllocSlab, loc);
-    return &((char*)CurAllocSlab->data)[loc * objsize];
+    slab_metadata* slab = CurAllocSlab;
+    unsigned loc = findFree(slab);
+    setUsed(slab, loc);
+    if (slab->numUsed == numObjs)
+      removeFromFreeList(slab);
+    return &((char*)slab->data)[loc * objsize];
   }
   void slab_free(void* obj) {
     slab_metadata* slab = getSlabForObj(obj);
@@ -227,7 +406,18 @@ class BitMaskSlabManager {
       assert(0 && "Freeing invalid object");
       abort();
     }
+    if (slab->numUsed == numObjs)
+      addToFreeList(slab);
     setFree(slab, getObjLoc(slab, obj));
+
+    // Give empty slabs back while the remaining ones are loaded lightly.
+    if (slab->numUsed == 0 && totalslots > numObjs &&
+        (uint64_t)totalallocs * 100 <= (uint64_t)load * (totalslots - numObjs)) {
+      removeFromFreeList(slab);
+      slabmetadata.erase(slab->data);
+      totalslots -= numObjs;
+      destroySlab(slab);
+    }
   }
   bool slab_valid(void* obj) {
     slab_metadata* slab = getSlabForObj(obj);
@@ -243,26 +433,30 @@ class BitMaskSlabManager {
     if (!slab) return false;
     unsigned loc = getObjLoc(slab, obj);
     if (isFree(slab, loc)) return false;
-    start = &(char*)(slab->data)[loc * objsize];
-    end = &(char*)(slab->data)[loc * objsize] - 1;
+    start = &((char*)slab->data)[loc * objsize];
+    end = &((char*)slab->data)[(loc + 1) * objsize - 1];
     return true;
   }
 };
 
+// CompoundSlabManager - Single objects come from FixedAllocator, unless they
+// do not fit in its slabs, and arrays from VarAllocator.
 template<class FixedAllocator, class VarAllocator>
 class CompoundSlabManager {
   FixedAllocator FixedAlloc;
   VarAllocator   VarAlloc;
   unsigned objsize;
+  bool FixedFits;
  public:
   CompoundSlabManager(unsigned Osize, unsigned Alignment) 
-    :FixedAlloc(Osize, Alignment), VarAlloc(1, Alignment), objsize(Osize)
+    :FixedAlloc(Osize, Alignment), VarAlloc(1, Alignment), objsize(Osize),
+     FixedFits(FixedAlloc.slab_fits())
   {}
   void* slab_alloc(unsigned num) {
-    if (num == 1)
+    if (num == 1 && FixedFits)
       return FixedAlloc.slab_alloc(1);
     else
-      return VarAlloc.slab_alloc(num * sizeof(objsize * num));
+      return VarAlloc.slab_alloc(num * objsize);
   }
   void slab_free(void* obj) {
     if (FixedAlloc.slab_managed(obj))
@@ -289,10 +483,25 @@ class LinuxMmap {
  public:
   enum d {pageSize = 4096};
   static void* getPages(unsigned num) {
-    return mmap(0, pageSize * num, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* mem = mmap(0, pageSize * num, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? 0 : mem;
+  }
+  // getAlignedPages - Return num pages aligned to num * pageSize.  num must be
+  // a power of two.
+  static void* getAlignedPages(unsigned num) {
+    size_t size = (size_t)pageSize * num;
+    char* mem = (char*)getPages(num * 2);
+    if (!mem) return 0;
+    char* aligned = (char*)(((uintptr_t)mem + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned != mem)
+      munmap(mem, aligned - mem);
+    munmap(aligned + size, mem + size - aligned);
+    return aligned;
   }
   static void freePages(void* page, unsigned num) {
     munmap(page, num * pageSize);
   }
 };
 
+#endif
+
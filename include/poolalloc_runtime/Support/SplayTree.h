@@ -155,8 +155,8 @@ class RangeSplayTree {
   template<class O>
   void __clear_internal(tree_node* t, O& act) {
     if (!t) return;
-    __clear_internal(t->left);
-    __clear_internal(t->right);
+    __clear_internal(t->left, act);
+    __clear_internal(t->right, act);
     t->do_act(act);
     __node_alloc.destroy(t);
     __node_alloc.deallocate(t, 1);
@@ -226,7 +226,7 @@ class RangeSplayTree {
   }
 
   tree_node* __find(void* key) {
-    if (!Tree) return false;
+    if (!Tree) return 0;
     Tree = splay(Tree, key);
     if (!key_lt(key, Tree) && !key_gt(key, Tree)) {
       return Tree;
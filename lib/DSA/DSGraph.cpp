@@ -110,7 +110,8 @@ std::string DSGraph::getFunctionNames() const {
 DSGraph::DSGraph(DSGraph* G, EquivalenceClasses<const GlobalValue*> &ECs,
                  SuperSet<Type*>& tss,
                  unsigned CloneFlags)
-  : GlobalsGraph(0), ScalarMap(ECs), TD(G->TD), TypeSS(tss) {
+  : GlobalsGraph(0), NodeArena(new DSNodeArena()), ScalarMap(ECs), TD(G->TD),
+    TypeSS(tss) {
   UseAuxCalls = false;
   cloneInto(G, CloneFlags);
 }
@@ -128,6 +129,9 @@ DSGraph::~DSGraph() {
 
   // Free all of the nodes.
   Nodes.clear();
+
+  // The slabs go away with the last node still alive in them.
+  NodeArena->release();
 }
 
 // dump - Allow inspection of graph in a debugger.
@@ -161,7 +165,7 @@ void DSGraph::removeFunctionCalls(Function& F) {
 /// and does not point to any other objects in the graph.
 DSNode *DSGraph::addObjectToGraph(Value *Ptr, bool UseDeclaredType) {
   assert(isa<PointerType>(Ptr->getType()) && "Ptr is not a pointer!");
-  DSNode *N = new DSNode(this);
+  DSNode *N = new (this) DSNode(this);
   assert(ScalarMap[Ptr].isNull() && "Object already in this graph!");
   ScalarMap[Ptr] = N;
 
@@ -199,7 +203,7 @@ void DSGraph::cloneInto( DSGraph* G, unsigned CloneFlags) {
   for (node_const_iterator I = G->node_begin(), E = G->node_end(); I != E; ++I) {
     assert(!I->isForwarding() &&
            "Forward nodes shouldn't be in node list!");
-    DSNode *New = new DSNode(*I, this);
+    DSNode *New = new (this) DSNode(*I, this);
     New->maskNodeTypes(~BitsToClear);
     OldNodeMap[I] = New;
   }
@@ -919,12 +923,18 @@ void DSGraph::removeTriviallyDeadNodes() {
   // Loop over all of the nodes in the graph, calling getNode on each field.
   // This will cause all nodes to update their forwarding edges, causing
   // forwarded nodes to be delete-able.  Further, reclaim any memory used by
-  // useless edge or type entries
-  for (node_iterator NI = node_begin(), E = node_end(); NI != E; ++NI)
+  // useless edge or type entries.  The targets are collected first, since
+  // cleaning a node that points to itself would erase from the edge list
+  // being walked.
+  for (node_iterator NI = node_begin(), E = node_end(); NI != E; ++NI) {
+    SmallVector<DSNode*, 8> Targets;
     for (DSNode::edge_iterator ii = NI->edge_begin(), ee = NI->edge_end();
-         ii != ee; ++ii) {
-      ii->second.getNode()->cleanEdges();
-    }
+         ii != ee; ++ii)
+      if (DSNode *N = ii->second.getNode())
+        Targets.push_back(N);
+    for (unsigned i = 0, e = Targets.size(); i != e; ++i)
+      Targets[i]->cleanEdges();
+  }
 
   // Likewise, forward any edges from the scalar nodes.  While we are at it,
   // clean house a bit.
@@ -1331,8 +1341,13 @@ void DSGraph::computeNodeMapping(const DSNodeHandle &NH1,
   // Recursively link outgoing edges together.
   //
   int N2Idx = NH2.getOffset()-NH1.getOffset();
+  // Links are copied rather than referenced, and missing links are skipped
+  // rather than created: a node's links live in a vector that moves when an
+  // entry is added.
+  //
   for (unsigned i = 0, e = N1->getSize(); i < e; ++i) {
-    const DSNodeHandle &N1NH = N1->getLink(i);
+    if (!N1->hasLink(i)) continue;
+    DSNodeHandle N1NH = N1->getLink(i);
     //
     // Don't call N2->getLink if not needed (avoiding crash if N2Idx is not
     // aligned correctly).
@@ -1348,9 +1363,12 @@ void DSGraph::computeNodeMapping(const DSNodeHandle &NH1,
         offset = (unsigned(N2Idx+i) % N2Size);
 
       //
-      // Compute the node mapping for the link.
+      // Compute the node mapping for the link.  A missing link in the second
+      // node maps to nothing.
       //
-      computeNodeMapping (N1NH, N2->getLink(offset), NodeMap, StrictChecking);
+      if (!N2->hasLink(offset)) continue;
+      DSNodeHandle N2NH = N2->getLink(offset);
+      computeNodeMapping (N1NH, N2NH, NodeMap, StrictChecking);
     }
   }
 }
@@ -1398,11 +1416,8 @@ void DSGraph::computeGGToGMapping(InvNodeMapTy &InvNodeMap) {
   NodeMapTy NodeMap;
   computeGToGGMapping(NodeMap);
 
-  while (!NodeMap.empty()) {
-    InvNodeMap.insert(std::make_pair(NodeMap.begin()->second,
-                                     NodeMap.begin()->first));
-    NodeMap.erase(NodeMap.begin());
-  }
+  for (NodeMapTy::iterator I = NodeMap.begin(), E = NodeMap.end(); I != E; ++I)
+    InvNodeMap.insert(std::make_pair(I->second, I->first));
 }
 
 
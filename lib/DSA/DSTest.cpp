@@ -19,6 +19,9 @@
 // -check-callees=caller,<list>     Verify the given caller has the following callees
 // -check-not-callees=caller,<list> Verify the given caller does not have the following callees
 // -verify-flags=<list>             Verify the given values match the flag specifications.
+// -print-canonical-graphs          Print every graph and the call graph in an
+//                                  order that does not depend on how they were
+//                                  built, so that runs can be diffed.
 //
 // In general a 'value' query on the DSA results looks like this:
 // graph:value[:offset]*
@@ -45,6 +48,7 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/ValueSymbolTable.h"
+#include <algorithm>
 using namespace llvm;
 
 namespace {
@@ -71,6 +75,9 @@ namespace {
   // For first function, verify that it does not call the other functions
   cl::list<std::string> CheckNotCallees("check-not-callees",
       cl::CommaSeparated, cl::ReallyHidden);
+  // Print all graphs in a canonical form, for diffing two runs
+  cl::opt<bool> PrintCanonicalGraphs("print-canonical-graphs",
+      cl::ReallyHidden);
 }
 
 typedef std::set<const Function*> FuncSetTy;
@@ -253,25 +260,32 @@ static void printAllValuesForNode(llvm::raw_ostream &O, NodeValue &NV) {
   // Look for values that have an equivalent NH
   DSNodeHandle &NH = NV.getNodeH();
   const DSGraph::ScalarMapTy &SM = NV.getGraph()->getScalarMap();
-  bool first = true;
+  std::vector<const Value*> Values;
 
   for (DSGraph::ScalarMapTy::const_iterator I = SM.begin(), E = SM.end();
       I != E; ++I )
     if (NH == I->second) {
       //Found one!
-      const Value *V = I->first;
+      Values.push_back(I->first);
+    }
 
-      //Print them out, separated by commas
-      if (!first) O << ",";
-      first = false;
+  // The scalar map is hashed, so put the values back in the (address) order
+  // an ordered map would have listed them in.
+  std::sort(Values.begin(), Values.end());
 
-      // Print out name, if it has one.
-      // FIXME: Get "%0, "%1", naming like the .ll has?
-      if (V->hasName())
-        O << V->getName();
-      else
-        O << "<tmp>";
-    }
+  for (unsigned i = 0, e = Values.size(); i != e; ++i) {
+    const Value *V = Values[i];
+
+    //Print them out, separated by commas
+    if (i) O << ",";
+
+    // Print out name, if it has one.
+    // FIXME: Get "%0, "%1", naming like the .ll has?
+    if (V->hasName())
+      O << V->getName();
+    else
+      O << "<tmp>";
+  }
 
   //FIXME: Search globals in this graph too (not just scalarMap)?
 }
@@ -688,6 +702,158 @@ static bool checkCallees(llvm::raw_ostream &O, const Module *M,
   return true;
 }
 
+/// CanonicalPrinter -- prints DSGraphs so that two runs that build the same
+/// graphs print the same text, whatever order the nodes were created or merged
+/// in.  Nodes are numbered in the order a depth first walk from the named
+/// roots reaches them, following links in offset order; unnamed values are
+/// only reached through links.
+///
+class CanonicalPrinter {
+  llvm::raw_ostream &O;
+  std::map<const DSNode*, unsigned> Ids;
+  std::vector<const DSNode*> Order;
+
+  void number(const DSNode *N) {
+    if (!N || !Ids.insert(std::make_pair(N, Ids.size())).second)
+      return;
+    Order.push_back(N);
+    for (DSNode::const_edge_iterator I = N->edge_begin(), E = N->edge_end();
+         I != E; ++I)
+      number(I->second.getNode());
+  }
+
+  void printHandle(const DSNodeHandle &NH) {
+    if (NH.isNull())
+      O << "null";
+    else
+      O << "#" << Ids[NH.getNode()] << "+" << NH.getOffset();
+  }
+
+  void printNode(const DSNode *N) {
+    O << "  #" << Ids[N] << " " << getFlags(const_cast<DSNode*>(N))
+      << " size " << N->getSize();
+    if (N->isNodeCompletelyFolded()) O << " folded";
+    if (N->isArrayNode()) O << " array";
+
+    std::vector<std::string> Globals;
+    for (DSNode::globals_iterator I = N->globals_begin(),
+         E = N->globals_end(); I != E; ++I)
+      Globals.push_back((*I)->getName().str());
+    std::sort(Globals.begin(), Globals.end());
+    for (unsigned i = 0, e = Globals.size(); i != e; ++i)
+      O << (i ? "," : " globals ") << Globals[i];
+
+    for (DSNode::TyMapTy::const_iterator I = N->type_begin(),
+         E = N->type_end(); I != E; ++I) {
+      O << "\n    type " << I->first << ":";
+      if (!I->second) {
+        O << " VOID";
+        continue;
+      }
+      std::vector<std::string> Types;
+      for (svset<Type*>::const_iterator TI = I->second->begin(),
+           TE = I->second->end(); TI != TE; ++TI) {
+        std::string Str;
+        raw_string_ostream OS(Str);
+        (*TI)->print(OS);
+        Types.push_back(OS.str());
+      }
+      std::sort(Types.begin(), Types.end());
+      for (unsigned i = 0, e = Types.size(); i != e; ++i)
+        O << " " << Types[i];
+    }
+    for (DSNode::const_edge_iterator I = N->edge_begin(), E = N->edge_end();
+         I != E; ++I) {
+      O << "\n    link " << I->first << ": ";
+      printHandle(I->second);
+    }
+    O << "\n";
+  }
+
+public:
+  explicit CanonicalPrinter(llvm::raw_ostream &O) : O(O) {}
+
+  /// getRootName -- Name a value uniquely within a graph: the graphs of an
+  /// SCC hold the locals of several functions.
+  static std::string getRootName(const Value *V) {
+    const Function *F = 0;
+    if (const Argument *A = dyn_cast<Argument>(V))
+      F = A->getParent();
+    else if (const Instruction *I = dyn_cast<Instruction>(V))
+      F = I->getParent()->getParent();
+    if (!F)
+      return "value @" + V->getName().str();
+    return "value " + F->getName().str() + ":" + V->getName().str();
+  }
+
+  void print(const std::string &Label, const DSGraph *G) {
+    Ids.clear();
+    Order.clear();
+
+    // The roots: return and var-arg nodes, then named values, by name.
+    typedef std::pair<std::string, DSNodeHandle> RootTy;
+    std::vector<RootTy> Roots;
+    for (DSGraph::retnodes_iterator I = G->retnodes_begin(),
+         E = G->retnodes_end(); I != E; ++I)
+      Roots.push_back(RootTy("return " + I->first->getName().str(),
+                             I->second));
+    for (DSGraph::vanodes_iterator I = G->vanodes_begin(),
+         E = G->vanodes_end(); I != E; ++I)
+      Roots.push_back(RootTy("vararg " + I->first->getName().str(),
+                             I->second));
+    const DSGraph::ScalarMapTy &SM = G->getScalarMap();
+    for (DSGraph::ScalarMapTy::const_iterator I = SM.begin(), E = SM.end();
+         I != E; ++I)
+      if (I->first->hasName())
+        Roots.push_back(RootTy(getRootName(I->first), I->second));
+    std::sort(Roots.begin(), Roots.end(),
+              [](const RootTy &L, const RootTy &R) {
+                return L.first < R.first;
+              });
+
+    for (unsigned i = 0, e = Roots.size(); i != e; ++i)
+      number(Roots[i].second.getNode());
+
+    O << "graph " << Label << "\n";
+    for (unsigned i = 0, e = Roots.size(); i != e; ++i) {
+      O << "  " << Roots[i].first << " -> ";
+      printHandle(Roots[i].second);
+      O << "\n";
+    }
+    for (unsigned i = 0, e = Order.size(); i != e; ++i)
+      printNode(Order[i]);
+  }
+};
+
+/// printCanonicalGraphs -- Print the globals graph, the graph of every
+/// function that has one, and the callees of every function, all by name.
+/// Returns true iff the user asked for it.
+///
+static bool printCanonicalGraphs(llvm::raw_ostream &O, const Module *M,
+                                 const DataStructures *DS) {
+  if (!PrintCanonicalGraphs) return false;
+
+  CanonicalPrinter P(O);
+  P.print("globals", DS->getGlobalsGraph());
+  const DSCallGraph &CG = DS->getCallGraph();
+  for (Module::const_iterator F = M->begin(), E = M->end(); F != E; ++F) {
+    if (F->isDeclaration() || !DS->hasDSGraph(*F)) continue;
+    P.print(F->getName().str(), DS->getDSGraph(*F));
+
+    FuncSetTy Callees = getCalleesFor(&*F, CG);
+    std::vector<std::string> Names;
+    for (FuncSetTy::iterator I = Callees.begin(), IE = Callees.end(); I != IE;
+         ++I)
+      Names.push_back((*I)->getName().str());
+    std::sort(Names.begin(), Names.end());
+    O << "callees " << F->getName() << ":";
+    for (unsigned i = 0, e = Names.size(); i != e; ++i)
+      O << " " << Names[i];
+    O << "\n";
+  }
+  return true;
+}
+
 /// handleTest -- handles any user-specified testing options.
 /// returns true iff the user specified something to test.
 ///
@@ -702,6 +868,7 @@ bool DataStructures::handleTest(llvm::raw_ostream &O, const Module *M) const {
   tested |= checkTypes(O,M,this);
   tested |= checkCallees(O,M,this);
   tested |= checkNotCallees(O,M,this);
+  tested |= printCanonicalGraphs(O,M,this);
 
   return tested;
 }
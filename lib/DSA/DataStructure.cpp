@@ -24,6 +24,7 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/TypeFinder.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/ADT/DepthFirstIterator.h"
@@ -151,6 +152,42 @@ DSNode::~DSNode() {
   assert(hasNoReferrers() && "Referrers to dead node exist!");
 }
 
+// Every node is preceded by a header naming the arena it was allocated from,
+// so that operator delete can hand it back.  Nodes created without a graph,
+// and the node list sentinels, come from the heap and have a null arena.
+static const size_t NodeHeaderSize = alignof(DSNode);
+static_assert(NodeHeaderSize >= sizeof(DSNodeArena*),
+              "DSNode header too small to hold the arena!");
+
+static void *allocateNode(size_t Size, DSNodeArena *Arena) {
+  size_t ChunkSize = NodeHeaderSize + Size;
+  char *Chunk = Arena ? (char*)Arena->Allocate(ChunkSize, alignof(DSNode))
+                      : (char*)::operator new(ChunkSize);
+  *(DSNodeArena**)Chunk = Arena;
+  return Chunk + NodeHeaderSize;
+}
+
+void *DSNode::operator new(size_t Size) {
+  return allocateNode(Size, 0);
+}
+
+void *DSNode::operator new(size_t Size, DSGraph *G) {
+  return allocateNode(Size, G ? &G->getNodeArena() : 0);
+}
+
+void DSNode::operator delete(void *Ptr, DSGraph *) {
+  DSNode::operator delete(Ptr);
+}
+
+void DSNode::operator delete(void *Ptr) {
+  if (!Ptr) return;
+  char *Chunk = (char*)Ptr - NodeHeaderSize;
+  if (DSNodeArena *Arena = *(DSNodeArena**)Chunk)
+    Arena->Deallocate(Chunk);
+  else
+    ::operator delete(Chunk);
+}
+
 void DSNode::assertOK() const {
   //  assert(((Ty && Ty->getTypeID() != Type::VoidTyID) ||
   //         ((!Ty || Ty->getTypeID() == Type::VoidTyID) && (Size == 0 ||
@@ -253,7 +290,7 @@ void DSNode::foldNodeCompletely() {
     // Create the node we are going to forward to.  This is required because
     // some referrers may have an offset that is > 0.  By forcing them to
     // forward, the forwarder has the opportunity to correct the offset.
-    DSNode *DestNode = new DSNode(ParentGraph);
+    DSNode *DestNode = new (ParentGraph) DSNode(ParentGraph);
     DestNode->NodeType = NodeType;
     DestNode->setCollapsedMarker();
     DestNode->Size = 1;
@@ -471,9 +508,7 @@ void DSNode::mergeTypeInfo(const TyMapTy::mapped_type TyIt, unsigned Offset) {
         growSize(Offset + TD.getTypeAllocSize(*ni));
     }
   } else if (TyIt) {
-    svset<Type*> S(*TyMap[Offset]);
-    S.insert(TyIt->begin(), TyIt->end());
-    TyMap[Offset] = getParentGraph()->getTypeSS().getOrCreate(S);
+    TyMap[Offset] = getParentGraph()->getTypeSS().getUnion(TyMap[Offset], TyIt);
   }
   assert(TyMap[Offset]);
 }
@@ -495,10 +530,12 @@ void DSNode::addEdgeTo(unsigned Offset, const DSNodeHandle &NH) {
   if (isNodeCompletelyFolded())
     Offset = 0;
 
-  DSNodeHandle &ExistingEdge = getLink(Offset);
-  if (!ExistingEdge.isNull()) {
-    // Merge the two nodes...
-    ExistingEdge.mergeWith(NH);
+  LinkMapTy::iterator ExistingEdge = Links.find(Offset);
+  if (ExistingEdge != Links.end() && !ExistingEdge->second.isNull()) {
+    // Merge the two nodes.  Merging may add links to this node, so work on a
+    // copy of the edge.
+    DSNodeHandle Edge = ExistingEdge->second;
+    Edge.mergeWith(NH);
   } else {                             // No merging to perform...
     setLink(Offset, NH);               // Just force a link in there...
   }
@@ -706,21 +743,14 @@ void DSNode::cleanEdges() {
   for (type_iterator ii = type_begin(); ii != type_end(); ) {
     if (ii->second)
       ++ii;
-    else {
-      type_iterator backup = ii;
-      ++backup;
-      TyMap.erase(ii);
-      ii = backup;
-    }
+    else
+      ii = TyMap.erase(ii);
   }
   //get rid of any node edge pointing to nothing
   for (edge_iterator ii = edge_begin(); ii != edge_end(); ) {
-    if (ii->second.isNull()) {
-      edge_iterator backup = ii;
-      ++backup;
-      Links.erase(ii);
-      ii = backup;
-    } else
+    if (ii->second.isNull())
+      ii = Links.erase(ii);
+    else
       ++ii;
   }
 }
@@ -788,7 +818,8 @@ DSNodeHandle ReachabilityCloner::getClonedNH(const DSNodeHandle &SrcNH) {
 
   if (!createDest) return DSNodeHandle(0,0);
 
-  DSNode *DN = new DSNode(*SN, Dest, true /* Null out all links */);
+  DSNode *DN = new (Dest) DSNode(*SN, Dest,
+                                 true /* Null out all links */);
   DN->maskNodeTypes(BitsToKeep);
   NH = DN;
 
@@ -959,7 +990,8 @@ void ReachabilityCloner::merge(const DSNodeHandle &NH,
   } else {
     // We cannot handle this case without allocating a temporary node.  Fall
     // back on being simple.
-    DSNode *NewDN = new DSNode(*SN, Dest, true /* Null out all links */);
+    DSNode *NewDN = new (Dest) DSNode(*SN, Dest,
+                                      true /* Null out all links */);
     NewDN->maskNodeTypes(BitsToKeep);
 
 #ifndef NDEBUG
@@ -1026,7 +1058,7 @@ void ReachabilityCloner::merge(const DSNodeHandle &NH,
         unsigned MergeOffset = 0;
         CN = SCNH.getNode();
         MergeOffset = (ii->first + SCNH.getOffset()) % CN->getSize();
-        CN->getLink(MergeOffset).mergeWith(Tmp);
+        CN->addEdgeTo(MergeOffset, Tmp);
       }
     }
   }
@@ -1475,6 +1507,17 @@ void DataStructures::cloneIntoGlobals(DSGraph* Graph, unsigned cloneFlags) {
 }
 
 
+// DataLayout computes struct layouts on first use, without a lock, so a pass
+// that builds graphs on several threads computes all of them up front.
+void DataStructures::computeStructLayouts(Module &M) const {
+  TypeFinder StructTypes;
+  StructTypes.run(M, false);
+  for (TypeFinder::iterator I = StructTypes.begin(), E = StructTypes.end();
+       I != E; ++I)
+    if ((*I)->isSized())
+      TD->getStructLayout(*I);
+}
+
 void DataStructures::init(DataStructures* D, bool clone, bool useAuxCalls, 
                           bool copyGlobalAuxCalls, bool resetAux) {
   assert (!GraphSource && "Already init");
@@ -89,7 +89,7 @@ namespace {
     ///
     DSNode *createNode() 
     {   
-      DSNode* ret = new DSNode(&G);
+      DSNode* ret = new (&G) DSNode(&G);
       assert(ret->getParentGraph() && "No parent?");
       return ret;
     }
@@ -108,7 +108,7 @@ namespace {
     /// specified node if one exists.  If a link does not already exist (it's
     /// null), then we create a new node, link it, then return it.
     ///
-    DSNodeHandle &getLink(const DSNodeHandle &Node, unsigned Link = 0);
+    DSNodeHandle getLink(const DSNodeHandle &Node, unsigned Link = 0);
 
     ////////////////////////////////////////////////////////////////////////////
     // Visitor functions, used to handle each instruction type we encounter...
@@ -335,7 +335,7 @@ DSNodeHandle GraphBuilder::getValueDest(Value* V) {
 /// specify the type of the Node field we are accessing so that we know what
 /// type should be linked to if we need to create a new node.
 ///
-DSNodeHandle &GraphBuilder::getLink(const DSNodeHandle &node, unsigned LinkNo) {
+DSNodeHandle GraphBuilder::getLink(const DSNodeHandle &node, unsigned LinkNo) {
   DSNodeHandle &Node = const_cast<DSNodeHandle&>(node);
   DSNodeHandle &Link = Node.getLink(LinkNo);
   if (Link.isNull()) {
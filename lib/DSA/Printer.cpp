@@ -24,6 +24,7 @@
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Config/config.h"
 #include "llvm/Support/FormattedStream.h"
+#include <algorithm>
 #include <sstream>
 #include <system_error>
 using namespace llvm;
@@ -197,7 +198,11 @@ struct DOTGraphTraits<const DSGraph*> : public DefaultDOTGraphTraits {
   static void addCustomGraphFeatures(const DSGraph *G,
                                      GraphWriter<const DSGraph*> &GW) {
     if (!LimitPrint) {
-      // Add scalar nodes to the graph...
+      // Add scalar nodes to the graph...  The scalar map is hashed, so sort
+      // them by how they print to get the same output on every run.
+      typedef std::pair<std::string, DSGraph::ScalarMapTy::const_iterator>
+        ScalarTy;
+      std::vector<ScalarTy> Scalars;
       const DSGraph::ScalarMapTy &VM = G->getScalarMap();
       for (DSGraph::ScalarMapTy::const_iterator I = VM.begin();
            I != VM.end(); ++I)
@@ -205,15 +210,24 @@ struct DOTGraphTraits<const DSGraph*> : public DefaultDOTGraphTraits {
           std::string OS_str;
           llvm::raw_string_ostream OS(OS_str);
           I->first->print(OS);
-          GW.emitSimpleNode(I->first, "", OS.str());
-          
-          // Add edge from return node to real destination
-          DSNode *DestNode = I->second.getNode();
-          int EdgeDest = I->second.getOffset();
-          if (EdgeDest == 0) EdgeDest = -1;
-          GW.emitEdge(I->first, -1, DestNode,
-                      EdgeDest, "arrowtail=tee,color=gray63");
+          Scalars.push_back(ScalarTy(OS.str(), I));
         }
+      std::stable_sort(Scalars.begin(), Scalars.end(),
+                       [](const ScalarTy &L, const ScalarTy &R) {
+                         return L.first < R.first;
+                       });
+
+      for (unsigned i = 0, e = Scalars.size(); i != e; ++i) {
+        DSGraph::ScalarMapTy::const_iterator I = Scalars[i].second;
+        GW.emitSimpleNode(I->first, "", Scalars[i].first);
+
+        // Add edge from return node to real destination
+        DSNode *DestNode = I->second.getNode();
+        int EdgeDest = I->second.getOffset();
+        if (EdgeDest == 0) EdgeDest = -1;
+        GW.emitEdge(I->first, -1, DestNode,
+                    EdgeDest, "arrowtail=tee,color=gray63");
+      }
     }
 
 
@@ -19,10 +19,15 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "dsa/DSGraph.h"
+#include "dsa/DSParallel.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/ADT/Statistic.h"
+
+#include <set>
 using namespace llvm;
 
 #define TIME_REGION(VARNAME, DESC)
@@ -35,6 +40,39 @@ namespace {
   Z("dsa-eqtd", "EQ Top-down Data Structure Analysis");
 
   STATISTIC (NumTDInlines, "Number of graphs inlined");
+
+  // TDThreads - Experimental.  The parallel traversal is off unless this is
+  // set above 1, and it is never used if LLVM was built without threads.
+  cl::opt<unsigned> TDThreads("dsa-td-threads", cl::Hidden,
+         cl::desc("Number of threads to inline callers into graphs on in the "
+                  "top-down pass (experimental; 1 = sequential)"),
+         cl::init(1));
+}
+
+namespace llvm {
+//
+// Struct: TDParallelState
+//
+// Description:
+//  The bookkeeping of a parallel top-down traversal.  A graph is started once
+//  every caller graph that comes before it in reverse post-order is finished,
+//  and a caller that comes after one of its callees waits for that callee.
+//  Graphs that call each other are therefore handled in the same order as by
+//  the sequential traversal, and unrelated graphs are handled at the same time.
+//
+struct TDParallelState {
+  // Graphs - The graphs in reverse post-order.
+  std::vector<DSGraph*> Graphs;
+
+  // GlobalsLock - Held while the globals graph is used.
+  std::mutex GlobalsLock;
+
+  // EdgesLock - Held while CallerEdges or IndCallMap is used.
+  std::mutex EdgesLock;
+
+  // GraphLocks - Held while a caller graph is inlined into a callee.
+  DSGraphLocks GraphLocks;
+};
 }
 
 char TDDataStructures::ID;
@@ -138,6 +176,9 @@ bool TDDataStructures::runOnModule(Module &M) {
 
 {TIME_REGION(XXX, "td:Inline stuff");
 
+  if (TDThreads > 1 && llvm_is_multithreaded())
+    parallelInlineCallers(M, PostOrder);
+
   // Visit each of the graphs in reverse post-order now!
   while (!PostOrder.empty()) {
     InlineCallersIntoGraph(PostOrder.back());
@@ -221,18 +262,74 @@ void TDDataStructures::ComputePostOrder(const Function &F,
   PostOrder.push_back(G);
 }
 
+/// parallelInlineCallers - Inline the callers of every graph in PostOrder into
+/// it on -dsa-td-threads threads.  PostOrder is left empty.
+void TDDataStructures::parallelInlineCallers(Module &M,
+                                             std::vector<DSGraph*> &PostOrder) {
+  TDParallelState PS;
+  PS.Graphs.assign(PostOrder.rbegin(), PostOrder.rend());
+  PostOrder.clear();
+
+  unsigned NumGraphs = PS.Graphs.size();
+  DenseMap<DSGraph*, unsigned> Index;
+  for (unsigned i = 0; i != NumGraphs; ++i)
+    Index[PS.Graphs[i]] = i;
+
+  // Find the graphs each graph calls, the same way ComputePostOrder does, and
+  // order each pair of caller and callee by their reverse post-order.
+  std::set<std::pair<unsigned, unsigned> > Order;
+  for (unsigned i = 0; i != NumGraphs; ++i) {
+    DSGraph *G = PS.Graphs[i];
+    svset<const Function*> Callees;
+    for (DSGraph::fc_iterator CI = G->fc_begin(), E = G->fc_end();
+         CI != E; ++CI)
+      if (CI->isDirectCall())
+        Callees.insert(CI->getCalleeFunc());
+      else
+        callgraph.addFullFunctionSet(CI->getCallSite(), Callees);
+
+    for (svset<const Function*>::iterator I = Callees.begin(),
+         E = Callees.end(); I != E; ++I) {
+      if ((*I)->isDeclaration()) continue;
+      unsigned j = Index.lookup(getDSGraph(**I));
+      if (j != i)
+        Order.insert(std::make_pair(std::min(i, j), std::max(i, j)));
+    }
+  }
+
+  DSWorkQueue Queue(NumGraphs);
+  for (std::set<std::pair<unsigned, unsigned> >::iterator I = Order.begin(),
+       E = Order.end(); I != E; ++I)
+    Queue.addEdge(I->first, I->second);
+
+  computeStructLayouts(M);
+  Parallel = &PS;
+  getTypeSS().setThreadSafe(true);
+  Queue.run(TDThreads, [this, &PS](unsigned i) {
+    InlineCallersIntoGraph(PS.Graphs[i]);
+  });
+  getTypeSS().setThreadSafe(false);
+  Parallel = 0;
+}
+
 /// InlineCallersIntoGraph - Inline all of the callers of the specified DS graph
 /// into it, then recompute completeness of nodes in the resultant graph.
 void TDDataStructures::InlineCallersIntoGraph(DSGraph* DSG) {
   // Inline caller graphs into this graph.  First step, get the list of call
   // sites that call into this graph.
   std::vector<CallerCallEdge> EdgesFromCaller;
-  std::map<DSGraph*, std::vector<CallerCallEdge> >::iterator
-    CEI = CallerEdges.find(DSG);
-  if (CEI != CallerEdges.end()) {
-    std::swap(CEI->second, EdgesFromCaller);
-    CallerEdges.erase(CEI);
+  {
+    // In a parallel traversal, CallerEdges, the globals graph, IndCallMap and
+    // the caller graphs are shared between threads.
+    OptionalLock Guard(Parallel ? &Parallel->EdgesLock : 0);
+    std::map<DSGraph*, std::vector<CallerCallEdge> >::iterator
+      CEI = CallerEdges.find(DSG);
+    if (CEI != CallerEdges.end()) {
+      std::swap(CEI->second, EdgesFromCaller);
+      CallerEdges.erase(CEI);
+    }
   }
+  std::mutex *GlobalsLock = Parallel ? &Parallel->GlobalsLock : 0;
 
   // Sort the caller sites to provide a by-caller-graph ordering.
   std::sort(EdgesFromCaller.begin(), EdgesFromCaller.end());
@@ -243,8 +340,11 @@ void TDDataStructures::InlineCallersIntoGraph(DSGraph* DSG) {
   // then having RemoveDeadNodes clone it back, we should do all of this as a
   // post-pass over all of the graphs.  We need to take cloning out of
   // removeDeadNodes and gut removeDeadNodes at the same time first though. :(
-  cloneGlobalsInto(DSG, DSGraph::DontCloneCallNodes |
-                        DSGraph::DontCloneAuxCallNodes);
+  {
+    OptionalLock Guard(GlobalsLock);
+    cloneGlobalsInto(DSG, DSGraph::DontCloneCallNodes |
+                          DSGraph::DontCloneAuxCallNodes);
+  }
 
   DEBUG(errs() << "[TD] Inlining callers into '"
         << DSG->getFunctionNames() << "'\n");
@@ -253,6 +353,8 @@ void TDDataStructures::InlineCallersIntoGraph(DSGraph* DSG) {
   // Iteratively inline caller graphs into this graph.
   while (!EdgesFromCaller.empty()) {
     DSGraph* CallerGraph = EdgesFromCaller.back().CallerGraph;
+    OptionalLock CallerGuard(Parallel ? Parallel->GraphLocks.get(CallerGraph)
+                                      : 0);
 
     // Iterate through all of the call sites of this graph, cloning and merging
     // any nodes required by the call.
@@ -314,22 +416,25 @@ void TDDataStructures::InlineCallersIntoGraph(DSGraph* DSG) {
   DSG->computeExternalFlags(ExtFlags);
   DSG->computeIntPtrFlags();
 
-  cloneIntoGlobals(DSG, DSGraph::DontCloneCallNodes |
-                        DSGraph::DontCloneAuxCallNodes);
-  //
-  // Delete dead nodes.  Treat globals that are unreachable as dead also.
-  //
-  // FIXME:
-  //  Do not delete unreachable globals as the comment describes.  For its
-  //  alignment checks on the results of load instructions, SAFECode must be
-  //  able to find the DSNode of both the result of the load as well as the
-  //  pointer dereferenced by the load.  If we remove unreachable globals, then
-  //  if the dereferenced pointer is a global, its DSNode will not reachable
-  //  from the local graph's scalar map, and chaos ensues.
-  //
-  //  So, for now, just remove dead nodes but leave the globals alone.
-  //
-  DSG->removeDeadNodes(0);
+  {
+    OptionalLock Guard(GlobalsLock);
+    cloneIntoGlobals(DSG, DSGraph::DontCloneCallNodes |
+                          DSGraph::DontCloneAuxCallNodes);
+    //
+    // Delete dead nodes.  Treat globals that are unreachable as dead also.
+    //
+    // FIXME:
+    //  Do not delete unreachable globals as the comment describes.  For its
+    //  alignment checks on the results of load instructions, SAFECode must be
+    //  able to find the DSNode of both the result of the load as well as the
+    //  pointer dereferenced by the load.  If we remove unreachable globals,
+    //  then if the dereferenced pointer is a global, its DSNode will not
+    //  reachable from the local graph's scalar map, and chaos ensues.
+    //
+    //  So, for now, just remove dead nodes but leave the globals alone.
+    //
+    DSG->removeDeadNodes(0);
+  }
 
   // We are done with computing the current TD Graph!  Finally, before we can
   // finish processing this function, we figure out which functions it calls and
@@ -337,6 +442,9 @@ void TDDataStructures::InlineCallersIntoGraph(DSGraph* DSG) {
   // callee graphs.
   if (DSG->fc_begin() == DSG->fc_end()) return;
 
+  // The edges recorded here are read by the callees once this graph is done.
+  OptionalLock EdgesGuard(Parallel ? &Parallel->EdgesLock : 0);
+
   // Loop over all the call sites and all the callees at each call site, and add
   // edges to the CallerEdges structure for each callee.
   for (DSGraph::fc_iterator CI = DSG->fc_begin(), E = DSG->fc_end();
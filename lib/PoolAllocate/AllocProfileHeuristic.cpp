@@ -0,0 +1,538 @@
+//===-- AllocProfileHeuristic.cpp - Allocation profile guided heuristic ---===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the AllocProfile heuristic, which decides how to pool
+// allocate each node from what the pool statistics of the runtime recorded for
+// it in a profiling run.  The statistics cover how often each node was
+// allocated and freed and how many bytes it took; they say nothing about how
+// the objects were accessed.
+//
+// A pool is known to the runtime by a name made of the smallest name of the
+// functions whose DSGraph holds its node (or "@globals" for nodes of the
+// globals graph) and the first value that points to the node.  The names only
+// depend on the program and on DSA, so they are the same in the instrumented
+// build and in the build that reads the profile back.  The workflow is:
+//
+//   opt -paheur-AllocProfile -poolalloc ...          (instrumented build)
+//   POOLALLOC_STATS=prof.json ./a.out                (profiling run)
+//   opt -paheur-AllocProfile -paheur-alloc-profile=prof.json -poolalloc ...
+//
+//===----------------------------------------------------------------------===//
+
+#include "poolalloc/Heuristic.h"
+#include "poolalloc/PoolAllocate.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace PA;
+
+namespace {
+  cl::opt<std::string>
+  ProfileFile("paheur-alloc-profile", cl::value_desc("filename"),
+              cl::desc("Pool statistics (POOLALLOC_STATS output) to guide "
+                       "the AllocProfile heuristic.  Without them, the "
+                       "program is instrumented to collect them"));
+
+  cl::opt<unsigned>
+  ColdAllocs("paheur-alloc-profile-cold", cl::init(32),
+             cl::desc("Nodes allocated fewer times than this stay on "
+                      "malloc"));
+
+  cl::opt<unsigned>
+  HotAllocs("paheur-alloc-profile-hot", cl::init(4096),
+            cl::desc("Nodes allocated at least this many times get a pool "
+                     "of their own"));
+
+  cl::opt<bool>
+  DropFrees("paheur-alloc-profile-drop-frees", cl::init(false),
+            cl::desc("Drop every free of a local node that the profiling run "
+                     "never freed, so that its pool becomes a bump-pointer "
+                     "pool.  Unsafe: a run that does free those objects "
+                     "keeps them until pooldestroy"));
+}
+
+//
+// Function: getProfileField()
+//
+// Description:
+//  Find the integer field Key in the JSON text of one pool site.
+//
+// Return value:
+//  true  - The field was found and its value is in Val.
+//  false - The field is missing or is not an unsigned integer.
+//
+static bool
+getProfileField(StringRef Site, StringRef Key, unsigned long long &Val) {
+  std::string Pattern = "\"" + Key.str() + "\":";
+  size_t Pos = Site.find(Pattern);
+  if (Pos == StringRef::npos) return false;
+
+  StringRef Digits = Site.substr(Pos + Pattern.size());
+  Digits = Digits.substr(0, Digits.find_first_not_of("0123456789"));
+  return !Digits.getAsInteger(10, Val);
+}
+
+//
+// Function: getProfileString()
+//
+// Description:
+//  Read the JSON string whose text, after the opening quote, starts Text.
+//  The runtime escapes quotes, backslashes and control characters in pool
+//  names.
+//
+// Return value:
+//  true  - The string was read into Str.
+//  false - The string is not terminated or has an escape we do not know.
+//
+static bool
+getProfileString(StringRef Text, std::string &Str) {
+  Str.clear();
+  for (size_t i = 0, e = Text.size(); i != e; ++i) {
+    char C = Text[i];
+    if (C == '"') return true;
+    if (C != '\\') {
+      Str += C;
+      continue;
+    }
+
+    if (++i == e) return false;
+    switch (Text[i]) {
+    case '"': case '\\': case '/': Str += Text[i]; break;
+    case 'b': Str += '\b'; break;
+    case 'f': Str += '\f'; break;
+    case 'n': Str += '\n'; break;
+    case 'r': Str += '\r'; break;
+    case 't': Str += '\t'; break;
+    case 'u': {
+      // The runtime only writes these for control characters.
+      unsigned Code;
+      if (i + 4 >= e || Text.substr(i + 1, 4).getAsInteger(16, Code) ||
+          Code > 0xff)
+        return false;
+      Str += (char)Code;
+      i += 4;
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return false;
+}
+
+//
+// Method: readProfile()
+//
+// Description:
+//  Read the pool statistics that the runtime appended to Filename.  Every
+//  line is a snapshot of one process, and a process may dump several times,
+//  so only the last line of each process is used.  The named sites of those
+//  lines are summed up into Profile.
+//
+// Return value:
+//  true  - The profile was read.
+//  false - The file could not be read.
+//
+bool
+AllocProfileHeuristic::readProfile(StringRef Filename) {
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Buffer =
+    MemoryBuffer::getFile(Filename);
+  if (!Buffer) return false;
+
+  std::map<unsigned long long, StringRef> LastSnapshot;
+  StringRef Rest = (*Buffer)->getBuffer();
+  while (!Rest.empty()) {
+    std::pair<StringRef, StringRef> Split = Rest.split('\n');
+    unsigned long long PID;
+    if (getProfileField(Split.first, "pid", PID))
+      LastSnapshot[PID] = Split.first;
+    Rest = Split.second;
+  }
+
+  for (std::map<unsigned long long, StringRef>::iterator
+         I = LastSnapshot.begin(), E = LastSnapshot.end(); I != E; ++I) {
+    SmallVector<StringRef, 64> Sites;
+    I->second.split(Sites, "{\"site\":");
+    for (unsigned i = 1, e = Sites.size(); i != e; ++i) {
+      StringRef Site = Sites[i];
+      size_t NamePos = Site.find("\"name\":\"");
+      if (NamePos == StringRef::npos) continue;
+      std::string Name;
+      if (!getProfileString(Site.substr(NamePos + 8), Name)) continue;
+
+      unsigned long long Pools = 0, Allocs = 0, Frees = 0, AllocBytes = 0;
+      getProfileField(Site, "pools", Pools);
+      getProfileField(Site, "allocs", Allocs);
+      getProfileField(Site, "frees", Frees);
+      getProfileField(Site, "alloc_bytes", AllocBytes);
+
+      NodeProfile &NP = Profile[Name];
+      NP.Pools += Pools;
+      NP.Allocs += Allocs;
+      NP.Frees += Frees;
+      NP.AllocBytes += AllocBytes;
+    }
+  }
+  return true;
+}
+
+bool
+AllocProfileHeuristic::runOnModule (Module & Module) {
+  //
+  // Remember which module we are analyzing.
+  //
+  M = &Module;
+
+  //
+  // Get the reference to the DSA Graph.
+  //
+  Graphs = &getAnalysis<EQTDDataStructures>();
+
+  //
+  // Find DSNodes which are reachable from globals and should be pool
+  // allocated.
+  //
+  findGlobalPoolNodes (GlobalPoolNodes);
+
+  //
+  // Name the nodes of every graph now, while the program is still the one
+  // that DSA analyzed.
+  //
+  std::set<DSGraph*> NamedGraphs;
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F) {
+    if (F->isDeclaration() || !Graphs->hasDSGraph(*F)) continue;
+    DSGraph *G = Graphs->getDSGraph(*F);
+    if (NamedGraphs.insert(G).second)
+      nameGraphNodes(G);
+  }
+  nameGraphNodes(Graphs->getGlobalsGraph());
+
+  //
+  // Read the profile.  If there is none, instrument the program to write one.
+  //
+  Instrument = ProfileFile.empty();
+  if (!Instrument && !readProfile(ProfileFile)) {
+    errs() << "Cannot read pool profile " << ProfileFile
+           << "; pool allocating as if every node were hot\n";
+  }
+
+  // We never modify anything in this pass
+  return false;
+}
+
+//
+// Method: releaseMemory()
+//
+// Description:
+//  This method frees memory consumed by the pass when the pass is no longer
+//  needed.
+//
+void
+AllocProfileHeuristic::releaseMemory () {
+  Profile.clear();
+  PoolNames.clear();
+  BumpNodes.clear();
+  NodeNames.clear();
+  GlobalPoolNodes.clear();
+  PoolProfileName = 0;
+}
+
+//
+// Method: nameGraphNodes()
+//
+// Description:
+//  Name the nodes of G that have no name yet.  A name starts with the
+//  lexicographically smallest name of the functions that share G, or with
+//  "@globals" for the globals graph.  After it comes the first value that
+//  points to the node: the ordinal of an argument or instruction, counted over
+//  the functions of G in name order, or the name of a global.  Nodes that no
+//  value points to are named after the first named node that links to them,
+//  and the offset of the link.
+//
+//  This is only called before pool allocation changes the program, so the
+//  names depend on nothing but the program and DSA.  Any node that still has
+//  no name is one that no value reaches; it is named by its position in G.
+//
+void
+AllocProfileHeuristic::nameGraphNodes(DSGraph *G) {
+  std::vector<std::string> FnNames;
+  std::vector<const Function*> Fns;
+  for (DSGraph::retnodes_iterator I = G->retnodes_begin(),
+         E = G->retnodes_end(); I != E; ++I)
+    FnNames.push_back(I->first->getName().str());
+  std::sort(FnNames.begin(), FnNames.end());
+  for (unsigned i = 0, e = FnNames.size(); i != e; ++i)
+    Fns.push_back(M->getFunction(FnNames[i]));
+
+  std::string Prefix = "@globals";
+  if (G != Graphs->getGlobalsGraph() && !Fns.empty())
+    Prefix = FnNames[0];
+
+  // Name the nodes that values point to, in order.
+  std::vector<const DSNode*> Named;
+  DSScalarMap &SM = G->getScalarMap();
+  for (unsigned f = 0, e = Fns.size(); f != e; ++f) {
+    std::string FnKey = f ? FnNames[f] + "." : "";
+    unsigned Ordinal = 0;
+    std::vector<const Value*> Values;
+    for (Function::const_arg_iterator I = Fns[f]->arg_begin(),
+           E = Fns[f]->arg_end(); I != E; ++I)
+      Values.push_back(&*I);
+    for (const_inst_iterator I = inst_begin(Fns[f]), E = inst_end(Fns[f]);
+         I != E; ++I)
+      Values.push_back(&*I);
+
+    for (unsigned i = 0, ie = Values.size(); i != ie; ++i, ++Ordinal) {
+      DSScalarMap::iterator SI = SM.find(Values[i]);
+      if (SI == SM.end() || !SI->second.getNode()) continue;
+      const DSNode *N = SI->second.getNode();
+      if (NodeNames.count(N)) continue;
+      NodeNames[N] = Prefix + ":" + FnKey + utostr(Ordinal);
+      Named.push_back(N);
+    }
+  }
+
+  for (Module::global_iterator I = M->global_begin(), E = M->global_end();
+       I != E; ++I) {
+    DSScalarMap::iterator SI = SM.find(&*I);
+    if (SI == SM.end() || !SI->second.getNode()) continue;
+    const DSNode *N = SI->second.getNode();
+    if (NodeNames.count(N)) continue;
+    NodeNames[N] = Prefix + ":@" + I->getName().str();
+    Named.push_back(N);
+  }
+
+  // Name the nodes that are only reached through memory after the first
+  // named node that links to them.
+  for (unsigned i = 0; i != Named.size(); ++i) {
+    const DSNode *N = Named[i];
+    for (DSNode::const_edge_iterator I = N->edge_begin(), E = N->edge_end();
+         I != E; ++I) {
+      const DSNode *Child = I->second.getNode();
+      if (!Child || NodeNames.count(Child)) continue;
+      NodeNames[Child] = NodeNames[N] + "/" + utostr(I->first);
+      Named.push_back(Child);
+    }
+  }
+
+  unsigned Index = 0;
+  for (DSGraph::node_iterator I = G->node_begin(), E = G->node_end();
+       I != E; ++I, ++Index)
+    if (!NodeNames.count(&*I))
+      NodeNames[&*I] = Prefix + ":#" + utostr(Index);
+}
+
+//
+// Method: getPoolName()
+//
+// Description:
+//  Return the name under which the runtime reports the pool of node N.
+//
+std::string
+AllocProfileHeuristic::getPoolName(const DSNode *N) {
+  std::map<const DSNode*, std::string>::iterator I = NodeNames.find(N);
+  if (I != NodeNames.end())
+    return I->second;
+
+  // The node was added to its graph after runOnModule named the nodes.
+  nameGraphNodes(N->getParentGraph());
+  return NodeNames[N];
+}
+
+//
+// Method: getNameString()
+//
+// Description:
+//  Return an i8* constant holding Name for passing to poolprofile_name.
+//
+Constant *
+AllocProfileHeuristic::getNameString(const std::string &Name) {
+  Constant *Init = ConstantDataArray::getString(M->getContext(), Name);
+  GlobalVariable *GV = new GlobalVariable(*M, Init->getType(), true,
+                                          GlobalValue::PrivateLinkage, Init,
+                                          "poolprofile.name");
+  Type *Int8PtrTy = Type::getInt8PtrTy(M->getContext());
+  return ConstantExpr::getPointerCast(GV, Int8PtrTy);
+}
+
+//
+// Method: nameAfterPoolInits()
+//
+// Description:
+//  Insert a call to poolprofile_name after every poolinit of the pool
+//  descriptor PD.  If F is not null, only poolinits in F are considered.
+//
+void
+AllocProfileHeuristic::nameAfterPoolInits(Value *PD, Constant *Name,
+                                          Function *F) {
+  if (PoolProfileName == 0) {
+    Type *VoidType = Type::getVoidTy(M->getContext());
+    Type *Int8PtrTy = Type::getInt8PtrTy(M->getContext());
+    PoolProfileName = M->getOrInsertFunction("poolprofile_name", VoidType,
+                                             PoolAllocate::PoolDescPtrTy,
+                                             Int8PtrTy, NULL);
+  }
+
+  std::vector<User*> Users(PD->user_begin(), PD->user_end());
+  for (unsigned i = 0, e = Users.size(); i != e; ++i) {
+    CallInst *CI = dyn_cast<CallInst>(Users[i]);
+    if (!CI || (CI->getCalledValue() != PA->PoolInit &&
+                CI->getCalledValue() != PA->PoolInitST))
+      continue;
+    if (F && CI->getParent()->getParent() != F) continue;
+
+    BasicBlock::iterator InsertPt = CI;
+    ++InsertPt;
+    Value *Opts[2] = {PD, Name};
+    CallInst::Create(PoolProfileName, Opts, "", InsertPt);
+  }
+}
+
+//
+// Method: AssignToPools()
+//
+// Description:
+//  When instrumenting, give every node a named pool of its own.  Otherwise,
+//  lay the nodes out by their profile:
+//
+//  o Nodes allocated fewer than -paheur-alloc-profile-cold times, including
+//    nodes the profiling run never allocated, are left on malloc.
+//
+//  o Local nodes whose objects were never freed before pooldestroy get a pool
+//    of their own, so that no other node's frees keep it from becoming a
+//    bump-pointer pool.  Whether it does is up to EliminateDeadPoolFrees,
+//    which only deletes the frees it can prove dead, and PoolOptimize; with
+//    -paheur-alloc-profile-drop-frees, HackFunctionBody drops all of them.
+//
+//  o Nodes allocated at least -paheur-alloc-profile-hot times get a pool of
+//    their own.
+//
+//  o The rest share a pool with the other warm nodes of the same object size
+//    and alignment.  The size is the static one, or the measured average for
+//    array nodes.
+//
+void
+AllocProfileHeuristic::AssignToPools(const DSNodeList_t &NodesToPA,
+                                     Function *F, DSGraph* G,
+                                     std::vector<OnePool> &ResultPools) {
+  std::map<std::pair<unsigned, unsigned>, unsigned> SharedPools;
+  bool HaveProfile = !Profile.empty();
+
+  for (unsigned i = 0, e = NodesToPA.size(); i != e; ++i) {
+    const DSNode *N = NodesToPA[i];
+    std::string Name = getPoolName(N);
+
+    if (Instrument) {
+      Constant *NameStr = getNameString(Name);
+      if (F) {
+        // The poolinit of a local pool is only inserted once the function
+        // body has been transformed.
+        PoolNames[N] = NameStr;
+        ResultPools.push_back(OnePool(N));
+      } else {
+        OnePool Pool(N);
+        Pool.PoolDesc = PA->CreateGlobalPool(Pool.PoolSize, Pool.PoolAlignment);
+        nameAfterPoolInits(Pool.PoolDesc, NameStr, 0);
+        ResultPools.push_back(Pool);
+      }
+      continue;
+    }
+
+    // Without a usable profile, fall back to one pool per node.
+    if (!HaveProfile) {
+      ResultPools.push_back(OnePool(N));
+      continue;
+    }
+
+    // Nodes the profiling run never allocated stay on malloc, even with
+    // -paheur-alloc-profile-cold=0; the average size below divides by Allocs.
+    std::map<std::string, NodeProfile>::iterator PI = Profile.find(Name);
+    if (PI == Profile.end() || PI->second.Allocs == 0 ||
+        PI->second.Allocs < ColdAllocs)
+      continue;
+    const NodeProfile &NP = PI->second;
+
+    if (F && NP.Frees == 0) {
+      BumpNodes.insert(N);
+      ResultPools.push_back(OnePool(N));
+      continue;
+    }
+
+    if (NP.Allocs >= HotAllocs) {
+      ResultPools.push_back(OnePool(N));
+      continue;
+    }
+
+    OnePool Pool(N);
+    unsigned Size = Pool.PoolSize;
+    if (Size == 0)
+      Size = NP.AllocBytes / NP.Allocs;
+    std::pair<unsigned, unsigned> Key(Size, Pool.PoolAlignment);
+    std::map<std::pair<unsigned, unsigned>, unsigned>::iterator SI =
+      SharedPools.find(Key);
+    if (SI == SharedPools.end()) {
+      SharedPools[Key] = ResultPools.size();
+      ResultPools.push_back(Pool);
+    } else {
+      ResultPools[SI->second].NodesInPool.push_back(N);
+    }
+  }
+}
+
+//
+// Method: HackFunctionBody()
+//
+// Description:
+//  Name the local pools of an instrumented function.  With
+//  -paheur-alloc-profile-drop-frees, also drop the frees of the local pools
+//  that the profile says are never freed from.  That is only a guess from one
+//  run, so it is off by default.
+//
+void
+AllocProfileHeuristic::HackFunctionBody(Function &F,
+                                        std::map<const DSNode*, Value*> &PDs) {
+  for (std::map<const DSNode*, Value*>::iterator PDI = PDs.begin(),
+         E = PDs.end(); PDI != E; ++PDI) {
+    std::map<const DSNode*, Constant*>::iterator NI =
+      PoolNames.find(PDI->first);
+    if (NI != PoolNames.end())
+      nameAfterPoolInits(PDI->second, NI->second, &F);
+
+    if (!DropFrees || !BumpNodes.count(PDI->first)) continue;
+    Value *PD = PDI->second;
+    std::vector<User*> Users(PD->user_begin(), PD->user_end());
+    for (unsigned i = 0, e = Users.size(); i != e; ++i) {
+      CallInst *CI = dyn_cast<CallInst>(Users[i]);
+      if (!CI || CI->getParent()->getParent() != &F) continue;
+      if (CI->getCalledValue() == PA->PoolFree ||
+          (PA->PoolFreeInline && CI->getCalledValue() == PA->PoolFreeInline))
+        CI->eraseFromParent();
+    }
+  }
+}
+
+//
+// Register the heuristic pass.
+//
+static RegisterPass<AllocProfileHeuristic>
+P ("paheur-AllocProfile",
+   "Pool allocate using a profile of the allocations of each pool");
+
+RegisterAnalysisGroup<Heuristic> HeuristicAllocProfile(P);
+
+char AllocProfileHeuristic::ID = 0;
@@ -874,6 +874,7 @@ OnlyOverheadHeuristic::HackFunctionBody(Function &F,
     for (unsigned i = 0, e = OldPDUsers.size(); i != e; ++i) {
       CallSite PDUser(cast<Instruction>(OldPDUsers[i]));
       if (PDUser.getCalledValue() != PoolInit &&
+          PDUser.getCalledValue() != PA->PoolInitST &&
           PDUser.getCalledValue() != PoolDestroy) {
         assert(PDUser.getInstruction()->getParent()->getParent() == &F &&
                "Not in cur fn??");
@@ -1519,7 +1519,7 @@ void PointerCompress::HandleGlobalPools(Module &M) {
 /// compress runtime library functions.
 void PointerCompress::InitializePoolLibraryFunctions(Module &M) {
   Type *VoidPtrTy = PointerType::getUnqual(Int8Type);
-  Type *PoolDescPtrTy = PointerType::getUnqual(ArrayType::get(VoidPtrTy, 16));
+  Type *PoolDescPtrTy = PointerType::getUnqual(ArrayType::get(VoidPtrTy, 32));
 
   PoolInitPC = M.getOrInsertFunction("poolinit_pc", VoidPtrTy, PoolDescPtrTy, 
                                      Int32Type, Int32Type, NULL);
@@ -21,9 +21,11 @@
 #include "poolalloc/Heuristic.h"
 #include "poolalloc/PoolAllocate.h"
 #include "poolalloc/RuntimeChecks.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Attributes.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/CFG.h"
@@ -65,6 +67,7 @@ namespace {
   STATISTIC (NumTSPools  , "Number of typesafe pools");
   STATISTIC (NumPoolFree , "Number of poolfree's elided");
   STATISTIC (NumNonprofit, "Number of DSNodes not profitable");
+  STATISTIC (NumSTPools  , "Number of pools only used by one thread");
   //  STATISTIC (NumColocated, "Number of DSNodes colocated");
 
   Type *VoidPtrTy;
@@ -78,7 +81,25 @@ namespace {
   cl::opt<bool>
   DisablePoolFreeOpt("poolalloc-force-all-poolfrees",
                      cl::desc("Do not try to elide poolfree's where possible"));
+  cl::opt<bool>
+  InlineFastPath("poolalloc-inline-fast-path",
+                 cl::desc("Allocate and free objects of a thread-private "
+                          "pool's declared size inline, without calling the "
+                          "FL2 runtime unless its free list is empty.  "
+                          "Implies -poolalloc-thread-private-pools"));
+  cl::opt<bool>
+  ThreadPrivatePools("poolalloc-thread-private-pools",
+                     cl::desc("Create the pools of data that no other thread "
+                              "can reach with poolinit_st, which never locks "
+                              "them"));
+
+}
 
+// useThreadPrivatePools - Return true if pools that only one thread can reach
+// are created with poolinit_st.  The inline fast paths only work on such
+// pools, so asking for them turns thread-private pools on as well.
+static bool useThreadPrivatePools() {
+  return ThreadPrivatePools || InlineFastPath;
 }
 
 static void
@@ -104,6 +125,240 @@ createPoolAllocInit (Module & M) {
   return;
 }
 
+//
+// Function: getPoolDescWord()
+//
+// Description:
+//  Return the address of the specified pointer sized word of a pool
+//  descriptor.
+//
+static Value *
+getPoolDescWord (Value * PD, unsigned Word, const Twine & Name,
+                 BasicBlock * BB) {
+  Type * Int32Type = Type::getInt32Ty(BB->getContext());
+  Value * Idx[2] = {ConstantInt::get(Int32Type, 0),
+                    ConstantInt::get(Int32Type, Word)};
+  return GetElementPtrInst::Create(nullptr, PD, Idx, Name, BB);
+}
+
+//
+// Function: createPoolAllocFastPath()
+//
+// Description:
+//  Create an inline fast path of poolalloc() named Name.  It pops an object
+//  off of the pool's free list of objects of the declared size if it can,
+//  and calls PoolAlloc otherwise.  It is always inlined.
+//
+//  The FL2 runtime keeps that free list in the second word of the pool
+//  descriptor, and the request size it serves and the header of an object
+//  allocated from it in the third and fourth.  Objects start one word after
+//  their header, and a free object links to the next and previous free
+//  objects in the two words after that.  PoolAllocator.h checks this layout
+//  with static_asserts next to PoolTy.  The inline code does not lock the pool, so the runtime only sets
+//  the size and the header for pools created with poolinit_st, and leaves
+//  them zero whenever all calls have to go through it.
+//
+static Function *
+createPoolAllocFastPath (Module & M, Constant * PoolAlloc, const char * Name) {
+  LLVMContext & Context = M.getContext();
+  Type * Int32Type = Type::getInt32Ty(Context);
+  Type * IntPtrType = M.getDataLayout().getIntPtrType(Context);
+  Type * IntPtrPtrType = PointerType::getUnqual(IntPtrType);
+  PointerType * VoidPtrType = PointerType::getUnqual(Type::getInt8Ty(Context));
+  Type * VoidPtrPtrType = PointerType::getUnqual(VoidPtrType);
+  PointerType * PDType = cast<PointerType>(PoolAllocate::PoolDescPtrTy);
+
+  std::vector<Type*> Params;
+  Params.push_back(PDType);
+  Params.push_back(Int32Type);
+  Function * F = Function::Create(FunctionType::get(VoidPtrType, Params, false),
+                                  GlobalValue::InternalLinkage, Name, &M);
+  F->addFnAttr(Attribute::AlwaysInline);
+  Function::arg_iterator AI = F->arg_begin();
+  Value * PD = &*AI++;
+  Value * Size = &*AI;
+  PD->setName("PD");
+  Size->setName("size");
+
+  BasicBlock * Entry = BasicBlock::Create(Context, "entry", F);
+  BasicBlock * Check = BasicBlock::Create(Context, "check", F);
+  BasicBlock * Pop = BasicBlock::Create(Context, "pop", F);
+  BasicBlock * FixPrev = BasicBlock::Create(Context, "fixprev", F);
+  BasicBlock * Mark = BasicBlock::Create(Context, "mark", F);
+  BasicBlock * Slow = BasicBlock::Create(Context, "slow", F);
+  BasicBlock * Done = BasicBlock::Create(Context, "done", F);
+  Constant * NullPD = ConstantPointerNull::get(PDType);
+  Constant * Null = ConstantPointerNull::get(VoidPtrType);
+
+  //
+  // Take the fast path if the pool exists, serves this size inline, and has a
+  // free object.
+  //
+  Value * NoPool = new ICmpInst(*Entry, ICmpInst::ICMP_EQ, PD, NullPD, "nopool");
+  BranchInst::Create(Slow, Check, NoPool, Entry);
+
+  Value * FreeList = getPoolDescWord(PD, 1, "freelist", Check);
+  Value * InlineSizePtr =
+    new BitCastInst(getPoolDescWord(PD, 2, "", Check), IntPtrPtrType,
+                    "inlinesize.addr", Check);
+  Value * InlineSize = new LoadInst(InlineSizePtr, "inlinesize", Check);
+  Value * WideSize = new ZExtInst(Size, IntPtrType, "size.wide", Check);
+  Value * SizeOK = new ICmpInst(*Check, ICmpInst::ICMP_EQ, InlineSize,
+                                WideSize, "sizeok");
+  Value * Head = new LoadInst(FreeList, "head", Check);
+  Value * NonEmpty = new ICmpInst(*Check, ICmpInst::ICMP_NE, Head, Null,
+                                  "nonempty");
+  Value * Fast = BinaryOperator::CreateAnd(SizeOK, NonEmpty, "fast", Check);
+  BranchInst::Create(Pop, Slow, Fast, Check);
+
+  //
+  // Unlink the first object from the free list.
+  //
+  Value * Node = new BitCastInst(Head, VoidPtrPtrType, "node", Pop);
+  Value * One = ConstantInt::get(Int32Type, 1);
+  Value * Two = ConstantInt::get(Int32Type, 2);
+  Value * NextPtr = GetElementPtrInst::Create(nullptr, Node, One, "next.addr",
+                                              Pop);
+  Value * Next = new LoadInst(NextPtr, "next", Pop);
+  new StoreInst(Next, FreeList, Pop);
+  Value * HasNext = new ICmpInst(*Pop, ICmpInst::ICMP_NE, Next, Null,
+                                 "hasnext");
+  BranchInst::Create(FixPrev, Mark, HasNext, Pop);
+
+  Value * NextNode = new BitCastInst(Next, VoidPtrPtrType, "nextnode", FixPrev);
+  new StoreInst(Null, GetElementPtrInst::Create(nullptr, NextNode, Two,
+                                                "prev.addr", FixPrev),
+                FixPrev);
+  BranchInst::Create(Mark, FixPrev);
+
+  //
+  // Mark the object allocated and return it.
+  //
+  Value * HeaderPtr = new BitCastInst(Head, IntPtrPtrType, "header.addr", Mark);
+  Value * Header = new LoadInst(HeaderPtr, "header", Mark);
+  new StoreInst(BinaryOperator::CreateOr(Header,
+                                         ConstantInt::get(IntPtrType, 1),
+                                         "allocated", Mark),
+                HeaderPtr, Mark);
+  Value * Obj = new BitCastInst(GetElementPtrInst::Create(nullptr, Node, One,
+                                                          "obj.addr", Mark),
+                                VoidPtrType, "obj", Mark);
+  BranchInst::Create(Done, Mark);
+
+  Value * Opts[2] = {PD, Size};
+  Value * SlowObj = CallInst::Create(PoolAlloc, Opts, "slowobj", Slow);
+  BranchInst::Create(Done, Slow);
+
+  PHINode * Result = PHINode::Create(VoidPtrType, 2, "result", Done);
+  Result->addIncoming(Obj, Mark);
+  Result->addIncoming(SlowObj, Slow);
+  ReturnInst::Create(Context, Result, Done);
+  return F;
+}
+
+//
+// Function: createPoolFreeFastPath()
+//
+// Description:
+//  Create an inline fast path of poolfree() named Name.  It pushes an object
+//  of the pool's declared size onto the pool's free list of such objects, and
+//  calls PoolFree for everything else.  It is always inlined.  See
+//  createPoolAllocFastPath() for the pool layout it relies on.
+//
+static Function *
+createPoolFreeFastPath (Module & M, Constant * PoolFree, const char * Name) {
+  LLVMContext & Context = M.getContext();
+  Type * Int32Type = Type::getInt32Ty(Context);
+  Type * IntPtrType = M.getDataLayout().getIntPtrType(Context);
+  Type * IntPtrPtrType = PointerType::getUnqual(IntPtrType);
+  PointerType * VoidPtrType = PointerType::getUnqual(Type::getInt8Ty(Context));
+  Type * VoidPtrPtrType = PointerType::getUnqual(VoidPtrType);
+  PointerType * PDType = cast<PointerType>(PoolAllocate::PoolDescPtrTy);
+
+  std::vector<Type*> Params;
+  Params.push_back(PDType);
+  Params.push_back(VoidPtrType);
+  Function * F = Function::Create(FunctionType::get(Type::getVoidTy(Context),
+                                                    Params, false),
+                                  GlobalValue::InternalLinkage, Name, &M);
+  F->addFnAttr(Attribute::AlwaysInline);
+  Function::arg_iterator AI = F->arg_begin();
+  Value * PD = &*AI++;
+  Value * Ptr = &*AI;
+  PD->setName("PD");
+  Ptr->setName("ptr");
+
+  BasicBlock * Entry = BasicBlock::Create(Context, "entry", F);
+  BasicBlock * Check = BasicBlock::Create(Context, "check", F);
+  BasicBlock * Push = BasicBlock::Create(Context, "push", F);
+  BasicBlock * FixPrev = BasicBlock::Create(Context, "fixprev", F);
+  BasicBlock * Slow = BasicBlock::Create(Context, "slow", F);
+  BasicBlock * Done = BasicBlock::Create(Context, "done", F);
+  Constant * Null = ConstantPointerNull::get(VoidPtrType);
+
+  //
+  // Take the fast path if there is a pool and an object, and the object's
+  // header says it was allocated from the free list the pool serves inline.
+  //
+  Value * NoPool = new ICmpInst(*Entry, ICmpInst::ICMP_EQ, PD,
+                                ConstantPointerNull::get(PDType), "nopool");
+  Value * NoPtr = new ICmpInst(*Entry, ICmpInst::ICMP_EQ, Ptr, Null, "noptr");
+  BranchInst::Create(Slow, Check,
+                     BinaryOperator::CreateOr(NoPool, NoPtr, "", Entry),
+                     Entry);
+
+  Value * Words = new BitCastInst(Ptr, VoidPtrPtrType, "words", Check);
+  Value * Node = GetElementPtrInst::Create(nullptr, Words,
+                                           ConstantInt::getSigned(Int32Type, -1),
+                                           "node", Check);
+  Value * HeaderPtr = new BitCastInst(Node, IntPtrPtrType, "header.addr",
+                                      Check);
+  Value * Header = new LoadInst(HeaderPtr, "header", Check);
+  Value * InlineHeaderPtr =
+    new BitCastInst(getPoolDescWord(PD, 3, "", Check), IntPtrPtrType,
+                    "inlineheader.addr", Check);
+  Value * InlineHeader = new LoadInst(InlineHeaderPtr, "inlineheader", Check);
+  Value * Fast = new ICmpInst(*Check, ICmpInst::ICMP_EQ, Header, InlineHeader,
+                              "fast");
+  BranchInst::Create(Push, Slow, Fast, Check);
+
+  //
+  // Mark the object free and put it at the front of the free list.
+  //
+  new StoreInst(BinaryOperator::CreateAnd(Header,
+                                          ConstantInt::get(IntPtrType, ~1ULL),
+                                          "free", Push),
+                HeaderPtr, Push);
+  Value * FreeList = getPoolDescWord(PD, 1, "freelist", Push);
+  Value * Head = new LoadInst(FreeList, "head", Push);
+  Value * One = ConstantInt::get(Int32Type, 1);
+  Value * Two = ConstantInt::get(Int32Type, 2);
+  new StoreInst(Head, GetElementPtrInst::Create(nullptr, Node, One,
+                                                "next.addr", Push),
+                Push);
+  new StoreInst(Null, GetElementPtrInst::Create(nullptr, Node, Two,
+                                                "prev.addr", Push),
+                Push);
+  Value * NodePtr = new BitCastInst(Node, VoidPtrType, "nodeptr", Push);
+  new StoreInst(NodePtr, FreeList, Push);
+  Value * HasHead = new ICmpInst(*Push, ICmpInst::ICMP_NE, Head, Null,
+                                 "hashead");
+  BranchInst::Create(FixPrev, Done, HasHead, Push);
+
+  Value * HeadNode = new BitCastInst(Head, VoidPtrPtrType, "headnode", FixPrev);
+  new StoreInst(NodePtr, GetElementPtrInst::Create(nullptr, HeadNode, Two,
+                                                   "headprev.addr", FixPrev),
+                FixPrev);
+  BranchInst::Create(Done, FixPrev);
+
+  Value * Opts[2] = {PD, Ptr};
+  CallInst::Create(PoolFree, Opts, "", Slow);
+  BranchInst::Create(Done, Slow);
+
+  ReturnInst::Create(Context, Done);
+  return F;
+}
+
 //
 // Function: createGlobalPoolCtor()
 //
@@ -203,6 +458,12 @@ void PoolAllocate::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<Heuristic>();
   AU.addPreserved<Heuristic>();
 
+  // Loop structure is used to batch allocations in counted loops.
+  if (BatchLoopAllocs) {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+  }
+
   if (dsa_pass_to_use == PASS_EQTD) {
     AU.addRequiredTransitive<EQTDDataStructures>();
     if(lie_preserve_passes != LIE_NONE)
@@ -408,6 +669,16 @@ bool PoolAllocate::runOnModule(Module &M) {
     }
   }
 
+  //
+  // Now that every function has been transformed, delete the frees that
+  // only the whole program shows to be dead.
+  //
+  if (!DisablePoolFreeOpt)
+    EliminateDeadPoolFrees(M);
+
+  if (PoolInitST)
+    UseThreadPrivateEntryPoints();
+
   //
   // Add an empty __poolalloc_init() function.  SAFECode will call this to
   // intialize things; we don't make use of it with real pool allocation.
@@ -480,10 +751,55 @@ void PoolAllocate::AddPoolPrototypes(Module* M) {
   PoolStrdup = M->getOrInsertFunction("poolstrdup",
                                                VoidPtrTy, PoolDescPtrTy,
                                                VoidPtrTy, NULL);
+  // The poolalloc_n function, used for allocations in counted loops.
+  PoolAllocN = M->getOrInsertFunction("poolalloc_n", VoidType,
+                                      PoolDescPtrTy, Int32Type, Int32Type,
+                                      PointerType::getUnqual(VoidPtrTy), NULL);
+
   // The poolmemalign function.
   // Get the poolfree function.
   PoolFree = M->getOrInsertFunction("poolfree", VoidType,
                                             PoolDescPtrTy, VoidPtrTy, NULL);
+
+  // The inline fast paths of poolalloc and poolfree.  They rely on the layout
+  // of FL2 pool descriptors, which SAFECode's runtime does not share, and the
+  // runtime only lets poolinit_st pools take them.
+  PoolAllocInline = PoolFreeInline = 0;
+  if (InlineFastPath && !SAFECodeEnabled) {
+    PoolAllocInline = M->getFunction("poolalloc_inline");
+    if (!PoolAllocInline)
+      PoolAllocInline = createPoolAllocFastPath(*M, PoolAlloc,
+                                                "poolalloc_inline");
+    PoolFreeInline = M->getFunction("poolfree_inline");
+    if (!PoolFreeInline)
+      PoolFreeInline = createPoolFreeFastPath(*M, PoolFree,
+                                              "poolfree_inline");
+  }
+  // The entry points of pools that are never shared between threads.
+  PoolInitST = PoolAllocST = PoolFreeST = 0;
+  if (useThreadPrivatePools() && !SAFECodeEnabled) {
+    PoolInitST = M->getOrInsertFunction("poolinit_st", VoidType,
+                                        PoolDescPtrTy, Int32Type,
+                                        Int32Type, NULL);
+    PoolAllocST = M->getOrInsertFunction("poolalloc_st", VoidPtrTy,
+                                         PoolDescPtrTy, Int32Type, NULL);
+    PoolFreeST = M->getOrInsertFunction("poolfree_st", VoidType,
+                                        PoolDescPtrTy, VoidPtrTy, NULL);
+  }
+  // The inline fast paths of those pools fall back on poolalloc_st and
+  // poolfree_st instead.
+  PoolAllocInlineST = PoolFreeInlineST = 0;
+  if (PoolAllocInline) {
+    PoolAllocInlineST = M->getFunction("poolalloc_inline_st");
+    if (!PoolAllocInlineST)
+      PoolAllocInlineST = createPoolAllocFastPath(*M, PoolAllocST,
+                                                  "poolalloc_inline_st");
+    PoolFreeInlineST = M->getFunction("poolfree_inline_st");
+    if (!PoolFreeInlineST)
+      PoolFreeInlineST = createPoolFreeFastPath(*M, PoolFreeST,
+                                                "poolfree_inline_st");
+  }
+
   //Get the poolregister function
   PoolRegister = M->getOrInsertFunction("poolregister", VoidType,
                                  PoolDescPtrTy, VoidPtrTy, Int32Type, NULL);
@@ -1276,6 +1592,8 @@ PoolAllocate::ProcessFunctionBody(Function &F, Function &NewF) {
   TransformBody(G, FI, PoolUses, PoolFrees, NewF);
 
   // Create pool construction/destruction code
+  if (!FI.NodesToPA.empty() && PoolInitST)
+    FindThreadPrivateNodes(G);
   if (!FI.NodesToPA.empty())
     InitializeAndDestroyPools(NewF, FI.NodesToPA, FI.PoolDescriptors,
                               PoolUses, PoolFrees);
@@ -1313,37 +1631,339 @@ static void DeleteIfIsPoolFree(Instruction *I, AllocaInst *PD,
       }
 }
 
+//
+// Function: getPassedPoolArgument()
+//
+// Description:
+//  If the call CS passes the pool descriptor PD to exactly one parameter of a
+//  function with a body, return that parameter.  Otherwise, return null.
+//
+static Argument *getPassedPoolArgument(CallSite CS, Value *PD) {
+  Function *Callee = CS.getCalledFunction();
+  if (!Callee || Callee->isDeclaration()) return 0;
+
+  Argument *Passed = 0;
+  Function::arg_iterator AI = Callee->arg_begin();
+  for (unsigned i = 0, e = CS.arg_size(); i != e; ++i) {
+    bool IsParam = AI != Callee->arg_end();
+    if (CS.getArgument(i) == PD) {
+      if (Passed || !IsParam) return 0;
+      Passed = AI;
+    }
+    if (IsParam) ++AI;
+  }
+  return Passed;
+}
+
+//
+// Method: isPoolAllocatingUse()
+//
+// Description:
+//  Determine whether the use U of the pool descriptor PD may allocate from the
+//  pool, which means that objects freed before U may be reused.  Frees and
+//  pooldestroy do not allocate.  If MayAllocArgs is given, neither does a call
+//  that passes the pool to a function parameter not in MayAllocArgs.
+//
+bool PoolAllocate::isPoolAllocatingUse(User *U, Value *PD,
+                                 const std::set<Argument*> *MayAllocArgs) {
+  //
+  // The only users of the pool should be call, invoke, and cast
+  // instructions.  We know that poolfree() and pooldestroy() do not need to
+  // cast pool handles, so if we see a non-call instruction, we know it's not
+  // used in a poolfree() or pooldestroy() call.
+  //
+  if (isa<Instruction>(U) && !isa<CallInst>(U) && !isa<InvokeInst>(U))
+    return true;
+
+  CallSite CS = CallSite(U->stripPointerCasts());
+  if (!CS.getInstruction())
+    return true;
+  if (CS.getCalledValue() == PoolFree || CS.getCalledValue() == PoolDestroy ||
+      CS.getCalledValue() == PoolFreeInline)
+    return false;
+
+  if (MayAllocArgs)
+    if (Argument *Passed = getPassedPoolArgument(CS, PD))
+      return MayAllocArgs->count(Passed);
+  return true;
+}
+
 void PoolAllocate::CalculateLivePoolFreeBlocks(std::set<BasicBlock*>&LiveBlocks,
-                                               Value *PD) {
+                                               Value *PD,
+                                 const std::set<Argument*> *MayAllocArgs) {
   for (Value::user_iterator I = PD->user_begin(), E = PD->user_end(); I != E; ++I){
-    //
-    // The only users of the pool should be call, invoke, and cast
-    // instructions.  We know that poolfree() and pooldestroy() do not need to
-    // cast pool handles, so if we see a non-call instruction, we know it's not
-    // used in a poolfree() or pooldestroy() call.
-    //
-    if (Instruction * Inst = dyn_cast<Instruction>(*I)) {
-      if (!isa<CallInst>(*I)) {
-        // This block and every block that can reach this block must keep pool
-        // frees.
-        for (idf_ext_iterator<BasicBlock*, std::set<BasicBlock*> >
-               DI = idf_ext_begin(Inst->getParent(), LiveBlocks),
-               DE = idf_ext_end(Inst->getParent(), LiveBlocks);
-             DI != DE; ++DI)
-          /* empty */;
+    Instruction *Inst = dyn_cast<Instruction>(*I);
+    if (!Inst || !isPoolAllocatingUse(Inst, PD, MayAllocArgs))
+      continue;
+
+    // This block and every block that can reach this block must keep pool
+    // frees.
+    BasicBlock *BB = Inst->getParent();
+    for (idf_ext_iterator<BasicBlock*, std::set<BasicBlock*> >
+           DI = idf_ext_begin(BB, LiveBlocks),
+           DE = idf_ext_end(BB, LiveBlocks);
+         DI != DE; ++DI)
+      /* empty */;
+  }
+}
+
+//
+// Method: isPoolAllocatedAfter()
+//
+// Description:
+//  Determine whether the pool PD may be allocated from after the instruction
+//  I, given the blocks LiveBlocks that can reach an allocation from it.
+//
+bool PoolAllocate::isPoolAllocatedAfter(Instruction *I, Value *PD,
+                                  const std::set<BasicBlock*> &LiveBlocks,
+                                  const std::set<Argument*> &MayAllocArgs) {
+  BasicBlock *BB = I->getParent();
+  for (succ_iterator SI = succ_begin(BB), E = succ_end(BB); SI != E; ++SI)
+    if (LiveBlocks.count(*SI))
+      return true;
+
+  BasicBlock::iterator It = I;
+  for (++It; It != BB->end(); ++It)
+    if (std::find(It->op_begin(), It->op_end(), PD) != It->op_end() &&
+        isPoolAllocatingUse(&*It, PD, &MayAllocArgs))
+      return true;
+  return false;
+}
+
+//
+// Method: EliminateDeadPoolFrees()
+//
+// Description:
+//  Delete the poolfree calls after which the pool is never allocated from
+//  again before it is destroyed, looking through calls.  Such frees only put
+//  objects on a free list that pooldestroy is about to throw away.
+//
+//  InitializeAndDestroyPool() already does this within one function, but has
+//  to assume that every call the pool is passed to allocates from it and
+//  cannot delete frees made through pool arguments.  This pass works out
+//
+//  o which pool arguments a function may allocate from, itself or through the
+//    functions it passes them to, and
+//
+//  o which pool arguments may be allocated from after the function returns,
+//    because some caller may allocate from the pool after the call.
+//
+//  A free of a pool argument is dead if the argument is not allocated from
+//  after the return and nothing can allocate from it after the free in the
+//  function itself.  Frees of global pools are left alone, as anything may
+//  allocate from them later.
+//
+//  Removing these frees is what leaves many pools with nothing but
+//  allocations, which PoolOptimize turns into bump-pointer pools.
+//
+void PoolAllocate::EliminateDeadPoolFrees(Module &M) {
+  //
+  // Find the local pools and the pool arguments of every function.
+  //
+  std::vector<Value*> Pools;
+  std::vector<Argument*> PoolArgs;
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (F->isDeclaration()) continue;
+    for (Function::arg_iterator AI = F->arg_begin(), AE = F->arg_end();
+         AI != AE; ++AI)
+      if (AI->getType() == PoolDescPtrTy) {
+        Pools.push_back(AI);
+        PoolArgs.push_back(AI);
+      }
+    for (BasicBlock::iterator I = F->front().begin(), IE = F->front().end();
+         I != IE; ++I)
+      if (AllocaInst *AI = dyn_cast<AllocaInst>(I))
+        if (AI->getAllocatedType() == PoolDescType)
+          Pools.push_back(AI);
+  }
+
+  //
+  // Find the pool arguments that may be allocated from.  An argument is, if
+  // it has an allocating use other than passing it on to another function
+  // parameter, or if it is passed on to a parameter that is.
+  //
+  std::set<Argument*> MayAllocArgs;
+  std::map<Argument*, std::vector<Argument*> > PassedFrom;
+  std::vector<Argument*> Worklist;
+  for (unsigned i = 0, e = PoolArgs.size(); i != e; ++i) {
+    Argument *A = PoolArgs[i];
+    for (Value::user_iterator UI = A->user_begin(), UE = A->user_end();
+         UI != UE; ++UI) {
+      if (!isPoolAllocatingUse(*UI, A, 0)) continue;
+      CallSite CS = CallSite(*UI);
+      if (Argument *To = CS.getInstruction() ? getPassedPoolArgument(CS, A) : 0)
+        PassedFrom[To].push_back(A);
+      else if (MayAllocArgs.insert(A).second)
+        Worklist.push_back(A);
+    }
+  }
+  while (!Worklist.empty()) {
+    std::vector<Argument*> &From = PassedFrom[Worklist.back()];
+    Worklist.pop_back();
+    for (unsigned i = 0, e = From.size(); i != e; ++i)
+      if (MayAllocArgs.insert(From[i]).second)
+        Worklist.push_back(From[i]);
+  }
+
+  //
+  // Find the blocks of each pool that can reach an allocation from it.
+  //
+  std::map<Value*, std::set<BasicBlock*> > LiveBlocks;
+  for (unsigned i = 0, e = Pools.size(); i != e; ++i)
+    CalculateLivePoolFreeBlocks(LiveBlocks[Pools[i]], Pools[i], &MayAllocArgs);
+
+  //
+  // Find the pool arguments that may be allocated from after their function
+  // returns.  That is the case if the function may be called from anywhere,
+  // if a caller passes something other than one of its own pools, if a
+  // caller may allocate from the pool after the call, or if the caller passes
+  // a pool argument of its own that is allocated from after it returns.
+  //
+  std::set<Argument*> AllocatedAfterReturn;
+  std::map<Argument*, std::vector<Argument*> > PassedTo;
+  for (unsigned i = 0, e = PoolArgs.size(); i != e; ++i) {
+    Argument *A = PoolArgs[i];
+    Function *F = A->getParent();
+    bool AllocatedAfter = !F->hasLocalLinkage() || F->hasAddressTaken();
+    for (Value::user_iterator UI = F->user_begin(), UE = F->user_end();
+         UI != UE && !AllocatedAfter; ++UI) {
+      CallSite CS = CallSite(*UI);
+      Value *Actual = CS.getArgument(A->getArgNo());
+      if (!LiveBlocks.count(Actual)) {
+        // A global pool, a null pool or something we cannot follow.
+        AllocatedAfter = true;
         continue;
       }
+      if (Argument *From = dyn_cast<Argument>(Actual))
+        PassedTo[From].push_back(A);
+      AllocatedAfter = isPoolAllocatedAfter(CS.getInstruction(), Actual,
+                                            LiveBlocks[Actual], MayAllocArgs);
+    }
+    if (AllocatedAfter && AllocatedAfterReturn.insert(A).second)
+      Worklist.push_back(A);
+  }
+  while (!Worklist.empty()) {
+    std::vector<Argument*> &To = PassedTo[Worklist.back()];
+    Worklist.pop_back();
+    for (unsigned i = 0, e = To.size(); i != e; ++i)
+      if (AllocatedAfterReturn.insert(To[i]).second)
+        Worklist.push_back(To[i]);
+  }
+
+  //
+  // Delete the frees that nothing can allocate after.
+  //
+  for (unsigned i = 0, e = Pools.size(); i != e; ++i) {
+    Value *PD = Pools[i];
+    if (Argument *A = dyn_cast<Argument>(PD))
+      if (AllocatedAfterReturn.count(A))
+        continue;
+
+    std::set<BasicBlock*> &Live = LiveBlocks[PD];
+    std::vector<CallInst*> DeadFrees;
+    for (Value::user_iterator UI = PD->user_begin(), UE = PD->user_end();
+         UI != UE; ++UI)
+      if (CallInst *CI = dyn_cast<CallInst>(*UI))
+        if ((CI->getCalledValue() == PoolFree ||
+             CI->getCalledValue() == PoolFreeInline) &&
+            CI->getArgOperand(0) == PD && !Live.count(CI->getParent()))
+          DeadFrees.push_back(CI);
+
+    for (unsigned j = 0, je = DeadFrees.size(); j != je; ++j) {
+      DeadFrees[j]->eraseFromParent();
+      ++NumPoolFree;
     }
+  }
+}
 
-    CallSite U = CallSite(I->stripPointerCasts());
-    if (U.getCalledValue() != PoolFree && U.getCalledValue() != PoolDestroy) {
-      // This block and every block that can reach this block must keep pool
-      // frees.
-      for (idf_ext_iterator<BasicBlock*, std::set<BasicBlock*> >
-             DI = idf_ext_begin(U.getInstruction()->getParent(), LiveBlocks),
-             DE = idf_ext_end(U.getInstruction()->getParent(), LiveBlocks);
-           DI != DE; ++DI)
-        /* empty */;
+//
+// Method: FindThreadPrivateNodes()
+//
+// Description:
+//  Find the nodes of the graph G whose objects only the thread that allocates
+//  them can reach, and add them to ThreadPrivateNodes.  A node may be reached
+//  by another thread if it is reachable from
+//
+//  o a global, or a node that DSA knows little about (external, incomplete,
+//    unknown and int-to-pointer nodes), or
+//
+//  o an argument of a call that may start a thread: a call to pthread_create,
+//    to an external function or to an unknown function pointer.
+//
+//  The pools of the other nodes are local to a function, so no other thread
+//  ever sees their descriptors either.
+//
+void PoolAllocate::FindThreadPrivateNodes(DSGraph *G) {
+  std::vector<const DSNode*> Worklist;
+  for (DSGraph::node_iterator I = G->node_begin(), E = G->node_end();
+       I != E; ++I)
+    if (I->isGlobalNode() || I->isExternalNode() || I->isIncompleteNode() ||
+        I->isUnknownNode() || I->isIntToPtrNode() || I->isPtrToIntNode())
+      Worklist.push_back(&*I);
+
+  std::vector<const DSCallSite*> Calls;
+  for (DSGraph::fc_iterator I = G->fc_begin(), E = G->fc_end(); I != E; ++I)
+    Calls.push_back(&*I);
+  for (DSGraph::afc_iterator I = G->afc_begin(), E = G->afc_end(); I != E; ++I)
+    Calls.push_back(&*I);
+  for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
+    const DSCallSite &CS = *Calls[i];
+    if (CS.isDirectCall() && !CS.getCalleeFunc()->isDeclaration())
+      continue;
+    Worklist.push_back(CS.getRetVal().getNode());
+    Worklist.push_back(CS.getVAVal().getNode());
+    for (unsigned a = 0, ae = CS.getNumPtrArgs(); a != ae; ++a)
+      Worklist.push_back(CS.getPtrArg(a).getNode());
+  }
+
+  DenseSet<const DSNode*> Shared;
+  while (!Worklist.empty()) {
+    const DSNode *N = Worklist.back();
+    Worklist.pop_back();
+    if (!N || !Shared.insert(N).second) continue;
+    for (DSNode::const_edge_iterator EI = N->edge_begin(), EE = N->edge_end();
+         EI != EE; ++EI)
+      Worklist.push_back(EI->second.getNode());
+  }
+
+  for (DSGraph::node_iterator I = G->node_begin(), E = G->node_end();
+       I != E; ++I)
+    if (!Shared.count(&*I))
+      ThreadPrivateNodes.insert(&*I);
+}
+
+//
+// Method: UseThreadPrivateEntryPoints()
+//
+// Description:
+//  Make the poolalloc and poolfree calls on the descriptor of each poolinit_st
+//  pool call poolalloc_st and poolfree_st, which skip the locking and the
+//  thread caches outright, and the calls of their inline fast paths call the
+//  fast paths that fall back on those.  Functions the pool is passed to still
+//  call poolalloc and poolfree, which check that the pool is single-threaded
+//  at run time.
+//
+void PoolAllocate::UseThreadPrivateEntryPoints() {
+  std::vector<CallInst*> Inits;
+  getCallsOf(PoolInitST, Inits);
+
+  std::set<Value*> Done;
+  for (unsigned i = 0, e = Inits.size(); i != e; ++i) {
+    Value *PD = Inits[i]->getArgOperand(0);
+    if (!Done.insert(PD).second) continue;
+
+    std::vector<User*> Users(PD->user_begin(), PD->user_end());
+    for (unsigned j = 0, je = Users.size(); j != je; ++j) {
+      CallInst *CI = dyn_cast<CallInst>(Users[j]);
+      if (!CI || CI->getArgOperand(0) != PD) continue;
+      if (CI->getCalledValue() == PoolAlloc)
+        CI->setCalledFunction(PoolAllocST);
+      else if (CI->getCalledValue() == PoolFree)
+        CI->setCalledFunction(PoolFreeST);
+      else if (PoolAllocInline && CI->getCalledValue() == PoolAllocInline)
+        CI->setCalledFunction(PoolAllocInlineST);
+      else if (PoolFreeInline && CI->getCalledValue() == PoolFreeInline)
+        CI->setCalledFunction(PoolFreeInlineST);
     }
   }
 }
@@ -1506,9 +2126,14 @@ void PoolAllocate::InitializeAndDestroyPool(Function &F, const DSNode *Node,
   unsigned AlignV = Heuristic::getRecommendedAlignment(Node);
   Value *Align  = ConstantInt::get(Int32Type, AlignV);
 
+  Constant *Init = PoolInit;
+  if (ThreadPrivateNodes.count(Node)) {
+    Init = PoolInitST;
+    ++NumSTPools;
+  }
   for (unsigned i = 0, e = PoolInitPoints.size(); i != e; ++i) {
     Value* Opts[3] = {PD, ElSize, Align};
-    CallInst::Create(PoolInit, Opts,  "", PoolInitPoints[i]);
+    CallInst::Create(Init, Opts,  "", PoolInitPoints[i]);
     DEBUG(errs() << PoolInitPoints[i]->getParent()->getName().str() << " ");
   }
 
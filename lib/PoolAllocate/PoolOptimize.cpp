@@ -14,13 +14,18 @@
 #define DEBUG_TYPE "pa-opt"
 
 #include "llvm/Pass.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include <map>
 #include <set>
+#include <vector>
 using namespace llvm;
 
 static Type * VoidType  = 0;
@@ -29,6 +34,12 @@ static Type * Int32Type = 0;
 
 namespace {
   STATISTIC (NumBumpPtr, "Number of bump pointer pools");
+  STATISTIC (NumSized  , "Number of poolallocs bound to sized entry points");
+
+  cl::opt<bool>
+  SizedPoolAlloc("pooloptimize-sized-poolalloc",
+                 cl::desc("Call the FL2 runtime's poolalloc entry points "
+                          "specialized for the declared size of the pool"));
 
   struct PoolOptimize : public ModulePass {
     static char ID;
@@ -60,6 +71,57 @@ static void getCallsOf(Constant *C, std::vector<CallInst*> &Calls) {
     Calls.push_back(cast<CallInst>(*UI));
 }
 
+// hasSizedPoolAlloc - Return true if the runtime has a poolalloc entry point
+// for pools of Size byte objects with alignment Align.
+static bool hasSizedPoolAlloc(uint64_t Size, uint64_t Align) {
+#define POOLALLOC_SIZE(S, A) \
+  if (Size == S && Align == A) return true;
+#include "poolalloc/PoolAllocSizes.def"
+  return false;
+}
+
+// getBumpPtrUses - Return true if every use of the pool PD allocates from it
+// with one of AllocFns, is a call of one of LifetimeFns, or passes it on to
+// exactly one parameter of a function with a body.  Set HasPoolAlloc if any
+// use allocates, and add the parameters the pool is passed to to PassedTo.
+static bool getBumpPtrUses(Value *PD, const std::set<Function*> &AllocFns,
+                           const std::set<Function*> &LifetimeFns,
+                           bool &HasPoolAlloc,
+                           std::vector<Argument*> &PassedTo) {
+  HasPoolAlloc = false;
+  for (Value::user_iterator UI = PD->user_begin(), E = PD->user_end();
+       UI != E; ++UI) {
+    CallSite CS(*UI);
+    Function *Callee = CS ? CS.getCalledFunction() : 0;
+    if (!Callee) return false;
+
+    Argument *Passed = 0;
+    unsigned NumPassed = 0;
+    Function::arg_iterator AI = Callee->arg_begin();
+    for (unsigned i = 0, e = CS.arg_size(); i != e; ++i) {
+      bool IsParam = AI != Callee->arg_end();
+      if (CS.getArgument(i) == PD) {
+        ++NumPassed;
+        Passed = IsParam ? &*AI : 0;
+      }
+      if (IsParam) ++AI;
+    }
+    if (NumPassed != 1 || CS.getArgument(0) != PD) {
+      if (NumPassed != 1 || !Passed || Callee->isDeclaration())
+        return false;
+      PassedTo.push_back(Passed);
+    } else if (AllocFns.count(Callee)) {
+      if (!isa<CallInst>(CS.getInstruction())) return false;
+      HasPoolAlloc = true;
+    } else if (!LifetimeFns.count(Callee)) {
+      if (!Passed || Callee->isDeclaration())
+        return false;
+      PassedTo.push_back(Passed);
+    }
+  }
+  return true;
+}
+
 bool PoolOptimize::runOnModule(Module &M) {
   //
   // Get pointers to 8 and 32 bit LLVM integer types.
@@ -76,7 +138,7 @@ bool PoolOptimize::runOnModule(Module &M) {
   if (SAFECodeEnabled)
     PoolDescPtrTy = PointerType::getUnqual(ArrayType::get(VoidPtrTy, 92));
   else
-    PoolDescPtrTy = PointerType::getUnqual(ArrayType::get(VoidPtrTy, 16));
+    PoolDescPtrTy = PointerType::getUnqual(ArrayType::get(VoidPtrTy, 32));
 
   // Get poolinit function.
   Constant *PoolInit = M.getOrInsertFunction("poolinit", VoidType,
@@ -121,6 +183,21 @@ bool PoolOptimize::runOnModule(Module &M) {
                                                 VoidPtrTy, PoolDescPtrTy,
                                                 Int32Type, NULL);
 
+  // The inline fast paths of poolalloc and poolfree, if the program has them.
+  // They take the same arguments as the functions they stand in for.
+  Function *PoolAllocInline = M.getFunction("poolalloc_inline");
+  Function *PoolFreeInline = M.getFunction("poolfree_inline");
+  Function *PoolAllocInlineST = M.getFunction("poolalloc_inline_st");
+  Function *PoolFreeInlineST = M.getFunction("poolfree_inline_st");
+
+  // The entry points of pools that only one thread uses, if the program has
+  // them.
+  Function *PoolInitST = M.getFunction("poolinit_st");
+  Function *PoolAllocST = M.getFunction("poolalloc_st");
+
+  // Programs instrumented by the AllocProfile heuristic name their pools.
+  Function *PoolProfileName = M.getFunction("poolprofile_name");
+
   Constant *Realloc = M.getOrInsertFunction("realloc",
                                             VoidPtrTy, VoidPtrTy, Int32Type,
                                             NULL);
@@ -135,24 +212,24 @@ bool PoolOptimize::runOnModule(Module &M) {
   for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
     CallInst *CI = Calls[i];
     // poolrealloc(PD, null, X) -> poolalloc(PD, X)
-    if (isa<ConstantPointerNull>(CI->getOperand(2))) {
-      Value* Opts[2] = {CI->getOperand(1), CI->getOperand(3)};
+    if (isa<ConstantPointerNull>(CI->getArgOperand(1))) {
+      Value* Opts[2] = {CI->getArgOperand(0), CI->getArgOperand(2)};
       Value *New = CallInst::Create(PoolAlloc, Opts,
                                 CI->getName(), CI);
       CI->replaceAllUsesWith(New);
       CI->eraseFromParent();
-    } else if (isa<Constant>(CI->getOperand(3)) && 
-               cast<Constant>(CI->getOperand(3))->isNullValue()) {
+    } else if (isa<Constant>(CI->getArgOperand(2)) && 
+               cast<Constant>(CI->getArgOperand(2))->isNullValue()) {
       // poolrealloc(PD, X, 0) -> poolfree(PD, X)
-      Value* Opts[2] = {CI->getOperand(1), CI->getOperand(2)};
+      Value* Opts[2] = {CI->getArgOperand(0), CI->getArgOperand(1)};
       CallInst::Create(PoolFree, Opts, "", CI);
       PointerType * PT = dyn_cast<PointerType>(CI->getType());
       assert (PT && "poolrealloc call does not return a pointer!\n");
       CI->replaceAllUsesWith(ConstantPointerNull::get(PT));
       CI->eraseFromParent();
-    } else if (isa<ConstantPointerNull>(CI->getOperand(1))) {
+    } else if (isa<ConstantPointerNull>(CI->getArgOperand(0))) {
       // poolrealloc(null, X, Y) -> realloc(X, Y)
-      Value* Opts[2] = {CI->getOperand(2), CI->getOperand(3)};
+      Value* Opts[2] = {CI->getArgOperand(1), CI->getArgOperand(2)};
       Value *New = CallInst::Create(Realloc, Opts,
                                 CI->getName(), CI);
       CI->replaceAllUsesWith(New);
@@ -165,11 +242,11 @@ bool PoolOptimize::runOnModule(Module &M) {
   for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
     CallInst *CI = Calls[i];
     // poolalloc(null, X) -> malloc(X)
-    if (isa<Constant>(CI->getOperand(1)) && 
-        cast<Constant>(CI->getOperand(1))->isNullValue()) {
+    if (isa<Constant>(CI->getArgOperand(0)) && 
+        cast<Constant>(CI->getArgOperand(0))->isNullValue()) {
 //FIXME: handle malloc
       #if 0
-      Value *New = new MallocInst(Int8Type, CI->getOperand(2),
+      Value *New = new MallocInst(Int8Type, CI->getArgOperand(1),
                                   CI->getName(), CI);
       CI->replaceAllUsesWith(New);
       CI->eraseFromParent();
@@ -182,8 +259,8 @@ bool PoolOptimize::runOnModule(Module &M) {
   for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
     CallInst *CI = Calls[i];
     // poolmemalign(null, X, Y) -> memalign(X, Y)
-    if (isa<ConstantPointerNull>(CI->getOperand(1))) {
-      Value* Opts[2] = {CI->getOperand(2), CI->getOperand(3)};
+    if (isa<ConstantPointerNull>(CI->getArgOperand(0))) {
+      Value* Opts[2] = {CI->getArgOperand(1), CI->getArgOperand(2)};
       Value *New = CallInst::Create(MemAlign, Opts, CI->getName(), CI);
       CI->replaceAllUsesWith(New);
       CI->eraseFromParent();
@@ -195,85 +272,225 @@ bool PoolOptimize::runOnModule(Module &M) {
   for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
     CallInst *CI = Calls[i];
     // poolfree(PD, null) -> noop
-    if (isa<ConstantPointerNull>(CI->getOperand(2)))
+    if (isa<ConstantPointerNull>(CI->getArgOperand(1)))
       CI->eraseFromParent();
-    else if (isa<ConstantPointerNull>(CI->getOperand(1))) {
+    else if (isa<ConstantPointerNull>(CI->getArgOperand(0))) {
       // poolfree(null, Ptr) -> free(Ptr)
       //FIXME: Handle free
-      //new FreeInst(CI->getOperand(2), CI);
+      //new FreeInst(CI->getArgOperand(1), CI);
       //CI->eraseFromParent();
     }
   }
+
+  // Optimize inline poolfrees
+  if (PoolFreeInline) {
+    getCallsOf(PoolFreeInline, Calls);
+    for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
+      CallInst *CI = Calls[i];
+      // poolfree_inline(PD, null) -> noop
+      if (isa<ConstantPointerNull>(CI->getArgOperand(1)))
+        CI->eraseFromParent();
+      else if (isa<ConstantPointerNull>(CI->getArgOperand(0))) {
+        // poolfree_inline(null, Ptr) -> poolfree(null, Ptr)
+        CI->setCalledFunction(PoolFree);
+      }
+    }
+  }
+
+  // poolfree_inline_st(PD, null) -> noop
+  if (PoolFreeInlineST) {
+    getCallsOf(PoolFreeInlineST, Calls);
+    for (unsigned i = 0, e = Calls.size(); i != e; ++i)
+      if (isa<ConstantPointerNull>(Calls[i]->getArgOperand(1)))
+        Calls[i]->eraseFromParent();
+  }
       
   // Transform pools that only have poolinit/destroy/allocate uses into
-  // bump-pointer pools.  Also, delete pools that are unused.  Find pools by
-  // looking for pool inits in the program.
+  // bump-pointer pools.  A pool may also be passed to functions that do no
+  // more than allocate from it, or pass it on to such functions, as long as
+  // every caller of those functions passes a bump-pointer pool; the callees
+  // then allocate with poolalloc_bp as well.  Also, delete pools that are
+  // unused.  Find pools by looking for pool inits in the program.
   getCallsOf(PoolInit, Calls);
   std::set<Value*> Pools;
   for (unsigned i = 0, e = Calls.size(); i != e; ++i)
-    Pools.insert(Calls[i]->getOperand(1));
+    Pools.insert(Calls[i]->getArgOperand(0));
+  if (PoolInitST) {
+    getCallsOf(PoolInitST, Calls);
+    for (unsigned i = 0, e = Calls.size(); i != e; ++i)
+      Pools.insert(Calls[i]->getArgOperand(0));
+  }
+
+  Function *PoolInitFn = cast<Function>(PoolInit->stripPointerCasts());
+  Function *PoolDestroyFn = cast<Function>(PoolDestroy->stripPointerCasts());
+  std::set<Function*> AllocFns, LifetimeFns, NoFns;
+  AllocFns.insert(cast<Function>(PoolAlloc->stripPointerCasts()));
+  if (PoolAllocInline)
+    AllocFns.insert(PoolAllocInline);
+  if (PoolAllocInlineST)
+    AllocFns.insert(PoolAllocInlineST);
+  if (PoolAllocST)
+    AllocFns.insert(PoolAllocST);
+  LifetimeFns.insert(PoolInitFn);
+  if (PoolInitST)
+    LifetimeFns.insert(PoolInitST);
+  LifetimeFns.insert(PoolDestroyFn);
+  if (PoolProfileName)
+    LifetimeFns.insert(PoolProfileName);
 
-  // Loop over all of the pools processing each as we find it.
+  // Find the pools and the pool arguments of internal functions that are
+  // only allocated from or passed on.
+  std::set<Value*> BumpPtrCandidates;
+  std::map<Value*, std::vector<Argument*> > PassedTo;
+  std::map<Value*, bool> HasPoolAlloc;
   for (std::set<Value*>::iterator PI = Pools.begin(), E = Pools.end();
-       PI != E; ++PI) {
-    bool HasPoolAlloc = false, HasOtherUse = false;
-    Value *PoolDesc = *PI;
-    for (Value::user_iterator UI = PoolDesc->user_begin(),
-           E = PoolDesc->user_end(); UI != E; ++UI) {
-      if (CallInst *CI = dyn_cast<CallInst>(*UI)) {
-        if (CI->getCalledFunction() == PoolInit ||
-            CI->getCalledFunction() == PoolDestroy) {
-          // ignore
-        } else if (CI->getCalledFunction() == PoolAlloc) {
-          HasPoolAlloc = true;
-        } else {
-          HasOtherUse = true;
-          break;
+       PI != E; ++PI)
+    if (getBumpPtrUses(*PI, AllocFns, LifetimeFns, HasPoolAlloc[*PI],
+                       PassedTo[*PI]))
+      BumpPtrCandidates.insert(*PI);
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (F->isDeclaration() || !F->hasLocalLinkage() || F->hasAddressTaken())
+      continue;
+    for (Function::arg_iterator AI = F->arg_begin(), AE = F->arg_end();
+         AI != AE; ++AI)
+      if (AI->getType() == PoolDescPtrTy &&
+          getBumpPtrUses(AI, AllocFns, NoFns, HasPoolAlloc[AI], PassedTo[AI]))
+        BumpPtrCandidates.insert(AI);
+  }
+
+  // A candidate remains one if everything it is passed to is a candidate and,
+  // for an argument, if every caller passes a candidate.
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (std::set<Value*>::iterator I = BumpPtrCandidates.begin();
+         I != BumpPtrCandidates.end(); ) {
+      Value *V = *I++;
+      bool Keep = true;
+      std::vector<Argument*> &To = PassedTo[V];
+      for (unsigned i = 0, e = To.size(); i != e && Keep; ++i)
+        Keep = BumpPtrCandidates.count(To[i]);
+      if (Argument *A = dyn_cast<Argument>(V)) {
+        Function *F = A->getParent();
+        for (Value::user_iterator UI = F->user_begin(), UE = F->user_end();
+             UI != UE && Keep; ++UI) {
+          CallSite CS(*UI);
+          Keep = BumpPtrCandidates.count(CS.getArgument(A->getArgNo()));
         }
-      } else {
-        HasOtherUse = true;
-        break;
+      }
+      if (!Keep) {
+        BumpPtrCandidates.erase(V);
+        Changed = true;
       }
     }
+  }
 
-    // Can we optimize it?
-    if (!HasOtherUse) {
-      // Yes, if there are uses at all, nuke the pool init, destroy, and the PD.
-      if (!HasPoolAlloc) {
-        while (!PoolDesc->use_empty())
-          cast<Instruction>(PoolDesc->user_back())->eraseFromParent();
-        if (AllocaInst *AI = dyn_cast<AllocaInst>(PoolDesc))
-          AI->eraseFromParent();
-        else
-          cast<GlobalVariable>(PoolDesc)->eraseFromParent();
-      } else {
-        // Convert all of the pool descriptor users to the BumpPtr flavor.
-        std::vector<User*> PDUsers(PoolDesc->user_begin(), PoolDesc->user_end());
-        
-        while (!PDUsers.empty()) {
-          CallInst *CI = cast<CallInst>(PDUsers.back());
-          PDUsers.pop_back();
-          std::vector<Value*> Args;
-          if (CI->getCalledFunction() == PoolAlloc) {
-            Args.assign(CI->op_begin()+1, CI->op_end());
-            Value *New = CallInst::Create(PoolAllocBP, Args, CI->getName(), CI);
-            CI->replaceAllUsesWith(New);
-            CI->eraseFromParent();
-          } else if (CI->getCalledFunction() == PoolInit) {
-            Args.assign(CI->op_begin()+1, CI->op_end());
-            Args.erase(Args.begin()+1); // Drop the size argument.
-            CallInst::Create(PoolInitBP, Args, "", CI);
-            CI->eraseFromParent();
-          } else {
-            assert(CI->getCalledFunction() == PoolDestroy);
-            Args.assign(CI->op_begin()+1, CI->op_end());
-            CallInst::Create(PoolDestroyBP, Args, "", CI);
-            CI->eraseFromParent();
-          }
-        }
-        ++NumBumpPtr;
+  // Loop over all of the candidates, converting each.
+  for (std::set<Value*>::iterator PI = BumpPtrCandidates.begin(),
+         E = BumpPtrCandidates.end(); PI != E; ++PI) {
+    Value *PoolDesc = *PI;
+    bool IsPool = Pools.count(PoolDesc);
+
+    // If there are no uses at all, nuke the pool init, destroy, and the PD.
+    if (IsPool && !HasPoolAlloc[PoolDesc] && PassedTo[PoolDesc].empty()) {
+      while (!PoolDesc->use_empty())
+        cast<Instruction>(PoolDesc->user_back())->eraseFromParent();
+      if (AllocaInst *AI = dyn_cast<AllocaInst>(PoolDesc))
+        AI->eraseFromParent();
+      else
+        cast<GlobalVariable>(PoolDesc)->eraseFromParent();
+      continue;
+    }
+
+    // Convert all of the pool descriptor users to the BumpPtr flavor.  Calls
+    // that pass the pool on are left alone; their callees are converted too.
+    std::vector<User*> PDUsers(PoolDesc->user_begin(), PoolDesc->user_end());
+    while (!PDUsers.empty()) {
+      CallSite CS(PDUsers.back());
+      PDUsers.pop_back();
+      Instruction *CI = CS.getInstruction();
+      Function *Callee = CS.getCalledFunction();
+      std::vector<Value*> Args(CS.arg_begin(), CS.arg_end());
+      if (AllocFns.count(Callee)) {
+        Value *New = CallInst::Create(PoolAllocBP, Args, CI->getName(), CI);
+        CI->replaceAllUsesWith(New);
+        CI->eraseFromParent();
+      } else if (Callee == PoolInitFn || Callee == PoolInitST) {
+        Args.erase(Args.begin()+1); // Drop the size argument.
+        CallInst::Create(PoolInitBP, Args, "", CI);
+        CI->eraseFromParent();
+      } else if (Callee == PoolDestroyFn) {
+        CallInst::Create(PoolDestroyBP, Args, "", CI);
+        CI->eraseFromParent();
+      }
+    }
+    if (IsPool)
+      ++NumBumpPtr;
+  }
+
+  // Allocations of exactly the declared size of the pool they are made from
+  // call poolalloc_<size>_<align>, which does the size math at compile time.
+  // This needs the size and alignment the pool was created with, so only
+  // calls on the descriptor that the poolinits use qualify.
+  if (SizedPoolAlloc && !SAFECodeEnabled) {
+    std::map<Value*, std::pair<uint64_t, uint64_t> > DeclaredSizes;
+    std::set<Value*> Unknown;
+    getCallsOf(PoolInit, Calls);
+    if (PoolInitST) {
+      std::vector<CallInst*> STCalls;
+      getCallsOf(PoolInitST, STCalls);
+      Calls.insert(Calls.end(), STCalls.begin(), STCalls.end());
+    }
+    for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
+      Value *PD = Calls[i]->getArgOperand(0);
+      ConstantInt *Size = dyn_cast<ConstantInt>(Calls[i]->getArgOperand(1));
+      ConstantInt *Align = dyn_cast<ConstantInt>(Calls[i]->getArgOperand(2));
+      if (!Size || !Align) {
+        Unknown.insert(PD);
+        continue;
       }
+      std::pair<uint64_t, uint64_t> SA(Size->getZExtValue(),
+                                       Align->getZExtValue());
+      if (DeclaredSizes.count(PD) && DeclaredSizes[PD] != SA)
+        Unknown.insert(PD);
+      DeclaredSizes[PD] = SA;
+    }
+
+    getCallsOf(PoolAlloc, Calls);
+    if (PoolAllocST) {
+      std::vector<CallInst*> STCalls;
+      getCallsOf(PoolAllocST, STCalls);
+      Calls.insert(Calls.end(), STCalls.begin(), STCalls.end());
+    }
+    for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
+      CallInst *CI = Calls[i];
+      Value *PD = CI->getArgOperand(0);
+      ConstantInt *NumBytes = dyn_cast<ConstantInt>(CI->getArgOperand(1));
+      if (!NumBytes || Unknown.count(PD) || !DeclaredSizes.count(PD))
+        continue;
+      uint64_t Size = DeclaredSizes[PD].first;
+      uint64_t Align = DeclaredSizes[PD].second;
+      if (NumBytes->getZExtValue() != Size || !hasSizedPoolAlloc(Size, Align))
+        continue;
+
+      Constant *PoolAllocSized =
+        M.getOrInsertFunction("poolalloc_" + utostr(Size) + "_" +
+                              utostr(Align), VoidPtrTy, PoolDescPtrTy, NULL);
+      Value *New = CallInst::Create(PoolAllocSized, PD, CI->getName(), CI);
+      CI->replaceAllUsesWith(New);
+      CI->eraseFromParent();
+      ++NumSized;
     }
   }
+
+  // Drop the inline fast paths if no pool uses them any more.
+  if (PoolAllocInline && PoolAllocInline->use_empty())
+    PoolAllocInline->eraseFromParent();
+  if (PoolFreeInline && PoolFreeInline->use_empty())
+    PoolFreeInline->eraseFromParent();
+  if (PoolAllocInlineST && PoolAllocInlineST->use_empty())
+    PoolAllocInlineST->eraseFromParent();
+  if (PoolFreeInlineST && PoolFreeInlineST->use_empty())
+    PoolFreeInlineST->eraseFromParent();
   return true;
 }
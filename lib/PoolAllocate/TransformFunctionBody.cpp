@@ -18,20 +18,35 @@
 #include "dsa/CallTargets.h"
 #include "poolalloc/PoolAllocate.h"
 #include "poolalloc/RuntimeChecks.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstVisitor.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringMap.h"
 
 #include <iostream>
 using namespace llvm;
 using namespace PA;
 
+cl::opt<bool>
+PA::BatchLoopAllocs("poolalloc-batch-loop-allocs",
+                    cl::desc("Allocate the objects of counted loops with one "
+                             "poolalloc_n call before the loop"));
+
 namespace {
+  STATISTIC (NumBatchedAllocs, "Number of allocations batched in loops");
+
+  // The largest trip count for which loop allocations are batched.  The
+  // objects are passed through a stack buffer of this many pointers.
+  const unsigned MaxBatchTripCount = 64;
+
   /// FuncTransform - This class implements transformation required of pool
   /// allocated functions.
   struct FuncTransform : public InstVisitor<FuncTransform> {
@@ -39,6 +54,11 @@ namespace {
     DSGraph* G;      // The Bottom-up DS Graph
     FuncInfo &FI;
 
+    // Loop information for the function, used to batch allocations in loops.
+    // These are null if allocations should not be batched.
+    LoopInfo *LI;
+    DominatorTree *DT;
+
     // PoolUses - For each pool (identified by the pool descriptor) keep track
     // of which blocks require the memory in the pool to not be freed.  This
     // does not include poolfree's.  Note that this is only tracked for pools
@@ -53,7 +73,7 @@ namespace {
     FuncTransform(PoolAllocate &P, DSGraph* g, FuncInfo &fi,
                   std::multimap<AllocaInst*, Instruction*> &poolUses,
                   std::multimap<AllocaInst*, CallInst*> &poolFrees)
-      : PAInfo(P), G(g), FI(fi), 
+      : PAInfo(P), G(g), FI(fi), LI(0), DT(0),
         PoolUses(poolUses), PoolFrees(poolFrees) {
     }
 
@@ -87,6 +107,8 @@ namespace {
 
   private:
     Instruction *TransformAllocationInstr(Instruction *I, Value *Size);
+    Instruction *BatchLoopAllocation(Instruction *I, Value *PH, Value *Size,
+                                     const std::string &Name);
     Instruction *InsertPoolFreeInstr(Value *V, Instruction *Where);
 
     //
@@ -163,7 +185,12 @@ PoolAllocate::TransformBody (DSGraph* g, PA::FuncInfo &fi,
                              std::multimap<AllocaInst*,Instruction*> &poolUses,
                              std::multimap<AllocaInst*, CallInst*> &poolFrees,
                              Function &F) {
-  FuncTransform(*this, g, fi, poolUses, poolFrees).visit(F);
+  FuncTransform FT(*this, g, fi, poolUses, poolFrees);
+  if (BatchLoopAllocs) {
+    FT.DT = &getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+    FT.LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+  }
+  FT.visit(F);
 }
 
 //
@@ -280,10 +307,24 @@ Instruction *FuncTransform::TransformAllocationInstr(Instruction *I,
   Value *PH = getPoolHandle(I);
   if (PH == 0 || isa<ConstantPointerNull>(PH)) return I;
 
-  // Create call to poolalloc, and record the use of the pool
-  Value* Opts[2] = {PH, Size};
-  Instruction *V = CallInst::Create(PAInfo.PoolAlloc, Opts, Name, I);
-  AddPoolUse(*V, PH, PoolUses);
+  // Create call to poolalloc, and record the use of the pool.  Allocations
+  // in counted loops take their object from a batch allocated before the loop
+  // instead.
+  Instruction *V = BatchLoopAllocation(I, PH, Size, Name);
+  if (V == 0) {
+    // Objects of a constant size may be of the pool's declared size, which
+    // the fast path allocates inline.
+    Constant *Alloc = PAInfo.PoolAlloc;
+    Value *OrigSize = Size;
+    if (CastInst *CI = dyn_cast<CastInst>(Size))
+      OrigSize = CI->getOperand(0);
+    if (PAInfo.PoolAllocInline && isa<ConstantInt>(OrigSize))
+      Alloc = PAInfo.PoolAllocInline;
+
+    Value* Opts[2] = {PH, Size};
+    V = CallInst::Create(Alloc, Opts, Name, I);
+    AddPoolUse(*V, PH, PoolUses);
+  }
 
   // Cast to the appropriate type if necessary
   // FIXME: Make use of "castTo" utility function
@@ -316,6 +357,131 @@ Instruction *FuncTransform::TransformAllocationInstr(Instruction *I,
   return Casted;
 }
 
+//
+// Function: getSmallConstantTripCount()
+//
+// Description:
+//  Return the number of iterations of the specified loop if it is a constant
+//  no larger than MaxBatchTripCount, and the loop is only left through its
+//  latch.  Otherwise, return zero.  Only loops counting a canonical induction
+//  variable up to a constant are recognized, which is the form loop rotation
+//  leaves "for (i = 0; i < N; ++i)" loops in.
+//
+static unsigned getSmallConstantTripCount(Loop *L) {
+  BasicBlock *Latch = L->getLoopLatch();
+  PHINode *IV = L->getCanonicalInductionVariable();
+  if (!Latch || !IV || L->getExitingBlock() != Latch)
+    return 0;
+
+  BranchInst *BI = dyn_cast<BranchInst>(Latch->getTerminator());
+  if (!BI || !BI->isConditional())
+    return 0;
+  ICmpInst *Cmp = dyn_cast<ICmpInst>(BI->getCondition());
+  if (!Cmp || Cmp->getOperand(0) != IV->getIncomingValueForBlock(Latch))
+    return 0;
+  ConstantInt *Limit = dyn_cast<ConstantInt>(Cmp->getOperand(1));
+  if (!Limit || Limit->getValue().getActiveBits() > 32)
+    return 0;
+
+  // Find the condition under which the loop keeps going.
+  ICmpInst::Predicate Pred = Cmp->getPredicate();
+  if (BI->getSuccessor(1) == L->getHeader())
+    Pred = Cmp->getInversePredicate();
+  if (Pred != ICmpInst::ICMP_NE && Pred != ICmpInst::ICMP_ULT &&
+      Pred != ICmpInst::ICMP_SLT)
+    return 0;
+
+  // The loop body runs once for each value 0 .. Limit-1 of the induction
+  // variable.
+  unsigned TripCount = Limit->getZExtValue();
+  return TripCount <= MaxBatchTripCount ? TripCount : 0;
+}
+
+//
+// Method: BatchLoopAllocation()
+//
+// Description:
+//  If the allocation I runs exactly once on every iteration of a loop with a
+//  small constant trip count, allocate the objects for all of the iterations
+//  with a single call to poolalloc_n() in the loop preheader, and replace I
+//  with a load of the object for the current iteration.
+//
+// Return value:
+//  NULL - The allocation cannot be batched.
+//  Otherwise, the instruction that yields the object for this iteration.
+//
+Instruction *
+FuncTransform::BatchLoopAllocation(Instruction *I, Value *PH, Value *Size,
+                                   const std::string &Name) {
+  if (LI == 0 || !isa<CallInst>(I))
+    return 0;
+
+  BasicBlock *BB = I->getParent();
+  Loop *L = LI->getLoopFor(BB);
+  if (L == 0 || L->getLoopPreheader() == 0 || !L->isLoopInvariant(PH))
+    return 0;
+
+  // The allocation must execute on every iteration of the loop, and never
+  // twice in one iteration (which it would if it was in an inner loop).
+  unsigned TripCount = getSmallConstantTripCount(L);
+  if (TripCount < 2 || !DT->dominates(BB, L->getLoopLatch()))
+    return 0;
+
+  // All of the objects must have the same, known size.  Look through the
+  // cast that TransformAllocationInstr may have inserted.
+  Type *Int32Type = Type::getInt32Ty(I->getContext());
+  Value *OrigSize = Size;
+  if (CastInst *CI = dyn_cast<CastInst>(Size))
+    OrigSize = CI->getOperand(0);
+  ConstantInt *ConstSize = dyn_cast<ConstantInt>(OrigSize);
+  if (ConstSize == 0 || ConstSize->getValue().getActiveBits() > 32)
+    return 0;
+
+  //
+  // Allocate a buffer for the objects and a cursor into it.  They go into the
+  // entry block so that they are static allocas.
+  //
+  Type *VoidPtrTy = PointerType::getUnqual(Type::getInt8Ty(I->getContext()));
+  Type *VoidPtrPtrTy = PointerType::getUnqual(VoidPtrTy);
+  BasicBlock &Entry = BB->getParent()->getEntryBlock();
+  Instruction *EntryPt = &*Entry.getFirstInsertionPt();
+  AllocaInst *Buffer = new AllocaInst(ArrayType::get(VoidPtrTy, TripCount),
+                                      Name + ".batch", EntryPt);
+  AllocaInst *Cursor = new AllocaInst(VoidPtrPtrTy, Name + ".batch.cur",
+                                      EntryPt);
+
+  //
+  // Fill the buffer before the loop is entered.
+  //
+  Instruction *PreheaderPt = L->getLoopPreheader()->getTerminator();
+  Value *Objects = CastInst::CreatePointerCast(Buffer, VoidPtrPtrTy,
+                                               Buffer->getName(), PreheaderPt);
+  Value* Opts[4] = {PH,
+                    ConstantInt::get(Int32Type, ConstSize->getZExtValue()),
+                    ConstantInt::get(Int32Type, TripCount),
+                    Objects};
+  CallInst *Batch = CallInst::Create(PAInfo.PoolAllocN, Opts, "", PreheaderPt);
+  AddPoolUse(*Batch, PH, PoolUses);
+  new StoreInst(Objects, Cursor, PreheaderPt);
+
+  //
+  // Take the next object from the buffer in the loop.
+  //
+  Value *Cur = new LoadInst(Cursor, Name + ".cur", I);
+  Instruction *Object = new LoadInst(Cur, Name, I);
+  Value *Idx = ConstantInt::get(Int32Type, 1);
+  Value *Next = GetElementPtrInst::CreateInBounds(Cur, Idx, Name + ".next", I);
+  new StoreInst(Next, Cursor, I);
+  AddPoolUse(*Object, PH, PoolUses);
+
+  // The size cast made for poolalloc() is no longer needed.
+  if (Size != OrigSize && Size->use_empty())
+    cast<Instruction>(Size)->eraseFromParent();
+
+  ++NumBatchedAllocs;
+  return Object;
+}
+
 void FuncTransform::visitAllocaInst(AllocaInst &MI) {
 #if 0
   if (MI.getType() != PoolAllocate::PoolDescPtrTy) {
@@ -377,7 +543,9 @@ FuncTransform::InsertPoolFreeInstr (Value *Arg, Instruction *Where){
   // Insert a call to poolfree(), and mark that memory was deallocated from the pool.
   //
   Value* Opts[2] = {PH, Casted};
-  CallInst *FreeI = CallInst::Create(PAInfo.PoolFree, Opts, "", Where);
+  Constant *Free = PAInfo.PoolFreeInline ? PAInfo.PoolFreeInline
+                                         : PAInfo.PoolFree;
+  CallInst *FreeI = CallInst::Create(Free, Opts, "", Where);
   AddPoolUse(*FreeI, PH, PoolFrees);
   return FreeI;
 }
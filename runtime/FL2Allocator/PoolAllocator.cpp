@@ -9,9 +9,6 @@
 //
 // This file is one possible implementation of the LLVM pool allocator runtime
 // library.
-//
-// FIXME:
-//  The pointer compression functions are not thread safe.
 //===----------------------------------------------------------------------===//
 
 #include "PoolAllocator.h"
@@ -19,6 +16,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef long intptr_t;
 typedef unsigned long uintptr_t;
@@ -27,6 +27,52 @@ typedef unsigned long uintptr_t;
 #define INITIAL_SLAB_SIZE 4096
 #define LARGE_SLAB_SIZE   4096
 
+// THREAD_CACHE_SIZE - The number of declared-size objects each thread may keep
+// in front of a pool, or 0 to disable the per-thread caches.  Each thread has
+// THREAD_CACHE_POOLS cache slots, used as a two-way set associative cache
+// indexed by a hash of the pool descriptor address.
+#define THREAD_CACHE_SIZE  32
+#define THREAD_CACHE_POOLS 8
+
+// BP_THREAD_CHUNK_SIZE - Each thread allocating from a bump-pointer pool takes
+// chunks of this many bytes from the shared slab and bumps through them without
+// locking.  Objects bigger than a quarter chunk use the shared bump pointer.
+#define BP_THREAD_CHUNK_SIZE 1024
+
+// DISCARD_SLAB_SIZE - Slabs at least this big give their pages back to the OS
+// when they become empty, if the slab provider supports it.
+#define DISCARD_SLAB_SIZE (256*1024)
+
+// HUGE_PAGE_SIZE - Slabs this big or bigger are backed with transparent huge
+// pages by the "hugemmap" slab provider.
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+// POOLALLOC_N_CHUNK - poolalloc_n looks for a free node that can hold up to
+// this many objects at once.
+#define POOLALLOC_N_CHUNK 256
+
+// STATS_SAMPLE_PERIOD - With runtime statistics enabled, the latency of one in
+// this many allocations and frees of each thread is measured.  Must be a power
+// of two.
+#define STATS_SAMPLE_PERIOD 64
+
+// PTRCOMP_RESERVE_SIZE - The address space reserved for each pointer
+// compressed pool.  Indexes into the pool are 32 bits, so it stays below 4GB.
+// PTRCOMP_COMMIT_SIZE - The pages of the reservation are made usable this many
+// bytes at a time at first, doubling as the pool fills.
+// PTRCOMP_STAGGER_LIMIT - Pools start at most this far into their reservation.
+#if defined(__LP64__) || defined(_LP64)
+#define PTRCOMP_RESERVE_SIZE (4UL*1024*1024*1024 - 2*PTRCOMP_STAGGER_LIMIT)
+#else
+#define PTRCOMP_RESERVE_SIZE (256UL*1024*1024)
+#endif
+#define PTRCOMP_COMMIT_SIZE   (256*1024)
+#define PTRCOMP_STAGGER_LIMIT (64*1024)
+
+// LOCK_FREE_BATCH - The number of objects a poolinit_lf pool allocates under
+// the lock when its lock-free free list runs dry.
+#define LOCK_FREE_BATCH 16
+
 #ifndef NDEBUG
 #define NDEBUG
 #endif
@@ -126,10 +172,12 @@ template<typename PoolTraits>
 static void PrintPoolStats(PoolTy<PoolTraits> *Pool) {
   fprintf(stderr,
           "(0x%X) BytesAlloc=%d  NumObjs=%d"
-          " AvgObjSize=%d  NextAllocSize=%d  DeclaredSize=%d\n",
+          " AvgObjSize=%d  NextAllocSize=%d  DeclaredSize=%d"
+          "  ReallocsInPlace=%d  ReallocsMoved=%d\n",
           Pool, Pool->BytesAllocated, Pool->NumObjects,
           Pool->NumObjects ? Pool->BytesAllocated/Pool->NumObjects : 0,
-          Pool->AllocSize, Pool->DeclaredSize);
+          Pool->AllocSize, Pool->DeclaredSize,
+          Pool->NumReallocsInPlace, Pool->NumReallocsMoved);
 }
 
 #else
@@ -173,56 +221,629 @@ static void InitPrintNumPools() {
 #endif
 
 //===----------------------------------------------------------------------===//
-//  PoolSlab implementation
+//  Runtime statistics
+//
+//  Setting POOLALLOC_STATS to a file name (or "-" for stderr) makes every
+//  normal and bump-pointer pool keep statistics.  Pools are grouped by the
+//  place poolinit was called from, which identifies the DSA node the pool was
+//  made for, or by the name given to the pool with poolprofile_name.  Names
+//  stay the same from one build of a program to the next, which is what lets
+//  the compiler read the statistics back as a profile.  The statistics are
+//  appended to the file as one line of JSON at exit and, if
+//  POOLALLOC_STATS_SIGNAL is set to a signal number, whenever that signal
+//  arrives.  Signal dumps happen at the next pool operation rather than in
+//  the signal handler.
+//===----------------------------------------------------------------------===//
+
+// The latency histograms have a bucket for each power of two nanoseconds.
+#define STATS_LATENCY_BUCKETS 32
+
+struct PoolCounters {
+  unsigned long long NumAllocs, NumFrees;
+
+  // AllocBytes - The bytes of all objects ever allocated.
+  unsigned long long AllocBytes;
+
+  // LiveBytes, PeakBytes - The bytes of the objects currently allocated, and
+  // the most there have ever been.
+  long long LiveBytes, PeakBytes;
+
+  // Slabs, SlabBytes - The slabs that the pool has taken from the system.
+  long long Slabs, SlabBytes;
+
+  // FreeNodes - The number of nodes on the free lists of the pool.
+  long long FreeNodes;
+
+  // LockContended - The number of times the pool lock was already taken.
+  unsigned long long LockContended;
+
+  // ReallocsInPlace, ReallocsMoved - The poolreallocs that resized an object
+  // where it was, and those that had to copy it to a new object.
+  unsigned long long ReallocsInPlace, ReallocsMoved;
+
+  unsigned AllocLatency[STATS_LATENCY_BUCKETS];
+  unsigned FreeLatency[STATS_LATENCY_BUCKETS];
+};
+
+struct PoolSiteStats;
+
+// PoolStats - The statistics of one pool.  Counters that are changed without
+// holding the pool lock are updated atomically.
+struct PoolStats {
+  PoolCounters C;
+  PoolSiteStats *Site;
+
+  // Next, Prev - The list of live pools of Site.
+  PoolStats *Next, **Prev;
+};
+
+// PoolSiteStats - The statistics of all pools created by one poolinit call.
+// Destroyed pools are summed up in Retired, except for the counters that
+// describe memory the pool holds.
+struct PoolSiteStats {
+  void *Site;
+  const char *Name;
+  unsigned DeclaredSize;
+  const char *Kind;
+  unsigned long long NumPools;
+  PoolCounters Retired;
+  PoolStats *LivePools;
+  PoolSiteStats *Next;
+};
+
+static bool StatsEnabled = false;
+static const char *StatsFile = 0;
+static volatile sig_atomic_t StatsDumpRequested = 0;
+static pthread_once_t StatsOnce = PTHREAD_ONCE_INIT;
+
+// StatsLock - Protects the list of sites and their lists of live pools.
+static pthread_mutex_t StatsLock = PTHREAD_MUTEX_INITIALIZER;
+static PoolSiteStats *StatsSites = 0;
+
+static __thread unsigned StatsSampleTick = 0;
+
+static void PrintCounters(FILE *F, const PoolCounters &C) {
+  fprintf(F, "\"allocs\":%llu,\"frees\":%llu,\"alloc_bytes\":%llu,"
+          "\"live_bytes\":%lld,\"peak_bytes\":%lld,\"slabs\":%lld,"
+          "\"slab_bytes\":%lld,\"free_nodes\":%lld,\"lock_contended\":%llu,"
+          "\"reallocs_in_place\":%llu,\"reallocs_moved\":%llu",
+          C.NumAllocs, C.NumFrees, C.AllocBytes, C.LiveBytes, C.PeakBytes,
+          C.Slabs, C.SlabBytes, C.FreeNodes, C.LockContended,
+          C.ReallocsInPlace, C.ReallocsMoved);
+
+  const unsigned *Hists[2] = { C.AllocLatency, C.FreeLatency };
+  const char *Names[2] = { "alloc_latency_ns", "free_latency_ns" };
+  for (unsigned h = 0; h != 2; ++h) {
+    fprintf(F, ",\"%s\":[", Names[h]);
+    for (unsigned i = 0; i != STATS_LATENCY_BUCKETS; ++i)
+      fprintf(F, i ? ",%u" : "%u", Hists[h][i]);
+    fprintf(F, "]");
+  }
+}
+
+// AddCounters - Add the counters of From to To.  If Retiring, From belongs to
+// a pool that is going away, and only its history is kept.
+static void AddCounters(PoolCounters &To, const PoolCounters &From,
+                        bool Retiring) {
+  To.NumAllocs += From.NumAllocs;
+  To.NumFrees += From.NumFrees;
+  To.AllocBytes += From.AllocBytes;
+  To.LockContended += From.LockContended;
+  To.ReallocsInPlace += From.ReallocsInPlace;
+  To.ReallocsMoved += From.ReallocsMoved;
+  if (From.PeakBytes > To.PeakBytes)
+    To.PeakBytes = From.PeakBytes;
+  if (!Retiring) {
+    To.LiveBytes += From.LiveBytes;
+    To.Slabs += From.Slabs;
+    To.SlabBytes += From.SlabBytes;
+    To.FreeNodes += From.FreeNodes;
+  }
+  for (unsigned i = 0; i != STATS_LATENCY_BUCKETS; ++i) {
+    To.AllocLatency[i] += From.AllocLatency[i];
+    To.FreeLatency[i] += From.FreeLatency[i];
+  }
+}
+
+// PrintString - Print Str as a JSON string.  Pool names come from the
+// program, so quotes, backslashes and control characters are escaped.
+static void PrintString(FILE *F, const char *Str) {
+  fputc('"', F);
+  for (const unsigned char *C = (const unsigned char*)Str; *C; ++C) {
+    if (*C == '"' || *C == '\\')
+      fprintf(F, "\\%c", *C);
+    else if (*C < 0x20)
+      fprintf(F, "\\u%04x", *C);
+    else
+      fputc(*C, F);
+  }
+  fputc('"', F);
+}
+
+// DumpStats - Append the statistics of all pool sites to StatsFile.  Pools
+// in use are read without locking them, so the numbers of a busy pool may be
+// slightly inconsistent.
+static void DumpStats() {
+  pthread_mutex_lock(&StatsLock);
+  StatsDumpRequested = 0;
+
+  FILE *F = stderr;
+  if (strcmp(StatsFile, "-") && !(F = fopen(StatsFile, "a"))) {
+    pthread_mutex_unlock(&StatsLock);
+    return;
+  }
+
+  fprintf(F, "{\"pid\":%d,\"sample_period\":%d,\"sites\":[",
+          (int)getpid(), STATS_SAMPLE_PERIOD);
+  bool First = true;
+  for (PoolSiteStats *S = StatsSites; S; S = S->Next) {
+    // Sites whose pools have all been renamed have nothing to say.
+    if (S->NumPools == 0) continue;
+
+    PoolCounters Total = S->Retired;
+    unsigned long long LivePools = 0;
+    for (PoolStats *PS = S->LivePools; PS; PS = PS->Next, ++LivePools)
+      AddCounters(Total, PS->C, false);
+
+    fprintf(F, "%s{\"site\":\"%p\",", First ? "" : ",", S->Site);
+    if (S->Name) {
+      fprintf(F, "\"name\":");
+      PrintString(F, S->Name);
+      fputc(',', F);
+    }
+    fprintf(F, "\"kind\":\"%s\",\"declared_size\":%u,"
+            "\"pools\":%llu,\"live_pools\":%llu,",
+            S->Kind, S->DeclaredSize, S->NumPools, LivePools);
+    First = false;
+    PrintCounters(F, Total);
+    fprintf(F, "}");
+  }
+  fprintf(F, "]}\n");
+
+  if (F != stderr)
+    fclose(F);
+  pthread_mutex_unlock(&StatsLock);
+}
+
+static void StatsSignalHandler(int) {
+  StatsDumpRequested = 1;
+}
+
+static void InitStats() {
+  StatsFile = getenv("POOLALLOC_STATS");
+  if (StatsFile == 0) return;
+  StatsEnabled = true;
+  atexit(DumpStats);
+
+  if (const char *Sig = getenv("POOLALLOC_STATS_SIGNAL")) {
+    struct sigaction SA;
+    memset(&SA, 0, sizeof(SA));
+    SA.sa_handler = StatsSignalHandler;
+    SA.sa_flags = SA_RESTART;
+    sigaction(atoi(Sig), &SA, 0);
+  }
+}
+
+// CreatePoolStats - Return a new statistics record for a pool created by the
+// poolinit call at Site, or null if statistics are disabled.
+static PoolStats *CreatePoolStats(void *Site, unsigned DeclaredSize,
+                                  const char *Kind) {
+  pthread_once(&StatsOnce, InitStats);
+  if (!StatsEnabled) return 0;
+
+  PoolStats *PS = (PoolStats*)calloc(1, sizeof(PoolStats));
+  pthread_mutex_lock(&StatsLock);
+  PoolSiteStats *S = StatsSites;
+  while (S && (S->Site != Site || S->DeclaredSize != DeclaredSize ||
+               S->Kind != Kind || S->Name))
+    S = S->Next;
+  if (S == 0) {
+    S = (PoolSiteStats*)calloc(1, sizeof(PoolSiteStats));
+    S->Site = Site;
+    S->DeclaredSize = DeclaredSize;
+    S->Kind = Kind;
+    S->Next = StatsSites;
+    StatsSites = S;
+  }
+
+  ++S->NumPools;
+  PS->Site = S;
+  PS->Next = S->LivePools;
+  PS->Prev = &S->LivePools;
+  if (PS->Next)
+    PS->Next->Prev = &PS->Next;
+  S->LivePools = PS;
+  pthread_mutex_unlock(&StatsLock);
+  return PS;
+}
+
+// RenamePoolStats - Move the pool with statistics PS to the site called Name,
+// creating it if need be.
+static void RenamePoolStats(PoolStats *PS, const char *Name) {
+  pthread_mutex_lock(&StatsLock);
+  PoolSiteStats *Old = PS->Site;
+  PoolSiteStats *S = StatsSites;
+  while (S && (!S->Name || strcmp(S->Name, Name) ||
+               S->DeclaredSize != Old->DeclaredSize || S->Kind != Old->Kind))
+    S = S->Next;
+  if (S == 0) {
+    S = (PoolSiteStats*)calloc(1, sizeof(PoolSiteStats));
+    S->Site = Old->Site;
+    S->Name = Name;
+    S->DeclaredSize = Old->DeclaredSize;
+    S->Kind = Old->Kind;
+    S->Next = StatsSites;
+    StatsSites = S;
+  }
+
+  if (S != Old) {
+    *PS->Prev = PS->Next;
+    if (PS->Next)
+      PS->Next->Prev = PS->Prev;
+    --Old->NumPools;
+
+    ++S->NumPools;
+    PS->Site = S;
+    PS->Next = S->LivePools;
+    PS->Prev = &S->LivePools;
+    if (PS->Next)
+      PS->Next->Prev = &PS->Next;
+    S->LivePools = PS;
+  }
+  pthread_mutex_unlock(&StatsLock);
+}
+
+// DestroyPoolStats - The pool with statistics PS is being destroyed.
+static void DestroyPoolStats(PoolStats *PS) {
+  pthread_mutex_lock(&StatsLock);
+  AddCounters(PS->Site->Retired, PS->C, true);
+  *PS->Prev = PS->Next;
+  if (PS->Next)
+    PS->Next->Prev = PS->Prev;
+  pthread_mutex_unlock(&StatsLock);
+  free(PS);
+}
+
+static unsigned long long getNanoTime() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec*1000000000ULL + TS.tv_nsec;
+}
+
+// StatsSampleStart - Return the current time if the latency of this operation
+// should be measured, and 0 otherwise.
+static inline unsigned long long StatsSampleStart() {
+  if (++StatsSampleTick & (STATS_SAMPLE_PERIOD-1))
+    return 0;
+  return getNanoTime();
+}
+
+static void RecordLatency(unsigned *Histogram, unsigned long long Start) {
+  unsigned long long Elapsed = getNanoTime()-Start;
+  unsigned Bucket = Elapsed ? 63-__builtin_clzll(Elapsed) : 0;
+  if (Bucket >= STATS_LATENCY_BUCKETS)
+    Bucket = STATS_LATENCY_BUCKETS-1;
+  __sync_fetch_and_add(&Histogram[Bucket], 1);
+}
+
+// StatsAlloc - Record an allocation of Bytes bytes from the pool with
+// statistics PS, which started at time Start if it was sampled.
+static void StatsAlloc(PoolStats *PS, long long Bytes,
+                       unsigned long long Start) {
+  if (StatsDumpRequested)
+    DumpStats();
+  if (Start)
+    RecordLatency(PS->C.AllocLatency, Start);
+
+  __sync_fetch_and_add(&PS->C.NumAllocs, 1);
+  __sync_fetch_and_add(&PS->C.AllocBytes, Bytes);
+  long long Live = __sync_add_and_fetch(&PS->C.LiveBytes, Bytes);
+  long long Peak = PS->C.PeakBytes;
+  while (Live > Peak) {
+    long long Prev = __sync_val_compare_and_swap(&PS->C.PeakBytes, Peak, Live);
+    if (Prev == Peak) break;
+    Peak = Prev;
+  }
+}
+
+// StatsFree - Record a free of Bytes bytes.
+static void StatsFree(PoolStats *PS, long long Bytes,
+                      unsigned long long Start) {
+  if (StatsDumpRequested)
+    DumpStats();
+  if (Start)
+    RecordLatency(PS->C.FreeLatency, Start);
+
+  __sync_fetch_and_add(&PS->C.NumFrees, 1);
+  __sync_fetch_and_sub(&PS->C.LiveBytes, Bytes);
+}
+
+// LockPool - Acquire the lock of Pool, counting contention if the pool keeps
+// statistics.
+template<typename PoolTraits>
+static inline void LockPool(PoolTy<PoolTraits> *Pool) {
+  if (__builtin_expect(Pool->Stats != 0, 0)) {
+    if (pthread_mutex_trylock(&Pool->pool_lock) == 0)
+      return;
+    __sync_fetch_and_add(&Pool->Stats->C.LockContended, 1);
+  }
+  pthread_mutex_lock(&Pool->pool_lock);
+}
+
+//===----------------------------------------------------------------------===//
+//  Segregated free lists
+//
+//  Free nodes that are not of the declared size are kept in size bins, as in
+//  the TLSF allocator.  The first level index of a bin is the log2 of the node
+//  size, and the second level splits each power of two into FREE_BIN_SLS
+//  linear ranges.  A bitmap per level records the non-empty bins, so finding
+//  a bin with a big enough node is a couple of bit scans instead of a walk
+//  over the free list.
 //===----------------------------------------------------------------------===//
 
+#define FREE_BIN_SL_LOG2 2
+#define FREE_BIN_SLS     (1 << FREE_BIN_SL_LOG2)
+
+// Nodes smaller than FREE_BIN_SMALL bytes are binned linearly in FL 0.
+#define FREE_BIN_SMALL   (1 << (FREE_BIN_SL_LOG2+2))
+
+template<typename PoolTraits>
+struct PoolFreeBins {
+  // FLBitmap - Bit N is set if any of the bins in first level N is non-empty.
+  unsigned FLBitmap;
+
+  // SLBitmaps - Bit M of SLBitmaps[N] is set if bin N,M is non-empty.
+  unsigned char SLBitmaps[PoolTraits::NumFreeBinFLs];
+
+  // Heads - The free list of each bin.
+  typename PoolTraits::FreeNodeHeaderPtrTy
+    Heads[PoolTraits::NumFreeBinFLs][FREE_BIN_SLS];
+
+  // getAllocSize - The number of bytes to reserve for the bins in a slab,
+  // keeping the slab body on the same alignment boundary.
+  static unsigned getAllocSize() {
+    return (sizeof(PoolFreeBins) + 15) & ~15;
+  }
+};
+
+// getFreeBin - Return the bin that free nodes of Size bytes are kept in.
+template<typename PoolTraits>
+static inline void getFreeBin(unsigned Size, unsigned &FL, unsigned &SL) {
+  if (Size < FREE_BIN_SMALL) {
+    FL = 0;
+    SL = Size / (FREE_BIN_SMALL / FREE_BIN_SLS);
+    return;
+  }
+
+  unsigned Log2 = 31 - __builtin_clz(Size);
+  FL = Log2 - (FREE_BIN_SL_LOG2+1);
+  SL = (Size >> (Log2-FREE_BIN_SL_LOG2)) - FREE_BIN_SLS;
+  if (FL >= PoolTraits::NumFreeBinFLs) {
+    // Everything too large for the table goes into the last bin.
+    FL = PoolTraits::NumFreeBinFLs-1;
+    SL = FREE_BIN_SLS-1;
+  }
+}
+
+// getFreeBinForAlloc - Return the first bin in which every node is at least
+// Size bytes large.  Return false if Size is beyond the last bin.
+template<typename PoolTraits>
+static inline bool getFreeBinForAlloc(unsigned Size, unsigned &FL,
+                                      unsigned &SL) {
+  if (Size < FREE_BIN_SMALL)
+    Size += FREE_BIN_SMALL/FREE_BIN_SLS - 1;
+  else
+    Size += (1 << (31 - __builtin_clz(Size) - FREE_BIN_SL_LOG2)) - 1;
+  getFreeBin<PoolTraits>(Size, FL, SL);
+  return FL != PoolTraits::NumFreeBinFLs-1 || SL != FREE_BIN_SLS-1;
+}
+
+template<typename PoolTraits>
+static inline typename PoolTraits::FreeNodeHeaderPtrTy *
+getFreeListFor(PoolTy<PoolTraits> *Pool, unsigned Size) {
+  if (Size == Pool->DeclaredSize)
+    return &Pool->ObjFreeList;
+
+  unsigned FL, SL;
+  getFreeBin<PoolTraits>(Size, FL, SL);
+  return &Pool->FreeBins->Heads[FL][SL];
+}
 
 template<typename PoolTraits>
 static void AddNodeToFreeList(PoolTy<PoolTraits> *Pool,
                               FreedNodeHeader<PoolTraits> *FreeNode) {
-  typename PoolTraits::FreeNodeHeaderPtrTy *FreeList;
-  if (FreeNode->Header.Size == Pool->DeclaredSize)
-    FreeList = &Pool->ObjFreeList;
-  else
-    FreeList = &Pool->OtherFreeList;
+  typename PoolTraits::FreeNodeHeaderPtrTy *FreeList =
+    getFreeListFor(Pool, FreeNode->Header.Size);
 
   void *PoolBase = Pool->Slabs;
 
   typename PoolTraits::FreeNodeHeaderPtrTy FreeNodeIdx = 
     PoolTraits::FNHPtrToIndex(FreeNode, PoolBase);
 
+  if (Pool->Stats) ++Pool->Stats->C.FreeNodes;
+
   FreeNode->Prev = 0;   // First on the list.
   FreeNode->Next = *FreeList;
   *FreeList = FreeNodeIdx;
   if (FreeNode->Next)
     PoolTraits::IndexToFNHPtr(FreeNode->Next, PoolBase)->Prev = FreeNodeIdx;
+
+  if (FreeList != &Pool->ObjFreeList) {
+    unsigned FL, SL;
+    getFreeBin<PoolTraits>(FreeNode->Header.Size, FL, SL);
+    Pool->FreeBins->FLBitmap |= 1U << FL;
+    Pool->FreeBins->SLBitmaps[FL] |= 1U << SL;
+    Pool->OtherFreeList = FreeNodeIdx;
+  }
 }
 
 template<typename PoolTraits>
 static void UnlinkFreeNode(PoolTy<PoolTraits> *Pool,
                            FreedNodeHeader<PoolTraits> *FNH) {
   void *PoolBase = Pool->Slabs;
+  typename PoolTraits::FreeNodeHeaderPtrTy NodeIdx = 
+    PoolTraits::FNHPtrToIndex(FNH, PoolBase);
+
+  if (Pool->Stats) --Pool->Stats->C.FreeNodes;
 
   // Make the predecessor point to our next node.
   if (FNH->Prev)
     PoolTraits::IndexToFNHPtr(FNH->Prev, PoolBase)->Next = FNH->Next;
+  else if (Pool->ObjFreeList == NodeIdx)
+    Pool->ObjFreeList = FNH->Next;
   else {
-    typename PoolTraits::FreeNodeHeaderPtrTy NodeIdx = 
-      PoolTraits::FNHPtrToIndex(FNH, PoolBase);
-
-    if (Pool->ObjFreeList == NodeIdx)
-      Pool->ObjFreeList = FNH->Next;
-    else {
-      assert(Pool->OtherFreeList == NodeIdx &&
-             "Prev Ptr is null but not at head of free list?");
-      Pool->OtherFreeList = FNH->Next;
+    unsigned FL, SL;
+    getFreeBin<PoolTraits>(FNH->Header.Size, FL, SL);
+    PoolFreeBins<PoolTraits> *Bins = Pool->FreeBins;
+    assert(Bins->Heads[FL][SL] == NodeIdx &&
+           "Prev Ptr is null but not at head of free list?");
+    Bins->Heads[FL][SL] = FNH->Next;
+    if (!FNH->Next) {
+      Bins->SLBitmaps[FL] &= ~(1U << SL);
+      if (!Bins->SLBitmaps[FL])
+        Bins->FLBitmap &= ~(1U << FL);
     }
   }
 
   if (FNH->Next)
     PoolTraits::IndexToFNHPtr(FNH->Next, PoolBase)->Prev = FNH->Prev;
+
+  if (Pool->OtherFreeList == NodeIdx)
+    Pool->OtherFreeList = 0;
+}
+
+// FindFreeNode - Return a free node from the bins that can hold NumBytes, or
+// null if there is none.
+template<typename PoolTraits>
+static FreedNodeHeader<PoolTraits> *FindFreeNode(PoolTy<PoolTraits> *Pool,
+                                                 unsigned NumBytes) {
+  PoolFreeBins<PoolTraits> *Bins = Pool->FreeBins;
+  if (Bins == 0) return 0;
+  void *PoolBase = Pool->Slabs;
+
+  unsigned FL, SL;
+  if (!getFreeBinForAlloc<PoolTraits>(NumBytes, FL, SL)) {
+    // Only the last bin can hold a node this big, and its nodes are not
+    // sorted by size: search it for the first fit.
+    typename PoolTraits::FreeNodeHeaderPtrTy Idx = Bins->Heads[FL][SL];
+    while (Idx) {
+      FreedNodeHeader<PoolTraits> *FNH = PoolTraits::IndexToFNHPtr(Idx,
+                                                                   PoolBase);
+      if (FNH->Header.Size >= NumBytes)
+        return FNH;
+      Idx = FNH->Next;
+    }
+    return 0;
+  }
+
+  unsigned SLMap = Bins->SLBitmaps[FL] & (~0U << SL);
+  if (SLMap == 0) {
+    unsigned FLMap = Bins->FLBitmap & (~1U << FL);
+    if (FLMap == 0) return 0;
+    FL = __builtin_ctz(FLMap);
+    SLMap = Bins->SLBitmaps[FL];
+  }
+  SL = __builtin_ctz(SLMap);
+  return PoolTraits::IndexToFNHPtr(Bins->Heads[FL][SL], PoolBase);
+}
+
+//===----------------------------------------------------------------------===//
+//  Slab providers
+//
+//  The memory of normal pool slabs comes from the slab provider selected by
+//  the POOLALLOC_SLABS environment variable:
+//    malloc   - Get slabs from the system malloc (the default).
+//    mmap     - Map each slab separately, and give the pages of empty slabs
+//               back to the OS with MADV_DONTNEED.
+//    hugemmap - Like mmap, but align slabs of HUGE_PAGE_SIZE and up to a huge
+//               page boundary and ask for transparent huge pages.
+//===----------------------------------------------------------------------===//
+
+struct SlabProvider {
+  // Allocate - Return Size bytes of memory.  Size may be rounded up, in which
+  // case the slab can use all of it.
+  void *(*Allocate)(unsigned long &Size);
+
+  // Release - Free memory returned by Allocate.
+  void (*Release)(void *Mem, unsigned long Size);
+
+  // Discard - Tell the OS that the contents of [Start, End) are no longer
+  // needed, or null if the provider cannot do this.
+  void (*Discard)(void *Start, void *End);
+};
+
+static void *MallocAllocateSlab(unsigned long &Size) {
+  return malloc(Size);
+}
+
+static void MallocReleaseSlab(void *Mem, unsigned long) {
+  free(Mem);
+}
+
+static unsigned long SlabPageSize;
+
+static void *MMAPAllocateSlab(unsigned long &Size) {
+  Size = (Size+SlabPageSize-1) & ~(SlabPageSize-1);
+  return AllocateSpaceWithMMAP(Size);
+}
+
+static void *HugeMMAPAllocateSlab(unsigned long &Size) {
+  if (Size < HUGE_PAGE_SIZE)
+    return MMAPAllocateSlab(Size);
+
+  Size = (Size+HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1UL);
+  void *Mem = AllocateAlignedSpaceWithMMAP(Size, HUGE_PAGE_SIZE);
+#ifdef MADV_HUGEPAGE
+  madvise(Mem, Size, MADV_HUGEPAGE);
+#endif
+  return Mem;
+}
+
+static void MMAPReleaseSlab(void *Mem, unsigned long Size) {
+  munmap(Mem, Size);
+}
+
+static void MMAPDiscard(void *Start, void *End) {
+  uintptr_t S = ((uintptr_t)Start+SlabPageSize-1) & ~(SlabPageSize-1);
+  uintptr_t E = (uintptr_t)End & ~(SlabPageSize-1);
+  if (S < E)
+    madvise((void*)S, E-S, MADV_DONTNEED);
+}
+
+static const SlabProvider SlabProviders[] = {
+  { MallocAllocateSlab,   MallocReleaseSlab, 0 },
+  { MMAPAllocateSlab,     MMAPReleaseSlab,   MMAPDiscard },
+  { HugeMMAPAllocateSlab, MMAPReleaseSlab,   MMAPDiscard }
+};
+
+static const SlabProvider *CurSlabProvider = 0;
+static pthread_once_t SlabProviderOnce = PTHREAD_ONCE_INIT;
+
+static void InitSlabProvider() {
+  SlabPageSize = sysconf(_SC_PAGESIZE);
+  CurSlabProvider = &SlabProviders[0];
+
+  const char *Name = getenv("POOLALLOC_SLABS");
+  if (Name == 0) return;
+  if (!strcmp(Name, "mmap"))
+    CurSlabProvider = &SlabProviders[1];
+  else if (!strcmp(Name, "hugemmap"))
+    CurSlabProvider = &SlabProviders[2];
+  else if (strcmp(Name, "malloc"))
+    fprintf(stderr, "poolalloc: unknown slab provider '%s', using malloc\n",
+            Name);
+}
+
+static inline const SlabProvider *getSlabProvider() {
+  if (__builtin_expect(CurSlabProvider == 0, 0))
+    pthread_once(&SlabProviderOnce, InitSlabProvider);
+  return CurSlabProvider;
 }
 
+//===----------------------------------------------------------------------===//
+//  PoolSlab implementation
+//===----------------------------------------------------------------------===//
+
 
 // PoolSlab Structure - Hold multiple objects of the current node type.
 // Invariants: FirstUnused <= UsedEnd
@@ -233,11 +854,15 @@ struct PoolSlab {
   // pool, for example, to destroy them all.
   PoolSlab<PoolTraits> *Next;
 
+  // Size - The number of bytes of memory in this slab, including the header.
+  unsigned long Size;
+
 public:
   static void create(PoolTy<PoolTraits> *Pool, unsigned SizeHint);
   static void *create_for_bp(PoolTy<PoolTraits> *Pool);
   static void create_for_ptrcomp(PoolTy<PoolTraits> *Pool,
                                  void *Mem, unsigned Size);
+  static void grow_for_ptrcomp(PoolTy<PoolTraits> *Pool, unsigned SizeHint);
   void destroy();
 
   PoolSlab<PoolTraits> *getNext() const { return Next; }
@@ -246,6 +871,12 @@ public:
 // create - Create a new (empty) slab and add it to the end of the Pools list.
 template<typename PoolTraits>
 void PoolSlab<PoolTraits>::create(PoolTy<PoolTraits> *Pool, unsigned SizeHint) {
+  // Pointer compressed pools grow in place instead of adding slabs.
+  if (!PoolTraits::UseSlabProvider) {
+    grow_for_ptrcomp(Pool, SizeHint);
+    return;
+  }
+
   if (Pool->DeclaredSize == 0) {
     unsigned Align = Pool->Alignment;
     if (SizeHint < sizeof(FreedNodeHeader<PoolTraits>) - 
@@ -254,16 +885,39 @@ void PoolSlab<PoolTraits>::create(PoolTy<PoolTraits> *Pool, unsigned SizeHint) {
                  sizeof(NodeHeader<PoolTraits>);
     SizeHint = SizeHint+sizeof(FreedNodeHeader<PoolTraits>)+(Align-1);
     SizeHint = (SizeHint & ~(Align-1))-sizeof(FreedNodeHeader<PoolTraits>);
-    Pool->DeclaredSize = SizeHint;
+    // The thread cache checks read this without the pool lock.
+    __atomic_store_n(&Pool->DeclaredSize, SizeHint, __ATOMIC_RELAXED);
   }
 
   unsigned Size = Pool->AllocSize;
   Pool->AllocSize <<= 1;
   Size = (Size+SizeHint-1) / SizeHint * SizeHint;
-  PoolSlab *PS = (PoolSlab*)malloc(Size+sizeof(PoolSlab<PoolTraits>) +
-                                   sizeof(NodeHeader<PoolTraits>) +
-                                   sizeof(FreedNodeHeader<PoolTraits>));
+
+  // The first slab of the pool also holds the free bins.
+  unsigned BinsSize = 0;
+  if (Pool->FreeBins == 0)
+    BinsSize = PoolFreeBins<PoolTraits>::getAllocSize();
+
+  unsigned Overhead = sizeof(PoolSlab<PoolTraits>) +
+                      sizeof(NodeHeader<PoolTraits>) +
+                      sizeof(FreedNodeHeader<PoolTraits>) + BinsSize;
+  unsigned long SlabSize = Size+Overhead;
+  PoolSlab *PS = (PoolSlab*)getSlabProvider()->Allocate(SlabSize);
+  PS->Size = SlabSize;
+  if (Pool->Stats) {
+    ++Pool->Stats->C.Slabs;
+    Pool->Stats->C.SlabBytes += SlabSize;
+  }
+
+  // Use any extra space the provider gave us.
+  Size = (SlabSize-Overhead) & ~(sizeof(void*)-1);
+
   char *PoolBody = (char*)(PS+1);
+  if (BinsSize) {
+    Pool->FreeBins = (PoolFreeBins<PoolTraits>*)PoolBody;
+    memset(PoolBody, 0, BinsSize);
+    PoolBody += BinsSize;
+  }
 
   // If the Alignment is greater than the size of the FreedNodeHeader, skip over
   // some space so that the a "free pointer + sizeof(FreedNodeHeader)" is always
@@ -286,6 +940,10 @@ void PoolSlab<PoolTraits>::create(PoolTy<PoolTraits> *Pool, unsigned SizeHint) {
                                      Size);
   End->Header.Size = ~0; // Looks like an allocated chunk
 
+  // Remember where the slab body starts, so that poolfree can tell when the
+  // whole slab is free.
+  End->Next = PoolTraits::FNHPtrToIndex(SlabBody, Pool->Slabs);
+
   // Add the slab to the list...
   PS->Next = Pool->Slabs;
   Pool->Slabs = PS;
@@ -294,9 +952,15 @@ void PoolSlab<PoolTraits>::create(PoolTy<PoolTraits> *Pool, unsigned SizeHint) {
 /// create_for_bp - This creates a slab for a bump-pointer pool.
 template<typename PoolTraits>
 void *PoolSlab<PoolTraits>::create_for_bp(PoolTy<PoolTraits> *Pool) {
-  unsigned Size = Pool->AllocSize;
+  unsigned long SlabSize = Pool->AllocSize+sizeof(PoolSlab);
   Pool->AllocSize <<= 1;
-  PoolSlab *PS = (PoolSlab*)malloc(Size+sizeof(PoolSlab));
+  PoolSlab *PS = (PoolSlab*)getSlabProvider()->Allocate(SlabSize);
+  PS->Size = SlabSize;
+  if (Pool->Stats) {
+    ++Pool->Stats->C.Slabs;
+    Pool->Stats->C.SlabBytes += SlabSize;
+  }
+  unsigned long Size = SlabSize-sizeof(PoolSlab);
   char *PoolBody = (char*)(PS+1);
   if (sizeof(PoolSlab) == 4)
     PoolBody += 4;            // No reason to start out unaligned.
@@ -310,6 +974,18 @@ void *PoolSlab<PoolTraits>::create_for_bp(PoolTy<PoolTraits> *Pool) {
   return PoolBody;
 }
 
+// getPtrCompEndMarker - Return where the end marker of the first Size bytes of
+// the pointer compressed pool PS goes.  It is placed so that a node that
+// replaces it later has correctly aligned user data.
+template<typename PoolTraits>
+static FreedNodeHeader<PoolTraits> *
+getPtrCompEndMarker(PoolTy<PoolTraits> *Pool, void *PS, unsigned long Size) {
+  uintptr_t Data = (uintptr_t)PS + Size - sizeof(FreedNodeHeader<PoolTraits>) +
+                   sizeof(NodeHeader<PoolTraits>);
+  Data &= ~(uintptr_t)(Pool->Alignment-1);
+  return (FreedNodeHeader<PoolTraits>*)(Data - sizeof(NodeHeader<PoolTraits>));
+}
+
 /// create_for_ptrcomp - Initialize a chunk of memory 'Mem' of size 'Size' for
 /// pointer compression.
 template<typename PoolTraits>
@@ -321,49 +997,122 @@ void PoolSlab<PoolTraits>::create_for_ptrcomp(PoolTy<PoolTraits> *Pool,
                         sizeof(NodeHeader<PoolTraits>);
     SizeHint = SizeHint+sizeof(FreedNodeHeader<PoolTraits>)+(Align-1);
     SizeHint = (SizeHint & ~(Align-1))-sizeof(FreedNodeHeader<PoolTraits>);
-    Pool->DeclaredSize = SizeHint;
+    __atomic_store_n(&Pool->DeclaredSize, SizeHint, __ATOMIC_RELAXED);
   }
 
-  Size -= sizeof(PoolSlab) + sizeof(NodeHeader<PoolTraits>) +
-          sizeof(FreedNodeHeader<PoolTraits>);
+  unsigned BinsSize = PoolFreeBins<PoolTraits>::getAllocSize();
   PoolSlab *PS = (PoolSlab*)SMem;
+  PS->Size = Size;
   char *PoolBody = (char*)(PS+1);
 
-  // If the Alignment is greater than the size of the NodeHeader, skip over some
-  // space so that the a "free pointer + sizeof(NodeHeader)" is always aligned
-  // for user data.
-  unsigned Alignment = Pool->Alignment;
-  if (Alignment > sizeof(NodeHeader<PoolTraits>)) {
-    PoolBody += Alignment-sizeof(NodeHeader<PoolTraits>);
-    Size -= Alignment-sizeof(NodeHeader<PoolTraits>);
-  }
+  // The free bins live at the start of the pool.  The memory may be a reused
+  // pool, so clear them.
+  Pool->FreeBins = (PoolFreeBins<PoolTraits>*)PoolBody;
+  memset(PoolBody, 0, BinsSize);
+  PoolBody += BinsSize;
+
+  // Skip over some space so that the a "free pointer + sizeof(NodeHeader)" is
+  // always aligned for user data.  The pool start is staggered, so this has to
+  // look at the actual address.
+  uintptr_t Alignment = Pool->Alignment;
+  PoolBody = (char*)(((uintptr_t)PoolBody + sizeof(NodeHeader<PoolTraits>) +
+                      Alignment-1) & ~(Alignment-1)) -
+             sizeof(NodeHeader<PoolTraits>);
+
+  // Make sure to add a marker at the end of the slab to prevent the coallescer
+  // from trying to merge off the end of the page.
+  FreedNodeHeader<PoolTraits> *End = getPtrCompEndMarker(Pool, PS, Size);
 
   // Add the body of the slab to the free list.
   FreedNodeHeader<PoolTraits> *SlabBody =(FreedNodeHeader<PoolTraits>*)PoolBody;
-  SlabBody->Header.Size = Size;
+  SlabBody->Header.Size = (char*)End - PoolBody - sizeof(NodeHeader<PoolTraits>);
   AddNodeToFreeList(Pool, SlabBody);
 
-  // Make sure to add a marker at the end of the slab to prevent the coallescer
-  // from trying to merge off the end of the page.
-  FreedNodeHeader<PoolTraits> *End =
-    (FreedNodeHeader<PoolTraits>*)(PoolBody + sizeof(NodeHeader<PoolTraits>) +
-                                   Size);
   End->Header.Size = ~0; // Looks like an allocated chunk
+  End->Next = PoolTraits::FNHPtrToIndex(SlabBody, Pool->Slabs);
   PS->Next = 0;
 }
 
+/// grow_for_ptrcomp - Make more of the address space reserved for a pointer
+/// compressed pool usable, so that an object of SizeHint bytes fits at its
+/// end.  The pool at least doubles, until the reservation runs out.
+template<typename PoolTraits>
+void PoolSlab<PoolTraits>::grow_for_ptrcomp(PoolTy<PoolTraits> *Pool,
+                                            unsigned SizeHint) {
+  PoolSlab *PS = Pool->Slabs;
+  unsigned long OldSize = PS->Size;
+  unsigned long MaxSize = PTRCOMP_RESERVE_SIZE+PTRCOMP_STAGGER_LIMIT -
+                          ((uintptr_t)PS & (PTRCOMP_STAGGER_LIMIT-1));
+
+  unsigned long Needed = (unsigned long)SizeHint + Pool->Alignment +
+                         2*sizeof(FreedNodeHeader<PoolTraits>);
+  unsigned long Grow = OldSize > Needed ? OldSize : Needed;
+  Grow = (Grow+PTRCOMP_COMMIT_SIZE-1) & ~(unsigned long)(PTRCOMP_COMMIT_SIZE-1);
+  if (Grow > MaxSize-OldSize)
+    Grow = MaxSize-OldSize;
+  if (Grow < Needed) {
+    fprintf(stderr, "Pool Overflow: pointer compressed pool %p is full\n",
+            (void*)Pool);
+    abort();
+  }
+
+  CommitSpaceWithMMAP((char*)PS+OldSize, Grow);
+  PS->Size = OldSize+Grow;
+
+  // The old end marker becomes the header of a free node that covers the new
+  // space.  It is not merged with a free node before it, but as the pool
+  // doubles each time, few such seams are made.
+  FreedNodeHeader<PoolTraits> *OldEnd = getPtrCompEndMarker(Pool, PS, OldSize);
+  FreedNodeHeader<PoolTraits> *End = getPtrCompEndMarker(Pool, PS, PS->Size);
+  typename PoolTraits::FreeNodeHeaderPtrTy SlabBodyIdx = OldEnd->Next;
+  OldEnd->Header.Size = (char*)End - (char*)OldEnd -
+                        sizeof(NodeHeader<PoolTraits>);
+  AddNodeToFreeList(Pool, OldEnd);
+
+  End->Header.Size = ~0; // Looks like an allocated chunk
+  End->Next = SlabBodyIdx;
+}
+
 
 template<typename PoolTraits>
 void PoolSlab<PoolTraits>::destroy() {
-  free(this);
+  getSlabProvider()->Release(this, Size);
+}
+
+// DiscardIfSlabEmpty - FNH is a free node that ends at End.  If it covers a
+// whole slab, let the slab provider give the pages back to the OS.
+template<typename PoolTraits>
+static inline void DiscardIfSlabEmpty(PoolTy<PoolTraits> *Pool,
+                                      FreedNodeHeader<PoolTraits> *FNH,
+                                      FreedNodeHeader<PoolTraits> *End) {
+  if (!PoolTraits::UseSlabProvider ||
+      End->Header.Size != (typename PoolTraits::NodeHeaderType)~0)
+    return;
+  if (PoolTraits::IndexToFNHPtr(End->Next, Pool->Slabs) != FNH ||
+      (char*)End - (char*)FNH < DISCARD_SLAB_SIZE)
+    return;
+
+  // Keep the free node header itself.
+  if (getSlabProvider()->Discard)
+    getSlabProvider()->Discard(FNH+1, End);
 }
 
 //===----------------------------------------------------------------------===//
 //
 //  Bump-pointer pool allocator library implementation
 //
+//  Threads carve chunks of BP_THREAD_CHUNK_SIZE bytes out of the shared slab
+//  under the pool lock, and bump through their own chunk without locking.
+//
 //===----------------------------------------------------------------------===//
 
+#if THREAD_CACHE_SIZE
+static void *ThreadBumpAllocate(PoolTy<NormalPoolTraits> *Pool,
+                                unsigned NumBytes);
+template<typename PoolTraits>
+static void DetachThreadCaches(PoolTy<PoolTraits> *Pool);
+#endif
+
 void poolinit_bp(PoolTy<NormalPoolTraits> *Pool, unsigned ObjAlignment) {
   DO_IF_PNP(memset(Pool, 0, sizeof(PoolTy<NormalPoolTraits>)));
   pthread_mutex_init(&Pool->pool_lock,NULL);
@@ -374,6 +1123,12 @@ void poolinit_bp(PoolTy<NormalPoolTraits> *Pool, unsigned ObjAlignment) {
   Pool->LargeArrays = 0;
   Pool->ObjFreeList = 0;     // This is our bump pointer.
   Pool->OtherFreeList = 0;   // This is our end pointer.
+  Pool->ThreadCaches = 0;    // The per-thread chunks.
+  Pool->InlineAllocSize = 0; // Compiled code must always call poolalloc_bp.
+  Pool->InlineHeader = 0;
+  Pool->LockFree = 0;
+  Pool->SingleThreaded = 0;
+  Pool->Stats = CreatePoolStats(__builtin_return_address(0), 0, "bp");
 
 #ifdef ENABLE_POOL_IDS
   unsigned PID;
@@ -386,23 +1141,10 @@ void poolinit_bp(PoolTy<NormalPoolTraits> *Pool, unsigned ObjAlignment) {
   DO_IF_PNP(InitPrintNumPools<NormalPoolTraits>());
 }
 
-void *poolalloc_bp(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes) {
-  DO_IF_FORCE_MALLOCFREE(return malloc(NumBytes));
-  assert(Pool && "Bump pointer pool does not support null PD!");
-  DO_IF_TRACE(fprintf(stderr, "[%d] poolalloc_bp(%d) -> ",
-                      getPoolNumber(Pool), NumBytes));
-  DO_IF_PNP(if (Pool->NumObjects == 0) ++PoolCounter);  // Track # pools.
-
-  pthread_mutex_lock(&Pool->pool_lock);
-
-  if (NumBytes >= LARGE_SLAB_SIZE)
-    goto LargeObject;
-
-  DO_IF_PNP(++Pool->NumObjects);
-  DO_IF_PNP(Pool->BytesAllocated += NumBytes);
-
-  if (NumBytes < 1) NumBytes = 1;
-
+// BumpAllocate - Allocate NumBytes from the shared bump pointer of Pool,
+// adding a slab when the current one is full.  The caller must hold the pool
+// lock.
+static void *BumpAllocate(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes) {
   uintptr_t Alignment;
   char *BumpPtr, *EndPtr;
   Alignment = Pool->Alignment-1;
@@ -414,17 +1156,47 @@ TryAgain:
   BumpPtr = (char*)(intptr_t((BumpPtr+Alignment)) & ~Alignment);
 
   if (BumpPtr + NumBytes < EndPtr) {
-    void *Result = BumpPtr;
     // Update bump ptr.
     Pool->ObjFreeList = (FreedNodeHeader<NormalPoolTraits>*)(BumpPtr+NumBytes);
-    DO_IF_TRACE(fprintf(stderr, "%p\n", Result));
-    pthread_mutex_unlock(&Pool->pool_lock);
-    return Result;
+    return BumpPtr;
   }
   
   BumpPtr = (char*)PoolSlab<NormalPoolTraits>::create_for_bp(Pool);
   EndPtr  = (char*)Pool->OtherFreeList; // Get our updated end pointer.  
   goto TryAgain;
+}
+
+static inline void *poolalloc_bp_nostats(PoolTy<NormalPoolTraits> *Pool,
+                                         unsigned NumBytes) {
+  assert(Pool && "Bump pointer pool does not support null PD!");
+  DO_IF_TRACE(fprintf(stderr, "[%d] poolalloc_bp(%d) -> ",
+                      getPoolNumber(Pool), NumBytes));
+  DO_IF_PNP(if (Pool->NumObjects == 0) ++PoolCounter);  // Track # pools.
+
+  if (NumBytes >= LARGE_SLAB_SIZE) {
+    LockPool(Pool);
+    goto LargeObject;
+  }
+
+  DO_IF_PNP(++Pool->NumObjects);
+  DO_IF_PNP(Pool->BytesAllocated += NumBytes);
+
+  if (NumBytes < 1) NumBytes = 1;
+
+  void *Result;
+#if THREAD_CACHE_SIZE
+  if (NumBytes <= BP_THREAD_CHUNK_SIZE/4) {
+    Result = ThreadBumpAllocate(Pool, NumBytes);
+    DO_IF_TRACE(fprintf(stderr, "%p\n", Result));
+    return Result;
+  }
+#endif
+
+  LockPool(Pool);
+  Result = BumpAllocate(Pool, NumBytes);
+  DO_IF_TRACE(fprintf(stderr, "%p\n", Result));
+  pthread_mutex_unlock(&Pool->pool_lock);
+  return Result;
 
 LargeObject:
   // Otherwise, the allocation is a large array.  Since we're not going to be
@@ -439,6 +1211,17 @@ LargeObject:
   return LAH+1;
 }
 
+void *poolalloc_bp(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes) {
+  DO_IF_FORCE_MALLOCFREE(return malloc(NumBytes));
+  if (__builtin_expect(Pool && Pool->Stats != 0, 0)) {
+    unsigned long long Start = StatsSampleStart();
+    void *Result = poolalloc_bp_nostats(Pool, NumBytes);
+    StatsAlloc(Pool->Stats, NumBytes, Start);
+    return Result;
+  }
+  return poolalloc_bp_nostats(Pool, NumBytes);
+}
+
 void pooldestroy_bp(PoolTy<NormalPoolTraits> *Pool) {
   assert(Pool && "Null pool pointer passed in to pooldestroy!\n");
 
@@ -449,6 +1232,10 @@ void pooldestroy_bp(PoolTy<NormalPoolTraits> *Pool) {
 #endif
   DO_IF_POOLDESTROY_STATS(PrintPoolStats(Pool));
 
+#if THREAD_CACHE_SIZE
+  DetachThreadCaches(Pool);
+#endif
+  if (Pool->Stats) DestroyPoolStats(Pool->Stats);
   pthread_mutex_destroy(&Pool->pool_lock);
 
   // Free all allocated slabs.
@@ -516,9 +1303,49 @@ static void poolinit_internal(PoolTy<PoolTraits> *Pool,
   DO_IF_PNP(InitPrintNumPools<PoolTraits>());
 }
 
+// EnableInlineFastPath - Let compiled code allocate and free objects of the
+// declared size itself, unless every allocation has to come through the
+// runtime to be counted or to go to malloc.  The inline code does not lock,
+// so this is only done for pools created with poolinit_st.
+static void EnableInlineFastPath(PoolTy<NormalPoolTraits> *Pool,
+                                 unsigned DeclaredSize) {
+  bool InlineFastPath = DeclaredSize != 0 && Pool->Stats == 0;
+  DO_IF_FORCE_MALLOCFREE(InlineFastPath = false);
+  if (InlineFastPath) {
+    Pool->InlineAllocSize = DeclaredSize;
+    Pool->InlineHeader = Pool->DeclaredSize|1;
+  }
+}
+
 void poolinit(PoolTy<NormalPoolTraits> *Pool,
               unsigned DeclaredSize, unsigned ObjAlignment) {
   poolinit_internal(Pool, DeclaredSize, ObjAlignment);
+  Pool->Stats = CreatePoolStats(__builtin_return_address(0),
+                                Pool->DeclaredSize, "normal");
+}
+
+void poolinit_lf(PoolTy<NormalPoolTraits> *Pool,
+                 unsigned DeclaredSize, unsigned ObjAlignment) {
+  poolinit_internal(Pool, DeclaredSize, ObjAlignment);
+  Pool->LockFree = Pool->DeclaredSize != 0;
+  Pool->Stats = CreatePoolStats(__builtin_return_address(0),
+                                Pool->DeclaredSize, "lockfree");
+}
+
+void poolinit_st(PoolTy<NormalPoolTraits> *Pool,
+                 unsigned DeclaredSize, unsigned ObjAlignment) {
+  poolinit_internal(Pool, DeclaredSize, ObjAlignment);
+  Pool->SingleThreaded = 1;
+  Pool->Stats = CreatePoolStats(__builtin_return_address(0),
+                                Pool->DeclaredSize, "st");
+  EnableInlineFastPath(Pool, DeclaredSize);
+}
+
+// poolprofile_name - Keep the statistics of Pool under Name.  The pool
+// allocator calls this after poolinit when it builds a program to profile the
+// pools of.
+void poolprofile_name(PoolTy<NormalPoolTraits> *Pool, const char *Name) {
+  if (Pool->Stats) RenamePoolStats(Pool->Stats, Name);
 }
 
 // pooldestroy - Release all memory allocated for a pool
@@ -534,6 +1361,10 @@ void pooldestroy(PoolTy<NormalPoolTraits> *Pool) {
   if(Pool->thread_refcount)
 	  return;
 
+#if THREAD_CACHE_SIZE
+  DetachThreadCaches(Pool);
+#endif
+  if (Pool->Stats) DestroyPoolStats(Pool->Stats);
   pthread_mutex_destroy(&Pool->pool_lock);
 
 #ifdef ENABLE_POOL_IDS
@@ -560,22 +1391,11 @@ void pooldestroy(PoolTy<NormalPoolTraits> *Pool) {
   }
 }
 
+// getAdjustedSize - Return the number of bytes that a request for NumBytes
+// actually occupies in the pool.
 template<typename PoolTraits>
-static void *poolalloc_internal(PoolTy<PoolTraits> *Pool, unsigned NumBytesA) {
-  DO_IF_TRACE(fprintf(stderr, "[%d] poolalloc%s(%d) -> ",
-                      getPoolNumber(Pool), PoolTraits::getSuffix(), NumBytesA));
-
-  unsigned NumBytes = NumBytesA;
-
-  // If a null pool descriptor is passed in, this is not a pool allocated data
-  // structure.  Hand off to the system malloc.
-  if (Pool == 0) {
-    void *Result = malloc(NumBytes);
-    DO_IF_TRACE(fprintf(stderr, "0x%X [malloc]\n", Result));
-                return Result;
-  }
-  DO_IF_PNP(if (Pool->NumObjects == 0) ++PoolCounter);  // Track # pools.
-
+static inline unsigned getAdjustedSize(PoolTy<PoolTraits> *Pool,
+                                       unsigned NumBytes) {
   // Objects must be at least 8 bytes to hold the FreedNodeHeader object when
   // they are freed.  This also handles allocations of 0 bytes.
   if (NumBytes < (sizeof(FreedNodeHeader<PoolTraits>) - 
@@ -588,9 +1408,76 @@ static void *poolalloc_internal(PoolTy<PoolTraits> *Pool, unsigned NumBytesA) {
   unsigned Alignment = Pool->Alignment;
   NumBytes = NumBytes+sizeof(FreedNodeHeader<PoolTraits>) + 
              (Alignment-1);      // Round up
-  NumBytes = (NumBytes & ~(Alignment-1)) - 
-             sizeof(FreedNodeHeader<PoolTraits>); // Truncate
+  return (NumBytes & ~(Alignment-1)) - 
+         sizeof(FreedNodeHeader<PoolTraits>); // Truncate
+}
 
+// AdjustedSize - getAdjustedSize worked out at compile time, for pools whose
+// alignment, as passed to poolinit, is Align.
+template<typename PoolTraits, unsigned Size, unsigned Align>
+struct AdjustedSize {
+  static const unsigned Alignment = Align < 4 ? __alignof(double) : Align;
+  static const unsigned MinSize = sizeof(FreedNodeHeader<PoolTraits>) -
+                                  sizeof(NodeHeader<PoolTraits>);
+  static const unsigned Value =
+    (((Size < MinSize ? MinSize : Size) + sizeof(FreedNodeHeader<PoolTraits>) +
+      (Alignment-1)) & ~(Alignment-1)) - sizeof(FreedNodeHeader<PoolTraits>);
+};
+
+template<typename PoolTraits>
+static void *poolalloc_slow(PoolTy<PoolTraits> *Pool, unsigned NumBytes);
+template<typename PoolTraits>
+static void poolfree_internal(PoolTy<PoolTraits> *Pool, void *Node);
+
+// CompareNodesDescending - qsort comparator that puts higher addresses first.
+static int CompareNodesDescending(const void *LHS, const void *RHS) {
+  char *L = *(char*const*)LHS, *R = *(char*const*)RHS;
+  return L < R ? 1 : (L > R ? -1 : 0);
+}
+
+// CoalesceObjFreeList - Pools created with poolinit_st push freed objects of
+// the declared size onto ObjFreeList without merging them with their
+// neighbours.  Before such a pool grows, give every node on the list back
+// through poolfree_internal, so that adjacent free nodes merge and empty slabs
+// are discarded.  poolfree_internal only merges a node with the free nodes
+// after it, so the nodes are freed from the highest address down.  Return
+// false if there was nothing to do.
+template<typename PoolTraits>
+static bool CoalesceObjFreeList(PoolTy<PoolTraits> *Pool) {
+  void *PoolBase = Pool->Slabs;
+  unsigned Num = 0;
+  for (typename PoolTraits::FreeNodeHeaderPtrTy I = Pool->ObjFreeList; I;
+       I = PoolTraits::IndexToFNHPtr(I, PoolBase)->Next)
+    ++Num;
+  if (Num == 0) return false;
+
+  FreedNodeHeader<PoolTraits> **Nodes =
+    (FreedNodeHeader<PoolTraits>**)malloc(Num*sizeof(*Nodes));
+  if (Nodes == 0) return false;
+
+  // Take every node off the list and mark it allocated, so that none of them
+  // is merged into another before its own turn comes.
+  for (unsigned i = 0; i != Num; ++i) {
+    FreedNodeHeader<PoolTraits> *FNH =
+      PoolTraits::IndexToFNHPtr(Pool->ObjFreeList, PoolBase);
+    UnlinkFreeNode(Pool, FNH);
+    DO_IF_PNP(CurHeapSize += FNH->Header.Size+sizeof(NodeHeader<PoolTraits>));
+    FNH->Header.Size |= 1;
+    Nodes[i] = FNH;
+  }
+
+  qsort(Nodes, Num, sizeof(*Nodes), CompareNodesDescending);
+  for (unsigned i = 0; i != Num; ++i)
+    poolfree_internal(Pool, &Nodes[i]->Header+1);
+  free(Nodes);
+  return true;
+}
+
+// poolalloc_adjusted - Allocate an object of NumBytes, as returned by
+// getAdjustedSize, from a non-null pool.
+template<typename PoolTraits>
+static inline void *poolalloc_adjusted(PoolTy<PoolTraits> *Pool,
+                                       unsigned NumBytes) {
   DO_IF_PNP(CurHeapSize += (NumBytes + sizeof(NodeHeader<PoolTraits>)));
   DO_IF_PNP(if (CurHeapSize > MaxHeapSize) MaxHeapSize = CurHeapSize);
 
@@ -611,80 +1498,40 @@ static void *poolalloc_internal(PoolTy<PoolTraits> *Pool, unsigned NumBytesA) {
     return &Node->Header+1;
   }
 
+  return poolalloc_slow(Pool, NumBytes);
+}
+
+// poolalloc_slow - Allocate NumBytes when the declared-size free list cannot
+// be used.
+template<typename PoolTraits>
+static void *poolalloc_slow(PoolTy<PoolTraits> *Pool, unsigned NumBytes) {
+  bool Coalesced = false;
   if (PoolTraits::UseLargeArrayObjects &&
       NumBytes >= LARGE_SLAB_SIZE-sizeof(PoolSlab<PoolTraits>) - 
       sizeof(NodeHeader<PoolTraits>))
     goto LargeObject;
 
-  // Fast path.  In the common case, we can allocate a portion of the node at
-  // the front of the free list.
   do {
-    void *PoolBase = Pool->Slabs;
-    FreedNodeHeader<PoolTraits> *FirstNode =
-      PoolTraits::IndexToFNHPtr(Pool->OtherFreeList, PoolBase);
-    if (FirstNode) {
-      unsigned FirstNodeSize = FirstNode->Header.Size;
-      if (FirstNodeSize >= NumBytes) {
-        if (FirstNodeSize >= 2*NumBytes+sizeof(NodeHeader<PoolTraits>)) {
-          // Put the remainder back on the list...
-          FreedNodeHeader<PoolTraits> *NextNodes =
-            (FreedNodeHeader<PoolTraits>*)((char*)FirstNode +
-                                   sizeof(NodeHeader<PoolTraits>) +NumBytes);
-          
-          // Remove from list
-          UnlinkFreeNode(Pool, FirstNode);
-          
-          NextNodes->Header.Size = FirstNodeSize-NumBytes -
-                                   sizeof(NodeHeader<PoolTraits>);
-          AddNodeToFreeList(Pool, NextNodes);
-          
-        } else {
-          UnlinkFreeNode(Pool, FirstNode);
-          NumBytes = FirstNodeSize;
-        }
-        FirstNode->Header.Size = NumBytes|1;   // Mark as allocated
-        DO_IF_TRACE(fprintf(stderr, "0x%X\n", &FirstNode->Header+1));
-        return &FirstNode->Header+1;
-      }
-
-      // Perform a search of the free list, taking the front of the first free
-      // chunk that is big enough.
-      typename PoolTraits::FreeNodeHeaderPtrTy *FN = &Pool->OtherFreeList;
-      FreedNodeHeader<PoolTraits> *FNN = FirstNode;
-      
-      // Search the list for the first-fit.
-      while (FNN && FNN->Header.Size < NumBytes) {
-        // Advance FN to point to the Next field of FNN.
-        FN = &FNN->Next;
-
-        // Advance FNN to point to whatever the next node points to (null or the
-        // next node in the free list).
-        FNN = PoolTraits::IndexToFNHPtr(*FN, PoolBase);
-      }
-      
-      if (FNN) {
-        // We found a slab big enough.  If it's a perfect fit, just unlink
-        // from the free list, otherwise, slice a little bit off and adjust
-        // the free list.
-        if (FNN->Header.Size > 2*NumBytes+sizeof(NodeHeader<PoolTraits>)) {
-          UnlinkFreeNode(Pool, FNN);
-          
-          // Put the remainder back on the list...
-          FreedNodeHeader<PoolTraits> *NextNodes =
-            (FreedNodeHeader<PoolTraits>*)((char*)FNN +
-                                           sizeof(NodeHeader<PoolTraits>) +
-                                           NumBytes);
-          NextNodes->Header.Size = FNN->Header.Size-NumBytes -
-            sizeof(NodeHeader<PoolTraits>);
-          AddNodeToFreeList(Pool, NextNodes);
-        } else {
-          UnlinkFreeNode(Pool, FNN);
-          NumBytes = FNN->Header.Size;
-        }
-        FNN->Header.Size = NumBytes|1;   // Mark as allocated
-        DO_IF_TRACE(fprintf(stderr, "0x%X\n", &FNN->Header+1));
-        return &FNN->Header+1;
+    if (FreedNodeHeader<PoolTraits> *FNN = FindFreeNode(Pool, NumBytes)) {
+      // We found a node big enough.  If the rest of it can hold a free node,
+      // split it off and put it back in the bins, otherwise hand out the
+      // whole node.
+      UnlinkFreeNode(Pool, FNN);
+      unsigned FNNSize = FNN->Header.Size;
+      if (FNNSize >= NumBytes+sizeof(FreedNodeHeader<PoolTraits>)) {
+        FreedNodeHeader<PoolTraits> *NextNodes =
+          (FreedNodeHeader<PoolTraits>*)((char*)FNN +
+                                         sizeof(NodeHeader<PoolTraits>) +
+                                         NumBytes);
+        NextNodes->Header.Size = FNNSize-NumBytes -
+                                 sizeof(NodeHeader<PoolTraits>);
+        AddNodeToFreeList(Pool, NextNodes);
+      } else {
+        NumBytes = FNNSize;
       }
+      FNN->Header.Size = NumBytes|1;   // Mark as allocated
+      DO_IF_TRACE(fprintf(stderr, "0x%X\n", &FNN->Header+1));
+      return &FNN->Header+1;
     }
 
     // If we are not allowed to grow this pool, don't.
@@ -694,6 +1541,14 @@ static void *poolalloc_internal(PoolTy<PoolTraits> *Pool, unsigned NumBytesA) {
       return 0;
     }
 
+    // A single-threaded pool may have unmerged neighbours on ObjFreeList that
+    // together are big enough.  Merge them once before growing.
+    if (Pool->SingleThreaded && !Coalesced) {
+      Coalesced = true;
+      if (CoalesceObjFreeList(Pool))
+        continue;
+    }
+
     // Oops, we didn't find anything on the free list big enough!  Allocate
     // another slab and try again.
     PoolSlab<PoolTraits>::create(Pool, NumBytes);
@@ -711,6 +1566,99 @@ LargeObject:
   return LAH+1;
 }
 
+template<typename PoolTraits>
+static void *poolalloc_internal(PoolTy<PoolTraits> *Pool, unsigned NumBytesA) {
+  DO_IF_TRACE(fprintf(stderr, "[%d] poolalloc%s(%d) -> ",
+                      getPoolNumber(Pool), PoolTraits::getSuffix(), NumBytesA));
+
+  // If a null pool descriptor is passed in, this is not a pool allocated data
+  // structure.  Hand off to the system malloc.
+  if (Pool == 0) {
+    void *Result = malloc(NumBytesA);
+    DO_IF_TRACE(fprintf(stderr, "0x%X [malloc]\n", Result));
+                return Result;
+  }
+  DO_IF_PNP(if (Pool->NumObjects == 0) ++PoolCounter);  // Track # pools.
+
+  return poolalloc_adjusted(Pool, getAdjustedSize(Pool, NumBytesA));
+}
+
+// poolalloc_n_internal - Allocate Count objects of NumBytes each into Out.
+// Objects on the declared-size free list are used first.  The rest are carved
+// back to back out of free nodes, preferring one that holds the whole batch.
+template<typename PoolTraits>
+static void poolalloc_n_internal(PoolTy<PoolTraits> *Pool, unsigned NumBytes,
+                                 unsigned Count, void **Out) {
+  unsigned Size = Pool ? getAdjustedSize(Pool, NumBytes) : 0;
+  if (Pool == 0 || (PoolTraits::UseLargeArrayObjects &&
+                    Size >= LARGE_SLAB_SIZE-sizeof(PoolSlab<PoolTraits>) -
+                            sizeof(NodeHeader<PoolTraits>))) {
+    for (unsigned i = 0; i != Count; ++i)
+      Out[i] = poolalloc_internal(Pool, NumBytes);
+    return;
+  }
+
+  while (Count && Size == Pool->DeclaredSize && Pool->ObjFreeList) {
+    *Out++ = poolalloc_internal(Pool, NumBytes);
+    --Count;
+  }
+
+  DO_IF_PNP(if (Pool->NumObjects == 0) ++PoolCounter);  // Track # pools.
+  DO_IF_PNP(CurHeapSize += Count*(Size + sizeof(NodeHeader<PoolTraits>)));
+  DO_IF_PNP(if (CurHeapSize > MaxHeapSize) MaxHeapSize = CurHeapSize);
+  DO_IF_PNP(Pool->NumObjects += Count);
+  DO_IF_PNP(Pool->BytesAllocated += Count*Size);
+
+  unsigned Stride = Size+sizeof(NodeHeader<PoolTraits>);
+  bool Coalesced = false;
+  while (Count) {
+    unsigned Chunk = Count < POOLALLOC_N_CHUNK ? Count : POOLALLOC_N_CHUNK;
+    FreedNodeHeader<PoolTraits> *FNN =
+      FindFreeNode(Pool, Chunk*Stride-sizeof(NodeHeader<PoolTraits>));
+    if (FNN == 0)
+      FNN = FindFreeNode(Pool, Size);
+    if (FNN == 0) {
+      // If we are not allowed to grow this pool, don't.
+      if (!PoolTraits::CanGrowPool) {
+        DO_IF_TRACE(fprintf(stderr, "Pool Overflow, not growable\n"));
+        abort();
+      }
+      if (Pool->SingleThreaded && !Coalesced) {
+        Coalesced = true;
+        if (CoalesceObjFreeList(Pool))
+          continue;
+      }
+      PoolSlab<PoolTraits>::create(Pool, Size);
+      continue;
+    }
+
+    // Hand out objects from the front of the node.  If what is left over
+    // cannot hold a free node, it goes with the last object.
+    UnlinkFreeNode(Pool, FNN);
+    char *Cur = (char*)FNN;
+    unsigned Left = FNN->Header.Size+sizeof(NodeHeader<PoolTraits>);
+    while (Count && Left >= Stride) {
+      FreedNodeHeader<PoolTraits> *Node = (FreedNodeHeader<PoolTraits>*)Cur;
+      if (Left-Stride < sizeof(FreedNodeHeader<PoolTraits>)) {
+        Node->Header.Size = (Left-sizeof(NodeHeader<PoolTraits>))|1;
+        Left = 0;
+      } else {
+        Node->Header.Size = Size|1;   // Mark as allocated
+        Left -= Stride;
+        Cur += Stride;
+      }
+      *Out++ = &Node->Header+1;
+      --Count;
+    }
+
+    if (Left) {
+      FreedNodeHeader<PoolTraits> *Rest = (FreedNodeHeader<PoolTraits>*)Cur;
+      Rest->Header.Size = Left-sizeof(NodeHeader<PoolTraits>);
+      AddNodeToFreeList(Pool, Rest);
+    }
+  }
+}
+
 template<typename PoolTraits>
 static void poolfree_internal(PoolTy<PoolTraits> *Pool, void *Node) {
   if (Node == 0) return;
@@ -764,6 +1712,7 @@ static void poolfree_internal(PoolTy<PoolTraits> *Pool, void *Node) {
       UnlinkFreeNode(Pool, ObjFNH);
       ObjFNH->Header.Size += Size+sizeof(NodeHeader<PoolTraits>);
       AddNodeToFreeList(Pool, ObjFNH);
+      DiscardIfSlabEmpty(Pool, ObjFNH, NextFNH);
       return;
     }
   }
@@ -775,14 +1724,19 @@ static void poolfree_internal(PoolTy<PoolTraits> *Pool, void *Node) {
 
     if ((char*)OFNH + sizeof(NodeHeader<PoolTraits>) +
         OFNH->Header.Size == (char*)FNH) {
-      // Merge this with a node that is already on the object size free list.
+      // Merge this with the node most recently put into the bins.  It grows,
+      // so it has to move to the bin for its new size.
+      UnlinkFreeNode(Pool, OFNH);
       OFNH->Header.Size += Size+sizeof(NodeHeader<PoolTraits>);
+      AddNodeToFreeList(Pool, OFNH);
+      DiscardIfSlabEmpty(Pool, OFNH, NextFNH);
       return;
     }
   }
 
   FNH->Header.Size = Size;
   AddNodeToFreeList(Pool, FNH);
+  DiscardIfSlabEmpty(Pool, FNH, NextFNH);
   return;
 
 LargeArrayCase:
@@ -821,14 +1775,53 @@ static void *poolrealloc_internal(PoolTy<PoolTraits> *Pool, void *Node,
   assert((FNH->Header.Size & 1) && "Node not allocated!");
   unsigned Size = FNH->Header.Size & ~1;
   if (Size != ~1U) {
-    // FIXME: This is obviously much worse than it could be.  In particular, we
-    // never try to expand something in a pool.  This might hurt some programs!
+    unsigned NewSize = getAdjustedSize(Pool, NumBytes);
+
+    // If the object is growing, see if the free nodes immediately after it
+    // (the ones poolfree_internal would coalesce with) make enough room.
+    if (NewSize > Size) {
+      unsigned Avail = Size;
+      FreedNodeHeader<PoolTraits> *NextFNH =
+        (FreedNodeHeader<PoolTraits>*)((char*)Node+Avail);
+      while (Avail < NewSize && (NextFNH->Header.Size & 1) == 0) {
+        Avail += sizeof(NodeHeader<PoolTraits>)+NextFNH->Header.Size;
+        NextFNH = (FreedNodeHeader<PoolTraits>*)((char*)Node+Avail);
+      }
+
+      if (Avail >= NewSize) {
+        while (Size != Avail) {
+          NextFNH = (FreedNodeHeader<PoolTraits>*)((char*)Node+Size);
+          UnlinkFreeNode(Pool, NextFNH);
+          Size += sizeof(NodeHeader<PoolTraits>)+NextFNH->Header.Size;
+        }
+        FNH->Header.Size = Size|1;
+      }
+    }
+
+    if (NewSize <= Size) {
+      // Resize in place.  If the tail of the object can hold a free node,
+      // split it off and free it.
+      if (Size >= NewSize+sizeof(FreedNodeHeader<PoolTraits>)) {
+        FreedNodeHeader<PoolTraits> *Tail =
+          (FreedNodeHeader<PoolTraits>*)((char*)Node+NewSize);
+        Tail->Header.Size = (Size-NewSize-sizeof(NodeHeader<PoolTraits>))|1;
+        FNH->Header.Size = NewSize|1;
+        poolfree_internal(Pool, &Tail->Header+1);
+      }
+      ++Pool->NumReallocsInPlace;
+      if (Pool->Stats) ++Pool->Stats->C.ReallocsInPlace;
+      DO_IF_TRACE(fprintf(stderr, "0x%X (in place)\n", Node));
+      return Node;
+    }
+
     void *New = poolalloc_internal(Pool, NumBytes);
     assert(New != 0 && "Our poolalloc doesn't ever return null for failure!");
     
     // Copy the min of the new and old sizes over.
     memcpy(New, Node, Size < NumBytes ? Size : NumBytes);
     poolfree_internal(Pool, Node);
+    ++Pool->NumReallocsMoved;
+    if (Pool->Stats) ++Pool->Stats->C.ReallocsMoved;
     DO_IF_TRACE(fprintf(stderr, "0x%X (moved)\n", New));
     return New;
   }
@@ -874,15 +1867,408 @@ unsigned poolobjsize(PoolTy<NormalPoolTraits> *Pool, void *Node) {
   return LAH->Size;
 }
 
+//===----------------------------------------------------------------------===//
+//
+//  Per-thread object caches
+//
+//  Each thread keeps a small stack of free objects of the declared size for
+//  the last few pools it used.  poolalloc and poolfree serve these objects
+//  without taking the pool lock, and only lock the pool to refill or drain the
+//  stack in batches.  Cached objects are still marked allocated in their
+//  headers, so the coalescer in poolfree_internal leaves them alone.
+//
+//  For bump-pointer pools the cache instead holds the thread's current chunk
+//  of the pool's slab.
+//
+//===----------------------------------------------------------------------===//
 
-void *poolalloc(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes) {
-  DO_IF_FORCE_MALLOCFREE(return malloc(NumBytes));
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
+#if THREAD_CACHE_SIZE
+template<typename PoolTraits>
+struct PoolThreadCache {
+  // Pool - The pool that the cached objects belong to, or null if unbound.
+  PoolTy<PoolTraits> *Pool;
+
+  // Next, Prev - The list of caches bound to Pool.
+  PoolThreadCache *Next, **Prev;
+
+  // Objs - A stack of NumObjs free objects of Pool's declared size.
+  unsigned NumObjs;
+  void *Objs[THREAD_CACHE_SIZE];
+
+  // BumpPtr, BumpEnd - The unused part of this thread's chunk of a
+  // bump-pointer pool.
+  char *BumpPtr, *BumpEnd;
+
+  // getPool, setPool - Access Pool.  DetachThreadCaches clears it from another
+  // thread while the owner checks it in getThreadCache without taking
+  // ThreadCacheLock, so it is loaded and stored atomically.  Relaxed ordering
+  // is enough, as the rest of the cache only changes hands under the lock.
+  PoolTy<PoolTraits> *getPool() const {
+    return __atomic_load_n(&Pool, __ATOMIC_RELAXED);
+  }
+  void setPool(PoolTy<PoolTraits> *P) {
+    __atomic_store_n(&Pool, P, __ATOMIC_RELAXED);
+  }
+};
+
+// ThreadCacheLock - Protects the binding of caches to pools, and the
+// PoolTy::ThreadCaches lists.  It is always acquired before any pool_lock.
+static pthread_mutex_t ThreadCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// ThreadCacheSlots - Normal and pointer compressed pools have separate sets of
+// cache slots.
+template<typename PoolTraits>
+struct ThreadCacheSlots {
+  // Caches - The THREAD_CACHE_POOLS cache slots of the current thread.
+  static __thread PoolThreadCache<PoolTraits> *Caches;
+
+  // Key - Used to flush the caches of a thread when it exits.
+  static pthread_key_t Key;
+  static pthread_once_t KeyOnce;
+};
+
+template<typename PoolTraits>
+__thread PoolThreadCache<PoolTraits> *ThreadCacheSlots<PoolTraits>::Caches = 0;
+template<typename PoolTraits>
+pthread_key_t ThreadCacheSlots<PoolTraits>::Key;
+template<typename PoolTraits>
+pthread_once_t ThreadCacheSlots<PoolTraits>::KeyOnce = PTHREAD_ONCE_INIT;
+
+// DrainThreadCache - Give the oldest Num cached objects back to the pool.  The
+// caller must hold the pool lock.
+template<typename PoolTraits>
+static void DrainThreadCache(PoolThreadCache<PoolTraits> *TC, unsigned Num) {
+  for (unsigned i = 0; i != Num; ++i)
+    poolfree_internal(TC->getPool(), TC->Objs[i]);
+  TC->NumObjs -= Num;
+  memmove(TC->Objs, TC->Objs+Num, TC->NumObjs*sizeof(void*));
+}
+
+// UnbindThreadCache - Give all cached objects back to their pool and unlink
+// the cache from the pool.  The caller must hold ThreadCacheLock.
+template<typename PoolTraits>
+static void UnbindThreadCache(PoolThreadCache<PoolTraits> *TC) {
+  PoolTy<PoolTraits> *Pool = TC->getPool();
+  if (Pool == 0) return;
+
+  LockPool(Pool);
+  DrainThreadCache(TC, TC->NumObjs);
+  pthread_mutex_unlock(&Pool->pool_lock);
+
+  *TC->Prev = TC->Next;
+  if (TC->Next)
+    TC->Next->Prev = TC->Prev;
+  TC->setPool(0);
+}
+
+template<typename PoolTraits>
+static void ThreadCacheDestructor(void *Caches) {
+  pthread_mutex_lock(&ThreadCacheLock);
+  for (unsigned i = 0; i != THREAD_CACHE_POOLS; ++i)
+    UnbindThreadCache((PoolThreadCache<PoolTraits>*)Caches + i);
+  pthread_mutex_unlock(&ThreadCacheLock);
+  free(Caches);
+}
+
+template<typename PoolTraits>
+static void CreateThreadCacheKey() {
+  pthread_key_create(&ThreadCacheSlots<PoolTraits>::Key,
+                     ThreadCacheDestructor<PoolTraits>);
+}
+
+// ThreadCacheSet - Return the first of the pair of cache slots Pool may use.
+// Pool descriptors are often a power of two bytes apart, so the low address
+// bits are folded together with the bits above them.
+static inline unsigned ThreadCacheSet(void *Pool) {
+  uintptr_t P = (uintptr_t)Pool;
+  return ((P >> 4) ^ (P >> 8) ^ (P >> 12)) & (THREAD_CACHE_POOLS-2);
+}
+
+// BindThreadCache - Flush the slot TC of the current thread and give it to
+// Pool.  This is kept out of line so that getThreadCache stays small.
+template<typename PoolTraits>
+static __attribute__((noinline)) PoolThreadCache<PoolTraits> *
+BindThreadCache(PoolThreadCache<PoolTraits> *TC, PoolTy<PoolTraits> *Pool) {
+  pthread_mutex_lock(&ThreadCacheLock);
+  UnbindThreadCache(TC);
+  TC->setPool(Pool);
+  TC->NumObjs = 0;
+  TC->BumpPtr = TC->BumpEnd = 0;
+  TC->Prev = &Pool->ThreadCaches;
+  TC->Next = Pool->ThreadCaches;
+  if (TC->Next)
+    TC->Next->Prev = &TC->Next;
+  Pool->ThreadCaches = TC;
+  pthread_mutex_unlock(&ThreadCacheLock);
+  return TC;
+}
+
+// getThreadCache - Return the current thread's cache for Pool.  A pool that
+// is in neither slot of its set takes an unused one if there is one, and
+// otherwise evicts the pool in the first.
+template<typename PoolTraits>
+static inline PoolThreadCache<PoolTraits> *
+getThreadCache(PoolTy<PoolTraits> *Pool) {
+  typedef ThreadCacheSlots<PoolTraits> Slots;
+  PoolThreadCache<PoolTraits> *Caches = Slots::Caches;
+  if (__builtin_expect(Caches == 0, 0)) {
+    pthread_once(&Slots::KeyOnce, CreateThreadCacheKey<PoolTraits>);
+    Caches = (PoolThreadCache<PoolTraits>*)
+      calloc(THREAD_CACHE_POOLS, sizeof(PoolThreadCache<PoolTraits>));
+    pthread_setspecific(Slots::Key, Caches);
+    Slots::Caches = Caches;
+  }
+
+  PoolThreadCache<PoolTraits> *TC = &Caches[ThreadCacheSet(Pool)];
+  PoolTy<PoolTraits> *First = TC->getPool();
+  if (__builtin_expect(First == Pool, 1))
+    return TC;
+  PoolTy<PoolTraits> *Second = TC[1].getPool();
+  if (Second == Pool)
+    return TC + 1;
+  return BindThreadCache(First && !Second ? TC + 1 : TC, Pool);
+}
+
+// DetachThreadCaches - Forget all objects cached for Pool.  This is only used
+// by the pool destroy functions, where they are released with the slabs.
+template<typename PoolTraits>
+static void DetachThreadCaches(PoolTy<PoolTraits> *Pool) {
+  pthread_mutex_lock(&ThreadCacheLock);
+  for (PoolThreadCache<PoolTraits> *TC = Pool->ThreadCaches; TC; TC = TC->Next) {
+    TC->setPool(0);
+    TC->NumObjs = 0;
+    TC->BumpPtr = TC->BumpEnd = 0;
+  }
+  Pool->ThreadCaches = 0;
+  pthread_mutex_unlock(&ThreadCacheLock);
+}
+
+// isThreadCacheSize, isThreadCacheObject - Return true if an allocation of
+// NumBytes, or the free of Node, can go through the thread cache of Pool.
+// These run without the pool lock, while PoolSlab::create may still set the
+// DeclaredSize of a pool created with a size of zero, so it is read
+// atomically.
+template<typename PoolTraits>
+static inline bool isThreadCacheSize(PoolTy<PoolTraits> *Pool,
+                                     unsigned NumBytes) {
+  if (!Pool) return false;
+  unsigned DeclaredSize = __atomic_load_n(&Pool->DeclaredSize,
+                                          __ATOMIC_RELAXED);
+  return DeclaredSize && getAdjustedSize(Pool, NumBytes) == DeclaredSize;
+}
+
+template<typename PoolTraits>
+static inline bool isThreadCacheObject(PoolTy<PoolTraits> *Pool, void *Node) {
+  return Pool && Node &&
+         (((NodeHeader<PoolTraits>*)Node-1)->Size & ~1UL) ==
+         __atomic_load_n(&Pool->DeclaredSize, __ATOMIC_RELAXED);
+}
+
+// ThreadCacheAlloc - Allocate a declared-size object from the current thread's
+// cache for Pool, refilling it under the pool lock when it is empty.
+template<typename PoolTraits>
+static inline void *ThreadCacheAlloc(PoolTy<PoolTraits> *Pool,
+                                     unsigned NumBytes) {
+  PoolThreadCache<PoolTraits> *TC = getThreadCache(Pool);
+  if (__builtin_expect(TC->NumObjs == 0, 0)) {
+    // Fill the cache backwards, so that objects are handed out in the order
+    // the pool allocated them.  Freeing them in that order again lets
+    // poolfree coalesce them back into whole slabs.
+    LockPool(Pool);
+    for (unsigned i = THREAD_CACHE_SIZE/2; i != 0; --i)
+      TC->Objs[i-1] = poolalloc_internal(Pool, NumBytes);
+    TC->NumObjs = THREAD_CACHE_SIZE/2;
+    pthread_mutex_unlock(&Pool->pool_lock);
+  }
+  return TC->Objs[--TC->NumObjs];
+}
+
+// ThreadCacheFree - Put the declared-size object Node in the current thread's
+// cache for Pool, draining half of it under the pool lock when it is full.
+template<typename PoolTraits>
+static inline void ThreadCacheFree(PoolTy<PoolTraits> *Pool, void *Node) {
+  PoolThreadCache<PoolTraits> *TC = getThreadCache(Pool);
+  if (__builtin_expect(TC->NumObjs == THREAD_CACHE_SIZE, 0)) {
+    LockPool(Pool);
+    DrainThreadCache(TC, THREAD_CACHE_SIZE/2);
+    pthread_mutex_unlock(&Pool->pool_lock);
+  }
+  TC->Objs[TC->NumObjs++] = Node;
+}
+
+// ThreadBumpAllocate - Allocate NumBytes from the current thread's chunk of the
+// bump-pointer pool Pool, taking a new chunk from the slab when it runs out.
+// What is left of the old chunk is simply abandoned.
+static void *ThreadBumpAllocate(PoolTy<NormalPoolTraits> *Pool,
+                                unsigned NumBytes) {
+  PoolThreadCache<NormalPoolTraits> *TC = getThreadCache(Pool);
+  uintptr_t Alignment = Pool->Alignment-1;
+  char *BumpPtr = (char*)(intptr_t((TC->BumpPtr+Alignment)) & ~Alignment);
+
+  if (__builtin_expect(BumpPtr + NumBytes > TC->BumpEnd, 0)) {
+    LockPool(Pool);
+    BumpPtr = (char*)BumpAllocate(Pool, BP_THREAD_CHUNK_SIZE);
+    pthread_mutex_unlock(&Pool->pool_lock);
+    TC->BumpEnd = BumpPtr+BP_THREAD_CHUNK_SIZE;
+  }
+
+  TC->BumpPtr = BumpPtr+NumBytes;
+  return BumpPtr;
+}
+#endif
+
+//===----------------------------------------------------------------------===//
+//
+//  Lock-free declared-size free list
+//
+//  Pools created with poolinit_lf keep freed objects of the declared size on
+//  a singly linked LIFO whose head is updated with compare-and-swap.  Objects
+//  on this list keep the allocated bit in their header, so the locked
+//  allocator never coalesces or unlinks them.  Slabs are only released by
+//  pooldestroy, so reading the Next field of a node that was just popped by
+//  another thread is harmless; the tag makes the following CAS fail.
+//
+//===----------------------------------------------------------------------===//
+
+typedef FreedNodeHeader<NormalPoolTraits> LockFreeNode;
+
+// On 64-bit hosts user space addresses fit in 48 bits, leaving 16 bits for the
+// tag.  32-bit hosts use a double-word CAS with a 32-bit tag.
+#if __SIZEOF_POINTER__ == 8
+#define LOCK_FREE_PTR_BITS 48
+#else
+#define LOCK_FREE_PTR_BITS 32
+#endif
+
+static inline void *getLockFreePtr(unsigned long long Head) {
+  return (void*)(uintptr_t)
+         (Head & ((1ULL << LOCK_FREE_PTR_BITS)-1));
+}
+
+// makeLockFreeHead - Return a new head pointing to Node, with the tag of Old
+// incremented.
+static inline unsigned long long
+makeLockFreeHead(void *Node, unsigned long long Old) {
+  return (unsigned long long)(uintptr_t)Node |
+         (((Old >> LOCK_FREE_PTR_BITS)+1) << LOCK_FREE_PTR_BITS);
+}
+
+// getLockFreeNext - Read the Next field of Node, which may have been popped and
+// reused by another thread since the head was read.  The value is then
+// garbage, but the following CAS fails, so the read is not instrumented.
+static inline __attribute__((no_sanitize_thread)) LockFreeNode *
+getLockFreeNext(LockFreeNode *Node) {
+  return *(LockFreeNode *volatile*)&Node->Next;
+}
+
+// LockFreePush - Push the chain of nodes First..Last, linked through their
+// Next fields, onto the lock-free list of Pool.
+static inline void LockFreePush(PoolTy<NormalPoolTraits> *Pool,
+                                LockFreeNode *First, LockFreeNode *Last) {
+  unsigned long long Old =
+    __atomic_load_n(&Pool->LockFreeObjList, __ATOMIC_RELAXED);
+  while (1) {
+    Last->Next = (LockFreeNode*)getLockFreePtr(Old);
+    unsigned long long Prev =
+      __sync_val_compare_and_swap(&Pool->LockFreeObjList, Old,
+                                  makeLockFreeHead(First, Old));
+    if (Prev == Old) return;
+    Old = Prev;
+  }
+}
+
+// LockFreePop - Pop a node off the lock-free list of Pool, or return null if
+// the list is empty.
+static inline LockFreeNode *LockFreePop(PoolTy<NormalPoolTraits> *Pool) {
+  unsigned long long Old =
+    __atomic_load_n(&Pool->LockFreeObjList, __ATOMIC_RELAXED);
+  while (1) {
+    LockFreeNode *Node = (LockFreeNode*)getLockFreePtr(Old);
+    if (Node == 0) return 0;
+    unsigned long long Prev =
+      __sync_val_compare_and_swap(&Pool->LockFreeObjList, Old,
+                                  makeLockFreeHead(getLockFreeNext(Node), Old));
+    if (Prev == Old) return Node;
+    Old = Prev;
+  }
+}
+
+// LockFreeRefill - The lock-free list is empty: allocate a batch of objects
+// under the lock, return one of them and push the rest onto the list.
+static void *LockFreeRefill(PoolTy<NormalPoolTraits> *Pool,
+                            unsigned NumBytes) {
+  LockFreeNode *First = 0, *Last = 0;
+  LockPool(Pool);
+  void *Result = poolalloc_internal(Pool, NumBytes);
+  for (unsigned i = 1; i != LOCK_FREE_BATCH; ++i) {
+    LockFreeNode *Node = (LockFreeNode*)
+      ((char*)poolalloc_internal(Pool, NumBytes) -
+       sizeof(NodeHeader<NormalPoolTraits>));
+    Node->Next = First;
+    if (Last == 0) Last = Node;
+    First = Node;
+  }
+  pthread_mutex_unlock(&Pool->pool_lock);
+
+  if (First)
+    LockFreePush(Pool, First, Last);
+  return Result;
+}
+
+// SingleThreadedFree - Free Node in a pool created with poolinit_st.  Such
+// pools have no thread caches, so objects of the declared size go straight
+// back on the object free list without being coalesced, which is what the
+// thread caches do for shared pools.  poolalloc_slow merges them before the
+// pool grows.
+static inline void SingleThreadedFree(PoolTy<NormalPoolTraits> *Pool,
+                                      void *Node) {
+  if (Node) {
+    FreedNodeHeader<NormalPoolTraits> *FNH = (FreedNodeHeader<NormalPoolTraits>*)
+      ((char*)Node - sizeof(NodeHeader<NormalPoolTraits>));
+    if ((FNH->Header.Size & ~1UL) == Pool->DeclaredSize) {
+      DO_IF_TRACE(fprintf(stderr, "[%d] poolfree_st(%p) %d bytes\n",
+                          getPoolNumber(Pool), Node, Pool->DeclaredSize));
+      DO_IF_PNP(CurHeapSize -= Pool->DeclaredSize +
+                               sizeof(NodeHeader<NormalPoolTraits>));
+      FNH->Header.Size = Pool->DeclaredSize;
+      AddNodeToFreeList(Pool, FNH);
+      return;
+    }
+  }
+  poolfree_internal(Pool, Node);
+}
+
+static inline void *poolalloc_nostats(PoolTy<NormalPoolTraits> *Pool,
+                                      unsigned NumBytes) {
+  if (Pool && Pool->SingleThreaded)
+    return poolalloc_internal(Pool, NumBytes);
+  if (Pool && Pool->LockFree &&
+      getAdjustedSize(Pool, NumBytes) == Pool->DeclaredSize) {
+    if (LockFreeNode *Node = LockFreePop(Pool))
+      return &Node->Header+1;
+    return LockFreeRefill(Pool, NumBytes);
+  }
+#if THREAD_CACHE_SIZE
+  if (isThreadCacheSize(Pool, NumBytes))
+    return ThreadCacheAlloc(Pool, NumBytes);
+#endif
+  if (Pool) LockPool(Pool);
   void* to_return = poolalloc_internal(Pool, NumBytes);
   if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
   return to_return;
 }
 
+void *poolalloc(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes) {
+  DO_IF_FORCE_MALLOCFREE(return malloc(NumBytes));
+  if (__builtin_expect(Pool && Pool->Stats != 0, 0)) {
+    unsigned long long Start = StatsSampleStart();
+    void *Result = poolalloc_nostats(Pool, NumBytes);
+    StatsAlloc(Pool->Stats, poolobjsize(Pool, Result), Start);
+    return Result;
+  }
+  return poolalloc_nostats(Pool, NumBytes);
+}
+
 void *poolcalloc(PoolTy<NormalPoolTraits> *Pool,
                  unsigned NumBytes,
                  unsigned NumElements) {
@@ -897,25 +2283,150 @@ void *poolmemalign(PoolTy<NormalPoolTraits> *Pool,
                    unsigned Alignment, unsigned NumBytes) {
   //punt and use pool alloc.
   //I don't know if this is safe or breaks any assumptions in the runtime
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
+  if (Pool) LockPool(Pool);
   intptr_t base = (intptr_t)poolalloc_internal(Pool, NumBytes + Alignment - 1);
   if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
   return (void*)((base + (Alignment - 1)) & ~((intptr_t)Alignment -1));
 }
 
+static inline void poolfree_nostats(PoolTy<NormalPoolTraits> *Pool,
+                                    void *Node) {
+  if (Pool && Pool->SingleThreaded) {
+    SingleThreadedFree(Pool, Node);
+    return;
+  }
+  if (Pool && Node && Pool->LockFree &&
+      (((NodeHeader<NormalPoolTraits>*)Node-1)->Size & ~1UL) ==
+      Pool->DeclaredSize) {
+    LockFreeNode *FNH = (LockFreeNode*)
+      ((char*)Node - sizeof(NodeHeader<NormalPoolTraits>));
+    LockFreePush(Pool, FNH, FNH);
+    return;
+  }
+#if THREAD_CACHE_SIZE
+  if (isThreadCacheObject(Pool, Node)) {
+    ThreadCacheFree(Pool, Node);
+    return;
+  }
+#endif
+  if (Pool) LockPool(Pool);
+  poolfree_internal(Pool, Node);
+  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
+}
+
 void poolfree(PoolTy<NormalPoolTraits> *Pool, void *Node) {
   DO_IF_FORCE_MALLOCFREE(free(Node); return);
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
-  poolfree_internal(Pool, Node);
+  if (__builtin_expect(Pool && Node && Pool->Stats != 0, 0)) {
+    unsigned long long Start = StatsSampleStart();
+    unsigned Size = poolobjsize(Pool, Node);
+    poolfree_nostats(Pool, Node);
+    StatsFree(Pool->Stats, Size, Start);
+    return;
+  }
+  poolfree_nostats(Pool, Node);
+}
+
+// poolalloc_st, poolfree_st - Nothing else can use the pool at the same time,
+// so these skip the lock, the thread caches and the lock-free list.
+void *poolalloc_st(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes) {
+  DO_IF_FORCE_MALLOCFREE(return malloc(NumBytes));
+  assert(Pool && "Single-threaded pool does not support null PD!");
+  if (__builtin_expect(Pool->Stats != 0, 0)) {
+    unsigned long long Start = StatsSampleStart();
+    void *Result = poolalloc_internal(Pool, NumBytes);
+    StatsAlloc(Pool->Stats, poolobjsize(Pool, Result), Start);
+    return Result;
+  }
+  return poolalloc_internal(Pool, NumBytes);
+}
+
+void poolfree_st(PoolTy<NormalPoolTraits> *Pool, void *Node) {
+  DO_IF_FORCE_MALLOCFREE(free(Node); return);
+  assert(Pool && "Single-threaded pool does not support null PD!");
+  if (__builtin_expect(Node && Pool->Stats != 0, 0)) {
+    unsigned long long Start = StatsSampleStart();
+    unsigned Size = poolobjsize(Pool, Node);
+    SingleThreadedFree(Pool, Node);
+    StatsFree(Pool->Stats, Size, Start);
+    return;
+  }
+  SingleThreadedFree(Pool, Node);
+}
+
+// poolalloc_sized - Allocate Size bytes from a pool created for objects of
+// that size and alignment Align.  The size math is done at compile time, and
+// the declared-size checks of poolalloc are known to succeed.
+template<unsigned Size, unsigned Align>
+static inline void *poolalloc_sized(PoolTy<NormalPoolTraits> *Pool) {
+  typedef AdjustedSize<NormalPoolTraits, Size, Align> Adjusted;
+  DO_IF_FORCE_MALLOCFREE(return malloc(Size));
+  assert(Pool && Pool->DeclaredSize == Adjusted::Value &&
+         Pool->Alignment == Adjusted::Alignment &&
+         "Pool was not created for objects of this size!");
+  DO_IF_PNP(if (Pool->NumObjects == 0) ++PoolCounter);  // Track # pools.
+
+  // Pools that keep statistics or a lock-free list take the usual path.
+  if (__builtin_expect(Pool->Stats != 0 || Pool->LockFree, 0))
+    return poolalloc(Pool, Size);
+  if (Pool->SingleThreaded)
+    return poolalloc_adjusted(Pool, Adjusted::Value);
+#if THREAD_CACHE_SIZE
+  return ThreadCacheAlloc(Pool, Size);
+#else
+  LockPool(Pool);
+  void *Result = poolalloc_adjusted(Pool, Adjusted::Value);
+  pthread_mutex_unlock(&Pool->pool_lock);
+  return Result;
+#endif
+}
+
+#define POOLALLOC_SIZE(Size, Align)                                   \
+  void *poolalloc_##Size##_##Align(PoolTy<NormalPoolTraits> *Pool) {  \
+    return poolalloc_sized<Size, Align>(Pool);                        \
+  }
+#include "poolalloc/PoolAllocSizes.def"
+
+void poolalloc_n(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes,
+                 unsigned Count, void **Out) {
+  DO_IF_FORCE_MALLOCFREE(for (unsigned i = 0; i != Count; ++i)
+                           Out[i] = malloc(NumBytes);
+                         return);
+  if (Pool) LockPool(Pool);
+  poolalloc_n_internal(Pool, NumBytes, Count, Out);
+  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
+
+  if (__builtin_expect(Pool && Pool->Stats != 0, 0))
+    for (unsigned i = 0; i != Count; ++i)
+      StatsAlloc(Pool->Stats, poolobjsize(Pool, Out[i]), 0);
+}
+
+void poolfree_n(PoolTy<NormalPoolTraits> *Pool, void **Ptrs, unsigned Count) {
+  DO_IF_FORCE_MALLOCFREE(for (unsigned i = 0; i != Count; ++i)
+                           free(Ptrs[i]);
+                         return);
+  if (__builtin_expect(Pool && Pool->Stats != 0, 0))
+    for (unsigned i = 0; i != Count; ++i)
+      if (Ptrs[i])
+        StatsFree(Pool->Stats, poolobjsize(Pool, Ptrs[i]), 0);
+
+  if (Pool) LockPool(Pool);
+  for (unsigned i = 0; i != Count; ++i)
+    poolfree_internal(Pool, Ptrs[i]);
   if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
 }
 
 void *poolrealloc(PoolTy<NormalPoolTraits> *Pool, void *Node,
                   unsigned NumBytes) {
   DO_IF_FORCE_MALLOCFREE(return realloc(Node, NumBytes));
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
+  PoolStats *PS = Pool ? Pool->Stats : 0;
+  long long OldSize = PS ? (long long)poolobjsize(Pool, Node) : 0;
+  if (Pool) LockPool(Pool);
   void* to_return = poolrealloc_internal(Pool, Node, NumBytes);
   if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
+  if (__builtin_expect(PS != 0, 0)) {
+    if (Node) StatsFree(PS, OldSize, 0);
+    if (to_return) StatsAlloc(PS, poolobjsize(Pool, to_return), 0);
+  }
   return to_return;
 }
 
@@ -989,12 +2500,49 @@ int poolalloc_pthread_create(pthread_t* thread,
 // around the normal pool routines.
 //===----------------------------------------------------------------------===//
 
-// For now, use address space reservation of 256MB.
-#define POOLSIZE (256*1024*1024)
+// ReleasedPools - When we are done with a pool, don't munmap it, keep it
+// around for next time.  The pools are kept on a lock-free stack, linked
+// through their PoolSlab headers, and only keep their first
+// PTRCOMP_COMMIT_SIZE bytes of memory.  Reservations are never unmapped, so
+// reading the Next field of a pool that another thread just took is harmless;
+// the tag in the head makes the following CAS fail.
+static unsigned long long ReleasedPools __attribute__((aligned(8))) = 0;
+
+static void PushReleasedPool(PoolSlab<CompressedPoolTraits> *PS) {
+  unsigned long long Old = __atomic_load_n(&ReleasedPools, __ATOMIC_RELAXED);
+  while (1) {
+    __atomic_store_n(&PS->Next,
+                     (PoolSlab<CompressedPoolTraits>*)getLockFreePtr(Old),
+                     __ATOMIC_RELAXED);
+    unsigned long long Prev =
+      __sync_val_compare_and_swap(&ReleasedPools, Old,
+                                  makeLockFreeHead(PS, Old));
+    if (Prev == Old) return;
+    Old = Prev;
+  }
+}
 
-// Pools - When we are done with a pool, don't munmap it, keep it around for
-// next time.
-static PoolSlab<CompressedPoolTraits> *Pools[4] = { 0, 0, 0, 0 };
+static PoolSlab<CompressedPoolTraits> *PopReleasedPool() {
+  unsigned long long Old = __atomic_load_n(&ReleasedPools, __ATOMIC_RELAXED);
+  while (1) {
+    PoolSlab<CompressedPoolTraits> *PS =
+      (PoolSlab<CompressedPoolTraits>*)getLockFreePtr(Old);
+    if (PS == 0) return 0;
+    PoolSlab<CompressedPoolTraits> *Next =
+      __atomic_load_n(&PS->Next, __ATOMIC_RELAXED);
+    unsigned long long Prev =
+      __sync_val_compare_and_swap(&ReleasedPools, Old,
+                                  makeLockFreeHead(Next, Old));
+    if (Prev == Old) return PS;
+    Old = Prev;
+  }
+}
+
+// getPtrCompReservation - Return the start of the address space reservation
+// that holds the pointer compressed pool PS.
+static inline char *getPtrCompReservation(PoolSlab<CompressedPoolTraits> *PS) {
+  return (char*)((uintptr_t)PS & ~(uintptr_t)(PTRCOMP_STAGGER_LIMIT-1));
+}
 
 void *poolinit_pc(PoolTy<CompressedPoolTraits> *Pool,
                   unsigned DeclaredSize, unsigned ObjAlignment) {
@@ -1008,45 +2556,43 @@ void *poolinit_pc(PoolTy<CompressedPoolTraits> *Pool,
   // register.
 
   // If we already have a pool mapped, reuse it.
-  for (unsigned i = 0; i != 4; ++i)
-    if (Pools[i]) {
-      Pool->Slabs = Pools[i];
-      Pools[i] = 0;
-      break;
-    }
-
-  //
-  // Wrap the stagger value back to zero if we're past the size of the pool.
-  // This way, we always reserve less than 2*POOLSIZE of the virtual address
-  // space.
-  //
-  if ((stagger * DeclaredSize) >= POOLSIZE)
-    stagger = 0;
+  Pool->Slabs = PopReleasedPool();
 
   if (Pool->Slabs == 0) {
     //
     // Didn't find an existing pool, create one.
     //
-    // To create a pool, we stagger the beginning of the pool so that pools
-    // do not end up starting on the same page boundary (creating extra cache
-    // conflicts).
+    // Reserve address space for the whole pool, but only make the start of it
+    // usable.  The pool grows into the rest as it fills.  To create a pool, we
+    // stagger the beginning of the pool so that pools do not end up starting
+    // on the same page boundary (creating extra cache conflicts).  The
+    // stagger wraps back to zero at the stagger limit, so that the pool
+    // always fits in its reservation.
     //
-    Pool->Slabs = (PoolSlab<CompressedPoolTraits>*)
-                      AllocateSpaceWithMMAP(POOLSIZE + (DeclaredSize * stagger), true);
-    Pool->Slabs += (DeclaredSize * stagger);
-
-    // Increase the stagger amount by one node.
-    stagger++;
+    unsigned long Offset = (unsigned long)DeclaredSize *
+                           __sync_fetch_and_add(&stagger, 1);
+    Offset %= PTRCOMP_STAGGER_LIMIT;
+    Offset -= Offset % (Pool->Alignment > 16 ? Pool->Alignment : 16);
+
+    char *Mem = (char*)ReserveSpaceWithMMAP(PTRCOMP_RESERVE_SIZE +
+                                            PTRCOMP_STAGGER_LIMIT,
+                                            PTRCOMP_STAGGER_LIMIT);
+    CommitSpaceWithMMAP(Mem, PTRCOMP_COMMIT_SIZE);
+    Pool->Slabs = (PoolSlab<CompressedPoolTraits>*)(Mem + Offset);
+    Pool->Slabs->Size = PTRCOMP_COMMIT_SIZE - Offset;
     DO_IF_TRACE(fprintf(stderr, "RESERVED ADDR SPACE: %p -> %p\n",
-                        Pool->Slabs, (char*)Pool->Slabs+POOLSIZE));
+                        Mem, Mem+PTRCOMP_RESERVE_SIZE+PTRCOMP_STAGGER_LIMIT));
   }
   PoolSlab<CompressedPoolTraits>::create_for_ptrcomp(Pool, Pool->Slabs,
-                                                     POOLSIZE);
+                                                     Pool->Slabs->Size);
   return Pool->Slabs;
 }
 
 void pooldestroy_pc(PoolTy<CompressedPoolTraits> *Pool) {
   assert(Pool && "Null pool pointer passed in to pooldestroy!\n");
+#if THREAD_CACHE_SIZE
+  DetachThreadCaches(Pool);
+#endif
   pthread_mutex_destroy(&Pool->pool_lock);
   if (Pool->Slabs == 0)
     return;   // no memory allocated from this pool.
@@ -1058,36 +2604,60 @@ void pooldestroy_pc(PoolTy<CompressedPoolTraits> *Pool) {
 #endif
   DO_IF_POOLDESTROY_STATS(PrintPoolStats(Pool));
 
-  // If there is space to remember this pool, do so.
-  for (unsigned i = 0; i != 4; ++i)
-    if (Pools[i] == 0) {
-      Pools[i] = Pool->Slabs;
-      return;
-    }
+  // Give back all but the first pages of the pool, and remember it for the
+  // next poolinit_pc.
+  PoolSlab<CompressedPoolTraits> *PS = Pool->Slabs;
+  char *Mem = getPtrCompReservation(PS);
+  unsigned long Committed = (char*)PS+PS->Size - Mem;
+  if (Committed > PTRCOMP_COMMIT_SIZE)
+    DecommitSpaceWithMMAP(Mem+PTRCOMP_COMMIT_SIZE,
+                          Committed-PTRCOMP_COMMIT_SIZE);
+  PS->Size = Mem+PTRCOMP_COMMIT_SIZE - (char*)PS;
+  PushReleasedPool(PS);
+}
+
+// poolalloc_ptrcomp, poolfree_ptrcomp - The allocation and free paths shared by
+// the _pc and _pca entry points.  Objects of the declared size go through the
+// per-thread caches.
+static inline void *poolalloc_ptrcomp(PoolTy<CompressedPoolTraits> *Pool,
+                                      unsigned NumBytes) {
+#if THREAD_CACHE_SIZE
+  if (isThreadCacheSize(Pool, NumBytes))
+    return ThreadCacheAlloc(Pool, NumBytes);
+#endif
+  if (Pool) LockPool(Pool);
+  void *Result = poolalloc_internal(Pool, NumBytes);
+  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
+  return Result;
+}
 
-  // Otherwise, just munmap it.
-  DO_IF_TRACE(fprintf(stderr, "UNMAPPING ADDR SPACE: %p -> %p\n",
-                      Pool->Slabs, (char*)Pool->Slabs+POOLSIZE));
-  munmap(Pool->Slabs, POOLSIZE);
+static inline void poolfree_ptrcomp(PoolTy<CompressedPoolTraits> *Pool,
+                                    void *Node) {
+#if THREAD_CACHE_SIZE
+  if (isThreadCacheObject(Pool, Node)) {
+    ThreadCacheFree(Pool, Node);
+    return;
+  }
+#endif
+  if (Pool) LockPool(Pool);
+  poolfree_internal(Pool, Node);
+  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
 }
 
 unsigned long long poolalloc_pc(PoolTy<CompressedPoolTraits> *Pool,
                                 unsigned NumBytes) {
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
-  void *Result = poolalloc_internal(Pool, NumBytes);
-  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
+  void *Result = poolalloc_ptrcomp(Pool, NumBytes);
   return (char*)Result-(char*)Pool->Slabs;
 }
 
 void poolfree_pc(PoolTy<CompressedPoolTraits> *Pool, unsigned long long Node) {
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
-  poolfree_internal(Pool, (char*)Pool->Slabs+Node);
-  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
+  if (Node == 0) return;
+  poolfree_ptrcomp(Pool, (char*)Pool->Slabs+Node);
 }
 
 unsigned long long poolrealloc_pc(PoolTy<CompressedPoolTraits> *Pool,
                                   unsigned long long Node, unsigned NumBytes) {
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
+  if (Pool) LockPool(Pool);
   void *Result = poolrealloc_internal(Pool, (char*)Pool->Slabs+Node, NumBytes);
   if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
   return (char*)Result-(char*)Pool->Slabs;
@@ -1107,23 +2677,18 @@ void pooldestroy_pca(PoolTy<CompressedPoolTraits> *Pool)
 
 void* poolalloc_pca(PoolTy<CompressedPoolTraits> *Pool, unsigned NumBytes)
 {
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
-  void* to_return = poolalloc_internal(Pool, NumBytes);
-  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
-  return to_return;
+  return poolalloc_ptrcomp(Pool, NumBytes);
 }
 
 void poolfree_pca(PoolTy<CompressedPoolTraits> *Pool, void* Node)
 {
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
-  poolfree_internal(Pool, Node);
-  if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
+  poolfree_ptrcomp(Pool, Node);
 }
 
 void* poolrealloc_pca(PoolTy<CompressedPoolTraits> *Pool, void* Node, 
 		      unsigned NumBytes)
 {
-  if (Pool) pthread_mutex_lock(&Pool->pool_lock);
+  if (Pool) LockPool(Pool);
   void* to_return = poolrealloc_internal(Pool, Node, NumBytes);
   if (Pool) pthread_mutex_unlock(&Pool->pool_lock);
   return to_return;
@@ -24,11 +24,17 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stddef.h>
 
 template<typename PoolTraits>
 struct PoolSlab;
 template<typename PoolTraits>
 struct FreedNodeHeader;
+template<typename PoolTraits>
+struct PoolFreeBins;
+template<typename PoolTraits>
+struct PoolThreadCache;
+struct PoolStats;
 
 // NormalPoolTraits - This describes normal pool allocation pools, which can
 // address the entire heap, and are made out of multiple chunks of memory.  The
@@ -38,7 +44,14 @@ struct NormalPoolTraits {
   typedef unsigned long NodeHeaderType;
   enum {
     UseLargeArrayObjects = 1,
-    CanGrowPool = 1
+    CanGrowPool = 1,
+
+    // Requests are smaller than LARGE_SLAB_SIZE, so free nodes of 8KB and up
+    // can all share the last size bin.
+    NumFreeBinFLs = 10,
+
+    // Slabs come from the configurable slab provider.
+    UseSlabProvider = 1
   };
 
   // Pointers are just pointers.
@@ -62,15 +75,21 @@ struct NormalPoolTraits {
 
 // CompressedPoolTraits - This describes a statically pointer compressed pool,
 // which is known to be <= 2^32 bytes in size (even on a 64-bit machine), and is
-// made out of a single contiguous block.  The meta-data to represent the pool
-// uses 32-bit indexes from the start of the pool instead of full pointers to
-// decrease the minimum object size.
+// made out of a single contiguous block that grows in place as it fills.  The
+// meta-data to represent the pool uses 32-bit indexes from the start of the
+// pool instead of full pointers to decrease the minimum object size.
 struct CompressedPoolTraits {
   typedef unsigned NodeHeaderType;
 
   enum {
     UseLargeArrayObjects = 0,
-    CanGrowPool = 0
+    CanGrowPool = 1,
+
+    // Any 32-bit size has a bin of its own.
+    NumFreeBinFLs = 29,
+
+    // The pool is one reserved region, not a set of slabs.
+    UseSlabProvider = 0
   };
 
   // Represent pointers with indexes from the pool base.
@@ -152,16 +171,37 @@ struct PoolTy {
   // memory of this structure for the pointer compression pass.
   PoolSlab<PoolTraits> *Slabs;
 
-  // The free node lists for objects of various sizes.  
+  // ObjFreeList - The free nodes of exactly the declared size.
   typename PoolTraits::FreeNodeHeaderPtrTy ObjFreeList;
+
+  // InlineAllocSize, InlineHeader - When compiled code may pop and push
+  // ObjFreeList itself (see -poolalloc-inline-fast-path), the request size
+  // that is served from ObjFreeList and the header of an object allocated
+  // from it.  Only pools created with poolinit_st set them; both are zero
+  // otherwise.  The compiler relies on these following ObjFreeList as the
+  // third and fourth pointer sized words of the pool, as checked below.
+  unsigned long InlineAllocSize;
+  unsigned long InlineHeader;
+
+  // OtherFreeList - The free node most recently put into one of the FreeBins,
+  // used as a coalescing hint.  Bump pointer pools keep their end pointer here.
   typename PoolTraits::FreeNodeHeaderPtrTy OtherFreeList;
 
   // Alignment - The required alignment of allocations the pool in bytes.
   unsigned Alignment;
 
-  // The declared size of the pool, just kept for the record.
+  // DeclaredSize - The size of the objects the pool was created for, rounded
+  // up as getAdjustedSize does, or that of the first allocation if that was
+  // zero.  Requests of this size are served from ObjFreeList, the thread
+  // caches, the lock-free list, the inline fast paths and the
+  // poolalloc_<size>_<align> entry points.  The thread cache checks read it
+  // without the pool lock, so it is written atomically after poolinit.
   unsigned DeclaredSize;
 
+  // FreeBins - Segregated free lists for all other free nodes.  This is
+  // carved out of the first slab of the pool.
+  PoolFreeBins<PoolTraits> *FreeBins;
+
   // LargeArrays - A doubly linked list of large array chunks, dynamically
   // allocated with malloc.
   LargeArrayHeader *LargeArrays;
@@ -176,17 +216,80 @@ struct PoolTy {
   // Together with NumObjects, allows us to calculate average object size.
   unsigned BytesAllocated;
 
+  // NumReallocsInPlace, NumReallocsMoved - The number of poolreallocs of
+  // objects in the pool that resized the object where it was, and the number
+  // that had to copy it to a new object.
+  unsigned NumReallocsInPlace;
+  unsigned NumReallocsMoved;
+
   // Lock for the pool
   pthread_mutex_t pool_lock;
 
   // Thread reference count for the pool
   int thread_refcount;
+
+  // ThreadCaches - The list of per-thread object caches currently bound to
+  // this pool.  Only modified while holding the global thread cache lock.
+  PoolThreadCache<PoolTraits> *ThreadCaches;
+
+  // Stats - The runtime statistics of this pool, or null if POOLALLOC_STATS
+  // is not set.
+  PoolStats *Stats;
+
+  // LockFreeObjList - For pools created with poolinit_lf, a lock-free stack of
+  // free objects of the declared size.  The low bits hold a FreedNodeHeader
+  // pointer, and the high bits a modification count that defeats ABA.  It is
+  // aligned to 8 bytes even where the ABI would not, so that the double-word
+  // compare-and-swap on 32-bit hosts never splits across cache lines.
+  unsigned long long LockFreeObjList __attribute__((aligned(8)));
+
+  // LockFree - True if this pool uses LockFreeObjList.
+  unsigned LockFree;
+
+  // SingleThreaded - True for pools created with poolinit_st.  Only one thread
+  // ever uses such a pool, so it is never locked and does not use the thread
+  // caches.
+  unsigned SingleThreaded;
 };
 
+// The inline fast paths the pool allocator pass emits address these fields
+// and the object headers by word number, and the pass allocates a descriptor
+// of 32 pointers for every pool (see createPoolAllocFastPath and getPoolType).
+static_assert(offsetof(PoolTy<NormalPoolTraits>, ObjFreeList) ==
+              1*sizeof(void*), "ObjFreeList must be word 1 of a pool");
+static_assert(offsetof(PoolTy<NormalPoolTraits>, InlineAllocSize) ==
+              2*sizeof(void*), "InlineAllocSize must be word 2 of a pool");
+static_assert(offsetof(PoolTy<NormalPoolTraits>, InlineHeader) ==
+              3*sizeof(void*), "InlineHeader must be word 3 of a pool");
+static_assert(sizeof(PoolTy<NormalPoolTraits>) <= 32*sizeof(void*),
+              "PoolTy must fit in the descriptor the compiler allocates");
+static_assert(sizeof(NodeHeader<NormalPoolTraits>) == sizeof(void*) &&
+              offsetof(FreedNodeHeader<NormalPoolTraits>, Next) ==
+                1*sizeof(void*) &&
+              offsetof(FreedNodeHeader<NormalPoolTraits>, Prev) ==
+                2*sizeof(void*),
+              "A free object must be its header, Next and Prev words");
+
 extern "C" {
   void poolinit(PoolTy<NormalPoolTraits> *Pool,
                 unsigned DeclaredSize, unsigned ObjAlignment);
+
+  // poolinit_lf - Like poolinit, but allocations and frees of the declared
+  // size never take the pool lock.  All other pool entry points are shared
+  // with normal pools.
+  void poolinit_lf(PoolTy<NormalPoolTraits> *Pool,
+                   unsigned DeclaredSize, unsigned ObjAlignment);
+
+  // poolinit_st - Like poolinit, for a pool that the pool allocator proved is
+  // only used by the thread that creates it.  No entry point locks the pool.
+  void poolinit_st(PoolTy<NormalPoolTraits> *Pool,
+                   unsigned DeclaredSize, unsigned ObjAlignment);
   void poolmakeunfreeable(PoolTy<NormalPoolTraits> *Pool);
+
+  // poolprofile_name - Report the statistics of Pool under Name rather than
+  // under the place it was created.  This is a no-op unless POOLALLOC_STATS
+  // is set.
+  void poolprofile_name(PoolTy<NormalPoolTraits> *Pool, const char *Name);
   void pooldestroy(PoolTy<NormalPoolTraits> *Pool);
   void *poolalloc(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes);
   void *poolcalloc(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes, unsigned);
@@ -196,6 +299,28 @@ extern "C" {
                      unsigned Alignment, unsigned NumBytes);
   void poolfree(PoolTy<NormalPoolTraits> *Pool, void *Node);
 
+  // poolalloc_st, poolfree_st - poolalloc and poolfree for pools created with
+  // poolinit_st.  They go straight to the allocator.
+  void *poolalloc_st(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes);
+  void poolfree_st(PoolTy<NormalPoolTraits> *Pool, void *Node);
+
+  // poolalloc_<Size>_<Align> - poolalloc(Pool, Size) for a pool created with
+  // poolinit(Pool, Size, Align) or poolinit_st.  The pool allocator calls
+  // these instead of poolalloc for the sizes and alignments listed in
+  // poolalloc/PoolAllocSizes.def.
+#define POOLALLOC_SIZE(Size, Align) \
+  void *poolalloc_##Size##_##Align(PoolTy<NormalPoolTraits> *Pool);
+#include "poolalloc/PoolAllocSizes.def"
+
+  // poolalloc_n - Allocate Count objects of NumBytes each, storing pointers to
+  // them in Out.  The pool is locked only once, and the objects are carved
+  // back to back out of free space where possible.
+  void poolalloc_n(PoolTy<NormalPoolTraits> *Pool, unsigned NumBytes,
+                   unsigned Count, void **Out);
+
+  // poolfree_n - Free the Count objects in Ptrs with a single lock.
+  void poolfree_n(PoolTy<NormalPoolTraits> *Pool, void **Ptrs, unsigned Count);
+
   /// poolobjsize - Return the size of the object at the specified address, in
   /// the specified pool.  Note that this cannot be used in normal cases, as it
   /// is completely broken if things land in the system heap.  Perhaps in the
@@ -9,6 +9,18 @@
 //
 // This file implements the PageManager.h interface.
 //
+// Freed pages are kept as spans of contiguous pages.  Each thread has a small
+// private cache of spans that it uses without locking.  When a thread cache
+// grows past its high watermark, half of it is moved to a global table of
+// spans that any thread can claim with a single compare-and-swap.  When the
+// global table is past its own high watermark, further spans are unmapped so
+// that a program whose pool usage shrinks gives its peak memory back to the
+// system.
+//
+// Spans are described by a page aligned pointer with the span length in pages
+// stored in the low bits, so the page manager never writes to, or reads from,
+// the free pages themselves.
+//
 //===----------------------------------------------------------------------===//
 
 #include "PageManager.h"
@@ -16,37 +28,218 @@
 #define _POSIX_MAPPED_FILES
 #endif
 #include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "poolalloc/MMAPSupport.h"
-#include "poolalloc/Support/MallocAllocator.h"
-#include <vector>
-#include <iostream>
 
 // Define this if we want to use memalign instead of mmap to get pages.
 // Empirically, this slows down the pool allocator a LOT.
 #define USE_MEMALIGN 0
 
+//===----------------------------------------------------------------------===//
+//  Page cache tweaking macros
+//===----------------------------------------------------------------------===//
+
+// PAGE_BATCH_SIZE - The number of pages to mmap at once when a single page is
+// requested and no cached page is available.
+#define PAGE_BATCH_SIZE 8
+
+// PAGE_MAX_CACHED_SPAN - Spans longer than this many pages are always mapped
+// and unmapped directly.  Must be less than the page size.
+#define PAGE_MAX_CACHED_SPAN 1024
+
+// PAGE_THREAD_CACHE_SPANS/PAGE_THREAD_HIGH_WATER - The number of spans and of
+// pages a thread may cache before it moves half of them to the global table.
+#define PAGE_THREAD_CACHE_SPANS 32
+#define PAGE_THREAD_HIGH_WATER  64
+
+// PAGE_GLOBAL_SPANS/PAGE_GLOBAL_HIGH_WATER - The number of spans and of pages
+// kept in the global table.  Anything beyond this is unmapped.
+#define PAGE_GLOBAL_SPANS      512
+#define PAGE_GLOBAL_HIGH_WATER 4096
+
 unsigned PageSize = 0;
 
 void InitializePageManager() {
   if (!PageSize) PageSize = sysconf(_SC_PAGESIZE);
 }
 
-// Explicitly use the malloc allocator here, to avoid depending on the C++
-// runtime library.
-typedef std::vector<void*, llvm::MallocAllocator<void*> > FreePagesListType;
+//===----------------------------------------------------------------------===//
+//  Span encoding
+//===----------------------------------------------------------------------===//
 
-static FreePagesListType &getFreePageList() {
-  static FreePagesListType *FreePages = 0;
+static inline uintptr_t makeSpan(void *Page, unsigned NumPages) {
+  return (uintptr_t)Page | NumPages;
+}
+
+static inline char *getSpanStart(uintptr_t Span) {
+  return (char*)(Span & ~(uintptr_t)(PageSize-1));
+}
+
+static inline unsigned getSpanPages(uintptr_t Span) {
+  return Span & (PageSize-1);
+}
+
+// UnmapPages - Give Num pages starting at Page back to the system.
+static inline void UnmapPages(void *Page, unsigned Num) {
+  ::munmap(Page, (size_t)Num*PageSize);
+}
 
-  if (!FreePages) {
-    // Avoid using operator new!
-    FreePages = (FreePagesListType*)malloc(sizeof(FreePagesListType));
-    // Use placement new now.
-    new (FreePages) std::vector<void*, llvm::MallocAllocator<void*> >();
+//===----------------------------------------------------------------------===//
+//  Global span table
+//
+//  A fixed table of spans.  A slot is claimed by swapping a span in for zero,
+//  and a span is taken by swapping zero in for it, so no memory is shared
+//  between the threads other than the table itself.  Threads start their scans
+//  at different slots to keep them off each other's cache lines.
+//
+//===----------------------------------------------------------------------===//
+
+static volatile uintptr_t GlobalSpans[PAGE_GLOBAL_SPANS];
+static volatile unsigned GlobalPages = 0;
+static volatile unsigned NextScanStart = 0;
+
+static __thread unsigned ScanStart = ~0U;
+
+static inline unsigned getScanStart() {
+  if (__builtin_expect(ScanStart == ~0U, 0))
+    ScanStart = __sync_fetch_and_add(&NextScanStart, 61) % PAGE_GLOBAL_SPANS;
+  return ScanStart;
+}
+
+// GlobalPush - Put Span in the global table, or unmap it if the table is past
+// its high watermark or full.
+static void GlobalPush(uintptr_t Span) {
+  unsigned Num = getSpanPages(Span);
+  if (__sync_add_and_fetch(&GlobalPages, Num) <= PAGE_GLOBAL_HIGH_WATER) {
+    unsigned Start = getScanStart();
+    for (unsigned i = 0; i != PAGE_GLOBAL_SPANS; ++i) {
+      unsigned Slot = (Start + i) % PAGE_GLOBAL_SPANS;
+      if (GlobalSpans[Slot] == 0 &&
+          __sync_bool_compare_and_swap(&GlobalSpans[Slot], 0, Span))
+        return;
+    }
   }
-  return *FreePages;
+
+  __sync_sub_and_fetch(&GlobalPages, Num);
+  UnmapPages(getSpanStart(Span), Num);
+}
+
+// GlobalPop - Take a span of at least Num pages out of the global table, or
+// return zero if there is none.
+static uintptr_t GlobalPop(unsigned Num) {
+  if (GlobalPages == 0) return 0;
+
+  unsigned Start = getScanStart();
+  for (unsigned i = 0; i != PAGE_GLOBAL_SPANS; ++i) {
+    unsigned Slot = (Start + i) % PAGE_GLOBAL_SPANS;
+    uintptr_t Span = GlobalSpans[Slot];
+    if (Span && getSpanPages(Span) >= Num &&
+        __sync_bool_compare_and_swap(&GlobalSpans[Slot], Span, 0)) {
+      __sync_sub_and_fetch(&GlobalPages, getSpanPages(Span));
+      return Span;
+    }
+  }
+  return 0;
 }
 
+//===----------------------------------------------------------------------===//
+//  Thread span caches
+//===----------------------------------------------------------------------===//
+
+struct PageThreadCache {
+  uintptr_t Spans[PAGE_THREAD_CACHE_SPANS];
+  unsigned NumSpans;
+  unsigned NumPages;
+};
+
+static __thread PageThreadCache ThreadCache;
+static __thread bool ThreadCacheRegistered = false;
+static pthread_key_t ThreadCacheKey;
+static pthread_once_t ThreadCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+// FlushThreadCache - Move the oldest spans of TC to the global table until at
+// most Keep pages remain.
+static void FlushThreadCache(PageThreadCache *TC, unsigned Keep) {
+  unsigned i = 0;
+  for (; i != TC->NumSpans && TC->NumPages > Keep; ++i) {
+    TC->NumPages -= getSpanPages(TC->Spans[i]);
+    GlobalPush(TC->Spans[i]);
+  }
+  TC->NumSpans -= i;
+  for (unsigned j = 0; j != TC->NumSpans; ++j)
+    TC->Spans[j] = TC->Spans[j+i];
+}
+
+// ThreadCacheDestructor - Flush the cache of an exiting thread.  Destructors
+// of other thread-specific data may still free pages after this one runs, so
+// the cache registers itself again when that happens, and pthreads then calls
+// this once more.
+static void ThreadCacheDestructor(void *TC) {
+  FlushThreadCache((PageThreadCache*)TC, 0);
+  ThreadCacheRegistered = false;
+}
+
+static void InitThreadCacheKey() {
+  pthread_key_create(&ThreadCacheKey, ThreadCacheDestructor);
+}
+
+// getThreadCache - Return this thread's span cache, arranging for it to be
+// flushed when the thread exits.
+static inline PageThreadCache *getThreadCache() {
+  PageThreadCache *TC = &ThreadCache;
+  if (__builtin_expect(!ThreadCacheRegistered, 0)) {
+    ThreadCacheRegistered = true;
+    pthread_once(&ThreadCacheKeyOnce, InitThreadCacheKey);
+    pthread_setspecific(ThreadCacheKey, TC);
+  }
+  return TC;
+}
+
+// ThreadCachePush - Add Num pages starting at Page to TC, moving older spans
+// to the global table if TC is past its high watermark.
+static void ThreadCachePush(PageThreadCache *TC, void *Page, unsigned Num) {
+  if (TC->NumSpans == PAGE_THREAD_CACHE_SPANS)
+    FlushThreadCache(TC, TC->NumPages - getSpanPages(TC->Spans[0]));
+  TC->Spans[TC->NumSpans++] = makeSpan(Page, Num);
+  TC->NumPages += Num;
+  if (TC->NumPages > PAGE_THREAD_HIGH_WATER)
+    FlushThreadCache(TC, PAGE_THREAD_HIGH_WATER/2);
+}
+
+// TakePages - Return the first Num pages of Span, and cache the rest of it.
+static void *TakePages(PageThreadCache *TC, uintptr_t Span, unsigned Num) {
+  char *Start = getSpanStart(Span);
+  if (getSpanPages(Span) != Num)
+    ThreadCachePush(TC, Start + (size_t)Num*PageSize,
+                    getSpanPages(Span) - Num);
+  return Start;
+}
+
+// ThreadCachePop - Return Num contiguous pages from TC or the global table, or
+// null if neither has a long enough span.  The most recently freed span is
+// preferred, since its pages are most likely to still be in the cache.
+static void *ThreadCachePop(PageThreadCache *TC, unsigned Num) {
+  for (unsigned i = TC->NumSpans; i != 0; --i) {
+    uintptr_t Span = TC->Spans[i-1];
+    if (getSpanPages(Span) >= Num) {
+      for (unsigned j = i; j != TC->NumSpans; ++j)
+        TC->Spans[j-1] = TC->Spans[j];
+      --TC->NumSpans;
+      TC->NumPages -= getSpanPages(Span);
+      return TakePages(TC, Span, Num);
+    }
+  }
+
+  if (uintptr_t Span = GlobalPop(Num))
+    return TakePages(TC, Span, Num);
+  return 0;
+}
+
+//===----------------------------------------------------------------------===//
+//  Page manager interface
+//===----------------------------------------------------------------------===//
+
 /// AllocatePage - This function returns a chunk of memory with size and
 /// alignment specified by PageSize.
 void *AllocatePage() {
@@ -55,27 +248,26 @@ void *AllocatePage() {
   posix_memalign(&Addr, PageSize, PageSize);
   return Addr;
 #else
+  return AllocateNPages(1);
+#endif
+}
 
-  FreePagesListType &FPL = getFreePageList();
+void *AllocateNPages(unsigned Num) {
+  if (Num == 0) Num = 1;
+  if (Num > PAGE_MAX_CACHED_SPAN)
+    return AllocateSpaceWithMMAP((size_t)Num*PageSize);
 
-  if (!FPL.empty()) {
-    void *Result = FPL.back();
-    FPL.pop_back();
+  PageThreadCache *TC = getThreadCache();
+  if (void *Result = ThreadCachePop(TC, Num))
     return Result;
-  }
 
-  // Allocate several pages, and put the extras on the freelist...
-  unsigned NumToAllocate = 8;
-  char *Ptr = (char*)AllocateSpaceWithMMAP(NumToAllocate*PageSize);
-  for (unsigned i = 1; i != NumToAllocate; ++i)
-    FPL.push_back(Ptr+i*PageSize);
+  // Allocate several pages at once for single page requests, and keep the
+  // extras in the thread cache.
+  unsigned NumToAllocate = Num == 1 ? PAGE_BATCH_SIZE : Num;
+  char *Ptr = (char*)AllocateSpaceWithMMAP((size_t)NumToAllocate*PageSize);
+  if (NumToAllocate != Num)
+    ThreadCachePush(TC, Ptr + (size_t)Num*PageSize, NumToAllocate - Num);
   return Ptr;
-#endif
-}
-
-void *AllocateNPages(unsigned Num) {
-  if (Num <= 1) return AllocatePage();
-  return AllocateSpaceWithMMAP(Num*PageSize);
 }
 
 /// FreePage - This function returns the specified page to the pagemanager for
@@ -84,7 +276,15 @@ void FreePage(void *Page) {
 #if USE_MEMALIGN
   free(Page);
 #else
-  FreePagesListType &FPL = getFreePageList();
-  FPL.push_back(Page);
+  FreeNPages(Page, 1);
 #endif
 }
+
+void FreeNPages(void *Page, unsigned Num) {
+  if (Num == 0) Num = 1;
+  if (Num > PAGE_MAX_CACHED_SPAN) {
+    UnmapPages(Page, Num);
+    return;
+  }
+  ThreadCachePush(getThreadCache(), Page, Num);
+}
@@ -30,11 +30,17 @@ extern unsigned PageSize;
 /// alignment specified by getPageSize().
 void *AllocatePage();
 
-/// AllocateNPages - 
+/// AllocateNPages - This function returns Num contiguous pages, aligned to
+/// PageSize.  Free them with FreeNPages, or one page at a time with FreePage.
 void *AllocateNPages(unsigned Num);
 
 /// FreePage - This function returns the specified page to the pagemanager for
 /// future allocation.
 void FreePage(void *Page);
 
+/// FreeNPages - This function returns Num contiguous pages starting at Page to
+/// the pagemanager.  Pages the pagemanager does not expect to reuse soon are
+/// given back to the system.
+void FreeNPages(void *Page, unsigned Num);
+
 #endif
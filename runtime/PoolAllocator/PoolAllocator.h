@@ -19,6 +19,10 @@ typedef struct PoolTy {
   // Ptr1, Ptr2 - Implementation specified data pointers.
   void *Ptr1, *Ptr2;
 
+  // PageMap - Implementation specified map from the pages of the pool to the
+  // slabs that hold them.
+  void *PageMap;
+
   // NodeSize - Keep track of the object size tracked by this pool
   unsigned NodeSize;
 
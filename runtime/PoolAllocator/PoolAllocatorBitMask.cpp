@@ -85,6 +85,36 @@ private:
     NodeFlagsVector[NodeNum/16] &= ~(1 << ((NodeNum & 15)+16));
   }
 
+  // markNodesAllocated - Mark the nodes in [Begin, End) allocated, a flag word
+  // at a time.
+  void markNodesAllocated(unsigned Begin, unsigned End) {
+    while (Begin != End) {
+      unsigned WordEnd = (Begin | 15) + 1;
+      if (WordEnd > End) WordEnd = End;
+      unsigned Bits = (1U << (WordEnd-Begin)) - 1;
+      NodeFlagsVector[Begin/16] |= Bits << (Begin & 15);
+      Begin = WordEnd;
+    }
+  }
+
+  // findNextNode - Return the first node in [NodeNum, Limit) that is free, or
+  // allocated if FindAllocated is set.  Return Limit if there is none.  The
+  // flag words are scanned 16 nodes at a time.
+  unsigned findNextNode(unsigned NodeNum, unsigned Limit,
+                        bool FindAllocated) const {
+    unsigned Invert = FindAllocated ? 0 : 0xFFFF;
+    while (NodeNum < Limit) {
+      unsigned Bits = ((NodeFlagsVector[NodeNum/16] ^ Invert) & 0xFFFF) >>
+                      (NodeNum & 15);
+      if (Bits) {
+        NodeNum += __builtin_ctz(Bits);
+        return NodeNum < Limit ? NodeNum : Limit;
+      }
+      NodeNum = (NodeNum | 15) + 1;
+    }
+    return Limit;
+  }
+
 public:
   // create - Create a new (empty) slab and add it to the end of the Pools list.
   static PoolSlab *create(PoolTy *Pool);
@@ -123,8 +153,21 @@ public:
     return NumNodesInSlab;
   }
 
+  // getNumPages - Return the number of pages that this slab occupies.  A
+  // single array slab does not use FirstUnused and UsedBegin, so they hold the
+  // low and high halves of the page count.
+  unsigned getNumPages() const {
+    return isSingleArray ? FirstUnused | (unsigned)UsedBegin << 16 : 1;
+  }
+
+  // setNumPages - Record the page count of a single array slab.
+  void setNumPages(unsigned NumPages) {
+    FirstUnused = NumPages & 0xFFFF;
+    UsedBegin = NumPages >> 16;
+  }
+
   // destroy - Release the memory for the current object.
-  void destroy();
+  void destroy(PoolTy *Pool);
 
   // isEmpty - This is a quick check to see if this slab is completely empty or
   // not.
@@ -166,6 +209,121 @@ public:
   unsigned lastNodeAllocated(unsigned ScanIdx);
 };
 
+//===----------------------------------------------------------------------===//
+//
+//  Slab page map
+//
+//  Each pool keeps a hash table from the pages it owns to the slabs that hold
+//  them, so that the slab containing an arbitrary pointer is found in constant
+//  time.  All pages of a multi-page single array map to its first page.  The
+//  table uses linear probing, and deletes by shifting later entries back.
+//
+//===----------------------------------------------------------------------===//
+
+struct SlabPageMap {
+  struct Entry {
+    unsigned long Page;   // Page number, or 0 if the entry is empty.
+    PoolSlab *Slab;
+  };
+
+  unsigned Size;          // Number of entries, a power of two.
+  unsigned NumUsed;
+  Entry Entries[];
+
+  unsigned getBucket(unsigned long Page) const {
+    return (unsigned)((Page * 0x9E3779B97F4A7C15ULL) >> 32) & (Size-1);
+  }
+};
+
+static inline unsigned long getPageNumber(void *Ptr) {
+  return (unsigned long)Ptr / PageSize;
+}
+
+static SlabPageMap *createSlabPageMap(unsigned Size) {
+  SlabPageMap *Map = (SlabPageMap*)calloc(1, sizeof(SlabPageMap) +
+                                          Size*sizeof(SlabPageMap::Entry));
+  assert(Map && "poolalloc: Could not allocate page map!");
+  Map->Size = Size;
+  return Map;
+}
+
+// insertIntoMap - Record that Page belongs to Slab.  The map must have a free
+// entry.
+static void insertIntoMap(SlabPageMap *Map, unsigned long Page,
+                          PoolSlab *Slab) {
+  unsigned B = Map->getBucket(Page);
+  while (Map->Entries[B].Page)
+    B = (B+1) & (Map->Size-1);
+  Map->Entries[B].Page = Page;
+  Map->Entries[B].Slab = Slab;
+  ++Map->NumUsed;
+}
+
+// addPagesToMap - Record that the NumPages pages starting at Slab belong to
+// Slab in the page map of Pool, growing the map if it gets too full.
+static void addPagesToMap(PoolTy *Pool, PoolSlab *Slab, unsigned NumPages) {
+  SlabPageMap *Map = (SlabPageMap*)Pool->PageMap;
+  if (Map == 0 || (Map->NumUsed+NumPages)*4 > Map->Size*3) {
+    unsigned NewSize = Map ? Map->Size*2 : 64;
+    while ((Map ? Map->NumUsed : 0)+NumPages > NewSize/4*3)
+      NewSize *= 2;
+
+    SlabPageMap *NewMap = createSlabPageMap(NewSize);
+    if (Map) {
+      for (unsigned i = 0; i != Map->Size; ++i)
+        if (Map->Entries[i].Page)
+          insertIntoMap(NewMap, Map->Entries[i].Page, Map->Entries[i].Slab);
+      free(Map);
+    }
+    Pool->PageMap = Map = NewMap;
+  }
+
+  unsigned long Page = getPageNumber(Slab);
+  for (unsigned i = 0; i != NumPages; ++i)
+    insertIntoMap(Map, Page+i, Slab);
+}
+
+// removePagesFromMap - Forget the NumPages pages starting at Slab.
+static void removePagesFromMap(PoolTy *Pool, PoolSlab *Slab,
+                               unsigned NumPages) {
+  SlabPageMap *Map = (SlabPageMap*)Pool->PageMap;
+  unsigned Mask = Map->Size-1;
+  unsigned long Page = getPageNumber(Slab);
+  for (unsigned long P = Page; P != Page+NumPages; ++P) {
+    unsigned B = Map->getBucket(P);
+    while (Map->Entries[B].Page != P) {
+      assert(Map->Entries[B].Page && "Page is not in the page map!");
+      B = (B+1) & Mask;
+    }
+
+    // Move back any later entry of the probe sequence that could not be found
+    // past the hole.
+    unsigned Hole = B;
+    for (unsigned I = (B+1) & Mask; Map->Entries[I].Page; I = (I+1) & Mask) {
+      unsigned Home = Map->getBucket(Map->Entries[I].Page);
+      if (((I-Home) & Mask) >= ((I-Hole) & Mask)) {
+        Map->Entries[Hole] = Map->Entries[I];
+        Hole = I;
+      }
+    }
+    Map->Entries[Hole].Page = 0;
+    --Map->NumUsed;
+  }
+}
+
+// findSlabInMap - Return the slab of Pool that holds the page containing Ptr,
+// or null if Ptr is not in the pool.
+static PoolSlab *findSlabInMap(PoolTy *Pool, void *Ptr) {
+  SlabPageMap *Map = (SlabPageMap*)Pool->PageMap;
+  if (Map == 0) return 0;
+  unsigned long Page = getPageNumber(Ptr);
+  for (unsigned B = Map->getBucket(Page); Map->Entries[B].Page;
+       B = (B+1) & (Map->Size-1))
+    if (Map->Entries[B].Page == Page)
+      return Map->Entries[B].Slab;
+  return 0;
+}
+
 // create - Create a new (empty) slab and add it to the end of the Pools list.
 PoolSlab *PoolSlab::create(PoolTy *Pool) {
   unsigned NodesPerSlab = getSlabSize(Pool);
@@ -183,6 +341,7 @@ PoolSlab *PoolSlab::create(PoolTy *Pool) {
 
   // Add the slab to the list...
   PS->addToList((PoolSlab**)&Pool->Ptr1);
+  addPagesToMap(Pool, PS, 1);
   return PS;
 }
 
@@ -198,16 +357,14 @@ void *PoolSlab::createSingleArray(PoolTy *Pool, unsigned NumNodes) {
   PS->addToList((PoolSlab**)&Pool->Ptr2);
 
   PS->isSingleArray = 1;  // Not a single array!
-  *(unsigned*)&PS->FirstUnused = NumPages;
+  PS->setNumPages(NumPages);
+  addPagesToMap(Pool, PS, NumPages);
   return PS->getElementAddress(0, 0);
 }
 
-void PoolSlab::destroy() {
-  if (isSingleArray)
-    for (unsigned NumPages = *(unsigned*)&FirstUnused; NumPages != 1;--NumPages)
-      FreePage((char*)this + (NumPages-1)*PageSize);
-
-  FreePage(this);
+void PoolSlab::destroy(PoolTy *Pool) {
+  removePagesFromMap(Pool, this, getNumPages());
+  FreeNPages(this, getNumPages());
 }
 
 // allocateSingle - Allocate a single element from this pool, returning -1 if
@@ -244,12 +401,8 @@ int PoolSlab::allocateSingle() {
     setStartBit(Idx);
     
     // Increment FirstUnused to point to the new first unused value...
-    // FIXME: this should be optimized
-    unsigned short FU = FirstUnused;
-    do {
-      ++FU;
-    } while (FU != SlabSize && isNodeAllocated(FU));
-    FirstUnused = FU;
+    FirstUnused = findNextNode(Idx+1, SlabSize, false);
+    if (Idx < UsedBegin) UsedBegin = Idx;
     
     return Idx;
   }
@@ -269,8 +422,7 @@ int PoolSlab::allocateMultiple(unsigned Size) {
     // Mark the returned entry used and set the start bit
     unsigned UE = UsedEnd;
     setStartBit(UE);
-    for (unsigned i = UE; i != UE+Size; ++i)
-      markNodeAllocated(i);
+    markNodesAllocated(UE, UE+Size);
     
     // If we are allocating out the first unused field, bump its index also
     if (FirstUnused == UE)
@@ -286,21 +438,18 @@ int PoolSlab::allocateMultiple(unsigned Size) {
   // If not, check to see if this node has a declared "FirstUnused" value
   // starting which Size nodes can be allocated
   //
+  unsigned SlabSize = getSlabSize();
   unsigned Idx = FirstUnused;
-  while (Idx+Size <= getSlabSize()) {
+  while (Idx+Size <= SlabSize) {
     assert(!isNodeAllocated(Idx) && "FirstUsed is not accurate!");
 
     // Check if there is a continuous array of Size nodes starting FirstUnused
-    unsigned LastUnused = Idx+1;
-    for (; LastUnused != Idx+Size && !isNodeAllocated(LastUnused); ++LastUnused)
-      /*empty*/;
+    unsigned LastUnused = findNextNode(Idx+1, Idx+Size, true);
 
     // If we found an unused section of this pool which is large enough, USE IT!
     if (LastUnused == Idx+Size) {
       setStartBit(Idx);
-      // FIXME: this loop can be made more efficient!
-      for (unsigned i = Idx; i != Idx + Size; ++i)
-        markNodeAllocated(i);
+      markNodesAllocated(Idx, Idx+Size);
 
       // This should not be allocating on the end of the pool, so we don't need
       // to bump the UsedEnd pointer.
@@ -308,16 +457,15 @@ int PoolSlab::allocateMultiple(unsigned Size) {
 
       // If we are allocating out the first unused field, bump its index also.
       if (Idx == FirstUnused)
-        FirstUnused += Size;
+        FirstUnused = findNextNode(Idx+Size, SlabSize, false);
+      if (Idx < UsedBegin) UsedBegin = Idx;
       
       // Return the entry
       return Idx;
     }
 
     // Otherwise, try later in the pool.  Find the next unused entry.
-    Idx = LastUnused;
-    while (Idx+Size <= getSlabSize() && isNodeAllocated(Idx))
-      ++Idx;
+    Idx = findNextNode(LastUnused, SlabSize, false);
   }
 
   return -1;
@@ -436,24 +584,15 @@ unsigned PoolSlab::lastNodeAllocated(unsigned ScanIdx) {
 ContainsAllocatedNode:
   // Figure out exactly which node is allocated in this word now.  The node
   // allocated is the one with the highest bit set in 'Flags'.
-  //
-  // This should use __builtin_clz to get the value, but this builtin is only
-  // available with GCC 3.4 and above.  :(
   assert(Flags && "Should have allocated node!");
   
-  unsigned short MSB;
-#if GCC3_4_EVENTUALLY
-  MSB = 16 - ::__builtin_clz(Flags);
-#else
-  for (MSB = 15; (Flags & (1U << MSB)) == 0; --MSB)
-    /*empty*/;
-#endif
+  unsigned MSB = 31 - __builtin_clz(Flags);
 
   assert((1U << MSB) & Flags);   // The bit should be set
   assert((~(1U << MSB) & Flags) < Flags);// Removing it should make flag smaller
   ScanIdx = CurWord*16 + MSB;
   assert(isNodeAllocated(ScanIdx));
-  return ScanIdx;
+  return ScanIdx+1;
 }
 
 
@@ -474,6 +613,7 @@ void poolinit(PoolTy *Pool, unsigned NodeSize) {
   // We must alway return unique pointers, even if they asked for 0 bytes
   Pool->NodeSize = NodeSize ? NodeSize : 1;
   Pool->Ptr1 = Pool->Ptr2 = 0;
+  Pool->PageMap = 0;
   Pool->FreeablePool = 1;
 }
 
@@ -491,7 +631,7 @@ void pooldestroy(PoolTy *Pool) {
   PoolSlab *PS = (PoolSlab*)Pool->Ptr1;
   while (PS) {
     PoolSlab *Next = PS->Next;
-    PS->destroy();
+    PS->destroy(Pool);
     PS = Next;
   }
 
@@ -499,9 +639,12 @@ void pooldestroy(PoolTy *Pool) {
   PS = (PoolSlab*)Pool->Ptr2;
   while (PS) {
     PoolSlab *Next = PS->Next;
-    PS->destroy();
+    PS->destroy(Pool);
     PS = Next;
   }
+
+  free(Pool->PageMap);
+  Pool->PageMap = 0;
 }
 
 
@@ -584,73 +727,31 @@ void *poolalloc(PoolTy *Pool, unsigned NumBytes) {
 
 
 
-// SearchForContainingSlab - Do a brute force search through the list of
-// allocated slabs for the node in question.
+// SearchForContainingSlab - Look up the slab that holds the node in question
+// in the page map of the pool.
 //
 static PoolSlab *SearchForContainingSlab(PoolTy *Pool, void *Node,
                                          unsigned &TheIndex) {
-  PoolSlab *PS = (PoolSlab*)Pool->Ptr1;
-  unsigned NodeSize = Pool->NodeSize;
+  PoolSlab *PS = findSlabInMap(Pool, Node);
+  assert(PS && "poolfree: node being free'd not found in allocation "
+         " pool specified!\n");
 
-  // Search the partially allocated slab list for the slab that contains this
-  // node.
-  int Idx = -1;
-  if (PS) {               // Pool->Ptr1 could be null if Ptr2 isn't
-    for (; PS; PS = PS->Next) {
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-    }
-  }
-
-  // If the partially allocated slab list doesn't contain it, maybe the
-  // completely allocated list does.
-  if (PS == 0) {
-    PS = (PoolSlab*)Pool->Ptr2;
-    assert(Idx == -1 && "Found node but don't have PS?");
-    
-    while (1) {
-      assert(PS && "poolfree: node being free'd not found in allocation "
-             " pool specified!\n");
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-      PS = PS->Next;
-    }
+  int Idx = 0;
+  if (!PS->isSingleArray) {
+    Idx = PS->containsElement(Node, Pool->NodeSize);
+    assert(Idx != -1 && "Node not contained in slab??");
   }
   TheIndex = Idx;
   return PS;
 }
 
 // same as above, but this is the actual run time check called from the
-// code to check if the node belongs to the pool or not, so will be 
-// like crazy, (use a hash table ?)
+// code to check if the node belongs to the pool or not.
 // FIXME cannot call this for pointers in the middle of the node yet,
 // asserts out if we do
 void poolcheck(PoolTy *Pool, void *Node) {
-   PoolSlab *PS = (PoolSlab*)Pool->Ptr1;
-  unsigned NodeSize = Pool->NodeSize;
-
-  // Search the partially allocated slab list for the slab that contains this
-  // node.
-  int Idx = -1;
-  if (PS) {               // Pool->Ptr1 could be null if Ptr2 isn't
-    for (; PS; PS = PS->Next) {
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-    }
-  }
-
-  // If the partially allocated slab list doesn't contain it, maybe the
-  // completely allocated list does.
-  if (PS == 0) {
-    PS = (PoolSlab*)Pool->Ptr2;
-    while (1) {
-      assert(PS && "poolfree: node being free'd not found in allocation "
-             " pool specified!\n");
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-      PS = PS->Next;
-    }
-  }
+  unsigned Idx;
+  SearchForContainingSlab(Pool, Node, Idx);
 }
 
 void poolfree(PoolTy *Pool, void *Node) {
@@ -667,16 +768,19 @@ void poolfree(PoolTy *Pool, void *Node) {
     // pointer in the pool.  Mask off some bits of the address to find the base
     // of the pool.
     assert((PageSize & PageSize-1) == 0 && "Page size is not a power of 2??");
-    PS = (PoolSlab*)((long)Node & ~(PageSize-1));
+    PS = (PoolSlab*)((unsigned long)Node & ~((unsigned long)PageSize-1));
+    assert(PS == findSlabInMap(Pool, Node) && "Node not in this pool??");
 
-    if (PS->isSingleArray) {
-      PS->unlinkFromList();
-      PS->destroy();
-      return;
+    if (!PS->isSingleArray) {
+      Idx = PS->containsElement(Node, Pool->NodeSize);
+      assert((int)Idx != -1 && "Node not contained in slab??");
     }
+  }
 
-    Idx = PS->containsElement(Node, Pool->NodeSize);
-    assert((int)Idx != -1 && "Node not contained in slab??");
+  if (PS->isSingleArray) {
+    PS->unlinkFromList();
+    PS->destroy(Pool);
+    return;
   }
 
   // If PS was full, it must have been in list #2.  Unlink it and move it to
@@ -715,7 +819,7 @@ void poolfree(PoolTy *Pool, void *Node) {
       // from because the pool we just freed from is more likely to be in the
       // processor cache.
       FirstSlab->unlinkFromList();
-      FirstSlab->destroy();
+      FirstSlab->destroy(Pool);
     }
 
     // Link our slab onto the head of the list so that allocations will find it
@@ -0,0 +1,385 @@
+//===- PoolAllocator.cpp - Slab manager pool allocator runtime ------------===//
+// 
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+// 
+//===----------------------------------------------------------------------===//
+//
+// This file exports the policy based pools of poolalloc_runtime/PoolAllocator.h
+// through the same C entry points as the FL2 runtime, so that a pool allocated
+// program can be linked against either library.  The exception is a program
+// built with -poolalloc-inline-fast-path, whose inlined code works on the FL2
+// pool descriptor and object headers directly.
+//
+// The slab manager is chosen once per process from the POOLALLOC_SLAB_MANAGER
+// environment variable:
+//   bitmask - Fixed size objects come from BitMaskSlabManager, and arrays from
+//             MallocSlabManager.  This is the default.
+//   malloc  - Every object comes from MallocSlabManager.
+// Bump pointer pools carve their objects out of malloc'ed chunks either way.
+//
+// Each pool is protected by its own lock.  Single-threaded and lock-free pools
+// are ordinary pools here, and no statistics are kept.
+//
+//===----------------------------------------------------------------------===//
+
+#include "poolalloc_runtime/PoolAllocator.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+  typedef PoolAllocator<CompoundSlabManager<BitMaskSlabManager<LinuxMmap>,
+                                            MallocSlabManager<> > > BitMaskPool;
+  typedef PoolAllocator<MallocSlabManager<> > MallocPool;
+
+  enum SlabManagerKind {
+    BitMaskKind,
+    MallocKind,
+    BumpKind
+  };
+
+  // BumpChunks - The state of a bump pointer pool.  Objects are carved from
+  // Cur up to End, and Chunks lists all chunks of the pool.
+  struct BumpChunks {
+    char *Cur, *End;
+    void *Chunks;
+  };
+
+  // SlabPool - The pool descriptor.  This must fit in the descriptor the pool
+  // allocator pass reserves, see PoolAllocate::getPoolType.
+  struct SlabPool {
+    pthread_mutex_t Lock;
+    unsigned ObjSize;
+    unsigned Alignment;
+    SlabManagerKind Kind;
+    union {
+      void *ForAlignment;
+      char BitMask[sizeof(BitMaskPool)];
+      char Malloc[sizeof(MallocPool)];
+      BumpChunks Bump;
+    } Storage;
+
+    BitMaskPool *getBitMaskPool() { return (BitMaskPool*)Storage.BitMask; }
+    MallocPool *getMallocPool() { return (MallocPool*)Storage.Malloc; }
+  };
+
+  typedef char SlabPoolFitsInDescriptor
+    [sizeof(SlabPool) <= 32 * sizeof(void*) ? 1 : -1];
+}
+
+extern "C" {
+  void poolinit(SlabPool *Pool, unsigned DeclaredSize, unsigned ObjAlignment);
+  void pooldestroy(SlabPool *Pool);
+  void *poolalloc(SlabPool *Pool, unsigned NumBytes);
+  void *poolcalloc(SlabPool *Pool, unsigned NumBytes, unsigned NumElements);
+  void *poolrealloc(SlabPool *Pool, void *Node, unsigned NumBytes);
+  void *poolmemalign(SlabPool *Pool, unsigned Alignment, unsigned NumBytes);
+  void *poolstrdup(SlabPool *Pool, const char *Str);
+  void poolfree(SlabPool *Pool, void *Node);
+  void poolalloc_n(SlabPool *Pool, unsigned NumBytes, unsigned Count,
+                   void **Out);
+  void poolfree_n(SlabPool *Pool, void **Ptrs, unsigned Count);
+  unsigned poolobjsize(SlabPool *Pool, void *Node);
+
+  void poolinit_bp(SlabPool *Pool, unsigned ObjAlignment);
+  void *poolalloc_bp(SlabPool *Pool, unsigned NumBytes);
+  void pooldestroy_bp(SlabPool *Pool);
+
+  void poolinit_st(SlabPool *Pool, unsigned DeclaredSize,
+                   unsigned ObjAlignment);
+  void *poolalloc_st(SlabPool *Pool, unsigned NumBytes);
+  void poolfree_st(SlabPool *Pool, void *Node);
+  void poolinit_lf(SlabPool *Pool, unsigned DeclaredSize,
+                   unsigned ObjAlignment);
+  void poolprofile_name(SlabPool *Pool, const char *Name);
+
+#define POOLALLOC_SIZE(Size, Align) \
+  void *poolalloc_##Size##_##Align(SlabPool *Pool);
+#include "poolalloc/PoolAllocSizes.def"
+}
+
+// BUMP_CHUNK_SIZE - The size of the chunks bump pointer pools allocate from.
+// Objects bigger than a quarter of this get a chunk of their own.
+#define BUMP_CHUNK_SIZE (64*1024)
+
+//===----------------------------------------------------------------------===//
+//  Slab manager selection
+//===----------------------------------------------------------------------===//
+
+static SlabManagerKind DefaultKind = BitMaskKind;
+static pthread_once_t DefaultKindOnce = PTHREAD_ONCE_INIT;
+
+static void InitDefaultKind() {
+  const char *Env = getenv("POOLALLOC_SLAB_MANAGER");
+  if (Env && !strcmp(Env, "malloc"))
+    DefaultKind = MallocKind;
+}
+
+//===----------------------------------------------------------------------===//
+//  Unlocked pool operations
+//===----------------------------------------------------------------------===//
+
+// BumpAlloc - Carve NumBytes out of the current chunk of a bump pointer pool,
+// starting a new chunk if it is full.  Chunks start with a pointer to the next
+// chunk of the pool.
+static void *BumpAlloc(SlabPool *Pool, unsigned NumBytes) {
+  BumpChunks &B = Pool->Storage.Bump;
+  uintptr_t Mask = Pool->Alignment - 1;
+  char *Start = (char*)(((uintptr_t)B.Cur + Mask) & ~Mask);
+  if (B.Cur && Start <= B.End && NumBytes <= (size_t)(B.End - Start)) {
+    B.Cur = Start + NumBytes;
+    return Start;
+  }
+
+  size_t Size = sizeof(void*) + Mask + NumBytes;
+  bool OwnChunk = Size > BUMP_CHUNK_SIZE/4;
+  if (!OwnChunk)
+    Size = BUMP_CHUNK_SIZE;
+  void **Chunk = (void**)malloc(Size);
+  if (!Chunk) return 0;
+  *Chunk = B.Chunks;
+  B.Chunks = Chunk;
+
+  Start = (char*)(((uintptr_t)(Chunk + 1) + Mask) & ~Mask);
+  // Keep bumping through the current chunk after a big object.
+  if (!OwnChunk) {
+    B.Cur = Start + NumBytes;
+    B.End = (char*)Chunk + Size;
+  }
+  return Start;
+}
+
+static inline void *AllocInternal(SlabPool *Pool, unsigned NumBytes) {
+  if (Pool->Kind == BumpKind)
+    return BumpAlloc(Pool, NumBytes);
+  unsigned Num = NumBytes <= Pool->ObjSize ? 1 :
+                 (NumBytes + Pool->ObjSize - 1) / Pool->ObjSize;
+  if (Pool->Kind == BitMaskKind)
+    return Pool->getBitMaskPool()->alloc(Num);
+  return Pool->getMallocPool()->alloc(Num);
+}
+
+// FreeInternal - Free Node.  Objects of bump pointer pools are only freed
+// with the whole pool.
+static inline void FreeInternal(SlabPool *Pool, void *Node) {
+  if (Pool->Kind == BitMaskKind)
+    Pool->getBitMaskPool()->dealloc(Node);
+  else if (Pool->Kind == MallocKind)
+    Pool->getMallocPool()->dealloc(Node);
+}
+
+// ObjSizeInternal - Return the number of bytes from Node to the end of the
+// object containing it, or 0 if Node is not in an allocated object.  Bump
+// pointer pools do not know the size of their objects.
+static inline unsigned ObjSizeInternal(SlabPool *Pool, void *Node) {
+  if (Pool->Kind == BumpKind) return 0;
+  void *Start, *End;
+  bool Found = Pool->Kind == BitMaskKind ?
+    Pool->getBitMaskPool()->getBounds(Node, Start, End) :
+    Pool->getMallocPool()->getBounds(Node, Start, End);
+  if (!Found) return 0;
+  return (char*)End - (char*)Node + 1;
+}
+
+//===----------------------------------------------------------------------===//
+//  Pool allocator library entry points
+//===----------------------------------------------------------------------===//
+
+void poolinit(SlabPool *Pool, unsigned DeclaredSize, unsigned ObjAlignment) {
+  assert(Pool && "Null pool pointer passed into poolinit!\n");
+  pthread_once(&DefaultKindOnce, InitDefaultKind);
+
+  if (ObjAlignment < sizeof(void*))
+    ObjAlignment = sizeof(void*);
+  if (DeclaredSize == 0)
+    DeclaredSize = ObjAlignment;
+
+  pthread_mutex_init(&Pool->Lock, 0);
+  Pool->ObjSize = DeclaredSize;
+  Pool->Alignment = ObjAlignment;
+  Pool->Kind = DefaultKind;
+  if (Pool->Kind == BitMaskKind)
+    new (Pool->Storage.BitMask) BitMaskPool(DeclaredSize, ObjAlignment);
+  else
+    new (Pool->Storage.Malloc) MallocPool(DeclaredSize, ObjAlignment);
+}
+
+// pooldestroy - Release all memory allocated for a pool
+//
+void pooldestroy(SlabPool *Pool) {
+  assert(Pool && "Null pool pointer passed in to pooldestroy!\n");
+  if (Pool->Kind == BitMaskKind) {
+    Pool->getBitMaskPool()->~BitMaskPool();
+  } else if (Pool->Kind == MallocKind) {
+    Pool->getMallocPool()->~MallocPool();
+  } else {
+    for (void *Chunk = Pool->Storage.Bump.Chunks; Chunk; ) {
+      void *Next = *(void**)Chunk;
+      free(Chunk);
+      Chunk = Next;
+    }
+  }
+  pthread_mutex_destroy(&Pool->Lock);
+}
+
+void *poolalloc(SlabPool *Pool, unsigned NumBytes) {
+  if (!Pool) return malloc(NumBytes);
+  pthread_mutex_lock(&Pool->Lock);
+  void *Result = AllocInternal(Pool, NumBytes);
+  pthread_mutex_unlock(&Pool->Lock);
+  return Result;
+}
+
+void *poolcalloc(SlabPool *Pool, unsigned NumBytes, unsigned NumElements) {
+  void *Result = poolalloc(Pool, NumBytes * NumElements);
+  if (Result)
+    memset(Result, 0, NumBytes * NumElements);
+  return Result;
+}
+
+void *poolrealloc(SlabPool *Pool, void *Node, unsigned NumBytes) {
+  if (!Pool) return realloc(Node, NumBytes);
+  if (Node == 0) return poolalloc(Pool, NumBytes);
+  if (NumBytes == 0) {
+    poolfree(Pool, Node);
+    return 0;
+  }
+
+  pthread_mutex_lock(&Pool->Lock);
+  void *Result = Node;
+  unsigned OldSize = ObjSizeInternal(Pool, Node);
+  if (NumBytes > OldSize) {
+    Result = AllocInternal(Pool, NumBytes);
+    if (Result) {
+      memcpy(Result, Node, OldSize);
+      FreeInternal(Pool, Node);
+    }
+  }
+  pthread_mutex_unlock(&Pool->Lock);
+  return Result;
+}
+
+void *poolmemalign(SlabPool *Pool, unsigned Alignment, unsigned NumBytes) {
+  if (Pool && Alignment <= Pool->Alignment)
+    return poolalloc(Pool, NumBytes);
+
+  // Both slab managers free an object given any pointer into it, so the
+  // rounded up pointer can be passed to poolfree.
+  intptr_t Base = (intptr_t)poolalloc(Pool, NumBytes + Alignment - 1);
+  return (void*)((Base + (Alignment - 1)) & ~((intptr_t)Alignment - 1));
+}
+
+void *poolstrdup(SlabPool *Pool, const char *Str) {
+  unsigned Len = strlen(Str) + 1;
+  void *Result = poolalloc(Pool, Len);
+  if (Result)
+    memcpy(Result, Str, Len);
+  return Result;
+}
+
+void poolfree(SlabPool *Pool, void *Node) {
+  if (!Node) return;
+  if (!Pool) {
+    free(Node);
+    return;
+  }
+  pthread_mutex_lock(&Pool->Lock);
+  FreeInternal(Pool, Node);
+  pthread_mutex_unlock(&Pool->Lock);
+}
+
+void poolalloc_n(SlabPool *Pool, unsigned NumBytes, unsigned Count,
+                 void **Out) {
+  if (!Pool) {
+    for (unsigned i = 0; i != Count; ++i)
+      Out[i] = malloc(NumBytes);
+    return;
+  }
+  pthread_mutex_lock(&Pool->Lock);
+  for (unsigned i = 0; i != Count; ++i)
+    Out[i] = AllocInternal(Pool, NumBytes);
+  pthread_mutex_unlock(&Pool->Lock);
+}
+
+void poolfree_n(SlabPool *Pool, void **Ptrs, unsigned Count) {
+  if (!Pool) {
+    for (unsigned i = 0; i != Count; ++i)
+      free(Ptrs[i]);
+    return;
+  }
+  pthread_mutex_lock(&Pool->Lock);
+  for (unsigned i = 0; i != Count; ++i)
+    if (Ptrs[i])
+      FreeInternal(Pool, Ptrs[i]);
+  pthread_mutex_unlock(&Pool->Lock);
+}
+
+unsigned poolobjsize(SlabPool *Pool, void *Node) {
+  if (!Pool || !Node) return 0;
+  pthread_mutex_lock(&Pool->Lock);
+  unsigned Size = ObjSizeInternal(Pool, Node);
+  pthread_mutex_unlock(&Pool->Lock);
+  return Size;
+}
+
+//===----------------------------------------------------------------------===//
+//  Bump pointer pool entry points.  These pools never see poolfree, so their
+//  objects are carved back to back out of chunks that are freed with the pool.
+//===----------------------------------------------------------------------===//
+
+void poolinit_bp(SlabPool *Pool, unsigned ObjAlignment) {
+  assert(Pool && "Null pool pointer passed into poolinit_bp!\n");
+  if (ObjAlignment < sizeof(void*))
+    ObjAlignment = sizeof(void*);
+
+  pthread_mutex_init(&Pool->Lock, 0);
+  Pool->ObjSize = 0;
+  Pool->Alignment = ObjAlignment;
+  Pool->Kind = BumpKind;
+  Pool->Storage.Bump.Cur = Pool->Storage.Bump.End = 0;
+  Pool->Storage.Bump.Chunks = 0;
+}
+
+void *poolalloc_bp(SlabPool *Pool, unsigned NumBytes) {
+  return poolalloc(Pool, NumBytes);
+}
+
+void pooldestroy_bp(SlabPool *Pool) {
+  pooldestroy(Pool);
+}
+
+//===----------------------------------------------------------------------===//
+//  Entry points of the FL2 runtime that only change how a pool is used.  The
+//  pools of this library are always locked and keep no statistics, so these
+//  are plain pool operations.
+//===----------------------------------------------------------------------===//
+
+void poolinit_st(SlabPool *Pool, unsigned DeclaredSize,
+                 unsigned ObjAlignment) {
+  poolinit(Pool, DeclaredSize, ObjAlignment);
+}
+
+void *poolalloc_st(SlabPool *Pool, unsigned NumBytes) {
+  return poolalloc(Pool, NumBytes);
+}
+
+void poolfree_st(SlabPool *Pool, void *Node) {
+  poolfree(Pool, Node);
+}
+
+void poolinit_lf(SlabPool *Pool, unsigned DeclaredSize,
+                 unsigned ObjAlignment) {
+  poolinit(Pool, DeclaredSize, ObjAlignment);
+}
+
+void poolprofile_name(SlabPool *, const char *) {
+}
+
+#define POOLALLOC_SIZE(Size, Align)                 \
+  void *poolalloc_##Size##_##Align(SlabPool *Pool) { \
+    return poolalloc(Pool, Size);                    \
+  }
+#include "poolalloc/PoolAllocSizes.def"
@@ -0,0 +1,95 @@
+; The top-down pass must build the same graphs whether it inlines callers on
+; one thread or on several.  Callees here have several callers each, so a
+; graph only becomes final once every caller's information has been merged
+; into it, and the callers that are ready at the same time run in parallel.
+
+;RUN: dsaopt %s -dsa-td -dsa-td-threads=1 -analyze -print-canonical-graphs > %t.1
+;RUN: dsaopt %s -dsa-td -dsa-td-threads=4 -analyze -print-canonical-graphs > %t.4
+;RUN: diff %t.1 %t.4
+;RUN: FileCheck %s < %t.4
+;RUN: dsaopt %s -dsa-eqtd -dsa-td-threads=1 -analyze -print-canonical-graphs > %t.e1
+;RUN: dsaopt %s -dsa-eqtd -dsa-td-threads=4 -analyze -print-canonical-graphs > %t.e4
+;RUN: diff %t.e1 %t.e4
+
+;CHECK: graph globals
+;CHECK: graph sink
+;CHECK: value sink:p ->
+;CHECK: graph main
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.obj = type { i32*, %struct.obj* }
+
+@shared = global %struct.obj* null
+@handler = global void (%struct.obj*)* @sink
+
+declare noalias i8* @malloc(i64) nounwind
+
+; sink - Called directly from two callers and indirectly from a third.
+define void @sink(%struct.obj* %p) nounwind {
+entry:
+  %f = getelementptr inbounds %struct.obj, %struct.obj* %p, i32 0, i32 0
+  %v = load i32*, i32** %f
+  store i32 0, i32* %v
+  ret void
+}
+
+; chain - A recursive SCC between the callers and sink.
+define void @chain(%struct.obj* %p, i32 %n) nounwind {
+entry:
+  %done = icmp eq i32 %n, 0
+  br i1 %done, label %last, label %more
+
+more:
+  %nextp = getelementptr inbounds %struct.obj, %struct.obj* %p, i32 0, i32 1
+  %next = load %struct.obj*, %struct.obj** %nextp
+  %m = sub i32 %n, 1
+  call void @chain(%struct.obj* %next, i32 %m) nounwind
+  br label %last
+
+last:
+  call void @sink(%struct.obj* %p) nounwind
+  ret void
+}
+
+define void @first() nounwind {
+entry:
+  %mem = call i8* @malloc(i64 16) nounwind
+  %o = bitcast i8* %mem to %struct.obj*
+  %imem = call i8* @malloc(i64 4) nounwind
+  %i = bitcast i8* %imem to i32*
+  %f = getelementptr inbounds %struct.obj, %struct.obj* %o, i32 0, i32 0
+  store i32* %i, i32** %f
+  call void @sink(%struct.obj* %o) nounwind
+  call void @chain(%struct.obj* %o, i32 3) nounwind
+  ret void
+}
+
+define void @second() nounwind {
+entry:
+  %o = alloca %struct.obj
+  %i = alloca i32
+  %f = getelementptr inbounds %struct.obj, %struct.obj* %o, i32 0, i32 0
+  store i32* %i, i32** %f
+  store %struct.obj* %o, %struct.obj** @shared
+  call void @sink(%struct.obj* %o) nounwind
+  ret void
+}
+
+define void @third() nounwind {
+entry:
+  %o = load %struct.obj*, %struct.obj** @shared
+  %h = load void (%struct.obj*)*, void (%struct.obj*)** @handler
+  call void %h(%struct.obj* %o) nounwind
+  call void @chain(%struct.obj* %o, i32 1) nounwind
+  ret void
+}
+
+define i32 @main() nounwind {
+entry:
+  call void @first() nounwind
+  call void @second() nounwind
+  call void @third() nounwind
+  ret i32 0
+}
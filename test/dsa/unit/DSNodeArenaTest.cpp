@@ -0,0 +1,198 @@
+//===- DSNodeArenaTest.cpp - Tests of the DSNode arena --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Allocate chunks from DSNodeArenas the way DSNode's operator new does, with a
+// header in front of each node that names its arena.  Check that chunks are
+// aligned and disjoint, that deleted ones are reused before the arena grows,
+// and that an arena lives exactly as long as its graph or any of its nodes,
+// including nodes that were spliced into another graph.  The global operator
+// new and delete are replaced to count the blocks that are live, so that an
+// arena that is freed too late shows up without a leak checker.  One freed too
+// early shows up under AddressSanitizer.  The sanitizers bring their own
+// operator new, so the blocks are not counted under them.
+//
+//===----------------------------------------------------------------------===//
+
+#include "dsa/DSNodeArena.h"
+#include "TestCheck.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+using namespace llvm;
+
+// LiveBlocks - The number of blocks from operator new not yet deleted.
+static long LiveBlocks = 0;
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define CHECK_HEAP(X)
+#else
+#define CHECK_HEAP(X) CHECK(X)
+
+void *operator new(size_t Size) {
+  void *P = malloc(Size ? Size : 1);
+  if (!P) abort();
+  ++LiveBlocks;
+  return P;
+}
+
+void operator delete(void *P) noexcept {
+  if (!P) return;
+  --LiveBlocks;
+  free(P);
+}
+#endif
+
+// Node - Stands in for a DSNode, which is a few pointers and counters.
+struct Node {
+  Node *Next;
+  void *Fields[8];
+  unsigned Size, Id;
+};
+
+// The header in front of every node, as in DataStructure.cpp.
+static const size_t NodeHeaderSize = alignof(Node);
+static const size_t ChunkSize = NodeHeaderSize + sizeof(Node);
+
+static Node *newNode(DSNodeArena &Arena, unsigned Id) {
+  char *Chunk = (char*)Arena.Allocate(ChunkSize, alignof(Node));
+  CHECK(((uintptr_t)Chunk & (alignof(Node)-1)) == 0);
+  *(DSNodeArena**)Chunk = &Arena;
+  Node *N = new (Chunk + NodeHeaderSize) Node();
+  N->Id = Id;
+  return N;
+}
+
+static void deleteNode(Node *N) {
+  char *Chunk = (char*)N - NodeHeaderSize;
+  N->~Node();
+  (*(DSNodeArena**)Chunk)->Deallocate(Chunk);
+}
+
+static int comparePtrs(const void *LHS, const void *RHS) {
+  char *L = *(char*const*)LHS, *R = *(char*const*)RHS;
+  return L < R ? -1 : (L > R ? 1 : 0);
+}
+
+// checkDisjoint - The chunks of the nodes in Nodes must not overlap.
+static void checkDisjoint(std::vector<Node*> Nodes) {
+  qsort(&Nodes[0], Nodes.size(), sizeof(Node*), comparePtrs);
+  for (unsigned i = 1; i < Nodes.size(); ++i)
+    CHECK((char*)Nodes[i-1] + sizeof(Node) + NodeHeaderSize <=
+          (char*)Nodes[i]);
+}
+
+// testReuse - Rounds of allocating and deleting many nodes.  Deleted nodes
+// are handed out again, most recently deleted first, so rounds after the
+// first need no new memory.
+static void testReuse() {
+  std::vector<Node*> Nodes;
+  Nodes.reserve(100000);
+  long Before = LiveBlocks;
+  DSNodeArena *Arena = new DSNodeArena();
+  long Grown = 0;
+  for (unsigned Round = 0; Round != 3; ++Round) {
+    for (unsigned i = 0; i != 100000; ++i)
+      Nodes.push_back(newNode(*Arena, i));
+    if (Round == 0) {
+      Grown = LiveBlocks;
+      checkDisjoint(Nodes);
+    }
+    CHECK_HEAP(LiveBlocks == Grown);
+    for (unsigned i = 0; i != Nodes.size(); ++i)
+      CHECK(Nodes[i]->Id == i);
+    // Delete every other node first, then the rest.
+    for (unsigned i = 0; i < Nodes.size(); i += 2)
+      deleteNode(Nodes[i]);
+    Node *Last = Nodes[Nodes.size() - 2];
+    Node *Again = newNode(*Arena, 0);
+    CHECK(Again == Last);
+    deleteNode(Again);
+    for (unsigned i = 1; i < Nodes.size(); i += 2)
+      deleteNode(Nodes[i]);
+    Nodes.clear();
+  }
+  Arena->release();
+  CHECK_HEAP(LiveBlocks == Before);
+}
+
+// testOutliveGraph - Nodes can outlive the graph that created them: the slabs
+// stay until the last node is deleted.
+static void testOutliveGraph() {
+  std::vector<Node*> Nodes;
+  Nodes.reserve(1000);
+  long Before = LiveBlocks;
+  DSNodeArena *Arena = new DSNodeArena();
+  for (unsigned i = 0; i != 1000; ++i)
+    Nodes.push_back(newNode(*Arena, i));
+  for (unsigned i = 10; i != 1000; ++i)
+    deleteNode(Nodes[i]);
+  Nodes.resize(10);
+
+  // The graph goes away; the ten nodes left must still be usable.
+  Arena->release();
+  CHECK_HEAP(LiveBlocks > Before);
+  for (unsigned i = 0; i != 10; ++i) {
+    memset(Nodes[i]->Fields, 0xA5, sizeof(Nodes[i]->Fields));
+    CHECK(Nodes[i]->Id == i);
+  }
+  for (unsigned i = 0; i != 9; ++i)
+    deleteNode(Nodes[i]);
+  CHECK_HEAP(LiveBlocks > Before);
+  deleteNode(Nodes[9]);
+  CHECK_HEAP(LiveBlocks == Before);
+
+  // An arena with no nodes left goes with its graph.
+  Arena = new DSNodeArena();
+  deleteNode(newNode(*Arena, 0));
+  Arena->release();
+  CHECK_HEAP(LiveBlocks == Before);
+}
+
+// testSplice - As with DSGraph::spliceFrom, nodes from two arenas end up in
+// one graph and are deleted together; each goes back to its own arena.
+static void testSplice() {
+  long Before = LiveBlocks;
+  DSNodeArena *A = new DSNodeArena(), *B = new DSNodeArena();
+  Node *List = 0;
+  for (unsigned i = 0; i != 500; ++i) {
+    Node *N = newNode(i % 3 ? *A : *B, i);
+    N->Next = List;
+    List = N;
+  }
+  // The graph that owned A is gone once its nodes are spliced away.
+  A->release();
+  CHECK_HEAP(LiveBlocks > Before);
+
+  // Deleting the nodes from B's graph frees A with its last node.
+  while (Node *N = List) {
+    List = N->Next;
+    deleteNode(N);
+  }
+  // Only B and its slabs are left, and its freed nodes are reused.
+  long OnlyB = LiveBlocks;
+  CHECK_HEAP(OnlyB > Before);
+  for (unsigned i = 0; i != 100; ++i)
+    deleteNode(newNode(*B, i));
+  CHECK_HEAP(LiveBlocks == OnlyB);
+  B->release();
+  CHECK_HEAP(LiveBlocks == Before);
+}
+
+int main() {
+  testReuse();
+  testOutliveGraph();
+  testSplice();
+
+  return reportFailures();
+}
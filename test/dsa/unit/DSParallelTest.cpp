@@ -0,0 +1,87 @@
+//===- DSParallelTest.cpp - Tests of the DSA threading helpers ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Run a DSWorkQueue the way the top-down pass does, with each piece ordered
+// after the pieces it depends on, and check that every piece runs exactly once
+// and only after all of them.  Each piece also updates a counter shared with
+// other pieces under a DSGraphLocks lock, standing in for the referrer counts
+// of a caller graph.  Run under ThreadSanitizer to see races.
+//
+//===----------------------------------------------------------------------===//
+
+#include "dsa/DSParallel.h"
+#include "TestCheck.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+
+using namespace llvm;
+
+static const unsigned NumPieces = 2000;
+static const unsigned NumShared = 7;
+
+// testQueue - Pieces that depend on a few of the pieces before them, as
+// callees wait for callers that come earlier in reverse post-order.
+static void testQueue(unsigned NumThreads) {
+  std::vector<std::vector<unsigned> > Before(NumPieces);
+  DSWorkQueue Queue(NumPieces);
+  for (unsigned i = 0; i != NumPieces; ++i)
+    for (unsigned j = i + 1; j < NumPieces && j < i + 6; j += 2) {
+      Queue.addEdge(i, j);
+      Before[j].push_back(i);
+    }
+
+  std::vector<std::atomic<unsigned> > Runs(NumPieces);
+  std::atomic<unsigned> OutOfOrder(0);
+  DSGraphLocks Locks;
+  unsigned Shared[NumShared] = { 0 };
+  Queue.run(NumThreads, [&](unsigned i) {
+    for (unsigned b = 0; b != Before[i].size(); ++b)
+      if (Runs[Before[i][b]] != 1)
+        ++OutOfOrder;
+    ++Runs[i];
+    // Any pointer stands in for a graph.
+    const DSGraph *G = (const DSGraph*)(uintptr_t)(i % NumShared + 1);
+    OptionalLock Guard(Locks.get(G));
+    ++Shared[i % NumShared];
+  });
+
+  CHECK(OutOfOrder == 0);
+  unsigned Total = 0;
+  for (unsigned i = 0; i != NumPieces; ++i)
+    CHECK(Runs[i] == 1);
+  for (unsigned i = 0; i != NumShared; ++i)
+    Total += Shared[i];
+  CHECK(Total == NumPieces);
+}
+
+// testOneThread - On one thread, the pieces ready from the start are handed
+// out lowest number first, and a piece that becomes ready goes next.
+static void testOneThread() {
+  DSWorkQueue Queue(6);
+  Queue.addEdge(0, 3);
+  Queue.addEdge(1, 3);
+  Queue.addEdge(3, 4);
+  std::vector<unsigned> Order;
+  Queue.run(1, [&](unsigned i) { Order.push_back(i); });
+  static const unsigned Expected[] = { 0, 1, 3, 4, 2, 5 };
+  CHECK(Order == std::vector<unsigned>(Expected, Expected + 6));
+}
+
+int main() {
+  testOneThread();
+  for (unsigned Round = 0; Round != 10; ++Round) {
+    testQueue(1);
+    testQueue(4);
+  }
+
+  return reportFailures();
+}
@@ -0,0 +1,268 @@
+//===- SVMapTest.cpp - Tests of svmap against std::map --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Put svmap and std::map through the same random operations and compare them.
+// Then replay the ways DSNode walks and changes its links - addEdgeTo merging
+// into the node whose edge it found, cleanEdges erasing while it iterates, and
+// computeNodeMapping recursing while nodes grow - on small graphs whose links
+// are kept in either kind of map.  Unlike std::map, svmap moves its entries on
+// insert and erase, so code that held on to one would read freed or shifted
+// memory here; run under AddressSanitizer to see the former.
+//
+//===----------------------------------------------------------------------===//
+
+#include "dsa/svmap.h"
+#include "TestCheck.h"
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+
+// A fixed xorshift generator, so that a failure can be reproduced.
+static unsigned Seed = 2463534242u;
+static unsigned randomInt(unsigned N) {
+  Seed ^= Seed << 13;
+  Seed ^= Seed >> 17;
+  Seed ^= Seed << 5;
+  return Seed % N;
+}
+
+typedef svmap<unsigned, int> SVMap;
+typedef std::map<unsigned, int> RefMap;
+
+static bool sameContents(const SVMap &M, const RefMap &Ref) {
+  if (M.size() != Ref.size() || M.empty() != Ref.empty())
+    return false;
+  RefMap::const_iterator R = Ref.begin();
+  for (SVMap::const_iterator I = M.begin(), E = M.end(); I != E; ++I, ++R)
+    if (I->first != R->first || I->second != R->second)
+      return false;
+  return true;
+}
+
+// testRandom - Random lookups, inserts and erases with keys from a range of
+// KeyRange, which decides how far the maps grow past their inline storage.
+static void testRandom(unsigned KeyRange) {
+  SVMap M, Other;
+  RefMap Ref, RefOther;
+  for (unsigned Op = 0; Op != 100000; ++Op) {
+    unsigned K = randomInt(KeyRange);
+    switch (randomInt(9)) {
+    case 0: {
+      int V = randomInt(1000);
+      std::pair<SVMap::iterator, bool> P = M.insert(std::make_pair(K, V));
+      std::pair<RefMap::iterator, bool> RP = Ref.insert(std::make_pair(K, V));
+      CHECK(P.second == RP.second);
+      CHECK(P.first->first == K && P.first->second == RP.first->second);
+      break;
+    }
+    case 1:
+    case 2:
+      M[K] += Op;
+      Ref[K] += Op;
+      break;
+    case 3:
+      CHECK(M.erase(K) == Ref.erase(K));
+      break;
+    case 4: {
+      // Erasing through an iterator returns the next entry.
+      SVMap::iterator I = M.find(K);
+      RefMap::iterator R = Ref.find(K);
+      CHECK((I == M.end()) == (R == Ref.end()));
+      if (I == M.end() || R == Ref.end())
+        break;
+      I = M.erase(I);
+      R = Ref.erase(R);
+      CHECK((I == M.end()) == (R == Ref.end()));
+      if (I != M.end() && R != Ref.end())
+        CHECK(I->first == R->first);
+      break;
+    }
+    case 5: {
+      SVMap::iterator I = M.lower_bound(K);
+      RefMap::iterator R = Ref.lower_bound(K);
+      CHECK((I == M.end()) == (R == Ref.end()));
+      if (I != M.end() && R != Ref.end())
+        CHECK(I->first == R->first && I->second == R->second);
+      break;
+    }
+    case 6: {
+      const SVMap &CM = M;
+      SVMap::const_iterator I = CM.find(K);
+      CHECK(CM.count(K) == Ref.count(K));
+      CHECK((I == CM.end()) == !Ref.count(K));
+      if (I != CM.end())
+        CHECK(I->second == Ref[K]);
+      break;
+    }
+    case 7:
+      if (randomInt(64) == 0) {
+        M.swap(Other);
+        Ref.swap(RefOther);
+      }
+      break;
+    case 8:
+      if (randomInt(1024) == 0) {
+        M.clear();
+        Ref.clear();
+      }
+      break;
+    }
+    if (Op % 64 == 0) {
+      CHECK(sameContents(M, Ref));
+      CHECK(sameContents(Other, RefOther));
+    }
+  }
+  CHECK(sameContents(M, Ref));
+}
+
+//===----------------------------------------------------------------------===//
+// A model of DSNode links.  Nodes are numbered from 1, and a link to node 0 is
+// a null handle.  Every node is NodeSize bytes with a link slot at each one.
+//===----------------------------------------------------------------------===//
+
+static const unsigned NumNodes = 24;
+static const unsigned NodeSize = 8;
+
+template<typename MapTy>
+struct Graph {
+  std::vector<MapTy> Links;
+
+  Graph() : Links(NumNodes + 1) {}
+
+  // mergeNodes - Give Dst every link of Src that Dst does not have yet.  Dst
+  // and Src may be the same node.
+  void mergeNodes(unsigned Dst, unsigned Src) {
+    std::vector<std::pair<unsigned, int> > SrcLinks(Links[Src].begin(),
+                                                    Links[Src].end());
+    for (unsigned i = 0; i != SrcLinks.size(); ++i)
+      Links[Dst].insert(SrcLinks[i]);
+    // As with a folded node, the merged node grows a link past its end.
+    Links[Dst].insert(std::make_pair(NodeSize + Src % 3, 0));
+  }
+
+  // addEdgeTo - As DSNode::addEdgeTo: merge with an existing edge, which may
+  // add links to N itself, or just set the link.
+  void addEdgeTo(unsigned N, unsigned Offset, unsigned Target) {
+    if (!Target) return;
+    typename MapTy::iterator ExistingEdge = Links[N].find(Offset);
+    if (ExistingEdge != Links[N].end() && ExistingEdge->second) {
+      int Edge = ExistingEdge->second;
+      mergeNodes(Edge, Target);
+      mergeNodes(Target, Edge);
+    } else {
+      Links[N][Offset] = Target;
+    }
+  }
+
+  // cleanEdges - As DSNode::cleanEdges: drop the null links.
+  void cleanEdges(unsigned N) {
+    for (typename MapTy::iterator ii = Links[N].begin();
+         ii != Links[N].end(); ) {
+      if (ii->second)
+        ++ii;
+      else
+        ii = Links[N].erase(ii);
+    }
+  }
+
+  // cleanTargets - As removeTriviallyDeadNodes: clean every node N points to,
+  // which may be N itself.
+  void cleanTargets(unsigned N) {
+    std::vector<unsigned> Targets;
+    for (typename MapTy::iterator ii = Links[N].begin(), ee = Links[N].end();
+         ii != ee; ++ii)
+      if (ii->second)
+        Targets.push_back(ii->second);
+    for (unsigned i = 0; i != Targets.size(); ++i)
+      cleanEdges(Targets[i]);
+  }
+
+  // computeNodeMapping - As DSGraph::computeNodeMapping, mapping the nodes
+  // reachable from N1 to those reachable from N2 within this graph.  Each
+  // node visited is marked with a null link past its end, so the links of the
+  // nodes further up the recursion move while they are being walked.
+  void computeNodeMapping(unsigned N1, unsigned N2,
+                          std::map<unsigned, unsigned> &NodeMap) {
+    unsigned &Entry = NodeMap[N1];
+    if (Entry) return;
+    Entry = N2;
+    Links[N1].insert(std::make_pair(NodeSize + 2 + N2 % 4, 0));
+    for (unsigned i = 0; i != NodeSize; ++i) {
+      if (!Links[N1].count(i)) continue;
+      int N1NH = Links[N1].find(i)->second;
+      if (!N1NH || !Links[N2].count(i)) continue;
+      int N2NH = Links[N2].find(i)->second;
+      if (N2NH)
+        computeNodeMapping(N1NH, N2NH, NodeMap);
+    }
+  }
+};
+
+template<typename MapTy>
+static bool sameLinks(const MapTy &M, const RefMap &Ref) {
+  if (M.size() != Ref.size())
+    return false;
+  RefMap::const_iterator R = Ref.begin();
+  for (typename MapTy::const_iterator I = M.begin(), E = M.end(); I != E;
+       ++I, ++R)
+    if (I->first != R->first || I->second != R->second)
+      return false;
+  return true;
+}
+
+// testGraph - Apply the same random node operations to both graphs.
+static void testGraph() {
+  Graph<SVMap> G;
+  Graph<RefMap> Ref;
+  for (unsigned Op = 0; Op != 20000; ++Op) {
+    unsigned N = randomInt(NumNodes) + 1, M = randomInt(NumNodes) + 1;
+    switch (randomInt(6)) {
+    case 0:
+    case 1:
+    case 2: {
+      unsigned Offset = randomInt(NodeSize);
+      G.addEdgeTo(N, Offset, M);
+      Ref.addEdgeTo(N, Offset, M);
+      break;
+    }
+    case 3:
+      G.cleanTargets(N);
+      Ref.cleanTargets(N);
+      break;
+    case 4: {
+      std::map<unsigned, unsigned> NodeMap, RefNodeMap;
+      G.computeNodeMapping(N, M, NodeMap);
+      Ref.computeNodeMapping(N, M, RefNodeMap);
+      CHECK(NodeMap == RefNodeMap);
+      break;
+    }
+    case 5:
+      // Start over with this node now and then, so that the graph does not
+      // end up fully connected.
+      if (randomInt(8) == 0) {
+        G.Links[N].clear();
+        Ref.Links[N].clear();
+      }
+      break;
+    }
+    if (Op % 32 == 0)
+      for (unsigned i = 1; i <= NumNodes; ++i)
+        CHECK(sameLinks(G.Links[i], Ref.Links[i]));
+  }
+}
+
+int main() {
+  testRandom(4);
+  testRandom(64);
+  testRandom(4096);
+  testGraph();
+
+  return reportFailures();
+}
@@ -0,0 +1,205 @@
+//===- SuperSetTest.cpp - Tests of the hash-consed SuperSet ---------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Build sets through every way SuperSet offers - interning a set, adding a
+// member and taking a union - and check each result against a std::set of the
+// members it should have.  Sets with the same members must always come back
+// as the same setPtr, whichever way they were built and however often the
+// memoized results are hit.  The last test does the same from several threads
+// at once with the SuperSet in thread safe mode.
+//
+//===----------------------------------------------------------------------===//
+
+#include "dsa/super_set.h"
+#include "TestCheck.h"
+
+#include <stdio.h>
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
+
+// The members stand in for Type pointers.
+static const unsigned NumMembers = 48;
+static int Members[NumMembers];
+
+typedef SuperSet<int*> SetsTy;
+typedef SetsTy::setPtr setPtr;
+typedef std::set<int*> RefSet;
+
+// Random - A fixed xorshift generator, so that a failure can be reproduced.
+struct Random {
+  unsigned Seed;
+  explicit Random(unsigned S) : Seed(S) {}
+  unsigned operator()(unsigned N) {
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed % N;
+  }
+};
+
+static RefSet contentsOf(setPtr P) {
+  return P ? RefSet(P->begin(), P->end()) : RefSet();
+}
+
+// Canon - Remembers the setPtr first seen for each set of members, and checks
+// that no other one turns up for them.
+class Canon {
+  std::map<RefSet, setPtr> Seen;
+public:
+  bool check(const RefSet &Expected, setPtr P) {
+    if (contentsOf(P) != Expected)
+      return false;
+    if (Expected.empty())
+      return P == 0;
+    return Seen.insert(std::make_pair(Expected, P)).first->second == P;
+  }
+  size_t size() const { return Seen.size(); }
+};
+
+static svset<int*> randomSet(Random &R, RefSet &Expected) {
+  svset<int*> S;
+  for (unsigned i = 0, e = R(6); i != e; ++i) {
+    int *M = &Members[R(NumMembers)];
+    S.insert(M);
+    Expected.insert(M);
+  }
+  return S;
+}
+
+// testRandom - Random getOrCreate and getUnion calls on sets built so far.
+static void testRandom() {
+  SetsTy Sets;
+  Canon C;
+  Random R(2463534242u);
+  std::vector<setPtr> Built(1, setPtr(0));
+  for (unsigned Op = 0; Op != 200000; ++Op) {
+    setPtr P = Built[R(Built.size())], Q = Built[R(Built.size())];
+    RefSet Expected;
+    setPtr Result;
+    switch (R(4)) {
+    case 0: {
+      svset<int*> S = randomSet(R, Expected);
+      Result = Sets.getOrCreate(S);
+      break;
+    }
+    case 1: {
+      int *M = &Members[R(NumMembers)];
+      Expected = contentsOf(P);
+      Expected.insert(M);
+      Result = Sets.getOrCreate(P, M);
+      if (P && P->count(M))
+        CHECK(Result == P);
+      break;
+    }
+    default: {
+      Expected = contentsOf(P);
+      RefSet QMembers = contentsOf(Q);
+      Expected.insert(QMembers.begin(), QMembers.end());
+      Result = Sets.getUnion(P, Q);
+      CHECK(Sets.getUnion(Q, P) == Result);
+      CHECK(Sets.getUnion(Result, P) == Result);
+      CHECK(Sets.getUnion(Result, Result) == Result);
+      break;
+    }
+    }
+    CHECK(C.check(Expected, Result));
+
+    if (Built.size() < 512)
+      Built.push_back(Result);
+    else
+      Built[R(Built.size())] = Result;
+  }
+  // Enough distinct sets to have grown the table several times.
+  CHECK(C.size() > 1000);
+}
+
+// testIntern - Interning an empty set gives null, and interning a copy of a
+// set that exists gives that set, however it was built.
+static void testIntern() {
+  SetsTy Sets;
+  svset<int*> Empty;
+  CHECK(Sets.getOrCreate(Empty) == 0);
+  CHECK(Sets.getUnion(0, 0) == 0);
+
+  setPtr AB = Sets.getOrCreate(Sets.getOrCreate(0, &Members[0]), &Members[1]);
+  svset<int*> Copy(*AB);
+  CHECK(Sets.getOrCreate(Copy) == AB);
+  setPtr BA = Sets.getOrCreate(Sets.getOrCreate(0, &Members[1]), &Members[0]);
+  CHECK(BA == AB);
+  CHECK(Sets.getUnion(Sets.getOrCreate(0, &Members[0]),
+                      Sets.getOrCreate(0, &Members[1])) == AB);
+  CHECK(Sets.getUnion(AB, 0) == AB && Sets.getUnion(0, AB) == AB);
+}
+
+//===----------------------------------------------------------------------===//
+// Several threads at once
+//===----------------------------------------------------------------------===//
+
+static const unsigned NumThreads = 4;
+
+struct Result {
+  RefSet Expected;
+  setPtr Set;
+};
+
+// buildSets - Build sets from one thread, keeping every result to be checked
+// once all threads are done.  The threads share their seeds in pairs, so that
+// the same sets are built from two threads at once.
+static void buildSets(SetsTy *Sets, unsigned Thread,
+                      std::vector<Result> *Results) {
+  Random R(12345 + Thread / 2);
+  std::vector<setPtr> Built(1, setPtr(0));
+  for (unsigned Op = 0; Op != 20000; ++Op) {
+    setPtr P = Built[R(Built.size())], Q = Built[R(Built.size())];
+    Result Res;
+    if (R(2)) {
+      int *M = &Members[R(NumMembers)];
+      Res.Expected = contentsOf(P);
+      Res.Expected.insert(M);
+      Res.Set = Sets->getOrCreate(P, M);
+    } else {
+      Res.Expected = contentsOf(P);
+      RefSet QMembers = contentsOf(Q);
+      Res.Expected.insert(QMembers.begin(), QMembers.end());
+      Res.Set = Sets->getUnion(P, Q);
+    }
+    Results->push_back(Res);
+    if (Built.size() < 256)
+      Built.push_back(Res.Set);
+    else
+      Built[R(Built.size())] = Res.Set;
+  }
+}
+
+static void testThreads() {
+  SetsTy Sets;
+  Sets.setThreadSafe(true);
+  std::vector<Result> Results[NumThreads];
+  std::vector<std::thread> Threads;
+  for (unsigned i = 0; i != NumThreads; ++i)
+    Threads.push_back(std::thread(buildSets, &Sets, i, &Results[i]));
+  for (unsigned i = 0; i != NumThreads; ++i)
+    Threads[i].join();
+  Sets.setThreadSafe(false);
+
+  Canon C;
+  for (unsigned i = 0; i != NumThreads; ++i)
+    for (unsigned j = 0; j != Results[i].size(); ++j)
+      CHECK(C.check(Results[i][j].Expected, Results[i][j].Set));
+}
+
+int main() {
+  testIntern();
+  testRandom();
+  testThreads();
+
+  return reportFailures();
+}
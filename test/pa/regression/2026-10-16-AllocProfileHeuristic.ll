@@ -0,0 +1,27 @@
+; Without a profile, the AllocProfile heuristic gives the list nodes a pool of
+; their own and names the pool for the runtime statistics.
+;RUN: paopt %s -paheur-AllocProfile -poolalloc -o %t.bc
+;RUN: llvm-dis %t.bc -o %t.ll
+;RUN: grep "call void @poolinit(" %t.ll
+;RUN: grep "call void @poolprofile_name(" %t.ll
+;RUN: grep "c\"build:[0-9]*\\\\00\"" %t.ll
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.node = type { %struct.node*, i64 }
+
+declare i8* @malloc(i64)
+declare void @free(i8*)
+
+define void @build() {
+entry:
+  %m1 = call i8* @malloc(i64 16)
+  %n1 = bitcast i8* %m1 to %struct.node*
+  %m2 = call i8* @malloc(i64 16)
+  %n2 = bitcast i8* %m2 to %struct.node*
+  %next = getelementptr %struct.node, %struct.node* %n1, i32 0, i32 0
+  store %struct.node* %n2, %struct.node** %next
+  call void @free(i8* %m2)
+  call void @free(i8* %m1)
+  ret void
+}
@@ -0,0 +1,47 @@
+; The AllocProfile heuristic names pools after the smallest function name of
+; their graph and the first value that points to them, so that the names do
+; not depend on where DSA put its nodes in memory.  @alpha and @zeta are called
+; through the same function pointer and so share one graph.
+;RUN: paopt %s -paheur-AllocProfile -poolalloc -o %t.bc
+;RUN: llvm-dis %t.bc -o %t.ll
+;RUN: grep -o "c\"[^\"]*\\\\00\"" %t.ll | sort > %t.names
+;RUN: paopt %s -paheur-AllocProfile -poolalloc -o %t2.bc
+;RUN: llvm-dis %t2.bc -o %t2.ll
+;RUN: grep -o "c\"[^\"]*\\\\00\"" %t2.ll | sort > %t2.names
+;RUN: diff %t.names %t2.names
+;RUN: grep "c\"alpha:[0-9]*\\\\00\"" %t.names
+;RUN: grep "c\"alpha:zeta\.[0-9]*\\\\00\"" %t.names
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.node = type { %struct.node*, i64 }
+
+declare i8* @malloc(i64)
+declare void @free(i8*)
+
+define void @zeta() {
+entry:
+  %m = call i8* @malloc(i64 16)
+  %n = bitcast i8* %m to %struct.node*
+  %v = getelementptr %struct.node, %struct.node* %n, i32 0, i32 1
+  store i64 1, i64* %v
+  call void @free(i8* %m)
+  ret void
+}
+
+define void @alpha() {
+entry:
+  %m = call i8* @malloc(i64 16)
+  %n = bitcast i8* %m to %struct.node*
+  %v = getelementptr %struct.node, %struct.node* %n, i32 0, i32 1
+  store i64 2, i64* %v
+  call void @free(i8* %m)
+  ret void
+}
+
+define void @main(i1 %c) {
+entry:
+  %f = select i1 %c, void ()* @alpha, void ()* @zeta
+  call void %f()
+  ret void
+}
@@ -0,0 +1,37 @@
+; Allocations in a loop with a constant trip count should be batched into a
+; single poolalloc_n call before the loop.
+;RUN: paopt %s -paheur-AllButUnreachableFromMemory -poolalloc -poolalloc-batch-loop-allocs -o %t.bc
+;RUN: llvm-dis %t.bc -o %t.ll
+;RUN: grep "call void @poolalloc_n(.*, i32 16, i32 10, " %t.ll
+;RUN: not grep "call i8\* @poolalloc(" %t.ll
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.node = type { %struct.node*, i64 }
+
+declare i8* @malloc(i64)
+
+define internal void @use(%struct.node* %list) {
+entry:
+  ret void
+}
+
+define void @build() {
+entry:
+  br label %loop
+
+loop:                                             ; preds = %loop, %entry
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %head = phi %struct.node* [ null, %entry ], [ %n, %loop ]
+  %m = call i8* @malloc(i64 16)
+  %n = bitcast i8* %m to %struct.node*
+  %next = bitcast i8* %m to %struct.node**
+  store %struct.node* %head, %struct.node** %next
+  %i.next = add i32 %i, 1
+  %c = icmp ult i32 %i.next, 10
+  br i1 %c, label %loop, label %exit
+
+exit:                                             ; preds = %loop
+  call void @use(%struct.node* %n)
+  ret void
+}
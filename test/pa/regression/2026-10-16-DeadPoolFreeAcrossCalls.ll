@@ -0,0 +1,32 @@
+; The free in @consume is passed a pool from which nothing is allocated once
+; @consume returns, so it should be deleted, and the pool should then become
+; a bump-pointer pool even though it is passed to another function.
+;RUN: paopt %s -paheur-AllButUnreachableFromMemory -poolalloc -pooloptimize -o %t.bc
+;RUN: llvm-dis %t.bc -o %t.ll
+;RUN: grep "call void @poolinit_bp(" %t.ll
+;RUN: grep "call i8\* @poolalloc_bp(" %t.ll
+;RUN: not grep "call void @poolfree(" %t.ll
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.node = type { %struct.node*, i64 }
+
+declare i8* @malloc(i64)
+declare void @free(i8*)
+
+define internal void @consume(%struct.node* %n) {
+entry:
+  %m = bitcast %struct.node* %n to i8*
+  call void @free(i8* %m)
+  ret void
+}
+
+define void @build() {
+entry:
+  %m = call i8* @malloc(i64 16)
+  %n = bitcast i8* %m to %struct.node*
+  %next = getelementptr %struct.node, %struct.node* %n, i32 0, i32 0
+  store %struct.node* null, %struct.node** %next
+  call void @consume(%struct.node* %n)
+  ret void
+}
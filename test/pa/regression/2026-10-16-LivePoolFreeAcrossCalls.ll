@@ -0,0 +1,40 @@
+; @consume frees through a pool argument, but @churn calls it in a loop and
+; allocates from the pool again once it returns, so the free has to be kept
+; and the pool must not become a bump-pointer pool.
+;RUN: paopt %s -paheur-AllButUnreachableFromMemory -poolalloc -pooloptimize -o %t.bc
+;RUN: llvm-dis %t.bc -o %t.ll
+;RUN: grep "call void @poolfree(" %t.ll
+;RUN: not grep "call void @poolinit_bp(" %t.ll
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.node = type { %struct.node*, i64 }
+
+declare i8* @malloc(i64)
+declare void @free(i8*)
+
+define internal void @consume(%struct.node* %n) {
+entry:
+  %m = bitcast %struct.node* %n to i8*
+  call void @free(i8* %m)
+  ret void
+}
+
+define void @churn(i32 %count) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %m = call i8* @malloc(i64 16)
+  %n = bitcast i8* %m to %struct.node*
+  %next = getelementptr %struct.node, %struct.node* %n, i32 0, i32 0
+  store %struct.node* %n, %struct.node** %next
+  call void @consume(%struct.node* %n)
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %count
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
@@ -0,0 +1,50 @@
+; The list nodes allocated in @churn cannot reach another thread, so their pool
+; should be created with poolinit_st and used through the unlocked entry
+; points.  With the inline fast paths, it should use the ones that fall back on
+; those entry points.
+;RUN: paopt %s -paheur-AllButUnreachableFromMemory -poolalloc -poolalloc-thread-private-pools -o %t.bc
+;RUN: llvm-dis %t.bc -o %t.ll
+;RUN: grep "call void @poolinit_st(" %t.ll
+;RUN: grep "call i8\* @poolalloc_st(.*, i32 16)" %t.ll
+;RUN: grep "call void @poolfree_st(" %t.ll
+;RUN: not grep "call void @poolinit(" %t.ll
+;RUN: paopt %s -paheur-AllButUnreachableFromMemory -poolalloc -poolalloc-thread-private-pools -poolalloc-inline-fast-path -o %t2.bc
+;RUN: llvm-dis %t2.bc -o %t2.ll
+;RUN: grep "call i8\* @poolalloc_inline_st(.*, i32 16)" %t2.ll
+;RUN: grep "call void @poolfree_inline_st(" %t2.ll
+;RUN: grep "slowobj = call i8\* @poolalloc_st(" %t2.ll
+;RUN: grep "call void @poolfree_st(" %t2.ll
+;RUN: not grep "call i8\* @poolalloc_inline(" %t2.ll
+;RUN: not grep "call void @poolfree_inline(" %t2.ll
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.node = type { %struct.node*, i64 }
+
+declare i8* @malloc(i64)
+declare void @free(i8*)
+
+define internal void @use(%struct.node* %n) {
+entry:
+  ret void
+}
+
+define void @churn(i32 %count) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %m = call i8* @malloc(i64 16)
+  %n = bitcast i8* %m to %struct.node*
+  %next = getelementptr %struct.node, %struct.node* %n, i32 0, i32 0
+  store %struct.node* null, %struct.node** %next
+  call void @use(%struct.node* %n)
+  call void @free(i8* %m)
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %count
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
@@ -0,0 +1,88 @@
+//===- BitMaskScan.cpp - Bitmap scans of the bitmask allocators -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Fill slabs of 4-byte nodes almost completely and then free and reallocate
+// random nodes, so that every allocation has to scan a slab bitmap for the
+// one free node.  Both the PoolSlab runtime and BitMaskSlabManager are timed.
+//
+// To compare against another version of the allocators, build this against
+// its sources with something like
+//   make bench SRC_ROOT=/path/to/other/checkout OUT=Output.other
+//
+// Usage: BitMaskScan [iterations]
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "poolalloc_runtime/PoolAllocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const unsigned NodeSize = 4;
+static const unsigned LiveObjs = 100000;
+static unsigned Iterations = 1000000;
+
+static unsigned long long Seed = 1;
+
+static unsigned nextRandom(unsigned Bound) {
+  Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned)(Seed >> 33) % Bound;
+}
+
+static double now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+static void benchPoolSlab(void **Live) {
+  PoolTy P;
+  poolinit(&P, NodeSize);
+  for (unsigned i = 0; i != LiveObjs; ++i)
+    Live[i] = poolalloc(&P, NodeSize);
+
+  Seed = 1;
+  double Start = now();
+  for (unsigned i = 0; i != Iterations; ++i) {
+    unsigned Slot = nextRandom(LiveObjs);
+    poolfree(&P, Live[Slot]);
+    Live[Slot] = poolalloc(&P, NodeSize);
+  }
+  double Elapsed = now() - Start;
+  pooldestroy(&P);
+  printf("PoolSlab:           %.1f ns/pair\n", Elapsed * 1e9 / Iterations);
+}
+
+static void benchBitMaskSlabManager(void **Live) {
+  PoolAllocator<BitMaskSlabManager<LinuxMmap> > P(NodeSize, NodeSize);
+  for (unsigned i = 0; i != LiveObjs; ++i)
+    Live[i] = P.alloc();
+
+  Seed = 1;
+  double Start = now();
+  for (unsigned i = 0; i != Iterations; ++i) {
+    unsigned Slot = nextRandom(LiveObjs);
+    P.dealloc(Live[Slot]);
+    Live[Slot] = P.alloc();
+  }
+  double Elapsed = now() - Start;
+  printf("BitMaskSlabManager: %.1f ns/pair\n", Elapsed * 1e9 / Iterations);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    Iterations = atoi(argv[1]);
+
+  void **Live = (void**)malloc(LiveObjs * sizeof(void*));
+  benchPoolSlab(Live);
+  benchBitMaskSlabManager(Live);
+  free(Live);
+  return 0;
+}
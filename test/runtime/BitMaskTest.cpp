@@ -0,0 +1,108 @@
+//===- BitMaskTest.cpp - Tests of the bitmask pool runtime ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Check the bookkeeping of PoolSlab when nodes are freed out of order.  The
+// runtime is included rather than linked so that the slabs can be inspected.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocatorBitMask.cpp"
+#include "TestCheck.h"
+
+static PoolSlab *firstSlab(PoolTy *Pool) {
+  return (PoolSlab*)Pool->Ptr1;
+}
+
+// testFreeLastAfterGap - Free a node in the middle of a slab and then the
+// last node.  The end of the used nodes must drop to just past the node
+// below the gap, so that freeing the rest empties the slab.
+static void testFreeLastAfterGap() {
+  PoolTy P;
+  poolinit(&P, 8);
+  void *N[4];
+  for (unsigned i = 0; i != 4; ++i)
+    N[i] = poolalloc(&P, 8);
+
+  poolfree(&P, N[1]);
+  poolfree(&P, N[3]);
+  poolfree(&P, N[2]);
+  CHECK(!firstSlab(&P)->isEmpty());
+  poolfree(&P, N[0]);
+  CHECK(firstSlab(&P)->isEmpty());
+
+  // The slab is reused from the start.
+  CHECK(poolalloc(&P, 8) == N[0]);
+  pooldestroy(&P);
+}
+
+// testFreeLastAfterGapAcrossWords - The same, with a gap that spans several
+// flag words, so that lastNodeAllocated has to search the words below the one
+// holding the freed node.
+static void testFreeLastAfterGapAcrossWords() {
+  PoolTy P;
+  poolinit(&P, 8);
+  void *N[40];
+  for (unsigned i = 0; i != 40; ++i)
+    N[i] = poolalloc(&P, 8);
+
+  for (unsigned i = 5; i != 39; ++i)
+    poolfree(&P, N[i]);
+  poolfree(&P, N[39]);
+
+  // Node 4 is the last one in use, so allocation continues right after it.
+  CHECK(poolalloc(&P, 8) == N[5]);
+  CHECK(poolalloc(&P, 8) == N[6]);
+  poolfree(&P, N[6]);
+  poolfree(&P, N[5]);
+  for (unsigned i = 0; i != 5; ++i)
+    poolfree(&P, N[i]);
+  CHECK(firstSlab(&P)->isEmpty());
+  pooldestroy(&P);
+}
+
+// testFreeArrayAfterGap - Free the small array at the end of a slab after a
+// single node below it.
+static void testFreeArrayAfterGap() {
+  PoolTy P;
+  poolinit(&P, 8);
+  void *A = poolalloc(&P, 8);
+  void *B = poolalloc(&P, 8);
+  void *C = poolalloc(&P, 8 * 20);
+
+  poolfree(&P, B);
+  poolfree(&P, C);
+  CHECK(poolalloc(&P, 8) == B);
+  poolfree(&P, B);
+  poolfree(&P, A);
+  CHECK(firstSlab(&P)->isEmpty());
+  pooldestroy(&P);
+}
+
+// testSingleArray - An array bigger than a slab gets pages of its own, and the
+// slab remembers how many so that all of them can be found and released.
+static void testSingleArray() {
+  PoolTy P;
+  poolinit(&P, 8);
+  unsigned NodesPerSlab = PoolSlab::getSlabSize(&P);
+  char *A = (char*)poolalloc(&P, 8 * (2*NodesPerSlab + 1));
+  PoolSlab *PS = findSlabInMap(&P, A);
+  CHECK(PS && PS->getNumPages() == 3);
+  CHECK(findSlabInMap(&P, A + 8 * 2*NodesPerSlab) == PS);
+  poolfree(&P, A);
+  CHECK(findSlabInMap(&P, A) == 0);
+  pooldestroy(&P);
+}
+
+int main() {
+  testFreeLastAfterGap();
+  testFreeLastAfterGapAcrossWords();
+  testFreeArrayAfterGap();
+  testSingleArray();
+  return reportFailures();
+}
@@ -0,0 +1,181 @@
+//===- FL2BatchTest.cpp - Tests of poolalloc_n and poolfree_n -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// poolalloc_n hands out freed declared-size objects first and carves the rest
+// back to back out of free nodes.  Check that the carved objects are distinct,
+// aligned and do not overlap, that a remainder too small for a free node goes
+// to the last object and a bigger one back to the free lists, and that every
+// object can be freed on its own or with poolfree_n.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const unsigned HeaderSize = sizeof(NodeHeader<NormalPoolTraits>);
+
+static int comparePtrs(const void *LHS, const void *RHS) {
+  char *L = *(char*const*)LHS, *R = *(char*const*)RHS;
+  return L < R ? -1 : (L > R ? 1 : 0);
+}
+
+// checkObjects - The Num objects in Objs must be aligned and must not overlap
+// each other.  Stamp them so that later overlaps show up as well.
+static void checkObjects(Pool *P, void **Objs, unsigned Num, unsigned Align) {
+  void **Sorted = (void**)malloc(Num * sizeof(void*));
+  memcpy(Sorted, Objs, Num * sizeof(void*));
+  qsort(Sorted, Num, sizeof(void*), comparePtrs);
+  for (unsigned i = 0; i != Num; ++i) {
+    CHECK(((uintptr_t)Sorted[i] & (Align-1)) == 0);
+    if (i)
+      CHECK((char*)Sorted[i-1] + poolobjsize(P, Sorted[i-1]) <=
+            (char*)Sorted[i]);
+    memset(Sorted[i], 0xA5, poolobjsize(P, Sorted[i]));
+  }
+  free(Sorted);
+}
+
+// testFreshPool - Objects of a batch that spans several chunks come out back
+// to back except where a slab ends, and can all be freed at once.
+static void testFreshPool() {
+  Pool P;
+  poolinit(&P, 24, 8);
+  static void *Out[600];
+  poolalloc_n(&P, 40, 600, Out);
+  checkObjects(&P, Out, 600, 8);
+  unsigned Adjacent = 0;
+  for (unsigned i = 0; i != 599; ++i)
+    Adjacent += (char*)Out[i+1] == (char*)Out[i] + 40 + HeaderSize;
+  CHECK(Adjacent >= 590);
+
+  // Once they are freed, the same batch fits without growing the pool.
+  void *Slabs = P.Slabs;
+  poolfree_n(&P, Out, 600);
+  poolalloc_n(&P, 40, 600, Out);
+  CHECK(P.Slabs == Slabs);
+  checkObjects(&P, Out, 600, 8);
+  poolfree_n(&P, Out, 600);
+  pooldestroy(&P);
+}
+
+// testObjFreeList - Freed objects of the declared size are used before any
+// free node is carved.
+static void testObjFreeList() {
+  Pool P;
+  poolinit_st(&P, 32, 8);
+  void *Objs[8];
+  for (unsigned i = 0; i != 8; ++i)
+    Objs[i] = poolalloc_st(&P, 32);
+  for (unsigned i = 0; i != 8; i += 2)
+    poolfree_st(&P, Objs[i]);
+
+  void *Out[7];
+  poolalloc_n(&P, 32, 7, Out);
+  // The four freed objects, most recently freed first.
+  for (unsigned i = 0; i != 4; ++i)
+    CHECK(Out[i] == Objs[6 - 2*i]);
+  for (unsigned i = 4; i != 7; ++i) {
+    CHECK(Out[i] < Objs[0] || Out[i] > Objs[7]);
+    CHECK(poolobjsize(&P, Out[i]) == 32);
+  }
+  void *All[11];
+  memcpy(All, Out, sizeof(Out));
+  for (unsigned i = 0; i != 4; ++i)
+    All[7+i] = Objs[2*i+1];
+  checkObjects(&P, All, 11, 8);
+
+  for (unsigned i = 0; i != 11; ++i)
+    poolfree_st(&P, All[i]);
+  pooldestroy(&P);
+}
+
+// carveFrom - Free a node of NodeSize bytes between two live objects and
+// allocate a batch of three 32 byte objects, which has to come out of it.
+static void carveFrom(Pool *P, unsigned NodeSize, void **Out) {
+  void *A = poolalloc(P, NodeSize);
+  void *Guard = poolalloc(P, 48);
+  poolfree(P, A);
+  poolalloc_n(P, 32, 3, Out);
+  for (unsigned i = 0; i != 3; ++i)
+    CHECK((char*)Out[i] == (char*)A + i*(32 + HeaderSize));
+  checkObjects(P, Out, 3, 8);
+  (void)Guard;
+}
+
+// testRemainder - What is left of the node after the batch either is too
+// small to be a free node and goes to the last object, or goes back to the
+// free lists.  Either way the objects can be freed one by one and merge into
+// the original node again.
+static void testRemainder() {
+  Pool P;
+  poolinit(&P, 24, 8);
+
+  void *Out[3];
+  carveFrom(&P, 128, Out);
+  CHECK(poolobjsize(&P, Out[0]) == 32);
+  CHECK(poolobjsize(&P, Out[1]) == 32);
+  CHECK(poolobjsize(&P, Out[2]) == 128 - 2*(32 + HeaderSize));
+  for (unsigned i = 3; i != 0; --i)
+    poolfree(&P, Out[i-1]);
+  CHECK(poolalloc(&P, 128) == Out[0]);
+
+  carveFrom(&P, 200, Out);
+  CHECK(poolobjsize(&P, Out[2]) == 32);
+  char *Rest = (char*)Out[2] + 32 + HeaderSize;
+  CHECK(poolalloc(&P, 200 - 3*(32 + HeaderSize)) == Rest);
+  poolfree(&P, Rest);
+  for (unsigned i = 3; i != 0; --i)
+    poolfree(&P, Out[i-1]);
+  // Requests of 200 bytes look in the next bin up, so ask for less.
+  void *Whole = poolalloc(&P, 192);
+  CHECK(Whole == Out[0]);
+  CHECK(poolobjsize(&P, Whole) == 200);
+  pooldestroy(&P);
+}
+
+// testLockFree - Batches from a pool with a lock-free list must not hand out
+// objects that are on that list or live.
+static void testLockFree() {
+  Pool P;
+  poolinit_lf(&P, 32, 8);
+  static void *Objs[40 + 200];
+  for (unsigned i = 0; i != 40; ++i)
+    Objs[i] = poolalloc(&P, 32);
+  for (unsigned i = 0; i != 40; i += 2)
+    poolfree(&P, Objs[i]);
+
+  poolalloc_n(&P, 32, 200, Objs + 40);
+  // Take the objects on the lock-free list back as well.
+  for (unsigned i = 0; i != 40; i += 2)
+    Objs[i] = poolalloc(&P, 32);
+  checkObjects(&P, Objs, 240, 8);
+
+  poolfree_n(&P, Objs + 40, 100);
+  for (unsigned i = 140; i != 240; ++i)
+    poolfree(&P, Objs[i]);
+  poolalloc_n(&P, 32, 200, Objs + 40);
+  checkObjects(&P, Objs, 240, 8);
+  poolfree_n(&P, Objs, 240);
+  pooldestroy(&P);
+}
+
+int main() {
+  testFreshPool();
+  testObjFreeList();
+  testRemainder();
+  testLockFree();
+
+  return reportFailures();
+}
@@ -0,0 +1,146 @@
+//===- FL2BumpPointerTest.cpp - Tests of poolinit_bp pools ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Several threads allocate from one bump-pointer pool, small objects from
+// their own chunks and bigger ones from the shared bump pointer and malloc.
+// Every object is filled with a pattern of its own, so objects that overlap
+// show up as a wrong pattern.  The pool is then destroyed and recreated at the
+// same address while the threads still hold chunks of the old one, which they
+// must not bump through again.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const unsigned NumThreads = 8;
+static const unsigned ObjsPerThread = 4000;
+static const unsigned Alignment = 16;
+
+static Pool P;
+static pthread_barrier_t Barrier;
+
+struct Obj {
+  unsigned char *Mem;
+  unsigned Size;
+  unsigned char Byte;
+};
+
+static Obj Objs[NumThreads][ObjsPerThread];
+
+// getSize - Mostly objects small enough for the thread chunks, some for the
+// shared bump pointer and a few large arrays.
+static unsigned getSize(unsigned T, unsigned i) {
+  unsigned R = (T * 7919 + i * 104729) % 1000;
+  if (R < 900) return 1 + R % 256;
+  if (R < 995) return 257 + R * 3;
+  return 5000;
+}
+
+// allocate - Allocate the objects of thread T with indices [Begin, End).
+static void allocate(unsigned T, unsigned Begin, unsigned End) {
+  for (unsigned i = Begin; i != End; ++i) {
+    Obj &O = Objs[T][i];
+    O.Size = getSize(T, i);
+    O.Byte = (unsigned char)(T * 31 + i);
+    O.Mem = (unsigned char*)poolalloc_bp(&P, O.Size);
+    CHECK(((uintptr_t)O.Mem & (Alignment-1)) == 0);
+    memset(O.Mem, O.Byte, O.Size);
+  }
+}
+
+static void verify(unsigned Begin, unsigned End) {
+  for (unsigned T = 0; T != NumThreads; ++T)
+    for (unsigned i = Begin; i != End; ++i) {
+      Obj &O = Objs[T][i];
+      for (unsigned b = 0; b != O.Size; ++b)
+        if (O.Mem[b] != O.Byte) {
+          CHECK(O.Mem[b] == O.Byte);
+          break;
+        }
+    }
+}
+
+static int compareObjs(const void *LHS, const void *RHS) {
+  const Obj *L = *(const Obj*const*)LHS, *R = *(const Obj*const*)RHS;
+  return L->Mem < R->Mem ? -1 : (L->Mem > R->Mem ? 1 : 0);
+}
+
+// checkDisjoint - No two of the objects with indices [Begin, End) overlap.
+static void checkDisjoint(unsigned Begin, unsigned End) {
+  unsigned Num = NumThreads * (End - Begin), n = 0;
+  Obj **Sorted = (Obj**)malloc(Num * sizeof(Obj*));
+  for (unsigned T = 0; T != NumThreads; ++T)
+    for (unsigned i = Begin; i != End; ++i)
+      Sorted[n++] = &Objs[T][i];
+  qsort(Sorted, Num, sizeof(Obj*), compareObjs);
+  for (unsigned i = 1; i < Num; ++i)
+    CHECK(Sorted[i-1]->Mem + Sorted[i-1]->Size <= Sorted[i]->Mem);
+  free(Sorted);
+}
+
+static void *worker(void *Arg) {
+  unsigned T = (unsigned)(uintptr_t)Arg;
+  allocate(T, 0, ObjsPerThread/2);
+
+  // The main thread recreates the pool between these barriers.
+  pthread_barrier_wait(&Barrier);
+  pthread_barrier_wait(&Barrier);
+  allocate(T, ObjsPerThread/2, ObjsPerThread);
+  return 0;
+}
+
+// testChunks - Small objects of one thread are bumped out of its chunk, so
+// most of them follow the previous one directly.
+static void testChunks() {
+  Pool Q;
+  poolinit_bp(&Q, 8);
+  unsigned Adjacent = 0;
+  char *Prev = (char*)poolalloc_bp(&Q, 16);
+  for (unsigned i = 0; i != 1000; ++i) {
+    char *Cur = (char*)poolalloc_bp(&Q, 16);
+    Adjacent += Cur == Prev + 16;
+    Prev = Cur;
+  }
+  CHECK(Adjacent >= 900);
+  pooldestroy_bp(&Q);
+}
+
+int main() {
+  testChunks();
+
+  pthread_barrier_init(&Barrier, 0, NumThreads + 1);
+  poolinit_bp(&P, Alignment);
+  pthread_t Threads[NumThreads];
+  for (unsigned T = 0; T != NumThreads; ++T)
+    pthread_create(&Threads[T], 0, worker, (void*)(uintptr_t)T);
+
+  pthread_barrier_wait(&Barrier);
+  verify(0, ObjsPerThread/2);
+  checkDisjoint(0, ObjsPerThread/2);
+  pooldestroy_bp(&P);
+  poolinit_bp(&P, Alignment);
+  pthread_barrier_wait(&Barrier);
+
+  for (unsigned T = 0; T != NumThreads; ++T)
+    pthread_join(Threads[T], 0);
+  verify(ObjsPerThread/2, ObjsPerThread);
+  checkDisjoint(ObjsPerThread/2, ObjsPerThread);
+  pooldestroy_bp(&P);
+  pthread_barrier_destroy(&Barrier);
+
+  return reportFailures();
+}
@@ -0,0 +1,105 @@
+//===- FL2Fragmentation.cpp - Fragmentation and latency of FL2 pools ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Keep a set of live objects of mixed sizes in one pool and replace a random
+// one at a time, so that the pool's free space breaks up into many fragments
+// of other than the declared size.  Report the cost of each free+alloc pair,
+// the tail latency of poolalloc, and the peak resident set size.
+//
+// To compare against another version of the runtime, build this against its
+// sources with something like
+//   make bench FL2_DIR=/path/to/other/runtime/FL2Allocator OUT=Output.other
+//
+// Usage: FL2Fragmentation [iterations]
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const unsigned DeclaredSize = 16;
+static const unsigned LiveObjs = 50000;
+static unsigned Iterations = 2000000;
+
+static unsigned long long Seed = 1;
+
+// nextRandom - A fixed linear congruential generator, so that every runtime
+// sees the same sequence of requests.
+static unsigned nextRandom(unsigned Bound) {
+  Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned)(Seed >> 33) % Bound;
+}
+
+// randomSize - 90% small objects of 16 to 48 bytes, and 10% big ones of 500
+// to 2000 bytes.
+static unsigned randomSize() {
+  if (nextRandom(10))
+    return 16 + nextRandom(33);
+  return 500 + nextRandom(1501);
+}
+
+static double now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    Iterations = atoi(argv[1]);
+
+  Pool P;
+  poolinit(&P, DeclaredSize, 8);
+  void **Live = (void**)malloc(LiveObjs * sizeof(void*));
+  for (unsigned i = 0; i != LiveObjs; ++i)
+    Live[i] = poolalloc(&P, randomSize());
+
+  // Time the whole loop for throughput, and every 64th allocation on its own
+  // for the latency distribution.
+  unsigned NumSamples = Iterations / 64;
+  double *Samples = (double*)malloc((NumSamples + 1) * sizeof(double));
+  unsigned Sampled = 0;
+  double Start = now();
+  for (unsigned i = 0; i != Iterations; ++i) {
+    unsigned Slot = nextRandom(LiveObjs);
+    poolfree(&P, Live[Slot]);
+    unsigned Size = randomSize();
+    if (i % 64) {
+      Live[Slot] = poolalloc(&P, Size);
+    } else {
+      double T = now();
+      Live[Slot] = poolalloc(&P, Size);
+      Samples[Sampled++] = now() - T;
+    }
+  }
+  double Elapsed = now() - Start;
+
+  for (unsigned i = 0; i != LiveObjs; ++i)
+    poolfree(&P, Live[i]);
+  pooldestroy(&P);
+
+  std::sort(Samples, Samples + Sampled);
+  struct rusage RU;
+  getrusage(RUSAGE_SELF, &RU);
+  printf("free+alloc: %.1f ns/pair\n", Elapsed * 1e9 / Iterations);
+  if (Sampled)
+    printf("poolalloc latency: p50 %.0f ns, p99 %.0f ns, max %.0f ns\n",
+           Samples[Sampled / 2] * 1e9, Samples[Sampled * 99 / 100] * 1e9,
+           Samples[Sampled - 1] * 1e9);
+  printf("peak RSS: %ld KB\n", RU.ru_maxrss);
+  free(Samples);
+  free(Live);
+  return 0;
+}
@@ -0,0 +1,193 @@
+//===- FL2FreeBinsTest.cpp - Tests of the FL2 segregated free lists -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Check that free nodes land in the right size bin, that allocation picks a
+// bin whose nodes are all big enough, and that splitting and coalescing keep
+// the bins and their bitmaps consistent.  The runtime is included rather than
+// linked so that the bins can be inspected.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.cpp"
+#include "TestCheck.h"
+
+typedef PoolTy<NormalPoolTraits> Pool;
+typedef FreedNodeHeader<NormalPoolTraits> FNH;
+
+static const unsigned NumFLs = NormalPoolTraits::NumFreeBinFLs;
+static const unsigned NumBins = NumFLs * FREE_BIN_SLS;
+
+static unsigned binIndex(unsigned Size) {
+  unsigned FL, SL;
+  getFreeBin<NormalPoolTraits>(Size, FL, SL);
+  return FL * FREE_BIN_SLS + SL;
+}
+
+// nodeOf - The free node header of the object at Obj.
+static FNH *nodeOf(void *Obj) {
+  return (FNH*)((char*)Obj - sizeof(NodeHeader<NormalPoolTraits>));
+}
+
+// checkBins - Check that every bin only holds free nodes of its size range,
+// that the Prev links match the Next links, and that the bitmaps say exactly
+// which bins are non-empty.  Return the number of nodes in the bins.
+static unsigned checkBins(Pool *P) {
+  PoolFreeBins<NormalPoolTraits> *Bins = P->FreeBins;
+  unsigned Num = 0;
+  for (unsigned FL = 0; FL != NumFLs; ++FL) {
+    for (unsigned SL = 0; SL != FREE_BIN_SLS; ++SL) {
+      FNH *Head = Bins->Heads[FL][SL];
+      CHECK(!!Head == !!(Bins->SLBitmaps[FL] & (1U << SL)));
+      FNH *Prev = 0;
+      for (FNH *N = Head; N; Prev = N, N = N->Next, ++Num) {
+        CHECK((N->Header.Size & 1) == 0);
+        CHECK(binIndex(N->Header.Size) == FL * FREE_BIN_SLS + SL);
+        CHECK(N->Prev == Prev);
+      }
+    }
+    CHECK(!!Bins->SLBitmaps[FL] == !!(Bins->FLBitmap & (1U << FL)));
+  }
+  return Num;
+}
+
+// isBinned - Return true if the node at N is in the bins with Size bytes.
+static bool isBinned(Pool *P, FNH *N, unsigned Size) {
+  unsigned Bin = binIndex(Size);
+  for (FNH *I = P->FreeBins->Heads[Bin / FREE_BIN_SLS][Bin % FREE_BIN_SLS]; I;
+       I = I->Next)
+    if (I == N)
+      return N->Header.Size == Size;
+  return false;
+}
+
+// testBinSelection - Bins must cover the sizes in order, and the bin chosen
+// for a request must be the first one whose nodes all fit it.
+static void testBinSelection() {
+  static unsigned MinSize[NumBins];
+  for (unsigned i = 0; i != NumBins; ++i)
+    MinSize[i] = ~0U;
+
+  unsigned LastBin = 0;
+  for (unsigned Size = 0; Size != 1 << 16; ++Size) {
+    unsigned Bin = binIndex(Size);
+    CHECK(Bin >= LastBin);
+    LastBin = Bin;
+    if (Size < MinSize[Bin])
+      MinSize[Bin] = Size;
+  }
+  CHECK(LastBin == NumBins-1);
+
+  for (unsigned Size = 1; Size != LARGE_SLAB_SIZE; ++Size) {
+    unsigned FL, SL;
+    CHECK(getFreeBinForAlloc<NormalPoolTraits>(Size, FL, SL));
+    unsigned Bin = FL * FREE_BIN_SLS + SL;
+    CHECK(MinSize[Bin] >= Size);
+
+    // The bin below may hold nodes that are too small.
+    unsigned Below = Bin;
+    while (Below != 0 && MinSize[--Below] == ~0U)
+      ;
+    CHECK(Bin == 0 || MinSize[Below] < Size);
+  }
+
+  // Requests beyond the table have to search the last bin.
+  unsigned FL, SL;
+  CHECK(!getFreeBinForAlloc<NormalPoolTraits>(1U << 20, FL, SL));
+  CHECK(FL == NumFLs-1 && SL == FREE_BIN_SLS-1);
+}
+
+// testSplit - A freed node is split for smaller requests as long as the rest
+// can hold a free node, and handed out whole otherwise.
+static void testSplit() {
+  // Free nodes of the declared size go to ObjFreeList instead of the bins, so
+  // no node in these tests is 24 bytes.
+  Pool P;
+  poolinit(&P, 24, 8);
+  void *A = poolalloc(&P, 200);
+  void *Guard = poolalloc(&P, 40);
+  unsigned Base = checkBins(&P);
+  poolfree(&P, A);
+  CHECK(isBinned(&P, nodeOf(A), 200));
+  CHECK(checkBins(&P) == Base+1);
+
+  // 64 bytes come from the front of A, leaving a 128 byte node.
+  void *B = poolalloc(&P, 64);
+  CHECK(B == A);
+  CHECK(poolobjsize(&P, B) == 64);
+  void *Rest = (char*)B + 64 + sizeof(NodeHeader<NormalPoolTraits>);
+  CHECK(isBinned(&P, nodeOf(Rest), 128));
+  CHECK(checkBins(&P) == Base+1);
+
+  // 104 bytes leave a 16 byte node, the smallest free node there is.
+  void *C = poolalloc(&P, 104);
+  CHECK(C == Rest);
+  CHECK(poolobjsize(&P, C) == 104);
+  void *Tail = (char*)C + 104 + sizeof(NodeHeader<NormalPoolTraits>);
+  CHECK(isBinned(&P, nodeOf(Tail), 16));
+  CHECK(checkBins(&P) == Base+1);
+
+  // Freeing C merges it with the tail again.  112 bytes would leave 8, which
+  // cannot hold a free node, so the whole node is handed out.
+  poolfree(&P, C);
+  CHECK(isBinned(&P, nodeOf(C), 128));
+  void *D = poolalloc(&P, 112);
+  CHECK(D == C);
+  CHECK(poolobjsize(&P, D) == 128);
+  CHECK(checkBins(&P) == Base);
+
+  poolfree(&P, D);
+  poolfree(&P, B);
+  poolfree(&P, Guard);
+  checkBins(&P);
+  pooldestroy(&P);
+}
+
+// testCoalesce - Freed nodes merge with the free nodes after them, and with
+// the node most recently put into the bins if it ends right before them.
+static void testCoalesce() {
+  Pool P;
+  poolinit(&P, 24, 8);
+  void *N[4];
+  for (unsigned i = 0; i != 4; ++i)
+    N[i] = poolalloc(&P, 48);
+  void *Guard = poolalloc(&P, 48);
+  unsigned Base = checkBins(&P);
+
+  // Forward: N[2] is free when N[1] is freed.
+  poolfree(&P, N[2]);
+  poolfree(&P, N[1]);
+  CHECK(isBinned(&P, nodeOf(N[1]), 48+8+48));
+  CHECK(checkBins(&P) == Base+1);
+
+  // Backward: N[1] is the last node put in the bins and ends at N[3].
+  poolfree(&P, N[3]);
+  CHECK(isBinned(&P, nodeOf(N[1]), 3*48+2*8));
+  CHECK(checkBins(&P) == Base+1);
+
+  // Both at once leave a single node covering all four objects.
+  poolfree(&P, N[0]);
+  CHECK(isBinned(&P, nodeOf(N[0]), 4*48+3*8));
+  CHECK(checkBins(&P) == Base+1);
+
+  // The merged node is split again for a request its bin serves.
+  CHECK(poolalloc(&P, 192) == N[0]);
+  CHECK(isBinned(&P, nodeOf((char*)N[0] + 192 + 8), 16));
+  CHECK(checkBins(&P) == Base+1);
+
+  poolfree(&P, Guard);
+  pooldestroy(&P);
+}
+
+int main() {
+  testBinSelection();
+  testSplit();
+  testCoalesce();
+
+  return reportFailures();
+}
@@ -0,0 +1,103 @@
+//===- FL2LockFreeTest.cpp - Stress test of poolinit_lf pools -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Several threads allocate and free declared-size objects of one poolinit_lf
+// pool, and hand some of them to each other to free.  Each object is stamped
+// with its owner while it is live, so an object that the lock-free list hands
+// out twice, or loses, shows up as a wrong stamp.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const unsigned NumThreads = 8;
+static const unsigned Iterations = 200000;
+static const unsigned LiveObjs = 64;
+static const unsigned ObjSize = 32;
+
+static Pool P;
+
+// Exchange - Objects handed from one thread to another, to be freed by the
+// thread that picks them up.
+static void *Exchange[NumThreads];
+
+// Stamp - What a live object of thread T holds in its first word.
+static unsigned long stamp(unsigned T, unsigned i) {
+  return (unsigned long)(T + 1) << 20 | i;
+}
+
+static void *allocStamped(unsigned long S) {
+  unsigned long *Obj = (unsigned long*)poolalloc(&P, ObjSize);
+  Obj[0] = S;
+  Obj[ObjSize/sizeof(long)-1] = S;
+  return Obj;
+}
+
+static void freeStamped(void *Obj, unsigned long S) {
+  unsigned long *Words = (unsigned long*)Obj;
+  if (Words[0] != S || Words[ObjSize/sizeof(long)-1] != S)
+    __sync_fetch_and_add(&Failures, 1);
+  poolfree(&P, Obj);
+}
+
+static void *worker(void *Arg) {
+  unsigned T = (unsigned)(unsigned long)Arg;
+  void *Live[LiveObjs];
+  for (unsigned i = 0; i != LiveObjs; ++i)
+    Live[i] = allocStamped(stamp(T, i));
+
+  unsigned long long Seed = T + 1;
+  for (unsigned n = 0; n != Iterations; ++n) {
+    Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    unsigned i = (Seed >> 33) % LiveObjs;
+    if ((Seed >> 60) == 0) {
+      // Hand the object to the next thread, and free whatever was waiting
+      // there.  Handed over objects are stamped with slot ~0.
+      ((unsigned long*)Live[i])[0] = stamp(NumThreads, 0);
+      ((unsigned long*)Live[i])[ObjSize/sizeof(long)-1] = stamp(NumThreads, 0);
+      void *Old = __sync_lock_test_and_set(&Exchange[(T+1) % NumThreads],
+                                           Live[i]);
+      if (Old)
+        freeStamped(Old, stamp(NumThreads, 0));
+    } else {
+      freeStamped(Live[i], stamp(T, i));
+    }
+    Live[i] = allocStamped(stamp(T, i));
+  }
+
+  for (unsigned i = 0; i != LiveObjs; ++i)
+    freeStamped(Live[i], stamp(T, i));
+  return 0;
+}
+
+int main() {
+  if (offsetof(Pool, LockFreeObjList) % 8 != 0) {
+    fprintf(stderr, "LockFreeObjList is not 8 byte aligned\n");
+    return 1;
+  }
+
+  poolinit_lf(&P, ObjSize, 0);
+  pthread_t Threads[NumThreads];
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_create(&Threads[t], 0, worker, (void*)(unsigned long)t);
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_join(Threads[t], 0);
+  for (unsigned t = 0; t != NumThreads; ++t)
+    if (Exchange[t])
+      freeStamped(Exchange[t], stamp(NumThreads, 0));
+  pooldestroy(&P);
+
+  return reportFailures("objects were handed out twice");
+}
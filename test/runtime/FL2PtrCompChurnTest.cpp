@@ -0,0 +1,74 @@
+//===- FL2PtrCompChurnTest.cpp - Concurrent pointer compressed pools ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Several threads create, fill and destroy poolinit_pc pools over and over,
+// so that released pools are taken off and put back on the shared lock-free
+// list of released pools at the same time.  Two live pools must never share
+// memory: each thread stamps its objects and checks the stamps before it
+// destroys its pool, and checks that no other thread holds the same pool.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <pthread.h>
+#include <stdio.h>
+
+typedef PoolTy<CompressedPoolTraits> Pool;
+
+static const unsigned NumThreads = 8;
+static const unsigned Rounds = 2000;
+static const unsigned NumObjs = 64;
+
+// LiveBases - The base of the pool each thread currently holds.
+static void *LiveBases[NumThreads];
+
+static void *worker(void *Arg) {
+  unsigned T = (unsigned)(unsigned long)Arg;
+  for (unsigned r = 0; r != Rounds; ++r) {
+    Pool P;
+    // Vary the declared size, so that new pools are staggered differently.
+    void *Base = poolinit_pc(&P, 16 + 16*(T % 4), 0);
+    __atomic_store_n(&LiveBases[T], Base, __ATOMIC_SEQ_CST);
+    for (unsigned t = 0; t != NumThreads; ++t)
+      if (t != T && __atomic_load_n(&LiveBases[t], __ATOMIC_SEQ_CST) == Base)
+        __sync_fetch_and_add(&Failures, 1);
+
+    // Every few rounds, grow the pool past its first commit.
+    unsigned Size = r % 8 == 0 ? 16*1024 : 48;
+    unsigned long long Objs[NumObjs];
+    unsigned Stamp = T << 24 | r;
+    for (unsigned i = 0; i != NumObjs; ++i) {
+      Objs[i] = poolalloc_pc(&P, Size);
+      unsigned *W = (unsigned*)((char*)Base + Objs[i]);
+      W[0] = W[Size/sizeof(unsigned)-1] = Stamp + i;
+    }
+    for (unsigned i = 0; i != NumObjs; ++i) {
+      unsigned *W = (unsigned*)((char*)Base + Objs[i]);
+      if (W[0] != Stamp + i || W[Size/sizeof(unsigned)-1] != Stamp + i)
+        __sync_fetch_and_add(&Failures, 1);
+    }
+    for (unsigned i = 0; i != NumObjs; i += 2)
+      poolfree_pc(&P, Objs[i]);
+
+    __atomic_store_n(&LiveBases[T], (void*)0, __ATOMIC_SEQ_CST);
+    pooldestroy_pc(&P);
+  }
+  return 0;
+}
+
+int main() {
+  pthread_t Threads[NumThreads];
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_create(&Threads[t], 0, worker, (void*)(unsigned long)t);
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_join(Threads[t], 0);
+
+  return reportFailures("conflicts between live pools");
+}
@@ -0,0 +1,76 @@
+//===- FL2PtrCompGrowTest.cpp - Growth of pointer compressed pools --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Allocate more than 256MB from a poolinit_pc pool, so that it grows well past
+// its first commit, and check that every object still holds what was written
+// to it and is reached through its 32-bit index.  Only the first and last
+// words of each object are touched, to keep the resident set small.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <stdio.h>
+
+typedef PoolTy<CompressedPoolTraits> Pool;
+
+static const unsigned ObjSize = 64*1024;
+static const unsigned NumObjs = 5000;   // About 320MB.
+
+static unsigned *getWords(Pool *P, unsigned long long Idx) {
+  return (unsigned*)((char*)P->Slabs + Idx);
+}
+
+int main() {
+  if (sizeof(void*) < 8) {
+    fprintf(stderr, "pointer compressed pools reserve 256MB here; skipped\n");
+    return 0;
+  }
+
+  Pool P;
+  void *Base = poolinit_pc(&P, 16, 0);
+  static unsigned long long Objs[NumObjs];
+  unsigned long long MaxIdx = 0;
+  for (unsigned i = 0; i != NumObjs; ++i) {
+    Objs[i] = poolalloc_pc(&P, ObjSize);
+    unsigned *W = getWords(&P, Objs[i]);
+    W[0] = i;
+    W[ObjSize/sizeof(unsigned)-1] = ~i;
+    if (Objs[i] > MaxIdx) MaxIdx = Objs[i];
+  }
+
+  // The pool does not move as it grows.
+  CHECK(P.Slabs == Base);
+  CHECK(MaxIdx > 256ULL*1024*1024);
+  CHECK(MaxIdx < 4ULL*1024*1024*1024);
+
+  unsigned Bad = 0;
+  for (unsigned i = 0; i != NumObjs; ++i) {
+    unsigned *W = getWords(&P, Objs[i]);
+    if (W[0] != i || W[ObjSize/sizeof(unsigned)-1] != ~i)
+      ++Bad;
+  }
+  CHECK(Bad == 0);
+
+  // Free half of the objects and allocate them again; the others must not be
+  // disturbed.
+  for (unsigned i = 0; i != NumObjs; i += 2)
+    poolfree_pc(&P, Objs[i]);
+  for (unsigned i = 0; i != NumObjs; i += 2)
+    getWords(&P, poolalloc_pc(&P, ObjSize))[0] = ~0U;
+  for (unsigned i = 1; i < NumObjs; i += 2) {
+    unsigned *W = getWords(&P, Objs[i]);
+    if (W[0] != i || W[ObjSize/sizeof(unsigned)-1] != ~i)
+      ++Bad;
+  }
+  CHECK(Bad == 0);
+  pooldestroy_pc(&P);
+
+  return reportFailures();
+}
@@ -0,0 +1,66 @@
+//===- FL2ReallocTest.cpp - Tests of poolrealloc in FL2 pools -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Grow an object into the free node after it, shrink it again, and grow it
+// past what is free around it.  The first two must resize the object where it
+// is and the last must move it, as NumReallocsInPlace and NumReallocsMoved
+// count, and the contents must survive all three.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static bool holds(void *Obj, unsigned Size, unsigned char Byte) {
+  for (unsigned i = 0; i != Size; ++i)
+    if (((unsigned char*)Obj)[i] != Byte)
+      return false;
+  return true;
+}
+
+int main() {
+  Pool P;
+  poolinit(&P, 16, 0);
+  void *A = poolalloc(&P, 64);
+  void *B = poolalloc(&P, 64);
+  void *C = poolalloc(&P, 64);   // Keeps A from growing into the slab tail.
+  memset(A, 0xA5, 64);
+  poolfree(&P, B);
+
+  // Grow into B.
+  void *R = poolrealloc(&P, A, 120);
+  CHECK(R == A);
+  CHECK(holds(R, 64, 0xA5));
+  CHECK(P.NumReallocsInPlace == 1 && P.NumReallocsMoved == 0);
+
+  // Shrink; the tail goes back to the pool.
+  memset(R, 0x5A, 120);
+  R = poolrealloc(&P, R, 32);
+  CHECK(R == A);
+  CHECK(holds(R, 32, 0x5A));
+  CHECK(P.NumReallocsInPlace == 2 && P.NumReallocsMoved == 0);
+  CHECK(poolalloc(&P, 64) ==
+        (char*)A + 32 + sizeof(NodeHeader<NormalPoolTraits>));
+
+  // C is in the way, so this has to move.
+  R = poolrealloc(&P, R, 4000);
+  CHECK(R != A);
+  CHECK(holds(R, 32, 0x5A));
+  CHECK(P.NumReallocsInPlace == 2 && P.NumReallocsMoved == 1);
+
+  poolfree(&P, R);
+  poolfree(&P, C);
+  pooldestroy(&P);
+
+  return reportFailures();
+}
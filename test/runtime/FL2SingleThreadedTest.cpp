@@ -0,0 +1,78 @@
+//===- FL2SingleThreadedTest.cpp - Tests of poolinit_st pools -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// poolfree_st does not merge freed objects of the declared size with their
+// neighbours.  Check that the pool merges them before it grows, so that the
+// space can be reused for objects of other sizes.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <stdio.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+// testReuseAfterFreeAll - Fill a slab with objects of the declared size and
+// free them all in a scattered order.  Objects of another size must be carved
+// out of the freed space before the pool grows again.
+static void testReuseAfterFreeAll() {
+  Pool P;
+  poolinit_st(&P, 16, 0);
+  static void *Objs[1 << 20];
+  unsigned Num = 0;
+  Objs[Num++] = poolalloc_st(&P, 16);
+  void *Slabs = P.Slabs;
+  do
+    Objs[Num++] = poolalloc_st(&P, 16);
+  while (P.Slabs == Slabs);
+  --Num;   // The last one is in the second slab.
+  Slabs = P.Slabs;
+
+  for (unsigned i = 0; i != Num; ++i)
+    poolfree_st(&P, Objs[(i*7) % Num]);
+  CHECK(Num % 7 != 0);
+
+  char *R;
+  do
+    R = (char*)poolalloc_st(&P, 40);
+  while (P.Slabs == Slabs && (R < Objs[0] || R > Objs[Num-1]));
+  CHECK(P.Slabs == Slabs);
+  CHECK(R == Objs[0]);
+  pooldestroy(&P);
+}
+
+// testMergeWithBinNeighbour - An object of the declared size that is next to
+// a free node of another size must be merged with it.
+static void testMergeWithBinNeighbour() {
+  Pool P;
+  poolinit_st(&P, 16, 0);
+  void *A = poolalloc_st(&P, 16);
+  void *B = poolalloc_st(&P, 200);
+  void *C = poolalloc_st(&P, 16);  // Keeps B from merging with the slab tail.
+  void *Slabs = P.Slabs;
+
+  poolfree_st(&P, B);
+  poolfree_st(&P, A);
+  // Only A followed by B can hold this without growing the pool.  Request it
+  // until the rest of the slab is used up.
+  void *R;
+  do
+    R = poolalloc_st(&P, 208);
+  while (R != A && P.Slabs == Slabs);
+  CHECK(R == A);
+  poolfree_st(&P, C);
+  pooldestroy(&P);
+}
+
+int main() {
+  testReuseAfterFreeAll();
+  testMergeWithBinNeighbour();
+  return reportFailures();
+}
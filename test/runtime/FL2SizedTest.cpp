@@ -0,0 +1,143 @@
+//===- FL2SizedTest.cpp - Tests of the poolalloc_<Size>_<Align> calls -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Call every poolalloc_<Size>_<Align> entry point listed in PoolAllocSizes.def
+// on normal pools, which go through the thread caches, on single-threaded and
+// on lock-free pools, and on a pool that keeps statistics.  The objects must
+// be aligned, big enough and disjoint, and a freed object must be the next
+// one handed out.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+struct SizedAlloc {
+  unsigned Size, Align;
+  void *(*Alloc)(Pool *);
+};
+
+static const SizedAlloc SizedAllocs[] = {
+#define POOLALLOC_SIZE(Size, Align) \
+  { Size, Align, poolalloc_##Size##_##Align },
+#include "poolalloc/PoolAllocSizes.def"
+};
+static const unsigned NumSizedAllocs =
+  sizeof(SizedAllocs)/sizeof(SizedAllocs[0]);
+
+enum PoolKind { Normal, SingleThreaded, LockFree };
+
+static const unsigned NumObjs = 200;
+
+static int comparePtrs(const void *LHS, const void *RHS) {
+  char *L = *(char*const*)LHS, *R = *(char*const*)RHS;
+  return L < R ? -1 : (L > R ? 1 : 0);
+}
+
+// testSized - Allocate objects with SA from a pool of kind Kind.
+static void testSized(const SizedAlloc &SA, PoolKind Kind) {
+  Pool P;
+  if (Kind == SingleThreaded)
+    poolinit_st(&P, SA.Size, SA.Align);
+  else if (Kind == LockFree)
+    poolinit_lf(&P, SA.Size, SA.Align);
+  else
+    poolinit(&P, SA.Size, SA.Align);
+
+  void *Objs[NumObjs];
+  for (unsigned i = 0; i != NumObjs; ++i) {
+    Objs[i] = SA.Alloc(&P);
+    CHECK(((uintptr_t)Objs[i] & (SA.Align-1)) == 0);
+    CHECK(poolobjsize(&P, Objs[i]) >= SA.Size);
+    memset(Objs[i], i, SA.Size);
+  }
+  for (unsigned i = 0; i != NumObjs; ++i)
+    for (unsigned b = 0; b != SA.Size; ++b)
+      if (((unsigned char*)Objs[i])[b] != (unsigned char)i) {
+        CHECK(!"Objects overlap");
+        break;
+      }
+  qsort(Objs, NumObjs, sizeof(void*), comparePtrs);
+  for (unsigned i = 1; i != NumObjs; ++i)
+    CHECK((char*)Objs[i-1] + SA.Size <= (char*)Objs[i]);
+
+  // Each kind of pool hands out the object freed last first.
+  for (unsigned i = 0; i < NumObjs; i += 7) {
+    if (Kind == SingleThreaded)
+      poolfree_st(&P, Objs[i]);
+    else
+      poolfree(&P, Objs[i]);
+    CHECK(SA.Alloc(&P) == Objs[i]);
+  }
+
+  for (unsigned i = 0; i != NumObjs; ++i) {
+    if (Kind == SingleThreaded)
+      poolfree_st(&P, Objs[i]);
+    else
+      poolfree(&P, Objs[i]);
+  }
+  pooldestroy(&P);
+}
+
+// testStats - Allocations through the sized entry points are counted.  The
+// statistics are set up by the first poolinit of a process, so this runs in a
+// child before the parent creates any pool.
+static void testStats() {
+  char File[] = "/tmp/FL2SizedTest.XXXXXX";
+  int FD = mkstemp(File);
+  if (FD < 0) {
+    perror("mkstemp");
+    ++Failures;
+    return;
+  }
+  close(FD);
+
+  pid_t Child = fork();
+  if (Child == 0) {
+    setenv("POOLALLOC_STATS", File, 1);
+    Pool P;
+    poolinit(&P, 48, 8);
+    for (unsigned i = 0; i != 5; ++i)
+      poolfree(&P, poolalloc_48_8(&P));
+    exit(0);
+  }
+  int Status;
+  CHECK(waitpid(Child, &Status, 0) == Child && WIFEXITED(Status) &&
+        WEXITSTATUS(Status) == 0);
+
+  char Buf[4096] = "";
+  FILE *F = fopen(File, "r");
+  if (F) {
+    if (!fgets(Buf, sizeof(Buf), F)) Buf[0] = 0;
+    fclose(F);
+  }
+  unlink(File);
+  CHECK(strstr(Buf, "\"kind\":\"normal\",\"declared_size\":48,\"pools\":1,"
+                    "\"live_pools\":1,\"allocs\":5,\"frees\":5,"
+                    "\"alloc_bytes\":240,"));
+}
+
+int main() {
+  testStats();
+  for (unsigned i = 0; i != NumSizedAllocs; ++i) {
+    testSized(SizedAllocs[i], Normal);
+    testSized(SizedAllocs[i], SingleThreaded);
+    testSized(SizedAllocs[i], LockFree);
+  }
+
+  return reportFailures();
+}
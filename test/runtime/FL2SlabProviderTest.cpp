@@ -0,0 +1,138 @@
+//===- FL2SlabProviderTest.cpp - Tests of the FL2 slab providers ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Run pools on the "mmap" and "hugemmap" slab providers.  Slabs must be page
+// or huge page aligned, a slab that becomes empty must have its pages dropped
+// with MADV_DONTNEED while it stays usable, and pooldestroy must unmap it.
+// The provider is picked once per process, so each one is tested in a child
+// process.  The runtime is included rather than linked so that the slabs and
+// the provider can be inspected.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.cpp"
+#include "TestCheck.h"
+#include <errno.h>
+#include <sys/wait.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const unsigned ObjSize = 1000;
+
+static bool isResident(void *Page) {
+  unsigned char Vec;
+  return mincore(Page, SlabPageSize, &Vec) == 0 && (Vec & 1);
+}
+
+static bool isMapped(void *Page) {
+  unsigned char Vec;
+  return mincore(Page, SlabPageSize, &Vec) == 0 || errno != ENOMEM;
+}
+
+static bool inSlab(PoolSlab<NormalPoolTraits> *PS, void *Obj) {
+  return (char*)Obj >= (char*)PS && (char*)Obj < (char*)PS + PS->Size;
+}
+
+static int compareDescending(const void *LHS, const void *RHS) {
+  char *L = *(char*const*)LHS, *R = *(char*const*)RHS;
+  return L < R ? 1 : (L > R ? -1 : 0);
+}
+
+// testDiscardRounding - Only the whole pages inside the range are dropped.
+static void testDiscardRounding() {
+  char *Mem = (char*)AllocateSpaceWithMMAP(4*SlabPageSize);
+  memset(Mem, 0xA5, 4*SlabPageSize);
+  getSlabProvider()->Discard(Mem + 100, Mem + 3*SlabPageSize + 100);
+  CHECK((unsigned char)Mem[SlabPageSize-1] == 0xA5);
+  CHECK(Mem[SlabPageSize] == 0 && Mem[3*SlabPageSize-1] == 0);
+  CHECK((unsigned char)Mem[3*SlabPageSize] == 0xA5);
+  munmap(Mem, 4*SlabPageSize);
+}
+
+// testEmptySlab - Fill pools until a slab of at least MinSlabSize exists,
+// check its alignment, empty it and check that its pages are dropped.
+static void testEmptySlab(unsigned long MinSlabSize, unsigned long Align) {
+  Pool P;
+  poolinit(&P, 24, 8);
+  unsigned Cap = 2*MinSlabSize/ObjSize + 64, Num = 0;
+  void **Objs = (void**)malloc(Cap*sizeof(void*));
+  while (P.Slabs == 0 || P.Slabs->Size < MinSlabSize ||
+         !inSlab(P.Slabs, Objs[Num-1]))
+    Objs[Num++] = poolalloc(&P, ObjSize);
+  // Fill the rest of the big slab as well.
+  for (unsigned i = 0; i != 16; ++i)
+    Objs[Num++] = poolalloc(&P, ObjSize);
+
+  PoolSlab<NormalPoolTraits> *PS = P.Slabs;
+  CHECK(((uintptr_t)PS & (Align-1)) == 0);
+  CHECK((PS->Size & (Align-1)) == 0);
+
+  // Free the objects of the slab from the top down, so that each merges with
+  // the free space after it.
+  unsigned NumInSlab = 0;
+  for (unsigned i = 0; i != Num; ++i)
+    if (inSlab(PS, Objs[i])) {
+      memset(Objs[i], 0xA5, ObjSize);
+      Objs[NumInSlab++] = Objs[i];
+    }
+  CHECK(NumInSlab > 16);
+  qsort(Objs, NumInSlab, sizeof(void*), compareDescending);
+  char *Middle = (char*)(((uintptr_t)Objs[NumInSlab/2] + SlabPageSize) &
+                         ~(SlabPageSize-1));
+  CHECK(isResident(Middle));
+  for (unsigned i = 0; i != NumInSlab; ++i)
+    poolfree(&P, Objs[i]);
+  CHECK(!isResident(Middle));
+  CHECK(*Middle == 0);
+
+  // The slab is still usable.
+  void *Obj = poolalloc(&P, ObjSize);
+  CHECK(inSlab(PS, Obj));
+  memset(Obj, 0x5A, ObjSize);
+  poolfree(&P, Obj);
+
+  pooldestroy(&P);
+  CHECK(!isMapped(Middle));
+  free(Objs);
+}
+
+static void testMMAP() {
+  CHECK(getSlabProvider() == &SlabProviders[1]);
+  testDiscardRounding();
+  testEmptySlab(DISCARD_SLAB_SIZE, SlabPageSize);
+}
+
+static void testHugeMMAP() {
+  CHECK(getSlabProvider() == &SlabProviders[2]);
+  testEmptySlab(HUGE_PAGE_SIZE, HUGE_PAGE_SIZE);
+}
+
+// runWithProvider - Run Test in a child process using the slab provider
+// Name, and return true if it passed.
+static bool runWithProvider(const char *Name, void (*Test)()) {
+  pid_t Child = fork();
+  if (Child == 0) {
+    setenv("POOLALLOC_SLABS", Name, 1);
+    Test();
+    _exit(Failures != 0);
+  }
+  int Status;
+  if (waitpid(Child, &Status, 0) != Child || !WIFEXITED(Status) ||
+      WEXITSTATUS(Status) != 0) {
+    fprintf(stderr, "slab provider %s failed\n", Name);
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  bool Passed = runWithProvider("mmap", testMMAP);
+  Passed &= runWithProvider("hugemmap", testHugeMMAP);
+  return Passed ? 0 : 1;
+}
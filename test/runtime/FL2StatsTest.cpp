@@ -0,0 +1,324 @@
+//===- FL2StatsTest.cpp - Tests of the POOLALLOC_STATS output -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A child process uses pools of every kind with statistics enabled, dumps
+// them once through POOLALLOC_STATS_SIGNAL and once at exit.  The parent
+// parses both lines as JSON, including a pool name full of characters that
+// have to be escaped, and checks the counters of each site.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const char *const OddName = "a \"quoted\" \\name\\\n\twith\x01 controls";
+
+//===----------------------------------------------------------------------===//
+// A small JSON parser.  It accepts exactly the JSON grammar, with numbers
+// limited to integers, which is all the runtime writes.
+//===----------------------------------------------------------------------===//
+
+struct Value {
+  enum { Null, Bool, Number, String, Array, Object } Kind;
+  long long Num;
+  std::string Str;
+  std::vector<Value> Elts;
+  std::map<std::string, Value> Members;
+
+  Value() : Kind(Null), Num(0) {}
+
+  const Value &operator[](const char *Key) const {
+    static const Value Missing;
+    std::map<std::string, Value>::const_iterator I = Members.find(Key);
+    return I == Members.end() ? Missing : I->second;
+  }
+};
+
+class Parser {
+  const char *Cur;
+
+  void skipSpace() {
+    while (*Cur == ' ' || *Cur == '\t' || *Cur == '\n' || *Cur == '\r')
+      ++Cur;
+  }
+
+  bool parseString(std::string &Str) {
+    if (*Cur++ != '"') return false;
+    for (;;) {
+      unsigned char C = *Cur++;
+      if (C == '"') return true;
+      if (C < 0x20) return false;
+      if (C != '\\') {
+        Str += C;
+        continue;
+      }
+      switch (*Cur++) {
+      case '"': Str += '"'; break;
+      case '\\': Str += '\\'; break;
+      case '/': Str += '/'; break;
+      case 'b': Str += '\b'; break;
+      case 'f': Str += '\f'; break;
+      case 'n': Str += '\n'; break;
+      case 'r': Str += '\r'; break;
+      case 't': Str += '\t'; break;
+      case 'u': {
+        unsigned Code = 0;
+        for (unsigned i = 0; i != 4; ++i, ++Cur) {
+          char H = *Cur;
+          if (H >= '0' && H <= '9') Code = Code*16 + H-'0';
+          else if (H >= 'a' && H <= 'f') Code = Code*16 + H-'a'+10;
+          else if (H >= 'A' && H <= 'F') Code = Code*16 + H-'A'+10;
+          else return false;
+        }
+        if (Code > 0x7f) return false;   // Not needed here.
+        Str += (char)Code;
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+  }
+
+  bool parseLiteral(const char *Lit) {
+    size_t Len = strlen(Lit);
+    if (strncmp(Cur, Lit, Len)) return false;
+    Cur += Len;
+    return true;
+  }
+
+public:
+  explicit Parser(const char *Text) : Cur(Text) {}
+
+  bool parseValue(Value &V) {
+    skipSpace();
+    switch (*Cur) {
+    case '{':
+      V.Kind = Value::Object;
+      ++Cur;
+      skipSpace();
+      if (*Cur == '}') { ++Cur; return true; }
+      for (;;) {
+        std::string Key;
+        skipSpace();
+        if (!parseString(Key) || V.Members.count(Key)) return false;
+        skipSpace();
+        if (*Cur++ != ':' || !parseValue(V.Members[Key])) return false;
+        skipSpace();
+        if (*Cur == '}') { ++Cur; return true; }
+        if (*Cur++ != ',') return false;
+      }
+    case '[':
+      V.Kind = Value::Array;
+      ++Cur;
+      skipSpace();
+      if (*Cur == ']') { ++Cur; return true; }
+      for (;;) {
+        V.Elts.push_back(Value());
+        if (!parseValue(V.Elts.back())) return false;
+        skipSpace();
+        if (*Cur == ']') { ++Cur; return true; }
+        if (*Cur++ != ',') return false;
+      }
+    case '"':
+      V.Kind = Value::String;
+      return parseString(V.Str);
+    case 't': V.Kind = Value::Bool; V.Num = 1; return parseLiteral("true");
+    case 'f': V.Kind = Value::Bool; return parseLiteral("false");
+    case 'n': return parseLiteral("null");
+    default: {
+      V.Kind = Value::Number;
+      bool Neg = *Cur == '-';
+      if (Neg) ++Cur;
+      if (*Cur < '0' || *Cur > '9' || (*Cur == '0' && Cur[1] >= '0' &&
+                                       Cur[1] <= '9'))
+        return false;
+      while (*Cur >= '0' && *Cur <= '9')
+        V.Num = V.Num*10 + *Cur++ - '0';
+      if (Neg) V.Num = -V.Num;
+      return true;
+    }
+    }
+  }
+
+  // parseDocument - Parse a value that makes up all of the text.
+  bool parseDocument(Value &V) {
+    if (!parseValue(V)) return false;
+    skipSpace();
+    return *Cur == 0;
+  }
+};
+
+//===----------------------------------------------------------------------===//
+// The child process
+//===----------------------------------------------------------------------===//
+
+static void runChild(const char *File) {
+  setenv("POOLALLOC_STATS", File, 1);
+  char Sig[16];
+  snprintf(Sig, sizeof(Sig), "%d", SIGUSR1);
+  setenv("POOLALLOC_STATS_SIGNAL", Sig, 1);
+
+  Pool Normal, Named, BP, ST, LF;
+  poolinit(&Normal, 32, 8);
+  poolinit(&Named, 32, 8);
+  poolprofile_name(&Named, OddName);
+  poolinit_bp(&BP, 8);
+  poolinit_st(&ST, 16, 8);
+  poolinit_lf(&LF, 16, 8);
+
+  void *Objs[100];
+  for (unsigned i = 0; i != 100; ++i)
+    Objs[i] = poolalloc(&Normal, 32);
+  for (unsigned i = 0; i != 60; ++i)
+    poolfree(&Normal, Objs[i]);
+  for (unsigned i = 0; i != 10; ++i)
+    Objs[i] = poolalloc(&Named, 100);
+  for (unsigned i = 0; i != 7; ++i)
+    poolalloc_bp(&BP, 24);
+  for (unsigned i = 0; i != 5; ++i)
+    poolfree_st(&ST, poolalloc_st(&ST, 16));
+  for (unsigned i = 0; i != 3; ++i)
+    poolfree(&LF, poolalloc(&LF, 16));
+
+  // The signal dump happens at the next pool operation.
+  raise(SIGUSR1);
+  poolfree(&Named, Objs[0]);
+  pooldestroy_bp(&BP);
+  exit(0);
+}
+
+//===----------------------------------------------------------------------===//
+// Checking the output
+//===----------------------------------------------------------------------===//
+
+static bool isCount(const Value &V) {
+  return V.Kind == Value::Number && V.Num >= 0;
+}
+
+// checkSite - Check the fields that every site has.
+static void checkSite(const Value &S) {
+  CHECK(S.Kind == Value::Object);
+  CHECK(S["site"].Kind == Value::String);
+  CHECK(S["kind"].Kind == Value::String);
+  const char *Counts[] = { "declared_size", "pools", "live_pools", "allocs",
+                           "frees", "alloc_bytes", "slabs", "slab_bytes",
+                           "free_nodes", "lock_contended",
+                           "reallocs_in_place", "reallocs_moved" };
+  for (unsigned i = 0; i != sizeof(Counts)/sizeof(Counts[0]); ++i)
+    CHECK(isCount(S[Counts[i]]));
+  CHECK(S["live_bytes"].Kind == Value::Number);
+  CHECK(S["peak_bytes"].Kind == Value::Number);
+
+  const char *Hists[] = { "alloc_latency_ns", "free_latency_ns" };
+  for (unsigned h = 0; h != 2; ++h) {
+    const Value &Hist = S[Hists[h]];
+    CHECK(Hist.Kind == Value::Array && Hist.Elts.size() == 32);
+    long long Sum = 0;
+    for (unsigned i = 0; i != Hist.Elts.size(); ++i) {
+      CHECK(isCount(Hist.Elts[i]));
+      Sum += Hist.Elts[i].Num;
+    }
+    // Only some operations are timed.
+    CHECK(Sum <= S[h ? "frees" : "allocs"].Num);
+  }
+}
+
+// findSite - Return the site of kind Kind with Name, or with no name if Name
+// is null.
+static const Value *findSite(const Value &Dump, const char *Kind,
+                             const char *Name) {
+  const std::vector<Value> &Sites = Dump["sites"].Elts;
+  for (unsigned i = 0; i != Sites.size(); ++i)
+    if (Sites[i]["kind"].Str == Kind &&
+        (Name ? Sites[i]["name"].Str == Name
+              : Sites[i]["name"].Kind == Value::Null))
+      return &Sites[i];
+  return 0;
+}
+
+// checkDump - Check one line of output.  AtExit tells which of the dumps it
+// is.
+static void checkDump(const char *Line, pid_t Child, bool AtExit) {
+  Value Dump;
+  if (!Parser(Line).parseDocument(Dump)) {
+    fprintf(stderr, "not JSON: %s\n", Line);
+    CHECK(!"Output is not JSON");
+    return;
+  }
+  CHECK(Dump.Kind == Value::Object);
+  CHECK(Dump["pid"].Num == Child);
+  CHECK(isCount(Dump["sample_period"]) && Dump["sample_period"].Num > 0);
+  CHECK(Dump["sites"].Kind == Value::Array);
+  for (unsigned i = 0; i != Dump["sites"].Elts.size(); ++i)
+    checkSite(Dump["sites"].Elts[i]);
+
+  const Value *S = findSite(Dump, "normal", 0);
+  CHECK(S && (*S)["declared_size"].Num == 32 && (*S)["pools"].Num == 1 &&
+        (*S)["allocs"].Num == 100 && (*S)["frees"].Num == 60 &&
+        (*S)["alloc_bytes"].Num == 3200 && (*S)["live_bytes"].Num == 1280 &&
+        (*S)["peak_bytes"].Num == 3200);
+
+  S = findSite(Dump, "normal", OddName);
+  CHECK(S && (*S)["pools"].Num == 1 && (*S)["allocs"].Num == 10 &&
+        (*S)["frees"].Num == AtExit);
+
+  S = findSite(Dump, "bp", 0);
+  CHECK(S && (*S)["pools"].Num == 1 && (*S)["allocs"].Num == 7 &&
+        (*S)["live_pools"].Num == !AtExit);
+
+  S = findSite(Dump, "st", 0);
+  CHECK(S && (*S)["allocs"].Num == 5 && (*S)["frees"].Num == 5 &&
+        (*S)["live_bytes"].Num == 0);
+
+  S = findSite(Dump, "lockfree", 0);
+  CHECK(S && (*S)["allocs"].Num == 3 && (*S)["frees"].Num == 3);
+}
+
+int main() {
+  char File[] = "/tmp/FL2StatsTest.XXXXXX";
+  int FD = mkstemp(File);
+  if (FD < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(FD);
+
+  pid_t Child = fork();
+  if (Child == 0)
+    runChild(File);
+  int Status;
+  CHECK(waitpid(Child, &Status, 0) == Child && WIFEXITED(Status) &&
+        WEXITSTATUS(Status) == 0);
+
+  FILE *F = fopen(File, "r");
+  std::vector<std::string> Lines;
+  char Buf[1 << 16];
+  while (F && fgets(Buf, sizeof(Buf), F))
+    Lines.push_back(Buf);
+  if (F) fclose(F);
+  unlink(File);
+
+  CHECK(Lines.size() == 2);
+  for (unsigned i = 0; i != Lines.size(); ++i)
+    checkDump(Lines[i].c_str(), Child, i == 1);
+
+  return reportFailures();
+}
@@ -0,0 +1,103 @@
+//===- FL2ThreadCacheTest.cpp - Tests of the FL2 per-thread caches --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Destroy a pool that other threads have cached objects of, while those
+// threads go on allocating from pools of their own.  pooldestroy unbinds the
+// other threads' caches as they look them up, so build this with
+// -fsanitize=thread as well to check that it does so without a data race.
+// Every other round the shared pool is created with a size of zero, so the
+// threads also race to set its declared size with their first allocations.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include "TestCheck.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const unsigned NumThreads = 4;
+static const unsigned Rounds = 50;
+static const unsigned ObjSize = 24;
+static const unsigned LiveObjs = 32;
+
+static Pool Shared;
+static pthread_barrier_t Barrier;
+
+// churnOwnPools - Replace objects in a few pools of this thread, checking that
+// every object keeps what was written to it.
+static void churnOwnPools(Pool *Pools, unsigned NumPools, unsigned Tag) {
+  void *Live[4][LiveObjs];
+  for (unsigned p = 0; p != NumPools; ++p)
+    for (unsigned i = 0; i != LiveObjs; ++i) {
+      Live[p][i] = poolalloc(&Pools[p], ObjSize);
+      memset(Live[p][i], Tag + p, ObjSize);
+    }
+
+  for (unsigned n = 0; n != 2000; ++n) {
+    unsigned p = n % NumPools, i = (n / NumPools) % LiveObjs;
+    if (((unsigned char*)Live[p][i])[ObjSize-1] != (unsigned char)(Tag + p))
+      __sync_fetch_and_add(&Failures, 1);
+    poolfree(&Pools[p], Live[p][i]);
+    Live[p][i] = poolalloc(&Pools[p], ObjSize);
+    memset(Live[p][i], Tag + p, ObjSize);
+  }
+
+  for (unsigned p = 0; p != NumPools; ++p)
+    for (unsigned i = 0; i != LiveObjs; ++i)
+      poolfree(&Pools[p], Live[p][i]);
+}
+
+static void *worker(void *Arg) {
+  unsigned Tag = (unsigned)(unsigned long)Arg * 16;
+  Pool Own[4];
+  for (unsigned p = 0; p != 4; ++p)
+    poolinit(&Own[p], ObjSize, 0);
+
+  for (unsigned r = 0; r != Rounds; ++r) {
+    pthread_barrier_wait(&Barrier);   // Shared is ready.
+    void *Objs[LiveObjs];
+    for (unsigned i = 0; i != LiveObjs; ++i)
+      Objs[i] = poolalloc(&Shared, ObjSize);
+    for (unsigned i = 0; i != LiveObjs; ++i)
+      poolfree(&Shared, Objs[i]);
+    pthread_barrier_wait(&Barrier);   // Done with Shared.
+
+    // The main thread destroys Shared meanwhile.
+    churnOwnPools(Own, 4, Tag);
+    pthread_barrier_wait(&Barrier);
+  }
+
+  for (unsigned p = 0; p != 4; ++p)
+    pooldestroy(&Own[p]);
+  return 0;
+}
+
+int main() {
+  pthread_barrier_init(&Barrier, 0, NumThreads + 1);
+  pthread_t Threads[NumThreads];
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_create(&Threads[t], 0, worker, (void*)(unsigned long)t);
+
+  for (unsigned r = 0; r != Rounds; ++r) {
+    poolinit(&Shared, r % 2 ? 0 : ObjSize, 0);
+    pthread_barrier_wait(&Barrier);
+    pthread_barrier_wait(&Barrier);
+    pooldestroy(&Shared);
+    pthread_barrier_wait(&Barrier);
+  }
+
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_join(Threads[t], 0);
+  pthread_barrier_destroy(&Barrier);
+
+  return reportFailures("objects were overwritten");
+}
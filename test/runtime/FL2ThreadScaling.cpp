@@ -0,0 +1,121 @@
+//===- FL2ThreadScaling.cpp - Thread scaling of FL2 pools -----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Time declared-size poolalloc/poolfree pairs on one pool shared by 1 to 8
+// threads, and on a single thread that alternates between pools whose
+// descriptors are laid out 256 bytes apart.  The second case catches pools
+// that fight over the same per-thread cache slot.
+//
+// Only runs with no more threads than online CPUs say anything about how the
+// shared pool scales; the others are marked as oversubscribed.  On a host with
+// one CPU the shared pool numbers just measure time slicing.
+//
+// Usage: FL2ThreadScaling [iterations per thread]
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef PoolTy<NormalPoolTraits> Pool;
+
+static const unsigned ObjSize = 24;
+static const unsigned LiveObjs = 64;
+static unsigned Iterations = 2000000;
+static long NumCPUs = 1;
+
+static double now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+// churn - Keep LiveObjs objects alive in each of NumPools pools, replacing
+// one object per iteration and moving to the next pool each time.
+static void churn(Pool **Pools, unsigned NumPools) {
+  void *Live[8][LiveObjs];
+  for (unsigned p = 0; p != NumPools; ++p)
+    for (unsigned i = 0; i != LiveObjs; ++i)
+      Live[p][i] = poolalloc(Pools[p], ObjSize);
+
+  for (unsigned i = 0; i != Iterations; ++i) {
+    unsigned p = i % NumPools, Slot = (i / NumPools) % LiveObjs;
+    poolfree(Pools[p], Live[p][Slot]);
+    Live[p][Slot] = poolalloc(Pools[p], ObjSize);
+  }
+
+  for (unsigned p = 0; p != NumPools; ++p)
+    for (unsigned i = 0; i != LiveObjs; ++i)
+      poolfree(Pools[p], Live[p][i]);
+}
+
+static void *sharedPoolThread(void *P) {
+  Pool *Pools[1] = { (Pool*)P };
+  churn(Pools, 1);
+  return 0;
+}
+
+static void sharedPool(unsigned NumThreads) {
+  Pool P;
+  poolinit(&P, ObjSize, 8);
+  pthread_t Threads[8];
+  double Start = now();
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_create(&Threads[t], 0, sharedPoolThread, &P);
+  for (unsigned t = 0; t != NumThreads; ++t)
+    pthread_join(Threads[t], 0);
+  double Elapsed = now() - Start;
+  pooldestroy(&P);
+
+  double Ops = (double)Iterations * NumThreads;
+  printf("shared pool, %u thread(s): %7.1f Mpairs/s%s\n",
+         NumThreads, Ops / Elapsed / 1e6,
+         NumThreads > NumCPUs ? "  (oversubscribed)" : "");
+}
+
+// alternatingPools - Run churn on NumPools pools whose descriptors are 256
+// bytes apart.
+static void alternatingPools(unsigned NumPools) {
+  static char Storage[8][256] __attribute__((aligned(256)));
+  if (sizeof(Pool) > sizeof(Storage[0])) {
+    fprintf(stderr, "PoolTy is bigger than 256 bytes\n");
+    exit(1);
+  }
+  Pool *Pools[8];
+  for (unsigned p = 0; p != NumPools; ++p) {
+    Pools[p] = (Pool*)Storage[p];
+    poolinit(Pools[p], ObjSize, 8);
+  }
+  double Start = now();
+  churn(Pools, NumPools);
+  double Elapsed = now() - Start;
+  for (unsigned p = 0; p != NumPools; ++p)
+    pooldestroy(Pools[p]);
+
+  printf("%u alternating pools, 1 thread: %7.1f ns/pair\n",
+         NumPools, Elapsed * 1e9 / Iterations);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    Iterations = atoi(argv[1]);
+  NumCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (NumCPUs < 1) NumCPUs = 1;
+  printf("%ld online CPU(s)\n", NumCPUs);
+
+  for (unsigned t = 1; t <= 8; t *= 2)
+    sharedPool(t);
+  for (unsigned p = 1; p <= 4; p *= 2)
+    alternatingPools(p);
+  return 0;
+}
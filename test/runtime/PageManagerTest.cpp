@@ -0,0 +1,184 @@
+//===- PageManagerTest.cpp - Tests of the page manager span caches --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Check how the page manager reuses freed spans: single pages are mapped in
+// batches, the most recently freed span is handed out first, split spans keep
+// their rest, thread caches spill to the global table past their high
+// watermark and when their thread exits, even for pages freed after they were
+// flushed, and pages beyond the global high watermark or in very long spans
+// are unmapped.  Each test runs in a thread of its own so that it starts with
+// an empty thread cache, and the global table is emptied between tests.  The
+// page manager is included rather than linked so that its caches can be
+// inspected.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PageManager.cpp"
+#include "TestCheck.h"
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+static char *page(void *Base, unsigned N) {
+  return (char*)Base + (size_t)N*PageSize;
+}
+
+static bool isMapped(void *Page) {
+  unsigned char Vec;
+  return mincore(Page, PageSize, &Vec) == 0 || errno != ENOMEM;
+}
+
+static void *runTest(void *Test) {
+  ((void (*)())Test)();
+  return 0;
+}
+
+// runInThread - Run Test in a new thread and wait for it to exit.
+static void runInThread(void (*Test)()) {
+  pthread_t T;
+  pthread_create(&T, 0, runTest, (void*)Test);
+  pthread_join(T, 0);
+}
+
+// drainGlobal - Unmap every span in the global table.
+static void drainGlobal() {
+  while (uintptr_t Span = GlobalPop(1))
+    UnmapPages(getSpanStart(Span), getSpanPages(Span));
+  CHECK(GlobalPages == 0);
+}
+
+// testBatch - A single page comes with a batch of pages, which are handed out
+// in order afterwards.
+static void testBatch() {
+  char *First = (char*)AllocatePage();
+  CHECK(((uintptr_t)First & (PageSize-1)) == 0);
+  CHECK(ThreadCache.NumSpans == 1);
+  CHECK(ThreadCache.NumPages == PAGE_BATCH_SIZE-1);
+  CHECK(getSpanStart(ThreadCache.Spans[0]) == page(First, 1));
+  for (unsigned i = 1; i != PAGE_BATCH_SIZE; ++i)
+    CHECK(AllocatePage() == page(First, i));
+  CHECK(ThreadCache.NumSpans == 0 && ThreadCache.NumPages == 0);
+  FreeNPages(First, PAGE_BATCH_SIZE);
+}
+
+// testReuse - The most recently freed span that is long enough is used, and
+// what is left of it stays cached.
+static void testReuse() {
+  char *A = (char*)AllocateNPages(4);
+  char *B = (char*)AllocateNPages(4);
+  char *C = (char*)AllocateNPages(10);
+  FreeNPages(A, 4);
+  FreeNPages(C, 10);
+  FreeNPages(B, 4);
+  CHECK(AllocatePage() == B);
+  CHECK(AllocateNPages(3) == page(B, 1));
+  CHECK(AllocateNPages(5) == C);
+  // The rest of C is now the most recent span.
+  CHECK(AllocateNPages(4) == page(C, 5));
+  CHECK(AllocateNPages(4) == A);
+  CHECK(ThreadCache.NumSpans == 1 && ThreadCache.NumPages == 1);
+  CHECK(getSpanStart(ThreadCache.Spans[0]) == page(C, 9));
+  CHECK(GlobalPages == 0);
+  FreeNPages(A, 4);
+  FreeNPages(B, 4);
+  FreeNPages(C, 9);
+}
+
+// testHighWater - Freed pages move to the global table once the thread caches
+// too many, and none get lost on the way.
+static void testHighWater() {
+  static void *Pages[PAGE_THREAD_HIGH_WATER + 6];
+  const unsigned Num = sizeof(Pages)/sizeof(Pages[0]);
+  for (unsigned i = 0; i != Num; ++i)
+    Pages[i] = AllocatePage();
+  unsigned Mapped = (Num + PAGE_BATCH_SIZE-1) / PAGE_BATCH_SIZE;
+  Mapped *= PAGE_BATCH_SIZE;
+  CHECK(ThreadCache.NumPages == Mapped - Num);
+
+  for (unsigned i = 0; i != Num; ++i) {
+    FreePage(Pages[i]);
+    CHECK(ThreadCache.NumPages <= PAGE_THREAD_HIGH_WATER);
+    CHECK(ThreadCache.NumSpans <= PAGE_THREAD_CACHE_SPANS);
+  }
+  CHECK(GlobalPages != 0);
+  CHECK(ThreadCache.NumPages + GlobalPages == Mapped);
+}
+
+// The thread exit tests pass a span from one thread to the next.
+static char *Handoff;
+
+static void freeAndExit() {
+  Handoff = (char*)AllocateNPages(5);
+  FreeNPages(Handoff, 5);
+  CHECK(GlobalPages == 0);
+}
+
+// freeAfterFlush - Free a span from a thread-specific data destructor.  glibc
+// runs the destructors in the order the keys were created, so this one runs
+// after the one that flushed the thread cache, which has to flush it again.
+static pthread_key_t LateFreeKey;
+
+static void lateFree(void *) {
+  FreeNPages(Handoff, 5);
+}
+
+static void freeAfterFlush() {
+  Handoff = (char*)AllocateNPages(5);
+  pthread_key_create(&LateFreeKey, lateFree);
+  pthread_setspecific(LateFreeKey, Handoff);
+}
+
+static void takeFromGlobal() {
+  CHECK(GlobalPages == 5);
+  CHECK(AllocateNPages(5) == Handoff);
+  CHECK(GlobalPages == 0);
+  FreeNPages(Handoff, 5);
+}
+
+// testGlobalHighWater - Spans that would take the global table past its high
+// watermark are unmapped.
+static void testGlobalHighWater() {
+  const unsigned Span = PAGE_MAX_CACHED_SPAN - 24;
+  const unsigned Num = PAGE_GLOBAL_HIGH_WATER / Span + 1;
+  char *Spans[Num];
+  for (unsigned i = 0; i != Num; ++i)
+    Spans[i] = (char*)AllocateNPages(Span);
+  for (unsigned i = 0; i != Num; ++i)
+    FreeNPages(Spans[i], Span);
+  CHECK(ThreadCache.NumPages == 0);
+  CHECK(GlobalPages == (Num-1) * Span);
+  for (unsigned i = 0; i != Num-1; ++i)
+    CHECK(isMapped(Spans[i]));
+  CHECK(!isMapped(Spans[Num-1]));
+}
+
+// testLongSpan - Spans longer than the caches take are unmapped right away.
+static void testLongSpan() {
+  char *P = (char*)AllocateNPages(PAGE_MAX_CACHED_SPAN + 1);
+  CHECK(isMapped(page(P, PAGE_MAX_CACHED_SPAN)));
+  FreeNPages(P, PAGE_MAX_CACHED_SPAN + 1);
+  CHECK(!isMapped(P) && !isMapped(page(P, PAGE_MAX_CACHED_SPAN)));
+  CHECK(ThreadCache.NumPages == 0 && GlobalPages == 0);
+}
+
+int main() {
+  InitializePageManager();
+  void (*Tests[])() = { testBatch, testReuse, testHighWater, freeAndExit,
+                        takeFromGlobal, freeAfterFlush, takeFromGlobal,
+                        testGlobalHighWater, testLongSpan };
+  for (unsigned i = 0; i != sizeof(Tests)/sizeof(Tests[0]); ++i) {
+    runInThread(Tests[i]);
+    // freeAndExit and freeAfterFlush leave their span to the next test.
+    if (Tests[i] != freeAndExit && Tests[i] != freeAfterFlush)
+      drainGlobal();
+  }
+  pthread_key_delete(LateFreeKey);
+
+  return reportFailures();
+}
@@ -0,0 +1,126 @@
+//===- SlabManagerTest.cpp - Tests of the slab manager runtime ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Check that bump pointer pools of the slab manager runtime carve objects back
+// to back out of shared chunks, and that the entry points it shares with the
+// FL2 runtime hand out usable objects, even ones larger than a slab.  The
+// runtime is included rather than linked so that the chunks of a pool can be
+// inspected.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolAllocator.cpp"
+#include "TestCheck.h"
+#include <stdio.h>
+
+static unsigned countChunks(SlabPool *P) {
+  unsigned Num = 0;
+  for (void *Chunk = P->Storage.Bump.Chunks; Chunk; Chunk = *(void**)Chunk)
+    ++Num;
+  return Num;
+}
+
+// testBump - Small objects follow each other, a big one gets a chunk of its
+// own without ending the current chunk, and full chunks are replaced.
+static void testBump() {
+  SlabPool P;
+  poolinit_bp(&P, 16);
+  char *Prev = (char*)poolalloc_bp(&P, 24);
+  CHECK(((uintptr_t)Prev & 15) == 0);
+  for (unsigned i = 0; i != 100; ++i) {
+    char *Cur = (char*)poolalloc_bp(&P, 24);
+    CHECK(Cur == Prev + 32);
+    Prev = Cur;
+  }
+  CHECK(countChunks(&P) == 1);
+
+  char *Big = (char*)poolalloc_bp(&P, BUMP_CHUNK_SIZE);
+  CHECK(((uintptr_t)Big & 15) == 0);
+  memset(Big, 0xA5, BUMP_CHUNK_SIZE);
+  CHECK(countChunks(&P) == 2);
+  CHECK(poolalloc_bp(&P, 8) == Prev + 32);
+
+  // Fill the current chunk; the next object starts a new one.
+  unsigned Chunks = countChunks(&P);
+  for (unsigned i = 0; i != BUMP_CHUNK_SIZE/64 && countChunks(&P) == Chunks;
+       ++i)
+    memset(poolalloc_bp(&P, 64), 0x5A, 64);
+  CHECK(countChunks(&P) == Chunks + 1);
+  pooldestroy_bp(&P);
+
+  // Alignments below a pointer are raised to it.
+  poolinit_bp(&P, 1);
+  char *A = (char*)poolalloc_bp(&P, 1);
+  CHECK((char*)poolalloc_bp(&P, 1) == A + sizeof(void*));
+  pooldestroy_bp(&P);
+}
+
+struct SizedAlloc {
+  unsigned Size, Align;
+  void *(*Alloc)(SlabPool *);
+};
+
+static const SizedAlloc SizedAllocs[] = {
+#define POOLALLOC_SIZE(Size, Align) \
+  { Size, Align, poolalloc_##Size##_##Align },
+#include "poolalloc/PoolAllocSizes.def"
+};
+
+// testEntryPoints - The single-threaded, lock-free and sized entry points
+// behave like the plain ones.
+static void testEntryPoints() {
+  for (unsigned i = 0; i != sizeof(SizedAllocs)/sizeof(SizedAllocs[0]); ++i) {
+    const SizedAlloc &SA = SizedAllocs[i];
+    SlabPool P;
+    if (i % 2)
+      poolinit_lf(&P, SA.Size, SA.Align);
+    else
+      poolinit_st(&P, SA.Size, SA.Align);
+    poolprofile_name(&P, "pool");
+    void *Objs[8];
+    for (unsigned j = 0; j != 8; ++j) {
+      Objs[j] = SA.Alloc(&P);
+      CHECK(((uintptr_t)Objs[j] & (SA.Align-1)) == 0);
+      CHECK(poolobjsize(&P, Objs[j]) >= SA.Size);
+      memset(Objs[j], j, SA.Size);
+    }
+    void *Arr = poolalloc_st(&P, 10*SA.Size);
+    CHECK(poolobjsize(&P, Arr) >= 10*SA.Size);
+    for (unsigned j = 0; j != 8; ++j)
+      poolfree_st(&P, Objs[j]);
+    poolfree_st(&P, Arr);
+    pooldestroy(&P);
+  }
+}
+
+// testBigObjects - Objects that do not fit in a slab of the bitmask manager
+// come from malloc.
+static void testBigObjects() {
+  const unsigned Size = (LinuxMmap::pageSize << 6) + 8;
+  SlabPool P;
+  poolinit(&P, Size, 8);
+  void *Objs[3];
+  for (unsigned i = 0; i != 3; ++i) {
+    Objs[i] = poolalloc(&P, Size);
+    CHECK(Objs[i] != 0);
+    CHECK(poolobjsize(&P, Objs[i]) >= Size);
+    memset(Objs[i], i, Size);
+  }
+  for (unsigned i = 0; i != 3; ++i)
+    poolfree(&P, Objs[i]);
+  pooldestroy(&P);
+}
+
+int main() {
+  testBump();
+  testEntryPoints();
+  testBigObjects();
+
+  return reportFailures();
+}
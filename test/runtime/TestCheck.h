@@ -0,0 +1,46 @@
+//===- TestCheck.h - Checks shared by the unit tests ------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The harness of the runtime and DSA unit tests.  CHECK(X) prints the file and
+// line of a condition that does not hold and counts it in Failures.  Tests
+// whose failures are better told as a count, such as objects that were
+// overwritten, add to Failures themselves.  Failures is updated atomically,
+// so checks can be made from any thread.
+//
+// Each test is a single translation unit whose main() ends with
+//   return reportFailures();
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef POOLALLOC_TEST_TESTCHECK_H
+#define POOLALLOC_TEST_TESTCHECK_H
+
+#include <stdio.h>
+
+static unsigned Failures = 0;
+
+#define CHECK(X) \
+  do { \
+    if (!(X)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); \
+      __sync_fetch_and_add(&Failures, 1); \
+    } \
+  } while (0)
+
+// reportFailures - Print how many failures there were, if any, described by
+// What, and return the exit status of the test.
+static inline int reportFailures(const char *What = "checks failed") {
+  if (Failures) {
+    fprintf(stderr, "%u %s\n", Failures, What);
+    return 1;
+  }
+  return 0;
+}
+
+#endif